@@ -0,0 +1,581 @@
+/*
+ * ctorrent_bench: micro benchmarks for the parser, encoder, lookups, SHA-1, SHA-256 merkle
+ * trees and the piece picker.
+ * Every result is printed as one JSON object per line.
+ *
+ * Usage: ctorrent_bench [--quick] [--filter <substring>]
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "bencode.h"
+#include "bencode_stream.h"
+#include "bencode_tape.h"
+#include "bitfield.h"
+#include "cryptography.h"
+#include "merkle.h"
+#include "picker.h"
+#include "sha1_backend.h"
+#include "sha256_backend.h"
+
+#pragma region Allocation Counting
+
+static atomic_size_t bench_allocs;
+static atomic_size_t bench_alloc_bytes;
+
+#if defined(__GLIBC__)
+/* Interpose the allocator of the whole process, the library's calls land here too */
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t count, size_t size);
+extern void* __libc_realloc(void* ptr, size_t size);
+extern void __libc_free(void* ptr);
+
+void* malloc(size_t size) {
+    atomic_fetch_add_explicit(&bench_allocs, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&bench_alloc_bytes, size, memory_order_relaxed);
+    return __libc_malloc(size);
+}
+
+void* calloc(size_t count, size_t size) {
+    atomic_fetch_add_explicit(&bench_allocs, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&bench_alloc_bytes, count * size, memory_order_relaxed);
+    return __libc_calloc(count, size);
+}
+
+void* realloc(void* ptr, size_t size) {
+    atomic_fetch_add_explicit(&bench_allocs, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&bench_alloc_bytes, size, memory_order_relaxed);
+    return __libc_realloc(ptr, size);
+}
+
+void free(void* ptr) {
+    __libc_free(ptr);
+}
+#define BENCH_COUNTS_ALLOCS 1
+#endif
+
+#pragma endregion Allocation Counting
+
+#pragma region Synthetic Torrents
+
+typedef struct Buf {
+    char*   data;
+    size_t  len;
+    size_t  cap;
+} Buf;
+
+static void buf_append(Buf* buf, const void* data, size_t len) {
+    if(buf->len + len > buf->cap) {
+        size_t new_cap = buf->cap ? buf->cap : 4096;
+        while(new_cap < buf->len + len) new_cap *= 2;
+        buf->data = realloc(buf->data, new_cap);
+        if(!buf->data) {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+        buf->cap = new_cap;
+    }
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+}
+
+static void buf_printf(Buf* buf, const char* fmt, ...) {
+    char tmp[256];
+    va_list args;
+    va_start(args, fmt);
+    int n = vsnprintf(tmp, sizeof(tmp), fmt, args);
+    va_end(args);
+    buf_append(buf, tmp, (size_t)n);
+}
+
+static void buf_string(Buf* buf, const char* str) {
+    buf_printf(buf, "%zu:%s", strlen(str), str);
+}
+
+static void buf_pieces(Buf* buf, unsigned long long total, unsigned long long piece_length) {
+    unsigned long long count = (total + piece_length - 1) / piece_length;
+    buf_printf(buf, "6:pieces%llu:", count * 20);
+
+    uint32_t x = 0x12345678;
+    for(unsigned long long i = 0; i < count * 20; ++i) {
+        x = x * 1664525u + 1013904223u;
+        char byte = (char)(x >> 24);
+        buf_append(buf, &byte, 1);
+    }
+}
+
+static Buf gen_single_file(unsigned long long total, unsigned long long piece_length) {
+    Buf buf = {0};
+    buf_printf(&buf, "d8:announce");
+    buf_string(&buf, "http://tracker.example.org:6969/announce");
+    buf_printf(&buf, "4:infod6:lengthi%llue4:name", total);
+    buf_string(&buf, "dataset.bin");
+    buf_printf(&buf, "12:piece lengthi%llue", piece_length);
+    buf_pieces(&buf, total, piece_length);
+    buf_printf(&buf, "ee");
+    return buf;
+}
+
+static Buf gen_multi_file(size_t files, unsigned long long file_size, unsigned long long piece_length) {
+    Buf buf = {0};
+    buf_printf(&buf, "d8:announce");
+    buf_string(&buf, "http://tracker.example.org:6969/announce");
+    buf_printf(&buf, "4:infod5:filesl");
+    for(size_t i = 0; i < files; ++i) {
+        char name[32];
+        snprintf(name, sizeof(name), "file%07zu.dat", i);
+        buf_printf(&buf, "d6:lengthi%llue4:pathl", file_size + i % 1000);
+        buf_string(&buf, i % 2 ? "odd" : "even");
+        buf_string(&buf, name);
+        buf_printf(&buf, "ee");
+    }
+    unsigned long long total = 0;
+    for(size_t i = 0; i < files; ++i) total += file_size + i % 1000;
+    buf_printf(&buf, "e4:name");
+    buf_string(&buf, "many-files");
+    buf_printf(&buf, "12:piece lengthi%llue", piece_length);
+    buf_pieces(&buf, total, piece_length);
+    buf_printf(&buf, "ee");
+    return buf;
+}
+
+static char* write_temp(const Buf* buf) {
+    char* path = strdup("/tmp/ctorrent_bench_XXXXXX");
+    int fd = mkstemp(path);
+    if(fd < 0 || write(fd, buf->data, buf->len) != (ssize_t)buf->len) {
+        fprintf(stderr, "failed to write %s\n", path);
+        exit(1);
+    }
+    close(fd);
+    return path;
+}
+
+#pragma endregion Synthetic Torrents
+
+#pragma region Harness
+
+typedef struct BenchConfig {
+    double      min_seconds;
+    const char* filter;
+} BenchConfig;
+
+typedef void (*bench_fn)(void* arg);
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/*
+ * Run fn until min_seconds have passed, then report the mean per iteration.
+ * units is what one iteration processes (bytes or operations), unit names it.
+ */
+static void bench_run(const BenchConfig* config, const char* name, const char* variant,
+                      bench_fn fn, void* arg, double units, const char* unit) {
+    char full_name[128];
+    snprintf(full_name, sizeof(full_name), "%s/%s", name, variant);
+    if(config->filter && !strstr(full_name, config->filter)) return;
+
+    fn(arg);    // warm up caches and the page cache
+
+    size_t allocs_before = atomic_load(&bench_allocs);
+    size_t bytes_before = atomic_load(&bench_alloc_bytes);
+
+    size_t iterations = 0;
+    double best = 1e300;
+    const double start = now_seconds();
+    double elapsed = 0;
+    do {
+        const double t0 = now_seconds();
+        fn(arg);
+        const double t1 = now_seconds();
+        if(t1 - t0 < best) best = t1 - t0;
+        iterations++;
+        elapsed = t1 - start;
+    } while(elapsed < config->min_seconds || iterations < 3);
+
+    const double allocs = (double)(atomic_load(&bench_allocs) - allocs_before) / (double)iterations;
+    const double alloc_bytes = (double)(atomic_load(&bench_alloc_bytes) - bytes_before) / (double)iterations;
+    const double mean = elapsed / (double)iterations;
+
+    printf("{\"bench\":\"%s\",\"case\":\"%s\",\"unit\":\"%s\",\"units\":%.0f,\"iterations\":%zu,"
+           "\"ns_per_unit\":%.4f,\"best_ns_per_unit\":%.4f,\"mb_per_s\":%.1f,",
+           name, variant, unit, units, iterations,
+           mean * 1e9 / units, best * 1e9 / units,
+           strcmp(unit, "byte") == 0 ? units / mean / 1e6 : 0.0);
+#if defined(BENCH_COUNTS_ALLOCS)
+    printf("\"allocs_per_iter\":%.1f,\"alloc_bytes_per_iter\":%.0f}\n", allocs, alloc_bytes);
+#else
+    (void)allocs;
+    (void)alloc_bytes;
+    printf("\"allocs_per_iter\":null,\"alloc_bytes_per_iter\":null}\n");
+#endif
+    fflush(stdout);
+}
+
+#pragma endregion Harness
+
+#pragma region Benchmarks
+
+static volatile size_t bench_sink;
+
+typedef struct ParseArg {
+    const char* path;
+    Arena*      arena;
+} ParseArg;
+
+static void bench_parse(void* arg) {
+    ParseArg* p = arg;
+    BDocument* doc = bencode_parse_torrent(p->path);
+    if(!doc) {
+        fprintf(stderr, "parse failed: %s\n", p->path);
+        exit(1);
+    }
+    bencode_free_document(doc);
+}
+
+static void bench_parse_arena(void* arg) {
+    ParseArg* p = arg;
+    BDocument* doc = bencode_parse_torrent_arena(p->path, p->arena);
+    if(!doc) {
+        fprintf(stderr, "parse failed: %s\n", p->path);
+        exit(1);
+    }
+    bencode_free_document(doc);
+    arena_reset(p->arena);
+}
+
+/* A tree that outlives its input: every string is copied, keys are interned */
+static void bench_parse_copy(void* arg) {
+    ParseArg* p = arg;
+    const BDecodeOptions opts = { .copy_strings = true };
+    BDocument* doc = bencode_parse_torrent_opts(p->path, &opts);
+    if(!doc) {
+        fprintf(stderr, "parse failed: %s\n", p->path);
+        exit(1);
+    }
+    bencode_free_document(doc);
+}
+
+static void bench_parse_stream(void* arg) {
+    ParseArg* p = arg;
+    BNode* root = bstream_parse_file(p->path, 0);
+    if(!root) {
+        fprintf(stderr, "parse failed: %s\n", p->path);
+        exit(1);
+    }
+    bencode_free_node(root);
+}
+
+/* Parse as the infohash command does: the info dict is located, nothing below it is decoded */
+static void bench_parse_lazy(void* arg) {
+    ParseArg* p = arg;
+    const BDecodeOptions opts = { .lazy = true };
+    BDocument* doc = bencode_parse_torrent_opts(p->path, &opts);
+    if(!doc) {
+        fprintf(stderr, "parse failed: %s\n", p->path);
+        exit(1);
+    }
+    bench_sink = bencode_find_node_by_key(doc->root, "info")->end;
+    bencode_free_document(doc);
+}
+
+static void bench_encode(void* arg) {
+    BEncodeBuf* buf = bencode_encode_node(arg);
+    if(!buf) {
+        fprintf(stderr, "encode failed\n");
+        exit(1);
+    }
+    bencode_free_buf(buf);
+}
+
+static void bench_lookup(void* arg) {
+    const BNode* files = arg;
+    size_t found = 0;
+    for(size_t i = 0; i < files->value.blist.len; ++i) {
+        const BNode* entry = files->value.blist.items[i];
+        found += bencode_find_node_by_key(entry, "length") != NULL;
+        found += bencode_find_node_by_key(entry, "path") != NULL;
+    }
+    bench_sink = found;
+}
+
+typedef struct TapeArg {
+    BTape       tape;
+    const Buf*  encoded;
+    size_t      files;      // entry of the files list
+} TapeArg;
+
+static void bench_tape_parse(void* arg) {
+    TapeArg* t = arg;
+    if(btape_parse(&t->tape, t->encoded->data, t->encoded->len, NULL) != 0) {
+        fprintf(stderr, "tape parse failed\n");
+        exit(1);
+    }
+}
+
+static void bench_tape_lookup(void* arg) {
+    TapeArg* t = arg;
+    size_t found = 0;
+
+    BTapeIter iter;
+    btape_iter_begin(&iter, &t->tape, t->files);
+    size_t key, entry;
+    while(btape_iter_next(&iter, &key, &entry)) {
+        found += btape_find_key(&t->tape, entry, "length", 6) != BTAPE_NONE;
+        found += btape_find_key(&t->tape, entry, "path", 4) != BTAPE_NONE;
+    }
+    bench_sink = found;
+}
+
+typedef struct HashArg {
+    const uint8_t*  data;
+    size_t          len;
+    size_t          count;      // sha1_many: messages of len bytes each
+    const uint8_t** msgs;
+    sha1hash*       out;
+    sha256hash*     out256;
+} HashArg;
+
+static void bench_sha1(void* arg) {
+    HashArg* h = arg;
+    sha1hash hash = sha1(h->data, h->len);
+    bench_sink = hash.bytes[0];
+}
+
+static void bench_sha1_many(void* arg) {
+    HashArg* h = arg;
+    sha1_many(h->msgs, h->len, h->count, h->out);
+    bench_sink = h->out[0].bytes[0];
+}
+
+static void bench_sha256(void* arg) {
+    HashArg* h = arg;
+    sha256hash hash = sha256(h->data, h->len);
+    bench_sink = hash.bytes[0];
+}
+
+static void bench_sha256_many(void* arg) {
+    HashArg* h = arg;
+    sha256_many(h->msgs, h->len, h->count, h->out256);
+    bench_sink = h->out256[0].bytes[0];
+}
+
+static void bench_merkle_tree(void* arg) {
+    HashArg* h = arg;
+    MerkleTree* tree = merkle_tree_build(h->data, h->len, 0);
+    bench_sink = merkle_tree_root(tree).bytes[0];
+    merkle_tree_free(tree);
+}
+
+typedef struct TorrentCase {
+    const char* name;
+    Buf         encoded;
+    char*       path;
+} TorrentCase;
+
+static void bench_torrent_case(const BenchConfig* config, TorrentCase* tc) {
+    Arena arena;
+    arena_init(&arena, 0);
+
+    ParseArg parse_arg = { .path = tc->path, .arena = &arena };
+    bench_run(config, "parse", tc->name, bench_parse, &parse_arg, (double)tc->encoded.len, "byte");
+    bench_run(config, "parse_arena", tc->name, bench_parse_arena, &parse_arg, (double)tc->encoded.len, "byte");
+    bench_run(config, "parse_lazy", tc->name, bench_parse_lazy, &parse_arg, (double)tc->encoded.len, "byte");
+    bench_run(config, "parse_copy", tc->name, bench_parse_copy, &parse_arg, (double)tc->encoded.len, "byte");
+    bench_run(config, "parse_stream", tc->name, bench_parse_stream, &parse_arg, (double)tc->encoded.len, "byte");
+
+    BDocument* doc = bencode_parse_torrent(tc->path);
+    bench_run(config, "encode", tc->name, bench_encode, doc->root, (double)tc->encoded.len, "byte");
+
+    const BNode* files = bencode_find_node_by_key(bencode_find_node_by_key(doc->root, "info"), "files");
+    if(files) {
+        bench_run(config, "find_node_by_key", tc->name, bench_lookup, (void*)files,
+                  (double)files->value.blist.len * 2, "lookup");
+    }
+
+    bencode_free_document(doc);
+    arena_free(&arena);
+
+    TapeArg tape_arg = { .encoded = &tc->encoded };
+    bench_run(config, "tape_parse", tc->name, bench_tape_parse, &tape_arg, (double)tc->encoded.len, "byte");
+
+    bench_tape_parse(&tape_arg);
+    const size_t info = btape_find_key(&tape_arg.tape, 0, "info", 4);
+    tape_arg.files = info != BTAPE_NONE ? btape_find_key(&tape_arg.tape, info, "files", 5) : BTAPE_NONE;
+    if(tape_arg.files != BTAPE_NONE) {
+        bench_run(config, "tape_find_key", tc->name, bench_tape_lookup, &tape_arg,
+                  (double)btape_count(&tape_arg.tape, tape_arg.files) * 2, "lookup");
+    }
+    btape_free(&tape_arg.tape);
+}
+
+static void bench_hashing(const BenchConfig* config) {
+    const size_t total = 64u * 1024 * 1024;
+    uint8_t* data = malloc(total);
+    for(size_t i = 0; i < total; ++i) data[i] = (uint8_t)(i * 2654435761u >> 24);
+
+    size_t backend_count;
+    const sha1_backend* backends = sha1_backends(&backend_count);
+    const sha1_backend* active = sha1_active_backend();
+
+    HashArg hash_arg = { .data = data, .len = total };
+    for(size_t i = 0; i < backend_count; ++i) {
+        if(!sha1_select_backend(backends[i].name)) continue;
+
+        char variant[64];
+        snprintf(variant, sizeof(variant), "64MiB-%s", backends[i].name);
+        bench_run(config, "sha1", variant, bench_sha1, &hash_arg, (double)total, "byte");
+    }
+    sha1_select_backend(active->name);
+
+    // 256 KiB pieces, the common piece size
+    const size_t piece = 256u * 1024;
+    const size_t count = total / piece;
+    const uint8_t** msgs = malloc(count * sizeof(uint8_t*));
+    sha1hash* out = malloc(count * sizeof(sha1hash));
+    for(size_t i = 0; i < count; ++i) msgs[i] = data + i * piece;
+
+    HashArg many_arg = { .len = piece, .count = count, .msgs = msgs, .out = out };
+    char variant[64];
+    snprintf(variant, sizeof(variant), "256KiBx%zu-%s", count, sha1_many_backend());
+    bench_run(config, "sha1_many", variant, bench_sha1_many, &many_arg, (double)total, "byte");
+
+    const sha256_backend* backends256 = sha256_backends(&backend_count);
+    const sha256_backend* active256 = sha256_active_backend();
+    for(size_t i = 0; i < backend_count; ++i) {
+        if(!sha256_select_backend(backends256[i].name)) continue;
+
+        snprintf(variant, sizeof(variant), "64MiB-%s", backends256[i].name);
+        bench_run(config, "sha256", variant, bench_sha256, &hash_arg, (double)total, "byte");
+    }
+    sha256_select_backend(active256->name);
+
+    // BEP 52 leaves: every 16 KiB block is a message of its own
+    const size_t blocks = total / MERKLE_BLOCK_SIZE;
+    const uint8_t** leaf_msgs = malloc(blocks * sizeof(uint8_t*));
+    sha256hash* leaves = malloc(blocks * sizeof(sha256hash));
+    for(size_t i = 0; i < blocks; ++i) leaf_msgs[i] = data + i * MERKLE_BLOCK_SIZE;
+
+    HashArg leaf_arg = { .len = MERKLE_BLOCK_SIZE, .count = blocks, .msgs = leaf_msgs, .out256 = leaves };
+    snprintf(variant, sizeof(variant), "16KiBx%zu-%s", blocks, sha256_many_backend());
+    bench_run(config, "sha256_many", variant, bench_sha256_many, &leaf_arg, (double)total, "byte");
+    bench_run(config, "merkle_tree", "64MiB", bench_merkle_tree, &hash_arg, (double)total, "byte");
+
+    free(leaf_msgs);
+    free(leaves);
+    free(msgs);
+    free(out);
+    free(data);
+}
+
+typedef struct PickerArg {
+    Picker*     picker;
+    size_t      piece_count;
+    uint8_t**   bitfields;
+    size_t      peers;
+    size_t*     picked;
+} PickerArg;
+
+static void bench_picker_bitfields(void* arg) {
+    PickerArg* p = arg;
+    for(size_t i = 0; i < p->peers; ++i) picker_add_bitfield(p->picker, p->bitfields[i]);
+    for(size_t i = 0; i < p->peers; ++i) picker_remove_bitfield(p->picker, p->bitfields[i]);
+}
+
+/* Every piece picked and started by the peers in turn, then put back for the next round */
+static void bench_picker_pick(void* arg) {
+    PickerArg* p = arg;
+    size_t count = 0;
+    for(size_t i = 0; i < p->piece_count; ++i) {
+        const size_t piece = picker_pick(p->picker, p->bitfields[i % p->peers]);
+        if(piece == PICKER_NONE) continue;
+        picker_start(p->picker, piece);
+        p->picked[count++] = piece;
+    }
+    for(size_t i = 0; i < count; ++i) picker_abort(p->picker, p->picked[i]);
+    bench_sink = count;
+}
+
+static void bench_picking(const BenchConfig* config) {
+    // 100k pieces and 300 peers with between none and all of them
+    const size_t piece_count = 100000;
+    const size_t peers = 300;
+    const size_t len = BITFIELD_BYTES(piece_count);
+
+    PickerArg arg = { .picker = picker_new(piece_count), .piece_count = piece_count, .peers = peers };
+    arg.bitfields = malloc(peers * sizeof(uint8_t*));
+    arg.picked = malloc(piece_count * sizeof(size_t));
+    uint64_t state = 0x9E3779B97F4A7C15ull;
+    for(size_t i = 0; i < peers; ++i) {
+        arg.bitfields[i] = calloc(len, 1);
+        const uint64_t percent = i * 100 / peers;
+        for(size_t piece = 0; piece < piece_count; ++piece) {
+            state ^= state << 13;
+            state ^= state >> 7;
+            state ^= state << 17;
+            if(state % 100 < percent) bitfield_set(arg.bitfields[i], piece);
+        }
+    }
+
+    char variant[64];
+    snprintf(variant, sizeof(variant), "%zupieces-%zupeers", piece_count, peers);
+    bench_run(config, "picker_bitfield", variant, bench_picker_bitfields, &arg, (double)(peers * 2), "bitfield");
+
+    for(size_t i = 0; i < peers; ++i) picker_add_bitfield(arg.picker, arg.bitfields[i]);
+    bench_run(config, "picker_pick", variant, bench_picker_pick, &arg, (double)piece_count, "pick");
+
+    for(size_t i = 0; i < peers; ++i) free(arg.bitfields[i]);
+    free(arg.bitfields);
+    free(arg.picked);
+    picker_free(arg.picker);
+}
+
+#pragma endregion Benchmarks
+
+int main(int argc, char** argv) {
+    BenchConfig config = { .min_seconds = 0.5, .filter = NULL };
+    for(int i = 1; i < argc; ++i) {
+        if(strcmp(argv[i], "--quick") == 0) {
+            config.min_seconds = 0.05;
+        } else if(strcmp(argv[i], "--filter") == 0 && i + 1 < argc) {
+            config.filter = argv[++i];
+        } else {
+            fprintf(stderr, "Usage: %s [--quick] [--filter <substring>]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    TorrentCase cases[] = {
+        // 4 GiB in 1 MiB pieces
+        { .name = "single-file", .encoded = gen_single_file(4ull << 30, 1u << 20) },
+        // 100k files of ~1 MiB in 4 MiB pieces
+        { .name = "multi-file-100k", .encoded = gen_multi_file(100000, 1u << 20, 4u << 20) },
+        // 50 GiB in 256 KiB pieces: a 4 MB pieces string
+        { .name = "huge-pieces", .encoded = gen_single_file(50ull << 30, 256u << 10) },
+    };
+    const size_t case_count = sizeof(cases) / sizeof(cases[0]);
+
+    for(size_t i = 0; i < case_count; ++i) {
+        cases[i].path = write_temp(&cases[i].encoded);
+        bench_torrent_case(&config, &cases[i]);
+    }
+    bench_hashing(&config);
+    bench_picking(&config);
+
+    for(size_t i = 0; i < case_count; ++i) {
+        unlink(cases[i].path);
+        free(cases[i].path);
+        free(cases[i].encoded.data);
+    }
+    return 0;
+}
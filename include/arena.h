@@ -0,0 +1,44 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+#define ARENA_DEFAULT_BLOCK_SIZE    (64 * 1024)
+
+typedef struct ArenaBlock ArenaBlock;
+
+/**
+ * Bump allocator: allocations are carved out of large blocks and are only
+ * released all at once by arena_reset or arena_free.
+ */
+typedef struct Arena {
+    ArenaBlock* first;
+    ArenaBlock* current;
+    size_t      block_size;
+    size_t      allocated;      // bytes handed out since the last reset
+} Arena;
+
+/**
+ * Initialize an empty arena. No memory is allocated until the first arena_alloc.
+ * @param arena The arena to initialize
+ * @param block_size Minimum size of each block, 0 for ARENA_DEFAULT_BLOCK_SIZE
+ */
+void arena_init(Arena* arena, size_t block_size);
+
+/**
+ * Allocate size bytes aligned for any type.
+ * @return Pointer into the arena, or NULL if a new block could not be allocated
+ */
+void* arena_alloc(Arena* arena, size_t size);
+
+/**
+ * Release every allocation at once while keeping the blocks for reuse.
+ */
+void arena_reset(Arena* arena);
+
+/**
+ * Release every allocation and return all blocks to the system.
+ */
+void arena_free(Arena* arena);
+
+#endif
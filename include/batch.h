@@ -0,0 +1,36 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+typedef enum BatchFormat {
+    BATCH_FORMAT_TSV,       // "<infohash>\t<path>", failures go to stderr
+    BATCH_FORMAT_JSON,      // one JSON object per line, failures included with an "error" field
+} BatchFormat;
+
+typedef struct BatchOptions {
+    size_t      threads;    // worker threads, 0 for one per online CPU
+    BatchFormat format;
+} BatchOptions;
+
+typedef struct BatchResult {
+    size_t  hashed;
+    size_t  failed;
+    double  seconds;
+} BatchResult;
+
+/**
+ * Compute the infohash of many torrent files on a pool of worker threads.
+ * Each worker reads files into a reusable buffer and decodes them into a reusable arena,
+ * so the per-file cost is the read and the hash. Lines are written to out as workers
+ * finish, not in input order.
+ * @param source A directory (searched recursively for *.torrent, symlinked subdirectories
+ *               are not followed), a file with one path per line, or "-" for a path list
+ *               on stdin
+ * @return 0 on success (even if some files failed), -1 if the source could not be read
+ */
+int batch_infohash(const char* source, const BatchOptions* opts, FILE* out, BatchResult* result);
+
+#endif
@@ -1,11 +1,21 @@
 #ifndef BENCODE_H
 #define BENCODE_H
 
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <sys/uio.h>
+
+#include "arena.h"
+#include "cryptography.h"
 
 #define BENC_MAX_LOOKAHEAD  32
-#define BENC_MAX_STRSIZE    100000
+#define BENC_DEFAULT_MAX_STRSIZE    (64u * 1024 * 1024)     // cap for streamed input of unknown size
+#define BENC_MAX_DEPTH      512
 #define BENC_PRINT_INDENT   4
+#define BENC_ENCODE_STAGING     (16 * 1024)     // encoder's buffer for small output pieces
+#define BENC_ENCODE_IOVECS      64              // iovecs handed to a sink at once
+#define BENC_ENCODE_COPY_MAX    256             // longer strings go to the sink without a copy
 
 #define BENC_DICT_START     'd'
 #define BENC_LIST_START     'l'
@@ -22,11 +32,13 @@ typedef enum BTYPE {
 } BTYPE;
 
 typedef struct BNode BNode;
+typedef struct BLazySource BLazySource;
 
+// 16 bytes: strings of 4 GiB and more are rejected by every decoder
 typedef struct BString {
-    size_t  pre_delim_len;
-    size_t  post_delim_len;
-    char*   data;
+    uint32_t    pre_delim_len;
+    uint32_t    post_delim_len;
+    char*       data;
 } BString;
 
 typedef struct BDict {
@@ -45,36 +57,265 @@ typedef struct BInt {
     long long value;
 } BInt;
 
+// BNode.value of a BNODE_LAZY container: the input to decode it from on first access
+typedef struct BLazy {
+    size_t          len;        // always 0, so an unexpanded container reads as empty
+    BLazySource*    source;
+} BLazy;
+
+// BNode.flags
+#define BNODE_BORROWED      0x01    // string data (or a dict's key data) points into the input, not owned
+#define BNODE_ARENA         0x02    // node and its arrays live in an Arena, bencode_free_node ignores it
+#define BNODE_REF           0x04    // string payload was not kept: data is NULL, see bencode_string_offset
+#define BNODE_SORTED        0x08    // dict keys are strictly ascending, lookups use binary search
+#define BNODE_BUILT         0x10    // container made by bencode_new_list/dict, its arrays can grow
+#define BNODE_LAZY          0x20    // container not decoded yet: only start/end and value.lazy are valid
+#define BNODE_INTERNED      0x40    // dict keys are shared copies from an intern table, see bencode_intern.h
+#define BNODE_INLINE        0x80    // string payload follows the node in the same allocation
+#define BNODE_PACKED        0x100   // dict values follow its keys in the same allocation
+
 struct BNode {
     BTYPE type;
+    unsigned int flags;
+    size_t start;   // offset of the first byte of the encoded value in the parsed input
+    size_t end;     // offset one past the last byte of the encoded value
     union {
         BString bstring;
         BDict   bdict;
         BList   blist;
         BInt    bint;
+        BLazy   lazy;
     } value;
 };
 
+/**
+ * Per-call decoder settings. Zero-initialized options give the defaults of bencode_decode_buffer.
+ */
+typedef struct BDecodeOptions {
+    size_t  max_string_size;    // longest accepted string, 0 for no limit beyond the input length
+    Arena*  arena;              // allocate the tree from this arena instead of the heap
+    bool    copy_strings;       // copy string payloads so the tree does not depend on the input, keys are interned
+    size_t  ref_threshold;      // with copy_strings: longer strings are kept as BNODE_REF, 0 to copy all
+    bool    lazy;               // decode nested containers on first access, see bencode_expand
+} BDecodeOptions;
+
+/**
+ * Iterator over the children of a dict or list, expanding it first if it is lazy.
+ */
+typedef struct BNodeIter {
+    const BNode*    node;
+    size_t          index;
+} BNodeIter;
+
 typedef struct BEncodeBuf {
     size_t len;
     char* data;
 } BEncodeBuf;
 
+/**
+ * Destination of the encoder. write receives the output in order, in batches of at most
+ * BENC_ENCODE_IOVECS iovecs, and returns 0 on success or non-zero to abort encoding.
+ * The iovecs are only valid during the call.
+ */
+typedef struct BEncodeSink {
+    int   (*write)(void* user, const struct iovec* iov, int iovcnt);
+    void* user;
+} BEncodeSink;
+
+/**
+ * Growable output buffer for bencode_buffer_sink. Zero-initialize it; data is released with free.
+ */
+typedef struct BEncodeBufferSink {
+    char*   data;
+    size_t  len;
+    size_t  cap;
+} BEncodeBufferSink;
+
+/**
+ * A parsed document: the root BNode together with the raw input it was parsed from.
+ * The start/end offsets of every node index into data.
+ */
+typedef struct BDocument {
+    BNode*          root;
+    const char*     data;   // read-only mapping of the input file, or a heap buffer if heap is set
+    size_t          len;
+    bool            heap;   // data came from malloc and is freed with the document
+} BDocument;
+
 void bencode_free_node(BNode* node);
 
+void bencode_free_document(BDocument* doc);
+
 /**
- * Parse a torrent file and return the root BNode.
- * @param fpath Path to the torrent file
+ * Decode a single bencoded value from a memory buffer (e.g. a mapped file or a network buffer).
+ * Strings in the returned tree point into data, so data must outlive the tree.
+ * @param data The encoded input
+ * @param len Length of the input in bytes
+ * @param consumed If non-NULL, receives the number of bytes the value occupied;
+ *                 if NULL, the value has to span the whole buffer
  * @return Pointer to the root BNode, or NULL on error
  */
-BNode* bencode_parse_torrent(const char* fpath);
+BNode* bencode_decode_buffer(const char* data, size_t len, size_t* consumed);
+
+/**
+ * Like bencode_decode_buffer, but every node and child array is bump-allocated from arena.
+ * The tree is released by arena_reset/arena_free instead of bencode_free_node; memory of a
+ * failed decode is reclaimed the same way.
+ */
+BNode* bencode_decode_buffer_arena(const char* data, size_t len, size_t* consumed, Arena* arena);
+
+/**
+ * Like bencode_decode_buffer with explicit options.
+ * With opts->lazy only the top-level value is decoded; nested dicts and lists are checked
+ * and skipped without building nodes, and are decoded one level at a time when first
+ * reached through bencode_find_node_by_key, bencode_iter_begin or bencode_expand.
+ * Lazy trees borrow from data (copy_strings is rejected) and expanding them is not
+ * thread-safe.
+ * The decoder keeps no global state, so threads may decode concurrently as long as
+ * they do not share an arena.
+ * @param opts Decoder settings, NULL for the defaults
+ */
+BNode* bencode_decode_buffer_opts(const char* data, size_t len, size_t* consumed, const BDecodeOptions* opts);
+
+/**
+ * Map a torrent file into memory and decode it without copying.
+ * @param fpath Path to the torrent file
+ * @return Pointer to the BDocument, or NULL on error
+ */
+BDocument* bencode_parse_torrent(const char* fpath);
+
+/**
+ * Decode a heap buffer, e.g. an info dict fetched from peers, in place without copying.
+ * On success the document owns data and frees it in bencode_free_document; on failure
+ * data stays with the caller.
+ * @param opts Decoder settings, NULL for the defaults
+ * @return Pointer to the BDocument, or NULL if data is not a single bencoded dict
+ */
+BDocument* bencode_document_from_buffer(char* data, size_t len, const BDecodeOptions* opts);
+
+/**
+ * Like bencode_parse_torrent, but the tree is allocated from arena.
+ * bencode_free_document only unmaps the file; reset the arena to release the tree.
+ */
+BDocument* bencode_parse_torrent_arena(const char* fpath, Arena* arena);
+
+/**
+ * Like bencode_parse_torrent with explicit decoder options.
+ */
+BDocument* bencode_parse_torrent_opts(const char* fpath, const BDecodeOptions* opts);
+
+/**
+ * Offset of a string node's payload in the input it was parsed from.
+ * This is how the bytes of a BNODE_REF string are located.
+ */
+size_t bencode_string_offset(const BNode* node);
+
+/**
+ * Payload of a string node of doc, resolving BNODE_REF strings against doc->data.
+ */
+const char* bencode_string_data(const BDocument* doc, const BNode* node);
 
+/**
+ * Look up the value of key in a dict: binary search if the dict is BNODE_SORTED, a linear scan otherwise.
+ * @return The value, or NULL if dict is not a dict or has no such key
+ */
 BNode* bencode_find_node_by_key(const BNode* dict, const char* key);
 
+/**
+ * Like bencode_find_node_by_key for keys that are not NUL-terminated. With interned keys
+ * (copy_strings, bstream_init_tree) a key taken from another dict of the same tree is
+ * found by pointer, without comparing bytes.
+ */
+BNode* bencode_find_node_by_key_len(const BNode* dict, const char* key, size_t key_len);
+
+/**
+ * Decode one level of a BNODE_LAZY container in place; its children that are containers
+ * become lazy nodes themselves. Does nothing for other nodes.
+ * @return false if the node is still lazy because memory ran out
+ */
+bool bencode_expand(const BNode* node);
+
+/**
+ * Start iterating over the children of a dict or list.
+ * @return false if node is not a container or could not be expanded
+ */
+bool bencode_iter_begin(BNodeIter* iter, const BNode* node);
+
+/**
+ * Advance to the next child. For dicts key receives the key, for lists NULL.
+ * @return false once the container is exhausted
+ */
+bool bencode_iter_next(BNodeIter* iter, const BString** key, BNode** value);
+
+/**
+ * Set or clear BNODE_SORTED on a dict after its keys were built or modified.
+ */
+void bencode_index_dict(BNode* dict);
+
+/**
+ * Constructors for trees built in memory, e.g. a new info dict. The nodes own copies of
+ * their data and are released with bencode_free_node.
+ */
+BNode* bencode_new_string(const char* data, size_t len);
+
+BNode* bencode_new_int(long long value);
+
+BNode* bencode_new_list(void);
+
+BNode* bencode_new_dict(void);
+
+/**
+ * Append item to a list from bencode_new_list; the list takes ownership of item on success.
+ */
+bool bencode_list_append(BNode* list, BNode* item);
+
+/**
+ * Insert or replace key in a dict from bencode_new_dict, keeping the keys sorted.
+ * The dict takes ownership of value on success; a replaced value is freed.
+ */
+bool bencode_dict_set(BNode* dict, const char* key, BNode* value);
+
 void bencode_free_buf(BEncodeBuf* buffer);
 
+/**
+ * Encode a tree into a new buffer. BNODE_REF strings have no payload to encode and make this fail.
+ */
 BEncodeBuf* bencode_encode_node(const BNode* node);
 
+/**
+ * Encode a tree in a single pass, streaming the output to sink.
+ * On failure the sink may already have received part of the output.
+ * @return 0 on success, -1 if the tree holds a BNODE_REF string or the sink failed
+ */
+int bencode_encode_to_sink(const BNode* node, const BEncodeSink* sink);
+
+/**
+ * Sinks for bencode_encode_to_sink: append to a growable buffer, writev to a descriptor,
+ * fwrite to a stream, or feed a SHA-1 context.
+ */
+BEncodeSink bencode_buffer_sink(BEncodeBufferSink* buffer);
+
+BEncodeSink bencode_fd_sink(int fd);
+
+BEncodeSink bencode_file_sink(FILE* file);
+
+BEncodeSink bencode_sha1_sink(sha1_ctx* ctx);
+
+/**
+ * SHA-1 of a tree's encoding, computed while encoding without buffering the output.
+ * Unlike bencode_hash_node this works for built trees that were never parsed.
+ * @return The digest, all zero if the tree cannot be encoded
+ */
+sha1hash bencode_hash_encoded(const BNode* node);
+
+/**
+ * Hash the raw bytes a node was parsed from, without re-encoding it.
+ * @param doc The document the node belongs to
+ * @param node The node to hash, e.g. the "info" dict
+ * @return SHA-1 of the node's encoded bytes in doc->data
+ */
+sha1hash bencode_hash_node(const BDocument* doc, const BNode* node);
+
 /**
  * Print the Contents of the BNode recursively.
  * @param node The BNode to print recursively
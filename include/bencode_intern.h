@@ -0,0 +1,49 @@
+#ifndef BENCODE_INTERN_H
+#define BENCODE_INTERN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "arena.h"
+
+/*
+ * Dict keys of one decode, each distinct key stored once. A torrent with 100k files
+ * repeats "length" and "path" in every entry; interned, all of those dicts point at the
+ * same two copies instead of owning two allocations each.
+ * Heap keys are refcounted: the table holds a reference and so does every dict key
+ * using it, the last bencode_intern_release frees it. Keys from an arena are released
+ * with the arena and are not counted.
+ */
+
+typedef struct BInternSlot {
+    char*       key;        // NULL for an empty slot
+    uint32_t    len;
+    uint32_t    hash;
+} BInternSlot;
+
+typedef struct BInternTable {
+    BInternSlot*    slots;
+    size_t          cap;        // power of two, 0 until the first key
+    size_t          count;
+    Arena*          arena;      // NULL: keys come from malloc and are refcounted
+} BInternTable;
+
+void bencode_intern_init(BInternTable* table, Arena* arena);
+
+/**
+ * The table's copy of key, made on first use. A heap key comes with a reference for the caller.
+ * @return The copy, or NULL if memory ran out
+ */
+char* bencode_intern(BInternTable* table, const char* key, uint32_t len);
+
+/**
+ * Drop a reference to a heap key from bencode_intern.
+ */
+void bencode_intern_release(char* key);
+
+/**
+ * Drop the table's references and empty it. Keys still used by dicts stay alive.
+ */
+void bencode_intern_clear(BInternTable* table);
+
+#endif
@@ -0,0 +1,67 @@
+#ifndef BENCODE_QUERY_H
+#define BENCODE_QUERY_H
+
+#include <stddef.h>
+
+#include "bencode.h"
+
+#define BENC_QUERY_MAX_STEPS    32
+
+typedef enum BQueryStepType {
+    BQUERY_KEY,         // "name"      value of a dict key
+    BQUERY_INDEX,       // "[3]"       list item
+    BQUERY_ALL_ITEMS,   // "[*]"       every list item
+    BQUERY_ALL_VALUES,  // "*"         every dict value
+} BQueryStepType;
+
+typedef struct BQueryStep {
+    BQueryStepType  type;
+    char*           key;
+    size_t          key_len;
+    size_t          index;
+} BQueryStep;
+
+/**
+ * A compiled path such as "info.files[*].length".
+ * Keys are separated by '.', a literal '.', '[' or '\\' inside a key is escaped with '\\'.
+ */
+typedef struct BQuery {
+    BQueryStep  steps[BENC_QUERY_MAX_STEPS];
+    size_t      len;
+} BQuery;
+
+typedef struct BQueryFrame {
+    const BNode*    node;
+    size_t          cursor;
+} BQueryFrame;
+
+/**
+ * Depth-first iterator over the matches of a query. Holds no heap memory.
+ */
+typedef struct BQueryIter {
+    const BQuery*   query;
+    BQueryFrame     frames[BENC_QUERY_MAX_STEPS + 1];
+    size_t          depth;          // frames in use
+} BQueryIter;
+
+/**
+ * Compile a path expression.
+ * @return Pointer to the BQuery, or NULL on a syntax error
+ */
+BQuery* bencode_query_compile(const char* path);
+
+void bencode_query_free(BQuery* query);
+
+void bencode_query_begin(BQueryIter* iter, const BQuery* query, const BNode* root);
+
+/**
+ * @return The next matching node in document order, or NULL once all matches were returned
+ */
+const BNode* bencode_query_next(BQueryIter* iter);
+
+/**
+ * Compile path, return its first match and free the query again.
+ */
+const BNode* bencode_query(const BNode* root, const char* path);
+
+#endif
@@ -0,0 +1,120 @@
+#ifndef BENCODE_SCAN_H
+#define BENCODE_SCAN_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#define BENC_SCAN_MAX_DIGITS    32      // longest digit run reported, longer runs are malformed anyway
+#define BENC_SCAN_EXACT_DIGITS  19      // every number of up to this many digits fits in 64 bits
+#define BENC_SCAN_SHORT_DIGITS  8       // runs shorter than this are converted by a plain loop
+
+/*
+ * Digit runs of length prefixes and integers are the only part of bencode a parser has to
+ * look at byte by byte: the structure is length-driven and a string payload may contain
+ * any byte, so everything else is skipped by jumping over payloads. The helpers below
+ * are inline because the runs are short and a call would cost more than the scan.
+ */
+
+static inline size_t bencode_scan_count_scalar(const char* p, size_t avail) {
+    const size_t limit = avail < BENC_SCAN_MAX_DIGITS ? avail : BENC_SCAN_MAX_DIGITS;
+    size_t n = 0;
+    while(n < limit && (unsigned char)(p[n] - '0') < 10) n++;
+    return n;
+}
+
+/**
+ * Number of ASCII digits at the start of p, at most BENC_SCAN_MAX_DIGITS.
+ * @param avail Bytes readable at p
+ */
+static inline size_t bencode_scan_count(const char* p, size_t avail) {
+#if defined(__AVX2__)
+    if(avail >= BENC_SCAN_MAX_DIGITS) {
+        // the whole run limit in one compare: a byte is a digit if (byte - '0') stays <= 9 unsigned
+        const __m256i bytes = _mm256_sub_epi8(_mm256_loadu_si256((const __m256i*)p), _mm256_set1_epi8('0'));
+        const __m256i digit = _mm256_cmpeq_epi8(_mm256_min_epu8(bytes, _mm256_set1_epi8(9)), bytes);
+        const unsigned int mask = ~(unsigned int)_mm256_movemask_epi8(digit);
+        return mask ? (size_t)__builtin_ctz(mask) : BENC_SCAN_MAX_DIGITS;
+    }
+#elif defined(__SSE2__)
+    if(avail >= BENC_SCAN_MAX_DIGITS) {
+        // 16 bytes per compare: a byte is a digit if (byte - '0') stays <= 9 unsigned
+        const __m128i zero = _mm_set1_epi8('0');
+        const __m128i nine = _mm_set1_epi8(9);
+        const __m128i lo = _mm_sub_epi8(_mm_loadu_si128((const __m128i*)p), zero);
+        unsigned int mask = ~(unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_min_epu8(lo, nine), lo)) & 0xFFFF;
+        if(mask) return (size_t)__builtin_ctz(mask);
+
+        const __m128i hi = _mm_sub_epi8(_mm_loadu_si128((const __m128i*)(p + 16)), zero);
+        mask = ~(unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_min_epu8(hi, nine), hi)) & 0xFFFF;
+        return mask ? 16 + (size_t)__builtin_ctz(mask) : BENC_SCAN_MAX_DIGITS;
+    }
+#endif
+    return bencode_scan_count_scalar(p, avail);
+}
+
+/*
+ * Convert n (1..8) digits with three multiplies instead of n: the digits are moved to the
+ * top of a 64-bit word, then adjacent digits, pairs and quads are combined. Reads 8 bytes.
+ */
+static inline uint64_t bencode_scan_swar8(const char* p, size_t n) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap64(v);
+#endif
+    v -= 0x3030303030303030ull;
+    v <<= 8 * (8 - n);      // drop the bytes after the run, the vacated low bytes act as leading zeros
+
+    v = (v * 10) + (v >> 8);
+    v = (((v & 0x000000FF000000FFull) * (100 + (1000000ull << 32))) +
+         (((v >> 16) & 0x000000FF000000FFull) * (1 + (10000ull << 32)))) >> 32;
+    return v;
+}
+
+/**
+ * Value of the n digits at p, UINT64_MAX if it does not fit into 64 bits.
+ * Long runs are rare; they are handled out of line.
+ */
+uint64_t bencode_scan_convert_long(const char* p, size_t n, size_t avail);
+
+static inline uint64_t bencode_scan_convert(const char* p, size_t n, size_t avail) {
+    if(n <= 8 && avail >= 8) return bencode_scan_swar8(p, n);
+    return bencode_scan_convert_long(p, n, avail);
+}
+
+/**
+ * Find the run of ASCII digits at the start of p and convert it.
+ * @param avail Bytes readable at p
+ * @param value Receives the number (0 for an empty run), UINT64_MAX if it does not fit into 64 bits
+ * @return Digits in the run, at most BENC_SCAN_MAX_DIGITS
+ */
+static inline size_t bencode_scan_digits(const char* p, size_t avail, uint64_t* value) {
+    // key lengths and most ints are a few digits in a regular pattern the branch predictor
+    // learns; a fused loop beats any fixed-latency vector sequence there
+    const size_t limit = avail < BENC_SCAN_SHORT_DIGITS ? avail : BENC_SCAN_SHORT_DIGITS;
+    uint64_t v = 0;
+    size_t n = 0;
+    while(n < limit && (unsigned char)(p[n] - '0') < 10) {
+        v = v * 10 + (uint64_t)(p[n] - '0');
+        n++;
+    }
+    if(__builtin_expect(n < BENC_SCAN_SHORT_DIGITS, 1) || n == avail || (unsigned char)(p[n] - '0') >= 10) {
+        *value = v;
+        return n;
+    }
+
+    // long run: find its end with vector compares and convert it 8 digits at a time
+    n = bencode_scan_count(p, avail);
+    *value = bencode_scan_convert(p, n, avail);
+    return n;
+}
+
+#endif
@@ -0,0 +1,113 @@
+#ifndef BENCODE_STREAM_H
+#define BENCODE_STREAM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "bencode.h"
+
+typedef enum BStreamEvent {
+    BEV_DICT_START,
+    BEV_LIST_START,
+    BEV_KEY,
+    BEV_STRING,
+    BEV_INT,
+    BEV_END,            // end of the innermost open dict or list
+} BStreamEvent;
+
+typedef struct BStreamToken {
+    BStreamEvent    type;
+    const char*     data;   // BEV_KEY/BEV_STRING payload, only valid during the callback;
+                            // NULL for strings skipped by ref_threshold, their payload is at end - len
+    size_t          len;
+    long long       value;  // BEV_INT
+    size_t          start;  // stream offset of the first byte of the token
+    size_t          end;    // stream offset one past its last byte
+} BStreamToken;
+
+/**
+ * Receives every token of the stream in document order.
+ * @return 0 to continue, anything else aborts decoding with BSTREAM_ERROR
+ */
+typedef int (*BStreamHandler)(void* user, const BStreamToken* token);
+
+typedef enum BStreamStatus {
+    BSTREAM_NEED_MORE,  // chunk consumed, the value is not complete yet
+    BSTREAM_DONE,       // a complete top-level value was decoded
+    BSTREAM_ERROR,
+} BStreamStatus;
+
+typedef struct BStreamBuilder BStreamBuilder;
+
+/**
+ * Incremental decoder for one bencoded value delivered in arbitrary chunks.
+ * All nesting state lives in frames[], nothing is re-scanned between feeds.
+ */
+typedef struct BStream {
+    BStreamHandler  handler;
+    void*           user;
+    BStreamBuilder* builder;        // set by bstream_init_tree
+
+    int             state;
+    size_t          offset;         // bytes consumed since the last reset
+    size_t          max_string_size;    // defaults to BENC_DEFAULT_MAX_STRSIZE
+    size_t          ref_threshold;      // longer value strings are skipped instead of buffered, 0 to buffer all
+
+    uint8_t         frames[BENC_MAX_DEPTH];
+    size_t          depth;
+
+    // token in progress
+    size_t          token_start;
+    size_t          digits;
+    size_t          str_len;
+    bool            negative;
+    unsigned long long magnitude;
+
+    // payload of a string that spans chunks
+    char*           buf;
+    size_t          buf_len;
+    size_t          buf_cap;
+} BStream;
+
+/**
+ * Initialize a decoder that reports tokens to handler.
+ */
+void bstream_init(BStream* stream, BStreamHandler handler, void* user);
+
+/**
+ * Initialize a decoder that builds a BNode tree with owned strings.
+ * @return false if the builder could not be allocated
+ */
+bool bstream_init_tree(BStream* stream);
+
+/**
+ * Feed the next chunk of input.
+ * @param consumed If non-NULL, receives how many bytes of chunk were used; once
+ *                 BSTREAM_DONE is returned the remaining bytes belong to the next message
+ */
+BStreamStatus bstream_feed(BStream* stream, const char* chunk, size_t len, size_t* consumed);
+
+/**
+ * Take ownership of the tree built by a bstream_init_tree decoder.
+ * @return The root BNode once bstream_feed returned BSTREAM_DONE, NULL otherwise
+ */
+BNode* bstream_take_root(BStream* stream);
+
+/**
+ * Prepare the decoder for the next message, keeping its buffers.
+ */
+void bstream_reset(BStream* stream);
+
+void bstream_free(BStream* stream);
+
+/**
+ * Decode a file through a small read buffer. Value strings longer than ref_threshold
+ * become BNODE_REF nodes whose payload stays in the file (see bencode_string_offset),
+ * so memory use does not grow with e.g. the size of "pieces".
+ * @param ref_threshold 0 to keep every string in memory
+ * @return Pointer to the root BNode, or NULL on error
+ */
+BNode* bstream_parse_file(const char* fpath, size_t ref_threshold);
+
+#endif
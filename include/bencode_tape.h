@@ -0,0 +1,114 @@
+#ifndef BENCODE_TAPE_H
+#define BENCODE_TAPE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "bencode.h"
+#include "cryptography.h"
+
+#define BTAPE_NONE  ((size_t)-1)
+
+/**
+ * One value of a tape. A container is followed by its children (a dict by alternating
+ * key and value entries), so a subtree is a contiguous run of entries and next skips it.
+ */
+typedef struct BTapeEntry {
+    uint16_t    type;       // BTYPE
+    uint16_t    prefix;     // string: digits of the length prefix; int: characters between 'i' and 'e'
+    uint32_t    next;       // index one past the value's last entry, i.e. its next sibling
+    uint64_t    start;      // offset of the value's first byte in the input
+    union {
+        uint64_t    len;    // string: payload length
+        int64_t     value;  // int: the value
+        uint64_t    end;    // dict/list: offset one past the closing 'e'
+    } data;
+} BTapeEntry;
+
+/**
+ * A parsed document flattened into one array, in document order.
+ * Entries point into the input, which has to outlive the tape.
+ */
+typedef struct BTape {
+    BTapeEntry*     entries;
+    size_t          len;
+    size_t          cap;
+    const char*     data;
+    size_t          data_len;
+} BTape;
+
+/**
+ * Iterator over the children of a dict or list.
+ */
+typedef struct BTapeIter {
+    const BTape*    tape;
+    size_t          pos;        // entry of the next child
+    size_t          end;        // one past the container's last entry
+    bool            dict;
+} BTapeIter;
+
+/**
+ * Parse one bencoded value into tape, which may be reused across calls to keep its array.
+ * Accepts exactly what bencode_decode_buffer accepts.
+ * @param consumed If non-NULL, receives the bytes the value occupied;
+ *                 if NULL, the value has to span the whole buffer
+ * @return 0 on success, -1 on malformed input or allocation failure
+ */
+int btape_parse(BTape* tape, const char* data, size_t len, size_t* consumed);
+
+void btape_free(BTape* tape);
+
+BTYPE btape_type(const BTape* tape, size_t entry);
+
+/**
+ * Payload of a string entry, NULL if entry is not a string.
+ */
+const char* btape_string(const BTape* tape, size_t entry, size_t* len);
+
+long long btape_int(const BTape* tape, size_t entry);
+
+/**
+ * Offset one past the last byte of any entry's encoded value.
+ */
+size_t btape_end(const BTape* tape, size_t entry);
+
+/**
+ * Number of items of a list or key-value pairs of a dict, counted by skipping over them.
+ */
+size_t btape_count(const BTape* tape, size_t entry);
+
+/**
+ * Start iterating over the children of a dict or list.
+ * @return false if entry is not a container
+ */
+bool btape_iter_begin(BTapeIter* iter, const BTape* tape, size_t entry);
+
+/**
+ * Advance to the next child. For dicts key receives the key entry, for lists BTAPE_NONE.
+ * @return false once the container is exhausted
+ */
+bool btape_iter_next(BTapeIter* iter, size_t* key, size_t* value);
+
+/**
+ * Value entry of key in a dict, BTAPE_NONE if entry is not a dict or has no such key.
+ */
+size_t btape_find_key(const BTape* tape, size_t dict, const char* key, size_t key_len);
+
+/**
+ * Item at index of a list, BTAPE_NONE if out of range.
+ */
+size_t btape_list_item(const BTape* tape, size_t list, size_t index);
+
+/**
+ * SHA-1 of an entry's encoded bytes, like bencode_hash_node.
+ */
+sha1hash btape_hash(const BTape* tape, size_t entry);
+
+/**
+ * Build a BNode tree of an entry, borrowing strings from the tape's input.
+ * @return Pointer to the BNode (bencode_free_node), or NULL on allocation failure
+ */
+BNode* btape_to_node(const BTape* tape, size_t entry);
+
+#endif
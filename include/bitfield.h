@@ -0,0 +1,44 @@
+#ifndef BITFIELD_H
+#define BITFIELD_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Piece bitfields in wire order: piece 0 is the most significant bit of the first byte.
+ * Bits past the last piece are kept clear. The multi-byte operations work a vector
+ * (AVX2 or SSE2, whichever the build targets) or a 64-bit word at a time.
+ */
+
+#define BITFIELD_BYTES(bits)    (((bits) + 7) / 8)
+
+static inline bool bitfield_get(const uint8_t* bits, size_t index) {
+    return bits[index / 8] & (0x80 >> (index % 8));
+}
+
+static inline void bitfield_set(uint8_t* bits, size_t index) {
+    bits[index / 8] |= (uint8_t)(0x80 >> (index % 8));
+}
+
+static inline void bitfield_clear(uint8_t* bits, size_t index) {
+    bits[index / 8] &= (uint8_t)~(0x80 >> (index % 8));
+}
+
+/**
+ * Number of set bits in the first len bytes.
+ */
+size_t bitfield_count(const uint8_t* bits, size_t len);
+
+/**
+ * Whether a and b have a set bit in common.
+ */
+bool bitfield_any_and(const uint8_t* a, const uint8_t* b, size_t len);
+
+/**
+ * First index >= from below nbits that is set in both a and b.
+ * @return The index, or nbits if there is none
+ */
+size_t bitfield_next_and(const uint8_t* a, const uint8_t* b, size_t nbits, size_t from);
+
+#endif
@@ -0,0 +1,37 @@
+#ifndef CREATE_H
+#define CREATE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "bencode.h"
+
+#define CREATE_MIN_PIECE_LENGTH     (16u * 1024)
+#define CREATE_MAX_PIECE_LENGTH     (16u * 1024 * 1024)
+#define CREATE_TARGET_PIECES        1500
+
+typedef struct CreateOptions {
+    uint64_t    piece_length;   // power of two, 0 for torrent_auto_piece_length
+    size_t      readers;        // reader threads, 0 for 2
+    size_t      hashers;        // hasher threads, 0 for one per online CPU
+    const char* announce;       // tracker URL, NULL to leave it out
+} CreateOptions;
+
+/**
+ * Piece length for a torrent of total_length bytes: the smallest power of two that keeps
+ * the piece count near CREATE_TARGET_PIECES, within the MIN/MAX piece lengths.
+ */
+uint64_t torrent_auto_piece_length(uint64_t total_length);
+
+/**
+ * Build the metainfo dict for a file or a directory tree.
+ * Files of a directory are sorted by path. Symlinks are followed, dangling ones and links
+ * back into a directory being walked are skipped. Pieces are read by reader threads into a
+ * bounded ring of piece buffers and hashed by hasher threads as they arrive.
+ * @param path The file or directory to share; its last component as given (not the
+ *             target of a symlink) becomes the name
+ * @return Root dict owned by the caller (bencode_free_node), or NULL on error
+ */
+BNode* torrent_create(const char* path, const CreateOptions* opts);
+
+#endif
@@ -1,9 +1,89 @@
+#ifndef CRYPTOGRAPHY_H
+#define CRYPTOGRAPHY_H
+
+#include <stddef.h>
 #include <stdint.h>
 
 typedef struct sha1hash {
     uint8_t bytes[20];
 } sha1hash;
 
+/**
+ * Incremental SHA-1 state. Buffers at most one 64-byte block of input.
+ * The hash functions may be called from any thread; a context must not be shared without locking.
+ */
+typedef struct sha1_ctx {
+    uint32_t    state[5];
+    uint64_t    length;         // total bytes hashed so far
+    uint8_t     block[64];
+    size_t      block_len;
+} sha1_ctx;
+
+void sha1_init(sha1_ctx* ctx);
+
+void sha1_update(sha1_ctx* ctx, const uint8_t* data, size_t len);
+
+/**
+ * Pad the last block and return the digest. The context has to be re-initialized before reuse.
+ */
+sha1hash sha1_final(sha1_ctx* ctx);
+
 sha1hash sha1(const uint8_t* message, size_t message_len);
 
-void print_sha1(sha1hash hash);
\ No newline at end of file
+/**
+ * Hash count independent messages of the same length, several at a time across SIMD lanes.
+ * Results are identical to calling sha1() on each message.
+ * @param msgs count pointers to len bytes each
+ * @param out Receives count digests, in the order of msgs
+ */
+void sha1_many(const uint8_t** msgs, size_t len, size_t count, sha1hash* out);
+
+/**
+ * Name of the lane implementation sha1_many uses ("avx512", "avx2", "sse2" or "scalar").
+ */
+const char* sha1_many_backend(void);
+
+void print_sha1(sha1hash hash);
+
+typedef struct sha256hash {
+    uint8_t bytes[32];
+} sha256hash;
+
+/**
+ * Incremental SHA-256 state, used like sha1_ctx.
+ */
+typedef struct sha256_ctx {
+    uint32_t    state[8];
+    uint64_t    length;
+    uint8_t     block[64];
+    size_t      block_len;
+} sha256_ctx;
+
+void sha256_init(sha256_ctx* ctx);
+
+void sha256_update(sha256_ctx* ctx, const uint8_t* data, size_t len);
+
+/**
+ * Pad the last block and return the digest. The context has to be re-initialized before reuse.
+ */
+sha256hash sha256_final(sha256_ctx* ctx);
+
+sha256hash sha256(const uint8_t* message, size_t message_len);
+
+/**
+ * SHA-256 of two digests written one after the other, an inner node of a merkle tree.
+ */
+sha256hash sha256_pair(const sha256hash* left, const sha256hash* right);
+
+/**
+ * Like sha1_many: count messages of len bytes each, hashed several at a time across
+ * SIMD lanes, with results identical to sha256() on each.
+ */
+void sha256_many(const uint8_t** msgs, size_t len, size_t count, sha256hash* out);
+
+/**
+ * Name of the lane implementation sha256_many uses ("avx512", "avx2" or "scalar").
+ */
+const char* sha256_many_backend(void);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,89 @@
+#ifndef DISK_H
+#define DISK_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "download.h"
+#include "torrent.h"
+
+#define DISK_DEFAULT_THREADS        2
+#define DISK_DEFAULT_CACHE          (64u * 1024 * 1024)     // bytes of pieces kept to serve reads
+#define DISK_DEFAULT_QUEUED         (256u * 1024 * 1024)    // bytes of writes waiting for a thread
+#define DISK_DEFAULT_OPEN_FILES     256
+
+typedef struct DiskOptions {
+    size_t      threads;        // I/O threads, 0 for DISK_DEFAULT_THREADS
+    uint64_t    cache_size;     // 0 for DISK_DEFAULT_CACHE
+    uint64_t    max_queued;     // 0 for DISK_DEFAULT_QUEUED, disk_write_piece waits beyond it
+    size_t      max_open_files; // 0 for DISK_DEFAULT_OPEN_FILES
+} DiskOptions;
+
+typedef struct DiskStats {
+    size_t      pieces_written;
+    size_t      write_failures;
+    size_t      write_calls;    // pwritev calls, fewer than pieces when neighbours were coalesced
+    uint64_t    bytes_written;
+    size_t      read_calls;
+    uint64_t    bytes_read;
+    size_t      cache_hits;     // disk_read calls answered from memory
+    size_t      cache_misses;
+} DiskStats;
+
+typedef struct Disk Disk;
+
+/**
+ * Piece storage for one torrent, below data_dir the way verify_torrent looks for it.
+ * Offsets are mapped to files through the prefix sums in TorrentFile.offset (binary
+ * search, see torrent_file_at); files and their directories are created on first use
+ * and at most max_open_files stay open. Writes and reads run on a pool of I/O threads:
+ * queued pieces that are neighbours on disk go out in one pwritev per file, written
+ * pieces stay in an LRU cache for uploads, and reads load whole pieces into that cache.
+ * Thread-safe.
+ * @param info Has to outlive the disk
+ * @return The disk, or NULL on error
+ */
+Disk* disk_new(const TorrentInfo* info, const char* data_dir, const DiskOptions* opts);
+
+/**
+ * Finish the queued writes and release the disk.
+ */
+void disk_free(Disk* disk);
+
+/**
+ * Queue a copy of a complete piece for writing. Waits while max_queued bytes are queued
+ * already, the only time the caller blocks on the disk.
+ * @return false if the copy could not be queued
+ */
+bool disk_write_piece(Disk* disk, size_t piece, const uint8_t* data, size_t len);
+
+/**
+ * Wait until every write queued before the call is done.
+ * @return false if a write failed since the last flush
+ */
+bool disk_flush(Disk* disk);
+
+/**
+ * Copy len bytes at begin of piece into out if the piece is in memory, otherwise start
+ * loading it and return right away; disk_event_fd becomes readable once it is loaded.
+ * @return 1 if out was filled, 0 if the piece is being loaded, -1 if it cannot be read
+ */
+int disk_read(Disk* disk, size_t piece, uint64_t begin, size_t len, uint8_t* out);
+
+/**
+ * An eventfd that is readable after pieces finished loading, for peer_engine_watch.
+ * disk_acknowledge resets it.
+ */
+int disk_event_fd(const Disk* disk);
+
+void disk_acknowledge(Disk* disk);
+
+void disk_get_stats(Disk* disk, DiskStats* stats);
+
+/**
+ * Storage callbacks for DownloadOptions.storage that queue each good piece on disk.
+ */
+DownloadStorage disk_storage(Disk* disk);
+
+#endif
@@ -0,0 +1,75 @@
+#ifndef DOWNLOAD_H
+#define DOWNLOAD_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "peer_engine.h"
+#include "picker.h"
+#include "torrent.h"
+
+#define DOWNLOAD_DEFAULT_PIPELINE   32                      // block requests outstanding per peer
+#define DOWNLOAD_DEFAULT_BUFFERED   (128u * 1024 * 1024)    // bytes of unfinished pieces held in memory
+
+typedef struct DownloadStorage {
+    void*   user;
+    // a piece whose hash matched; false fails the piece as if the hash had not
+    bool    (*write_piece)(void* user, size_t piece, const uint8_t* data, size_t len);
+} DownloadStorage;
+
+typedef struct DownloadOptions {
+    size_t          pipeline;       // 0 for DOWNLOAD_DEFAULT_PIPELINE
+    uint64_t        max_buffered;   // 0 for DOWNLOAD_DEFAULT_BUFFERED, at least one piece is always allowed
+    DownloadStorage storage;
+} DownloadOptions;
+
+typedef struct DownloadStats {
+    size_t      peers;              // peers past the handshake
+    size_t      pieces_done;
+    size_t      hash_failures;
+    uint64_t    bytes_received;     // block payload, including blocks that were discarded
+} DownloadStats;
+
+typedef struct Download Download;
+
+/**
+ * Leecher side of the peer wire protocol for one torrent.
+ * Pieces are chosen rarest first (see picker.h), their blocks requested from unchoking
+ * peers (the last ones from two peers in the end game), assembled per piece in memory,
+ * checked against the piece hash and handed to storage. Driven entirely by the callbacks of
+ * download_peer_handler, so it runs on the thread of the engine it is attached to.
+ * @param info Has to outlive the download
+ * @return The download, or NULL on error
+ */
+Download* download_new(const TorrentInfo* info, const DownloadOptions* opts);
+
+/**
+ * Release the download. The engine it was attached to has to be freed first.
+ */
+void download_free(Download* download);
+
+/**
+ * Callbacks to pass as PeerEngineOptions.handler.
+ */
+PeerHandler download_peer_handler(Download* download);
+
+/**
+ * Whether every wanted piece passed the hash check.
+ */
+bool download_complete(const Download* download);
+
+/**
+ * Change which pieces are fetched first, 0 (PICKER_PRIORITY_SKIP) to PICKER_PRIORITY_MAX.
+ * Pieces start at PICKER_PRIORITY_DEFAULT; skipped ones are not downloaded at all.
+ */
+void download_set_priority(Download* download, size_t piece, int priority);
+
+void download_get_stats(const Download* download, DownloadStats* stats);
+
+/**
+ * Pieces that passed the hash check, one bit per piece, most significant bit first.
+ */
+const uint8_t* download_bitfield(const Download* download, size_t* len);
+
+#endif
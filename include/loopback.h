@@ -0,0 +1,50 @@
+#ifndef LOOPBACK_H
+#define LOOPBACK_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define LOOPBACK_DEFAULT_PEERS      64
+#define LOOPBACK_DEFAULT_SIZE       (256u * 1024 * 1024)
+
+typedef struct LoopbackOptions {
+    size_t      peers;          // connections to stand-in seeds, 0 for LOOPBACK_DEFAULT_PEERS
+    uint64_t    size;           // bytes of generated torrent data, 0 for LOOPBACK_DEFAULT_SIZE
+    uint64_t    piece_length;   // power of two, 0 for torrent_auto_piece_length
+    size_t      threads;        // seed engines, each on its own thread, 0 for 1
+    size_t      files;          // split the data into this many files, 0 or 1 for a single-file torrent
+    const char* data_dir;       // NULL to keep the data in memory, see loopback_run
+    bool        magnet;         // start from the infohash alone and fetch the info dict from the seeds first
+} LoopbackOptions;
+
+typedef struct LoopbackResult {
+    size_t      peers;          // most connections past the handshake at the same time
+    size_t      pieces;
+    size_t      good_pieces;    // stored pieces that match the generated data
+    size_t      hash_failures;
+    uint64_t    bytes;          // block payload received
+    size_t      write_calls;    // pwritev calls storing the download, 0 in memory
+    double      seconds;        // the metadata fetch included
+    double      cpu_seconds;    // of the whole process, seeds included
+    double      metadata_seconds;       // magnet: until the info dict was verified and parsed
+    double      first_piece_seconds;    // until the first piece passed its hash check
+} LoopbackResult;
+
+/**
+ * Download a generated torrent over 127.0.0.1 from stand-in seeds running in this process.
+ * The data is generated in memory and turned into a single-file torrent; seed engines
+ * share one listening port and serve every piece, and a downloader engine opens
+ * opts->peers connections to them and fetches the torrent through the peer wire protocol.
+ * With opts->data_dir the seeds serve the data from data_dir/seed through the disk layer
+ * and the download is stored in data_dir/leech, then verified there; its progress is
+ * kept in data_dir/leech.resume.
+ * With opts->magnet the downloader knows only the infohash, as from a magnet link: it
+ * fetches the info dict from the seeds over ut_metadata (BEP 9) on connections of its
+ * own, then downloads with the torrent parsed from it.
+ * Raises the soft open file limit as far as the connection count needs.
+ * @return 0 if the download completed, -1 if it could not be set up or stalled
+ */
+int loopback_run(const LoopbackOptions* opts, LoopbackResult* result);
+
+#endif
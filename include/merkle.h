@@ -0,0 +1,117 @@
+#ifndef MERKLE_H
+#define MERKLE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "cryptography.h"
+
+/*
+ * BEP 52 merkle trees. A file is cut into 16 KiB blocks whose SHA-256 hashes are the
+ * leaves (the last block is hashed at its real size), the leaf layer is padded with
+ * all-zero hashes to a power of two and every inner node hashes its two children.
+ * The root is the file's "pieces root", the layer whose nodes cover one piece each is
+ * its entry in "piece layers".
+ */
+
+#define MERKLE_BLOCK_SIZE   16384
+
+typedef struct MerkleTree {
+    sha256hash* nodes;          // every layer from the leaves up, each padded to a power of two
+    size_t      block_count;    // leaves that hash file data
+    size_t      leaf_count;     // block_count rounded up to a power of two
+    size_t      depth;          // layers above the leaves, the length of a proof
+} MerkleTree;
+
+/**
+ * Number of 16 KiB blocks of a file, the last one may be short.
+ */
+size_t merkle_block_count(uint64_t file_length);
+
+/**
+ * Number of hashes in a file's piece layer, 0 if the file fits into one piece and has
+ * no piece layer.
+ */
+size_t merkle_piece_count(uint64_t file_length, uint64_t piece_length);
+
+/**
+ * Root of a subtree of height level whose leaves are all padding.
+ */
+sha256hash merkle_pad_hash(size_t level);
+
+/**
+ * Hash every 16 KiB block of data into leaves, merkle_block_count(len) of them. Full
+ * blocks go through sha256_many, spread over threads workers (0 for one per online CPU).
+ */
+void merkle_hash_blocks(const uint8_t* data, uint64_t len, size_t threads, sha256hash* leaves);
+
+/**
+ * Root over count hashes of one layer, level layers above the leaves, padded up to width
+ * (a power of two >= count) with merkle_pad_hash(level).
+ * @return false if width is not a power of two >= count or memory ran out
+ */
+bool merkle_root(const sha256hash* hashes, size_t count, size_t width, size_t level, sha256hash* root);
+
+/**
+ * Build the whole tree over count leaf hashes.
+ * @return The tree, or NULL if count is 0 or memory ran out
+ */
+MerkleTree* merkle_tree_from_leaves(const sha256hash* leaves, size_t count);
+
+/**
+ * Hash a file's data with merkle_hash_blocks and build its tree.
+ * @return The tree, or NULL if len is 0 (empty files have no tree) or memory ran out
+ */
+MerkleTree* merkle_tree_build(const uint8_t* data, uint64_t len, size_t threads);
+
+void merkle_tree_free(MerkleTree* tree);
+
+sha256hash merkle_tree_root(const MerkleTree* tree);
+
+/**
+ * A layer of the tree, level 0 being the leaves, including its padding.
+ * @return The hashes, or NULL if level is above the root
+ */
+const sha256hash* merkle_tree_layer(const MerkleTree* tree, size_t level, size_t* count);
+
+/**
+ * Write the piece layer for piece_length into layer, merkle_piece_count hashes.
+ * @return false if piece_length is not a power of two >= MERKLE_BLOCK_SIZE
+ */
+bool merkle_tree_piece_layer(const MerkleTree* tree, uint64_t piece_length, sha256hash* layer);
+
+/**
+ * Write the sibling hashes from a block's leaf up to the root into proof, bottom first.
+ * @return The number written (tree->depth), or 0 if block is out of range
+ */
+size_t merkle_tree_proof(const MerkleTree* tree, size_t block, sha256hash* proof);
+
+/**
+ * Whether hash, the node at index of a layer depth levels below root, leads up to root
+ * through the sibling hashes in proof.
+ */
+bool merkle_verify_proof(const sha256hash* root, const sha256hash* hash, size_t index,
+                         const sha256hash* proof, size_t depth);
+
+/**
+ * Check one block of a file against its pieces root, with the proof from merkle_tree_proof.
+ * len has to be the block's exact size, MERKLE_BLOCK_SIZE but for the file's last block.
+ */
+bool merkle_verify_block(const sha256hash* root, uint64_t file_length, size_t block,
+                         const uint8_t* data, size_t len, const sha256hash* proof);
+
+/**
+ * Check a file's piece layer, merkle_piece_count hashes, against its pieces root.
+ */
+bool merkle_verify_piece_layer(const sha256hash* root, uint64_t file_length, uint64_t piece_length,
+                               const sha256hash* layer);
+
+/**
+ * Check one piece of a file against its piece layer hash. len is the piece's size, short
+ * for the file's last piece; the leaves past it are padding.
+ */
+bool merkle_verify_piece(const sha256hash* piece_hash, uint64_t piece_length,
+                         const uint8_t* data, size_t len);
+
+#endif
@@ -0,0 +1,127 @@
+#ifndef METADATA_H
+#define METADATA_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "bencode.h"
+#include "cryptography.h"
+#include "peer_engine.h"
+
+#define METADATA_PIECE_SIZE         16384
+#define METADATA_MAX_SIZE           (16u * 1024 * 1024)     // larger metadata_size announcements are refused
+#define METADATA_LOCAL_ID           1                       // our extension id for ut_metadata
+#define METADATA_PIPELINE           4                       // piece requests outstanding per peer
+
+typedef enum MetadataResult {
+    METADATA_INVALID,           // piece out of range or of the wrong length, nothing stored
+    METADATA_STORED,            // stored (or already had it), pieces are still missing
+    METADATA_COMPLETE,          // the last missing piece arrived and the infohash matched
+    METADATA_HASH_FAILED,       // the last missing piece arrived but the infohash did not match; every piece was dropped
+} MetadataResult;
+
+typedef struct MetadataAssembler MetadataAssembler;
+
+/**
+ * Collects the info dict of a torrent from METADATA_PIECE_SIZE pieces arriving in any
+ * order (BEP 9). Pieces are copied straight to their place in one buffer of the full
+ * size, and the SHA-1 runs over the contiguous prefix as soon as it grows, so the hash
+ * is final the moment the last piece is in.
+ * @param size The metadata_size a peer announced, at most METADATA_MAX_SIZE
+ * @return The assembler, or NULL if size is 0, too large or memory ran out
+ */
+MetadataAssembler* metadata_assembler_new(const sha1hash* info_hash, size_t size);
+
+void metadata_assembler_free(MetadataAssembler* assembler);
+
+size_t metadata_size(const MetadataAssembler* assembler);
+
+size_t metadata_piece_count(const MetadataAssembler* assembler);
+
+bool metadata_have_piece(const MetadataAssembler* assembler, size_t piece);
+
+/**
+ * Pieces not stored yet.
+ */
+size_t metadata_missing(const MetadataAssembler* assembler);
+
+/**
+ * Store one piece. Every piece is METADATA_PIECE_SIZE bytes but the last, which holds
+ * the rest.
+ */
+MetadataResult metadata_add_piece(MetadataAssembler* assembler, size_t piece, const uint8_t* data, size_t len);
+
+/**
+ * Decode the completed info dict in place: the document takes over the buffer, its
+ * root is the info dict (see torrent_info_from_dict). The assembler is empty afterwards.
+ * @param opts Decoder settings, NULL for the defaults
+ * @return The document, or NULL if the metadata is not complete or not a bencoded dict
+ */
+BDocument* metadata_take_document(MetadataAssembler* assembler, const BDecodeOptions* opts);
+
+typedef struct MetadataFetchStats {
+    size_t      peers;              // peers past the handshake
+    size_t      pieces_received;    // data messages, duplicates included
+    size_t      hash_failures;
+} MetadataFetchStats;
+
+typedef struct MetadataFetch MetadataFetch;
+
+/**
+ * Fetches the info dict of a torrent known only by its infohash (a magnet link) from
+ * peers that speak the extension protocol (BEP 10) and ut_metadata (BEP 9). The engine
+ * it runs on has to set PEER_EXTENSION_BIT in its reserved bytes. Pieces are spread over
+ * the peers, METADATA_PIPELINE at a time each, and asked from more than one peer only
+ * once every missing piece is requested somewhere. Peers may announce different sizes:
+ * one size is fetched at a time from the peers that announced it, and when the result
+ * fails the infohash check the size that failed least often is tried next. Driven by
+ * the callbacks of metadata_fetch_handler on the engine's thread.
+ * @return The fetch, or NULL on error
+ */
+MetadataFetch* metadata_fetch_new(const sha1hash* info_hash);
+
+/**
+ * Release the fetch. The engine it was attached to has to be freed first.
+ */
+void metadata_fetch_free(MetadataFetch* fetch);
+
+/**
+ * Callbacks to pass as PeerEngineOptions.handler.
+ */
+PeerHandler metadata_fetch_handler(MetadataFetch* fetch);
+
+/**
+ * Whether the info dict is complete and matched the infohash.
+ */
+bool metadata_fetch_complete(const MetadataFetch* fetch);
+
+void metadata_fetch_get_stats(const MetadataFetch* fetch, MetadataFetchStats* stats);
+
+/**
+ * The fetched info dict as a document, see metadata_take_document. Only once.
+ */
+BDocument* metadata_fetch_take_document(MetadataFetch* fetch);
+
+/**
+ * The serving side: the raw bencoded info dict of a torrent we have.
+ */
+typedef struct MetadataSource {
+    const uint8_t*  data;
+    size_t          len;
+} MetadataSource;
+
+/**
+ * Call from on_connect: sends our extension handshake, announcing ut_metadata and the
+ * metadata size, to a peer that set PEER_EXTENSION_BIT.
+ * @return false if it did not fit into the output ring
+ */
+bool metadata_source_connect(const MetadataSource* source, PeerConn* conn, const PeerHandshake* remote);
+
+/**
+ * Call from on_message for PEER_MSG_EXTENDED: remembers the peer's ut_metadata id from
+ * its extension handshake, in the connection's user pointer, and answers its requests.
+ */
+PeerAction metadata_source_message(const MetadataSource* source, PeerConn* conn, const PeerMessage* msg);
+
+#endif
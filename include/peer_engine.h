@@ -0,0 +1,114 @@
+#ifndef PEER_ENGINE_H
+#define PEER_ENGINE_H
+
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "cryptography.h"
+#include "peer_wire.h"
+
+#define PEER_DEFAULT_MAX_PEERS      4096
+#define PEER_DEFAULT_RING_SIZE      (64u * 1024)
+
+typedef struct PeerEngine PeerEngine;
+typedef struct PeerConn PeerConn;
+
+typedef enum PeerAction {
+    PEER_CONTINUE,          // message handled, consume it
+    PEER_BLOCKED,           // cannot handle it yet: keep it and retry once output drained or on peer_engine_resume
+    PEER_DISCONNECT,        // drop the connection
+} PeerAction;
+
+/**
+ * Callbacks of the engine's user, all invoked on the thread running peer_engine_poll.
+ * Messages are written to peer_conn_output and flushed by the engine.
+ */
+typedef struct PeerHandler {
+    void*       user;
+    // handshake with a matching infohash received; return false to drop the peer
+    bool        (*on_connect)(void* user, PeerConn* conn, const PeerHandshake* remote);
+    // msg and its payload are only valid during the call
+    PeerAction  (*on_message)(void* user, PeerConn* conn, const PeerMessage* msg);
+    // connection gone, after on_connect returned true; conn is invalid afterwards
+    void        (*on_close)(void* user, PeerConn* conn);
+} PeerHandler;
+
+typedef struct PeerEngineOptions {
+    sha1hash    info_hash;              // handshakes for any other torrent are refused
+    uint8_t     peer_id[PEER_ID_LEN];
+    uint8_t     reserved[8];            // reserved bits of our handshakes, e.g. PEER_EXTENSION_BIT
+    size_t      max_peers;              // 0 for PEER_DEFAULT_MAX_PEERS
+    size_t      ring_size;              // input and output buffer per connection, power of two, 0 for PEER_DEFAULT_RING_SIZE
+    PeerHandler handler;
+} PeerEngineOptions;
+
+/**
+ * Peer wire protocol engine for one torrent on one thread.
+ * Sockets are non-blocking and watched edge-triggered by one epoll instance; each
+ * connection owns a fixed input and output ring, and messages are parsed in place from
+ * the input ring. An engine is not thread-safe: run one per core, each listening on the
+ * same port (SO_REUSEPORT lets the kernel spread incoming connections across them).
+ * @return The engine, or NULL on error
+ */
+PeerEngine* peer_engine_new(const PeerEngineOptions* opts);
+
+/**
+ * Close every connection (calling on_close) and release the engine.
+ */
+void peer_engine_free(PeerEngine* engine);
+
+/**
+ * Accept incoming peers on addr. Port 0 picks a free port.
+ * @return The bound port, or -1 on error
+ */
+int peer_engine_listen(PeerEngine* engine, const struct sockaddr_in* addr);
+
+/**
+ * Start connecting to a peer; the handshake is sent once the connection is up.
+ * @return The connection, or NULL if it could not be started or max_peers is reached
+ */
+PeerConn* peer_engine_connect(PeerEngine* engine, const struct sockaddr_in* addr);
+
+/**
+ * Wait up to timeout_ms for socket events and service every ready connection.
+ * @return Number of events handled, or -1 if waiting failed
+ */
+int peer_engine_poll(PeerEngine* engine, int timeout_ms);
+
+/**
+ * Watch one more descriptor, e.g. an eventfd another thread signals when work for this
+ * engine completed. on_ready is called on the polling thread for as long as fd is
+ * readable (level-triggered), so it has to drain it. One watch per engine.
+ * @return false if the engine already has a watch or fd could not be watched
+ */
+bool peer_engine_watch(PeerEngine* engine, int fd, void (*on_ready)(void* user), void* user);
+
+/**
+ * Retry the messages handlers returned PEER_BLOCKED for, in this poll round if called
+ * from a callback and in the next one otherwise.
+ */
+void peer_engine_resume(PeerEngine* engine);
+
+/**
+ * Connections open or being opened.
+ */
+size_t peer_engine_peers(const PeerEngine* engine);
+
+/**
+ * Output ring of the connection. Whatever is appended is sent when the engine next
+ * services the connection, at the latest at the end of the current peer_engine_poll.
+ */
+PeerRing* peer_conn_output(PeerConn* conn);
+
+void peer_conn_set_user(PeerConn* conn, void* user);
+
+void* peer_conn_user(const PeerConn* conn);
+
+/**
+ * Close the connection after the current callback; on_close follows.
+ */
+void peer_conn_close(PeerConn* conn);
+
+#endif
@@ -0,0 +1,154 @@
+#ifndef PEER_WIRE_H
+#define PEER_WIRE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#include "cryptography.h"
+
+#define PEER_PROTOCOL           "BitTorrent protocol"
+#define PEER_PROTOCOL_LEN       19
+#define PEER_HANDSHAKE_LEN      (1 + PEER_PROTOCOL_LEN + 8 + 20 + 20)
+#define PEER_ID_LEN             20
+#define PEER_BLOCK_SIZE         (16u * 1024)        // request size every client accepts
+#define PEER_MAX_BLOCK_SIZE     (128u * 1024)       // larger requests are a protocol error
+#define PEER_EXTENSION_BYTE     5                   // reserved handshake bit of the extension protocol (BEP 10)
+#define PEER_EXTENSION_BIT      0x10
+#define PEER_EXTENDED_HANDSHAKE 0                   // extended message id of the extension handshake
+
+typedef enum PeerMessageType {
+    PEER_MSG_KEEPALIVE      = -1,   // zero-length message, no id
+    PEER_MSG_CHOKE          = 0,
+    PEER_MSG_UNCHOKE        = 1,
+    PEER_MSG_INTERESTED     = 2,
+    PEER_MSG_NOT_INTERESTED = 3,
+    PEER_MSG_HAVE           = 4,
+    PEER_MSG_BITFIELD       = 5,
+    PEER_MSG_REQUEST        = 6,
+    PEER_MSG_PIECE          = 7,
+    PEER_MSG_CANCEL         = 8,
+    PEER_MSG_EXTENDED       = 20,   // BEP 10: one byte of extension id, then the extension's body
+} PeerMessageType;
+
+/**
+ * Byte ring with a power-of-two capacity. head and tail run freely and are masked on
+ * access, so the ring is empty when they are equal and full when they are cap apart.
+ */
+typedef struct PeerRing {
+    uint8_t*    data;
+    size_t      cap;
+    size_t      head;       // next byte to read
+    size_t      tail;       // next byte to write
+} PeerRing;
+
+typedef struct PeerHandshake {
+    uint8_t     reserved[8];
+    sha1hash    info_hash;
+    uint8_t     peer_id[PEER_ID_LEN];
+} PeerHandshake;
+
+/**
+ * A message parsed in place. The payload of bitfield, piece, extended and unknown messages is not
+ * copied: it is described by up to two segments of the ring, split where the ring wraps,
+ * and stays valid until the message is consumed.
+ */
+typedef struct PeerMessage {
+    int             type;           // PeerMessageType, or the raw id of a message this codec does not know
+    uint32_t        index;          // have, request, piece, cancel; the extension id of an extended message
+    uint32_t        begin;          // request, piece, cancel
+    uint32_t        length;         // request, cancel
+    struct iovec    payload[2];
+    int             payload_count;
+    size_t          payload_len;
+    size_t          size;           // bytes the message occupies in the ring, length prefix included
+} PeerMessage;
+
+bool peer_ring_init(PeerRing* ring, size_t cap);
+
+void peer_ring_free(PeerRing* ring);
+
+static inline size_t peer_ring_used(const PeerRing* ring) {
+    return ring->tail - ring->head;
+}
+
+static inline size_t peer_ring_space(const PeerRing* ring) {
+    return ring->cap - (ring->tail - ring->head);
+}
+
+/**
+ * Describe len readable bytes starting offset bytes after head.
+ * @return Number of segments written to iov (0 if len is 0)
+ */
+int peer_ring_peek(const PeerRing* ring, size_t offset, size_t len, struct iovec iov[2]);
+
+/**
+ * Describe the free space, e.g. for readv. Bytes written there are published with peer_ring_commit.
+ * @return Number of segments written to iov (0 if the ring is full)
+ */
+int peer_ring_reserve(const PeerRing* ring, struct iovec iov[2]);
+
+static inline void peer_ring_commit(PeerRing* ring, size_t len) {
+    ring->tail += len;
+}
+
+static inline void peer_ring_consume(PeerRing* ring, size_t len) {
+    ring->head += len;
+}
+
+/**
+ * Copy len readable bytes starting offset bytes after head into out, across the wrap.
+ */
+void peer_ring_copy_out(const PeerRing* ring, size_t offset, void* out, size_t len);
+
+/**
+ * Append len bytes, all or nothing.
+ * @return false if they do not fit
+ */
+bool peer_ring_write(PeerRing* ring, const void* data, size_t len);
+
+/**
+ * Parse the handshake at the head of the ring without consuming it.
+ * @return 1 when parsed (PEER_HANDSHAKE_LEN bytes), 0 if more input is needed, -1 if it is not a BitTorrent handshake
+ */
+int peer_parse_handshake(const PeerRing* ring, PeerHandshake* handshake);
+
+/**
+ * Parse the length-prefixed message at the head of the ring without consuming it.
+ * Fixed-size messages are checked for their exact length.
+ * @param max_len Longest message body accepted, at most the ring capacity minus the prefix
+ * @return 1 when parsed, 0 if more input is needed, -1 on a protocol error
+ */
+int peer_parse_message(const PeerRing* ring, size_t max_len, PeerMessage* msg);
+
+/*
+ * Message writers: each appends one complete message to the ring, or nothing and
+ * returns false when it does not fit.
+ */
+
+bool peer_write_handshake(PeerRing* ring, const PeerHandshake* handshake);
+
+/**
+ * choke, unchoke, interested, not interested or a keep-alive (PEER_MSG_KEEPALIVE).
+ */
+bool peer_write_simple(PeerRing* ring, PeerMessageType type);
+
+bool peer_write_have(PeerRing* ring, uint32_t index);
+
+bool peer_write_bitfield(PeerRing* ring, const uint8_t* bitfield, size_t len);
+
+/**
+ * request or cancel (type PEER_MSG_REQUEST or PEER_MSG_CANCEL).
+ */
+bool peer_write_request(PeerRing* ring, PeerMessageType type, uint32_t index, uint32_t begin, uint32_t length);
+
+bool peer_write_piece(PeerRing* ring, uint32_t index, uint32_t begin, const void* block, size_t len);
+
+/**
+ * Extended message for extension id: a bencoded dict, optionally followed by raw data
+ * (data_len 0 for none), as ut_metadata sends it.
+ */
+bool peer_write_extended(PeerRing* ring, uint8_t id, const void* dict, size_t dict_len, const void* data, size_t data_len);
+
+#endif
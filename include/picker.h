@@ -0,0 +1,101 @@
+#ifndef PICKER_H
+#define PICKER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define PICKER_NONE                 SIZE_MAX
+#define PICKER_PRIORITY_SKIP        0           // never downloaded
+#define PICKER_PRIORITY_DEFAULT     4
+#define PICKER_PRIORITY_MAX         7
+#define PICKER_AVAILABILITY_LEVELS  1024        // pieces more peers than this have count as equally common
+
+typedef struct Picker Picker;
+
+/**
+ * Rarest-first piece selection for one torrent.
+ * Pieces that can be started sit in buckets keyed by (priority, availability), each a
+ * linked list, with a bitmap of the non-empty buckets. Availability changes move a piece
+ * between neighbouring buckets and picking walks the buckets from the rarest of the
+ * highest priority, so neither scans the pieces. Peers that have every piece are only
+ * counted (picker_add_seed), they do not change the order.
+ * Not thread-safe.
+ * @return The picker with every piece wanted at PICKER_PRIORITY_DEFAULT, or NULL on error
+ */
+Picker* picker_new(size_t piece_count);
+
+void picker_free(Picker* picker);
+
+/**
+ * A peer announced one more piece (have message).
+ */
+void picker_add_have(Picker* picker, size_t piece);
+
+/**
+ * Count or uncount every piece in a peer's bitfield (connect, disconnect).
+ */
+void picker_add_bitfield(Picker* picker, const uint8_t* bitfield);
+
+void picker_remove_bitfield(Picker* picker, const uint8_t* bitfield);
+
+void picker_add_seed(Picker* picker);
+
+void picker_remove_seed(Picker* picker);
+
+/**
+ * Peers that have the piece, seeds included.
+ */
+size_t picker_availability(const Picker* picker, size_t piece);
+
+/**
+ * Set a piece's priority, 0 (PICKER_PRIORITY_SKIP) to PICKER_PRIORITY_MAX.
+ * Higher priorities are picked first, rarest first within a priority.
+ */
+void picker_set_priority(Picker* picker, size_t piece, int priority);
+
+/**
+ * The rarest piece of the highest priority that the peer has and that was not started.
+ * @param bitfield The peer's pieces, NULL for a seed
+ * @return The piece, or PICKER_NONE
+ */
+size_t picker_pick(const Picker* picker, const uint8_t* bitfield);
+
+/**
+ * Take a piece out of selection while it is downloaded.
+ */
+void picker_start(Picker* picker, size_t piece);
+
+/**
+ * Put a started piece back, e.g. when it was given up.
+ */
+void picker_abort(Picker* picker, size_t piece);
+
+/**
+ * The piece is downloaded and checked, it is no longer wanted.
+ */
+void picker_done(Picker* picker, size_t piece);
+
+/**
+ * Whether the piece still has to be downloaded (started or not).
+ */
+bool picker_wanted(const Picker* picker, size_t piece);
+
+/**
+ * Whether the peer has a piece that still has to be downloaded.
+ * @param bitfield The peer's pieces, NULL for a seed
+ */
+bool picker_interesting(const Picker* picker, const uint8_t* bitfield);
+
+/**
+ * Pieces still to be downloaded, started ones included; 0 once everything wanted is done.
+ */
+size_t picker_remaining(const Picker* picker);
+
+/**
+ * End game: every wanted piece is started, only their outstanding blocks are left, so
+ * they may be requested from more than one peer.
+ */
+bool picker_endgame(const Picker* picker);
+
+#endif
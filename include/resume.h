@@ -0,0 +1,75 @@
+#ifndef RESUME_H
+#define RESUME_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "disk.h"
+#include "torrent.h"
+
+#define RESUME_DEFAULT_INTERVAL     30.0    // seconds between writes of a ResumeWriter at most
+
+/*
+ * A resume file is a bencoded dict kept next to the data:
+ *   info-hash  the torrent it belongs to
+ *   pieces     bitfield of the pieces that passed the hash check and are on disk
+ *   files      per file of the torrent: length and mtime (mtime-ns) when it was written
+ *   version    1
+ */
+
+typedef struct ResumeResult {
+    uint8_t*    bitfield;       // one bit per piece, most significant bit first, set if the piece is good
+    size_t      bitfield_len;
+    size_t      good_pieces;
+    size_t      trusted_pieces; // good according to the resume file, not hashed
+    size_t      checked_pieces; // hashed because the resume file was missing or their files changed
+    bool        loaded;         // the resume file was read and belongs to the torrent
+    double      seconds;
+} ResumeResult;
+
+/**
+ * Record which pieces are good, with the current size and mtime of every file below
+ * data_dir. Written to path.tmp and renamed over path, so a crash leaves either the old
+ * or the new file. Only pieces whose data is written may be passed: a piece written
+ * after its file was looked at here would be trusted on the next start.
+ * @return true if the file was replaced
+ */
+bool resume_save(const TorrentInfo* info, const char* path, const char* data_dir, const uint8_t* bitfield);
+
+/**
+ * Startup check: pieces the resume file marks good are trusted as long as every file
+ * they touch still has the recorded size and mtime; only the pieces touching changed
+ * files are hashed again. Without a usable resume file every piece is hashed.
+ * @param threads Hashing threads, 0 for one per online CPU
+ * @return 0 on success (even if pieces are bad), -1 if the check could not run
+ */
+int resume_check(const TorrentInfo* info, const char* path, const char* data_dir, size_t threads, ResumeResult* result);
+
+void resume_result_free(ResumeResult* result);
+
+typedef struct ResumeOptions {
+    double      interval;       // 0 for RESUME_DEFAULT_INTERVAL
+    Disk*       disk;           // flushed before each write so the recorded pieces are on disk, may be NULL
+} ResumeOptions;
+
+typedef struct ResumeWriter ResumeWriter;
+
+/**
+ * Keeps the resume file current from a thread of its own: updates are only copied, and
+ * the file is written at most once per interval while they keep coming.
+ * @return The writer, or NULL on error
+ */
+ResumeWriter* resume_writer_new(const TorrentInfo* info, const char* path, const char* data_dir, const ResumeOptions* opts);
+
+/**
+ * The pieces that are good now. Cheap, meant to be called whenever one completes.
+ */
+void resume_writer_update(ResumeWriter* writer, const uint8_t* bitfield);
+
+/**
+ * Write the last update if it was not written yet and release the writer.
+ */
+void resume_writer_free(ResumeWriter* writer);
+
+#endif
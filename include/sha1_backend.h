@@ -0,0 +1,49 @@
+#ifndef SHA1_BACKEND_H
+#define SHA1_BACKEND_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Compress nblocks consecutive 64-byte blocks into the five-word SHA-1 state.
+ */
+typedef void (*sha1_compress_fn)(uint32_t state[5], const uint8_t* blocks, size_t nblocks);
+
+typedef struct sha1_backend {
+    const char*         name;
+    sha1_compress_fn    compress;
+    bool                (*supported)(void);
+} sha1_backend;
+
+/**
+ * All compiled-in backends, fastest first. The last entry is the reference implementation.
+ */
+const sha1_backend* sha1_backends(size_t* count);
+
+/**
+ * The backend sha1_update uses. Picked on first use: the fastest one the CPU supports
+ * whose output matches the reference implementation, unless the CTORRENT_SHA1
+ * environment variable names a specific backend.
+ */
+const sha1_backend* sha1_active_backend(void);
+
+/**
+ * Force a backend by name.
+ * @return false if it is unknown, unsupported by this CPU or fails the cross-check
+ */
+bool sha1_select_backend(const char* name);
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SHA1_HAVE_X86 1
+
+bool sha1_cpu_has_ssse3(void);
+bool sha1_cpu_has_avx2(void);
+bool sha1_cpu_has_shani(void);
+
+void sha1_compress_ssse3(uint32_t state[5], const uint8_t* blocks, size_t nblocks);
+void sha1_compress_avx2(uint32_t state[5], const uint8_t* blocks, size_t nblocks);
+void sha1_compress_shani(uint32_t state[5], const uint8_t* blocks, size_t nblocks);
+#endif
+
+#endif
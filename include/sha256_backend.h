@@ -0,0 +1,43 @@
+#ifndef SHA256_BACKEND_H
+#define SHA256_BACKEND_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "sha1_backend.h"
+
+/**
+ * Compress nblocks consecutive 64-byte blocks into the eight-word SHA-256 state.
+ */
+typedef void (*sha256_compress_fn)(uint32_t state[8], const uint8_t* blocks, size_t nblocks);
+
+typedef struct sha256_backend {
+    const char*         name;
+    sha256_compress_fn  compress;
+    bool                (*supported)(void);
+} sha256_backend;
+
+/**
+ * All compiled-in backends, fastest first. The last entry is the reference implementation.
+ */
+const sha256_backend* sha256_backends(size_t* count);
+
+/**
+ * The backend sha256_update uses, picked like sha1_active_backend; the CTORRENT_SHA256
+ * environment variable forces one by name.
+ */
+const sha256_backend* sha256_active_backend(void);
+
+/**
+ * Force a backend by name.
+ * @return false if it is unknown, unsupported by this CPU or fails the cross-check
+ */
+bool sha256_select_backend(const char* name);
+
+#if defined(SHA1_HAVE_X86)
+// the SHA extensions bit covers both SHA-1 and SHA-256, see sha1_cpu_has_shani
+void sha256_compress_shani(uint32_t state[8], const uint8_t* blocks, size_t nblocks);
+#endif
+
+#endif
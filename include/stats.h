@@ -0,0 +1,122 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Process-wide counters and timers around the hot paths, for --stats. Every thread adds
+ * to a block of its own, so counting is a plain load and store with no shared cache line;
+ * a snapshot sums the blocks. Timers count nanoseconds of CLOCK_MONOTONIC.
+ * Built with -DCTORRENT_STATS=OFF the STATS_* macros expand to nothing and every counter
+ * reads 0.
+ */
+
+typedef enum StatCounter {
+    STAT_PARSE_CALLS,
+    STAT_PARSE_BYTES,
+    STAT_PARSE_NS,
+    STAT_ENCODE_CALLS,
+    STAT_ENCODE_BYTES,
+    STAT_ENCODE_NS,
+    STAT_SHA1_CALLS,            // whole messages hashed by sha1 and sha1_many
+    STAT_SHA1_BYTES,            // including the ones streamed through sha1_update
+    STAT_SHA1_NS,
+    STAT_SHA256_CALLS,          // whole messages hashed by sha256 and sha256_many
+    STAT_SHA256_BYTES,
+    STAT_SHA256_NS,
+    STAT_NODE_ALLOCS,           // BNodes made by the decoder and the builders
+    STAT_NODE_BYTES,
+    STAT_STRING_ALLOCS,         // string payloads and dict keys copied out of the input
+    STAT_STRING_BYTES,
+    STAT_NET_BYTES_IN,
+    STAT_NET_BYTES_OUT,
+    STAT_NET_MESSAGES_IN,
+    STAT_DISK_READ_BYTES,
+    STAT_DISK_READ_NS,
+    STAT_DISK_WRITE_BYTES,
+    STAT_DISK_WRITE_NS,
+    STAT_COUNT,
+} StatCounter;
+
+typedef enum StatsFormat {
+    STATS_FORMAT_JSON,
+    STATS_FORMAT_PROMETHEUS,
+} StatsFormat;
+
+#ifdef CTORRENT_STATS
+
+typedef struct StatsBlock {
+    _Atomic uint64_t    values[STAT_COUNT];
+    struct StatsBlock*  next;
+} StatsBlock;
+
+extern _Thread_local StatsBlock* stats_local;
+
+/**
+ * The calling thread's block, registered on first use.
+ */
+StatsBlock* stats_register(void);
+
+uint64_t stats_now(void);
+
+static inline void stats_add(StatCounter counter, uint64_t n) {
+    StatsBlock* block = stats_local ? stats_local : stats_register();
+    if(!block) return;
+
+    // only this thread writes the block, the atomics just make the snapshot reads well-defined
+    const uint64_t value = atomic_load_explicit(&block->values[counter], memory_order_relaxed);
+    atomic_store_explicit(&block->values[counter], value + n, memory_order_relaxed);
+}
+
+#define STATS_ADD(counter, n)               stats_add((counter), (uint64_t)(n))
+#define STATS_TIMER_START(name)             const uint64_t name = stats_now()
+#define STATS_TIMER_STOP(name, counter)     stats_add((counter), stats_now() - (name))
+
+#else
+
+#define STATS_ADD(counter, n)               ((void)0)
+#define STATS_TIMER_START(name)             ((void)0)
+#define STATS_TIMER_STOP(name, counter)     ((void)0)
+
+#endif
+
+/**
+ * Whether the build counts anything.
+ */
+bool stats_enabled(void);
+
+/**
+ * Totals over every thread that ever counted, including the ones that exited.
+ */
+void stats_snapshot(uint64_t values[STAT_COUNT]);
+
+/**
+ * Name of a counter, e.g. "parse_ns".
+ */
+const char* stats_name(StatCounter counter);
+
+/**
+ * Write a snapshot as one JSON object per line, or as Prometheus text exposition where
+ * the *_ns timers become ctorrent_*_seconds_total.
+ * @return false on a write error
+ */
+bool stats_write(FILE* out, StatsFormat format);
+
+typedef struct StatsReporter StatsReporter;
+
+/**
+ * Write a snapshot to out every interval seconds from a thread of its own, for the
+ * long-running modes.
+ * @return The reporter, or NULL on error
+ */
+StatsReporter* stats_reporter_start(FILE* out, StatsFormat format, double interval);
+
+/**
+ * Stop the reporter; does not write a final snapshot.
+ */
+void stats_reporter_stop(StatsReporter* reporter);
+
+#endif
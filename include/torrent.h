@@ -0,0 +1,97 @@
+#ifndef TORRENT_H
+#define TORRENT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "bencode.h"
+#include "cryptography.h"
+
+#define TORRENT_HASH_LEN    20
+#define TORRENT_V2_HASH_LEN 32
+
+typedef struct TorrentFile {
+    char*       path;       // path relative to the torrent root, components joined with '/'
+    uint64_t    length;
+    uint64_t    offset;     // offset of the file's first byte in the concatenated torrent data
+} TorrentFile;
+
+/**
+ * The parts of a v1 info dict needed to locate and check piece data.
+ */
+typedef struct TorrentInfo {
+    sha1hash        info_hash;
+    char*           name;
+    uint64_t        piece_length;
+    size_t          piece_count;
+    const uint8_t*  pieces;         // piece_count * 20 bytes, points into the parsed document
+    TorrentFile*    files;          // a single-file torrent has one entry whose path is name
+    size_t          file_count;
+    uint64_t        total_length;
+    bool            multi_file;
+} TorrentInfo;
+
+/**
+ * Read the info dict of a parsed torrent.
+ * The result borrows the pieces string from doc, so doc has to outlive it.
+ * @return Pointer to the TorrentInfo, or NULL if the info dict is missing or malformed
+ */
+TorrentInfo* torrent_info_from_document(const BDocument* doc);
+
+/**
+ * Like torrent_info_from_document for an info dict of doc, e.g. the root of a document
+ * made from metadata fetched from peers.
+ */
+TorrentInfo* torrent_info_from_dict(const BDocument* doc, const BNode* info_node);
+
+void torrent_info_free(TorrentInfo* info);
+
+/**
+ * Size of a piece in bytes, the last piece may be shorter than piece_length.
+ */
+uint64_t torrent_piece_size(const TorrentInfo* info, size_t piece);
+
+/**
+ * Index of the file that contains the given offset of the concatenated torrent data.
+ * Zero-length files are never returned.
+ */
+size_t torrent_file_at(const TorrentInfo* info, uint64_t offset);
+
+/**
+ * A file of a v2 (BEP 52) info dict.
+ */
+typedef struct TorrentFileV2 {
+    char*           path;           // path relative to the torrent root, components joined with '/'
+    uint64_t        length;
+    const uint8_t*  pieces_root;    // 32 bytes in the parsed document, NULL for empty files
+    const uint8_t*  piece_layer;    // piece_count * 32 bytes in the document, NULL if the file fits into one piece
+    size_t          piece_count;    // hashes in the file's piece layer, 0 without one
+} TorrentFileV2;
+
+/**
+ * The parts of a v2 info dict (a v2-only or hybrid torrent) needed to check data
+ * against the per-file merkle trees. Every file starts at a piece boundary of its own.
+ */
+typedef struct TorrentInfoV2 {
+    sha256hash      info_hash;      // SHA-256 of the bencoded info dict
+    char*           name;
+    uint64_t        piece_length;   // a power of two, at least 16 KiB
+    TorrentFileV2*  files;          // in file tree order; a single-file torrent has one entry whose path is name
+    size_t          file_count;
+    uint64_t        total_length;
+    bool            multi_file;
+} TorrentInfoV2;
+
+/**
+ * Read the v2 info dict ("meta version" 2, "file tree") of a parsed torrent together
+ * with the top-level "piece layers", checking every layer against its pieces root.
+ * Layers missing from doc, as in metadata fetched from peers, leave piece_layer NULL.
+ * The result borrows the hashes from doc, so doc has to outlive it.
+ * @return Pointer to the TorrentInfoV2, or NULL if doc has no valid v2 info dict
+ */
+TorrentInfoV2* torrent_info_v2_from_document(const BDocument* doc);
+
+void torrent_info_v2_free(TorrentInfoV2* info);
+
+#endif
@@ -0,0 +1,69 @@
+#ifndef VERIFY_H
+#define VERIFY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "torrent.h"
+
+typedef struct VerifyResult {
+    uint8_t*    bitfield;       // one bit per piece, most significant bit first, set if the piece is good
+    size_t      bitfield_len;
+    size_t      good_pieces;
+    uint64_t    bytes_hashed;
+    double      seconds;
+} VerifyResult;
+
+/**
+ * Hash every piece of the torrent's data and compare it against info->pieces.
+ * Files are looked up below data_dir (data_dir/name/... for multi-file torrents,
+ * data_dir/name for single-file ones); missing or short files make their pieces bad.
+ * @param threads Worker threads, 0 for one per online CPU
+ * @return 0 on success (even if pieces are bad), -1 if the check could not run
+ */
+int verify_torrent(const TorrentInfo* info, const char* data_dir, size_t threads, VerifyResult* result);
+
+/**
+ * verify_torrent for the pieces set in the pieces bitfield only (all if NULL); the
+ * others are neither read nor counted and stay clear in the result.
+ */
+int verify_pieces(const TorrentInfo* info, const char* data_dir, const uint8_t* pieces, size_t threads, VerifyResult* result);
+
+/**
+ * Check the data of a v2 torrent against its merkle trees: each piece of a file with a
+ * piece layer against its layer hash, a file that fits into one piece against its pieces
+ * root. The bitfield has one bit per v2 piece in file order, see verify_v2_piece_count;
+ * a large file whose piece layer is missing has all its pieces bad.
+ * @param threads Workers hashing the 16 KiB leaves, 0 for one per online CPU
+ * @return 0 on success (even if pieces are bad), -1 if the check could not run
+ */
+int verify_torrent_v2(const TorrentInfoV2* info, const char* data_dir, size_t threads, VerifyResult* result);
+
+/**
+ * Number of v2 pieces of a file: none for an empty file, one if it fits into a piece.
+ */
+size_t verify_v2_piece_count(const TorrentInfoV2* info, size_t file);
+
+void verify_result_free(VerifyResult* result);
+
+/**
+ * Where a file of the torrent is looked for below data_dir.
+ * @return The path, to be freed, or NULL on error
+ */
+char* verify_file_path(const TorrentInfo* info, const char* data_dir, size_t file);
+
+/**
+ * Open every file of the torrent read-only below data_dir.
+ * @return Array of file_count descriptors, -1 for files that could not be opened, or NULL on error
+ */
+int* verify_open_files(const TorrentInfo* info, const char* data_dir);
+
+void verify_close_files(const TorrentInfo* info, int* fds);
+
+/**
+ * Read size bytes of the concatenated torrent data at offset, crossing file boundaries.
+ * @return true if every byte could be read
+ */
+bool verify_read_range(const TorrentInfo* info, const int* fds, uint64_t offset, uint8_t* buffer, uint64_t size);
+
+#endif
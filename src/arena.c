@@ -0,0 +1,80 @@
+#include "arena.h"
+
+#include <stdalign.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+struct ArenaBlock {
+    ArenaBlock* next;
+    size_t      size;
+    size_t      used;
+    alignas(max_align_t) unsigned char data[];
+};
+
+#define ARENA_ALIGN alignof(max_align_t)
+
+void arena_init(Arena* arena, size_t block_size) {
+    arena->first = NULL;
+    arena->current = NULL;
+    arena->block_size = block_size ? block_size : ARENA_DEFAULT_BLOCK_SIZE;
+    arena->allocated = 0;
+}
+
+static ArenaBlock* arena_new_block(size_t size) {
+    ArenaBlock* block = malloc(sizeof(*block) + size);
+    if(!block) return NULL;
+
+    block->next = NULL;
+    block->size = size;
+    block->used = 0;
+    return block;
+}
+
+void* arena_alloc(Arena* arena, size_t size) {
+    if(size > SIZE_MAX - ARENA_ALIGN) return NULL;
+    size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+
+    // bump inside the current block, or move on to the next one that fits
+    ArenaBlock* block = arena->current;
+    while(block && block->size - block->used < size) {
+        block = block->next;
+        if(block) block->used = 0;
+    }
+
+    if(!block) {
+        size_t block_size = size > arena->block_size ? size : arena->block_size;
+        block = arena_new_block(block_size);
+        if(!block) return NULL;
+
+        // append after the current block so the chain stays in use order
+        if(arena->current) {
+            block->next = arena->current->next;
+            arena->current->next = block;
+        } else {
+            block->next = arena->first;
+            arena->first = block;
+        }
+    }
+    arena->current = block;
+
+    void* result = block->data + block->used;
+    block->used += size;
+    arena->allocated += size;
+    return result;
+}
+
+void arena_reset(Arena* arena) {
+    if(arena->first) arena->first->used = 0;
+    arena->current = arena->first;
+    arena->allocated = 0;
+}
+
+void arena_free(Arena* arena) {
+    ArenaBlock* block = arena->first;
+    while(block) {
+        ArenaBlock* next = block->next;
+        free(block);
+        block = next;
+    }
+    arena_init(arena, arena->block_size);
+}
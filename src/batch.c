@@ -0,0 +1,499 @@
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE     // d_type in struct dirent
+
+#include "batch.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "bencode.h"
+#include "cryptography.h"
+
+// paths handed to a worker at once, amortizes the queue lock over many small files
+#define BATCH_CHUNK_PATHS       64
+#define BATCH_CHUNKS_PER_THREAD 4
+
+typedef struct BatchBuf {
+    char*   data;
+    size_t  len;
+    size_t  cap;
+} BatchBuf;
+
+typedef struct BatchChunk {
+    struct BatchChunk*  next;
+    BatchBuf            paths;      // NUL-terminated paths back to back
+    size_t              count;
+} BatchChunk;
+
+typedef struct BatchJob {
+    pthread_mutex_t lock;
+    pthread_cond_t  not_empty;
+    pthread_cond_t  not_full;
+    BatchChunk*     head;
+    BatchChunk*     tail;
+    size_t          queued;
+    size_t          capacity;
+    bool            closed;
+
+    BatchFormat     format;
+    FILE*           out;
+    pthread_mutex_t out_lock;
+    atomic_size_t   hashed;
+    atomic_size_t   failed;
+} BatchJob;
+
+/**
+ * State a worker reuses from file to file.
+ */
+typedef struct BatchWorker {
+    BatchJob*   job;
+    BatchBuf    file;       // contents of the current torrent
+    Arena       arena;      // tree of the current torrent, reset after each file
+    BatchBuf    lines;      // output of the current chunk
+    BatchBuf    errors;     // TSV failures of the current chunk, written to stderr
+} BatchWorker;
+
+#pragma region Buffers
+
+static bool batch_buf_reserve(BatchBuf* buf, size_t size) {
+    if(size <= buf->cap) return true;
+
+    size_t cap = buf->cap ? buf->cap : 4096;
+    while(cap < size) cap *= 2;
+    char* data = realloc(buf->data, cap);
+    if(!data) return false;
+
+    buf->data = data;
+    buf->cap = cap;
+    return true;
+}
+
+static bool batch_buf_append(BatchBuf* buf, const char* data, size_t len) {
+    if(!batch_buf_reserve(buf, buf->len + len)) return false;
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+    return true;
+}
+
+static bool batch_buf_append_str(BatchBuf* buf, const char* str) {
+    return batch_buf_append(buf, str, strlen(str));
+}
+
+/* Length of the well-formed UTF-8 sequence at p, 0 if it is not one (overlong, surrogate, cut off) */
+static size_t batch_utf8_length(const unsigned char* p) {
+    size_t len;
+    unsigned char lo = 0x80, hi = 0xBF;     // bounds of the second byte
+    if(p[0] >= 0xC2 && p[0] <= 0xDF) len = 2;
+    else if(p[0] >= 0xE0 && p[0] <= 0xEF) {
+        len = 3;
+        if(p[0] == 0xE0) lo = 0xA0;
+        if(p[0] == 0xED) hi = 0x9F;
+    } else if(p[0] >= 0xF0 && p[0] <= 0xF4) {
+        len = 4;
+        if(p[0] == 0xF0) lo = 0x90;
+        if(p[0] == 0xF4) hi = 0x8F;
+    } else return 0;
+
+    if(p[1] < lo || p[1] > hi) return 0;
+    for(size_t i = 2; i < len; ++i) {
+        if(p[i] < 0x80 || p[i] > 0xBF) return 0;
+    }
+    return len;
+}
+
+/* A JSON string; bytes that are not UTF-8 (paths are only bytes) are escaped as the code point of the same value */
+static bool batch_buf_append_json(BatchBuf* buf, const char* str) {
+    static const char hex[] = "0123456789abcdef";
+
+    bool ok = batch_buf_append(buf, "\"", 1);
+    for(const unsigned char* p = (const unsigned char*)str; *p && ok; ++p) {
+        size_t len;
+        if(*p == '"' || *p == '\\') {
+            char escaped[2] = { '\\', (char)*p };
+            ok = batch_buf_append(buf, escaped, 2);
+        } else if(*p < 0x20 || (*p >= 0x80 && (len = batch_utf8_length(p)) == 0)) {
+            char escaped[6] = { '\\', 'u', '0', '0', hex[*p >> 4], hex[*p & 0xF] };
+            ok = batch_buf_append(buf, escaped, 6);
+        } else if(*p >= 0x80) {
+            ok = batch_buf_append(buf, (const char*)p, len);
+            p += len - 1;
+        } else {
+            ok = batch_buf_append(buf, (const char*)p, 1);
+        }
+    }
+    return ok && batch_buf_append(buf, "\"", 1);
+}
+
+#pragma endregion Buffers
+
+#pragma region Queue
+
+static void batch_queue_push(BatchJob* job, BatchChunk* chunk) {
+    pthread_mutex_lock(&job->lock);
+    while(job->queued >= job->capacity) pthread_cond_wait(&job->not_full, &job->lock);
+
+    if(job->tail) job->tail->next = chunk;
+    else job->head = chunk;
+    job->tail = chunk;
+    job->queued++;
+
+    pthread_cond_signal(&job->not_empty);
+    pthread_mutex_unlock(&job->lock);
+}
+
+static BatchChunk* batch_queue_pop(BatchJob* job) {
+    pthread_mutex_lock(&job->lock);
+    while(!job->head && !job->closed) pthread_cond_wait(&job->not_empty, &job->lock);
+
+    BatchChunk* chunk = job->head;
+    if(chunk) {
+        job->head = chunk->next;
+        if(!job->head) job->tail = NULL;
+        job->queued--;
+        pthread_cond_signal(&job->not_full);
+    }
+    pthread_mutex_unlock(&job->lock);
+    return chunk;
+}
+
+static void batch_queue_close(BatchJob* job) {
+    pthread_mutex_lock(&job->lock);
+    job->closed = true;
+    pthread_cond_broadcast(&job->not_empty);
+    pthread_mutex_unlock(&job->lock);
+}
+
+static void batch_chunk_free(BatchChunk* chunk) {
+    if(!chunk) return;
+    free(chunk->paths.data);
+    free(chunk);
+}
+
+#pragma endregion Queue
+
+#pragma region Workers
+
+/**
+ * Read a whole file into the worker's buffer. A plain read into a reused buffer is
+ * cheaper than a fresh mapping for the small files this runs over, and avoids the
+ * TLB shootdowns of munmap in a multi-threaded process.
+ */
+static const char* batch_read_file(BatchWorker* worker, const char* path) {
+    int fd = open(path, O_RDONLY);
+    if(fd < 0) return "cannot open file";
+
+    const char* error = NULL;
+    struct stat st;
+    if(fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        error = "not a regular file";
+    } else if(st.st_size <= 0) {
+        error = "empty file";
+    } else if(!batch_buf_reserve(&worker->file, (size_t)st.st_size)) {
+        error = "out of memory";
+    } else {
+        worker->file.len = 0;
+        while(worker->file.len < (size_t)st.st_size) {
+            ssize_t n = read(fd, worker->file.data + worker->file.len, (size_t)st.st_size - worker->file.len);
+            if(n <= 0) break;
+            worker->file.len += (size_t)n;
+        }
+        if(worker->file.len != (size_t)st.st_size) error = "cannot read file";
+    }
+
+    close(fd);
+    return error;
+}
+
+static const char* batch_hash_file(BatchWorker* worker, const char* path, sha1hash* info_hash) {
+    const char* error = batch_read_file(worker, path);
+    if(error) return error;
+
+    const BDecodeOptions opts = { .arena = &worker->arena, .lazy = true };
+    BNode* root = bencode_decode_buffer_opts(worker->file.data, worker->file.len, NULL, &opts);
+    const BNode* info = root && root->type == BDICT ? bencode_find_node_by_key(root, "info") : NULL;
+
+    if(!root || root->type != BDICT) {
+        error = "failed to parse torrent";
+    } else if(!info || info->type != BDICT) {
+        error = "torrent has no info dict";
+    } else {
+        const BDocument doc = { .root = root, .data = worker->file.data, .len = worker->file.len };
+        *info_hash = bencode_hash_node(&doc, info);
+    }
+
+    arena_reset(&worker->arena);
+    return error;
+}
+
+static void batch_emit(BatchWorker* worker, const char* path, const sha1hash* info_hash, const char* error) {
+    static const char hex[] = "0123456789abcdef";
+    char digest[2 * sizeof(info_hash->bytes)];
+    if(!error) {
+        for(size_t i = 0; i < sizeof(info_hash->bytes); ++i) {
+            digest[2 * i] = hex[info_hash->bytes[i] >> 4];
+            digest[2 * i + 1] = hex[info_hash->bytes[i] & 0xF];
+        }
+    }
+
+    if(worker->job->format == BATCH_FORMAT_JSON) {
+        BatchBuf* buf = &worker->lines;
+        batch_buf_append_str(buf, "{\"path\":");
+        batch_buf_append_json(buf, path);
+        if(error) {
+            batch_buf_append_str(buf, ",\"error\":");
+            batch_buf_append_json(buf, error);
+        } else {
+            batch_buf_append_str(buf, ",\"infohash\":\"");
+            batch_buf_append(buf, digest, sizeof(digest));
+            batch_buf_append_str(buf, "\"");
+        }
+        batch_buf_append_str(buf, "}\n");
+    } else if(error) {
+        batch_buf_append_str(&worker->errors, path);
+        batch_buf_append_str(&worker->errors, ": ");
+        batch_buf_append_str(&worker->errors, error);
+        batch_buf_append_str(&worker->errors, "\n");
+    } else {
+        batch_buf_append(&worker->lines, digest, sizeof(digest));
+        batch_buf_append_str(&worker->lines, "\t");
+        batch_buf_append_str(&worker->lines, path);
+        batch_buf_append_str(&worker->lines, "\n");
+    }
+}
+
+static void* batch_worker(void* arg) {
+    BatchWorker* worker = arg;
+    BatchJob* job = worker->job;
+
+    BatchChunk* chunk;
+    while((chunk = batch_queue_pop(job))) {
+        size_t hashed = 0, failed = 0;
+
+        const char* path = chunk->paths.data;
+        for(size_t i = 0; i < chunk->count; ++i) {
+            sha1hash info_hash;
+            const char* error = batch_hash_file(worker, path, &info_hash);
+            batch_emit(worker, path, &info_hash, error);
+            if(error) failed++;
+            else hashed++;
+            path += strlen(path) + 1;
+        }
+        batch_chunk_free(chunk);
+
+        // one locked write per chunk keeps lines whole without serializing the workers
+        pthread_mutex_lock(&job->out_lock);
+        if(worker->lines.len) fwrite(worker->lines.data, 1, worker->lines.len, job->out);
+        if(worker->errors.len) fwrite(worker->errors.data, 1, worker->errors.len, stderr);
+        pthread_mutex_unlock(&job->out_lock);
+        worker->lines.len = 0;
+        worker->errors.len = 0;
+
+        atomic_fetch_add(&job->hashed, hashed);
+        atomic_fetch_add(&job->failed, failed);
+    }
+    return NULL;
+}
+
+#pragma endregion Workers
+
+#pragma region Producer
+
+typedef struct BatchProducer {
+    BatchJob*   job;
+    BatchChunk* chunk;
+} BatchProducer;
+
+static bool batch_produce(BatchProducer* producer, const char* path, size_t len) {
+    if(!producer->chunk) {
+        producer->chunk = calloc(1, sizeof(BatchChunk));
+        if(!producer->chunk) return false;
+    }
+
+    BatchChunk* chunk = producer->chunk;
+    if(!batch_buf_append(&chunk->paths, path, len) || !batch_buf_append(&chunk->paths, "", 1)) return false;
+
+    if(++chunk->count == BATCH_CHUNK_PATHS) {
+        batch_queue_push(producer->job, chunk);
+        producer->chunk = NULL;
+    }
+    return true;
+}
+
+static bool batch_has_torrent_suffix(const char* name) {
+    size_t len = strlen(name);
+    return len > 8 && strcmp(name + len - 8, ".torrent") == 0;
+}
+
+static bool batch_walk_directory(BatchProducer* producer, BatchBuf* path) {
+    DIR* dir = opendir(path->data);
+    if(!dir) return false;
+
+    const size_t base = path->len;
+    bool ok = true;
+    struct dirent* entry;
+    while(ok && (entry = readdir(dir))) {
+        if(strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+
+        path->len = base;
+        ok = batch_buf_append(path, "/", 1) && batch_buf_append_str(path, entry->d_name) &&
+             batch_buf_append(path, "", 1);
+        if(!ok) break;
+        path->len--;
+
+        bool is_dir = entry->d_type == DT_DIR;
+        bool is_file = entry->d_type == DT_REG;
+        if(entry->d_type == DT_UNKNOWN || entry->d_type == DT_LNK) {
+            // links to torrents count, links to directories are not followed (a link to a parent would loop)
+            struct stat st;
+            if(lstat(path->data, &st) != 0) continue;
+            const bool link = S_ISLNK(st.st_mode);
+            if(link && stat(path->data, &st) != 0) continue;
+            is_dir = !link && S_ISDIR(st.st_mode);
+            is_file = S_ISREG(st.st_mode);
+        }
+
+        if(is_dir) {
+            // unreadable subdirectories are skipped, not fatal
+            batch_walk_directory(producer, path);
+        } else if(is_file && batch_has_torrent_suffix(entry->d_name)) {
+            ok = batch_produce(producer, path->data, path->len);
+        }
+    }
+
+    path->len = base;
+    path->data[base] = '\0';
+    closedir(dir);
+    return ok;
+}
+
+static bool batch_read_list(BatchProducer* producer, FILE* list) {
+    char* line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+    bool ok = true;
+
+    while(ok && (len = getline(&line, &cap, list)) >= 0) {
+        while(len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) len--;
+        if(len == 0) continue;
+        line[len] = '\0';
+        ok = batch_produce(producer, line, (size_t)len);
+    }
+
+    free(line);
+    return ok && !ferror(list);
+}
+
+static bool batch_produce_source(BatchProducer* producer, const char* source) {
+    if(strcmp(source, "-") == 0) return batch_read_list(producer, stdin);
+
+    struct stat st;
+    if(stat(source, &st) != 0) return false;
+
+    if(S_ISDIR(st.st_mode)) {
+        BatchBuf path = {0};
+        bool ok = batch_buf_append_str(&path, source) && batch_buf_append(&path, "", 1);
+        if(ok) {
+            path.len--;
+            // no double slash when the directory is given as "dir/"
+            while(path.len > 1 && path.data[path.len - 1] == '/') path.data[--path.len] = '\0';
+            ok = batch_walk_directory(producer, &path);
+        }
+        free(path.data);
+        return ok;
+    }
+
+    FILE* list = fopen(source, "r");
+    if(!list) return false;
+    bool ok = batch_read_list(producer, list);
+    fclose(list);
+    return ok;
+}
+
+#pragma endregion Producer
+
+#pragma region Public
+
+int batch_infohash(const char* source, const BatchOptions* opts, FILE* out, BatchResult* result) {
+    memset(result, 0, sizeof(*result));
+
+    size_t threads = opts ? opts->threads : 0;
+    if(threads == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cpus > 0 ? (size_t)cpus : 1;
+    }
+
+    BatchJob job = {
+        .capacity = threads * BATCH_CHUNKS_PER_THREAD,
+        .format = opts ? opts->format : BATCH_FORMAT_TSV,
+        .out = out,
+    };
+    pthread_mutex_init(&job.lock, NULL);
+    pthread_cond_init(&job.not_empty, NULL);
+    pthread_cond_init(&job.not_full, NULL);
+    pthread_mutex_init(&job.out_lock, NULL);
+    atomic_init(&job.hashed, 0);
+    atomic_init(&job.failed, 0);
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    BatchWorker* workers = calloc(threads, sizeof(BatchWorker));
+    pthread_t* tids = malloc(threads * sizeof(pthread_t));
+    size_t started = 0;
+    if(workers && tids) {
+        for(; started < threads; ++started) {
+            workers[started].job = &job;
+            arena_init(&workers[started].arena, 0);
+            if(pthread_create(&tids[started], NULL, batch_worker, &workers[started]) != 0) break;
+        }
+    }
+
+    bool ok = started > 0;
+    if(ok) {
+        // the calling thread walks the source while the workers hash
+        BatchProducer producer = { .job = &job };
+        ok = batch_produce_source(&producer, source);
+        if(producer.chunk && producer.chunk->count > 0) batch_queue_push(&job, producer.chunk);
+        else batch_chunk_free(producer.chunk);
+    }
+    batch_queue_close(&job);
+
+    for(size_t i = 0; i < started; ++i) {
+        pthread_join(tids[i], NULL);
+        free(workers[i].file.data);
+        free(workers[i].lines.data);
+        free(workers[i].errors.data);
+        arena_free(&workers[i].arena);
+    }
+    free(workers);
+    free(tids);
+
+    // chunks left over if no worker could be started
+    while(job.head) {
+        BatchChunk* next = job.head->next;
+        batch_chunk_free(job.head);
+        job.head = next;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    result->hashed = atomic_load(&job.hashed);
+    result->failed = atomic_load(&job.failed);
+    result->seconds = (double)(end.tv_sec - start.tv_sec) + (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+
+    pthread_mutex_destroy(&job.lock);
+    pthread_cond_destroy(&job.not_empty);
+    pthread_cond_destroy(&job.not_full);
+    pthread_mutex_destroy(&job.out_lock);
+    fflush(out);
+    return ok ? 0 : -1;
+}
+
+#pragma endregion Public
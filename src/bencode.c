@@ -1,24 +1,60 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include "bencode.h"
+#include "arena.h"
+#include "bencode_intern.h"
+#include "bencode_scan.h"
+#include "stats.h"
 
+#include <errno.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdbool.h>
 #include <stdlib.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 
 #pragma region Decoding
 
+/* Input of a lazy decode, shared by its unexpanded containers */
+struct BLazySource {
+    const char* data;
+    size_t      len;
+    Arena*      arena;          // NULL: refcounted, freed with the last lazy node
+    size_t      max_string_size;
+    size_t      refs;
+};
+
+static void bencode_lazy_release(BLazySource* source) {
+    if(source->arena) return;   // released together with its arena
+    if(--source->refs == 0) free(source);
+}
+
 void bencode_free_node(BNode* node) {
     if(!node) return;
+    if(node->flags & BNODE_ARENA) return;   // released together with its arena
+    if(node->flags & BNODE_LAZY) {
+        bencode_lazy_release(node->value.lazy.source);
+        free(node);
+        return;
+    }
 
+    const bool borrowed = node->flags & BNODE_BORROWED;
     switch (node->type)
     {
         case BDICT:
             for(size_t i = 0; i < node->value.bdict.len; ++i) {
-                free(node->value.bdict.keys[i].data);
+                if(node->flags & BNODE_INTERNED) bencode_intern_release(node->value.bdict.keys[i].data);
+                else if(!borrowed) free(node->value.bdict.keys[i].data);
                 bencode_free_node(node->value.bdict.values[i]);
             }
             free(node->value.bdict.keys);
-            free(node->value.bdict.values);
+            if(!(node->flags & BNODE_PACKED)) free(node->value.bdict.values);
             break;
         case BLIST:
             for(size_t i = 0; i < node->value.blist.len; ++i) {
@@ -27,269 +63,495 @@ void bencode_free_node(BNode* node) {
             free(node->value.blist.items);
             break;
         case BSTRING:
-            free(node->value.bstring.data);
+            if(!(node->flags & (BNODE_BORROWED | BNODE_INLINE))) free(node->value.bstring.data);
             break;
         case BINT:
             break;
     }
     free(node);
-};
+}
 
-static BNode* bencode_decode_any(FILE* f);
+typedef struct BDecoder {
+    const char* data;
+    size_t      len;
+    size_t      pos;
+    size_t      depth;
+    Arena*      arena;          // NULL: nodes and arrays come from malloc
+    size_t      max_string_size;
+    bool        copy_strings;
+    size_t      ref_threshold;
+    BLazySource* lazy;          // non-NULL: nested containers are skipped and decoded on access
+    BInternTable interned;      // with copy_strings: one copy of each distinct dict key
+
+    // children of the containers currently being decoded, copied into an
+    // exactly sized array once the container is complete
+    BNode**     nodes;
+    size_t      nodes_len;
+    size_t      nodes_cap;
+    BString*    keys;
+    size_t      keys_len;
+    size_t      keys_cap;
+
+#ifdef CTORRENT_STATS
+    // allocations made so far, published once per decode instead of per node
+    size_t      node_allocs;
+    size_t      string_bytes;
+#endif
+} BDecoder;
+
+#ifdef CTORRENT_STATS
+#define BENC_COUNT(dec, field, n)   ((dec)->field += (n))
+#else
+#define BENC_COUNT(dec, field, n)   ((void)0)
+#endif
+
+static BNode* bencode_decode_any(BDecoder* dec);
+
+static void* bencode_alloc(BDecoder* dec, size_t size) {
+    if(dec->arena) return arena_alloc(dec->arena, size);
+    return malloc(size);
+}
 
-static BNode* bencode_decode_string(FILE* f) {
-    BNode* result = NULL;
-    char* str_data = NULL;
-    
-    if(!f) goto cleanup;
+/* extra bytes are allocated right behind the node, for a BNODE_INLINE payload */
+static BNode* bencode_new_node(BDecoder* dec, BTYPE type, size_t extra) {
+    BNode* result = bencode_alloc(dec, sizeof(*result) + extra);
+    if(!result) return NULL;
+    BENC_COUNT(dec, node_allocs, 1);
 
-    // read in Length of encoded string
-    size_t len_buf_size = 0;
-    bool found_delim = false;
-    char str_len_buf[BENC_MAX_LOOKAHEAD] = {0};    
-    for(size_t i = 0; i < BENC_MAX_LOOKAHEAD-1; i++) {
-        int c = fgetc(f);
-        if(c == EOF) goto cleanup;
-        if(c == BENC_DELIMITER) {
-            found_delim = true;
-            break;
-        };
-        if(c < '0' || c > '9') goto cleanup;
+    result->type = type;
+    result->flags = dec->arena ? BNODE_ARENA : 0;
+    return result;
+}
 
-        str_len_buf[i] = c;
-        len_buf_size++;
+static bool bencode_push_node(BDecoder* dec, BNode* node) {
+    if(dec->nodes_len >= dec->nodes_cap) {
+        size_t new_cap = dec->nodes_cap == 0 ? 64 : dec->nodes_cap * 2;
+        BNode** new_nodes = realloc(dec->nodes, new_cap*sizeof(BNode*));
+        if(!new_nodes) return false;
+        dec->nodes = new_nodes;
+        dec->nodes_cap = new_cap;
     }
-    if(!found_delim) goto cleanup;
-    
-    // convert str to long
-    char* end;
-    long len = strtol(str_len_buf, &end, 10);
-    if (*end != '\0' || len < 0) goto cleanup;
-    if(len > BENC_MAX_STRSIZE) goto cleanup;
+    dec->nodes[dec->nodes_len++] = node;
+    return true;
+}
 
-    // read in encoded string data
-    str_data = malloc(len);
-    if(!str_data) goto cleanup;
+static bool bencode_push_key(BDecoder* dec, BString key) {
+    if(dec->keys_len >= dec->keys_cap) {
+        size_t new_cap = dec->keys_cap == 0 ? 32 : dec->keys_cap * 2;
+        BString* new_keys = realloc(dec->keys, new_cap*sizeof(BString));
+        if(!new_keys) return false;
+        dec->keys = new_keys;
+        dec->keys_cap = new_cap;
+    }
+    dec->keys[dec->keys_len++] = key;
+    return true;
+}
 
-    size_t read = fread(str_data, sizeof(char), len, f);
-    if(read != len) goto cleanup;
+static bool bencode_decode_bstring(BDecoder* dec, BString* out) {
+    const char* p = dec->data + dec->pos;
+    const char* end = dec->data + dec->len;
 
-    result = malloc(sizeof(*result));
-    if(!result) goto cleanup;
+    // read in Length of encoded string
+    uint64_t len;
+    const size_t len_buf_size = bencode_scan_digits(p, (size_t)(end - p), &len);
+    if(len_buf_size == 0 || len_buf_size >= BENC_MAX_LOOKAHEAD) return false;
+    p += len_buf_size;
+    if(p == end || *p != BENC_DELIMITER) return false;
+    p++;
+
+    if(len > dec->max_string_size || len > UINT32_MAX) return false;
+    if(len > (uint64_t)(end - p)) return false;
+
+    // point into the input instead of copying the payload
+    *out = (BString){ .pre_delim_len = (uint32_t)len_buf_size, .post_delim_len = (uint32_t)len, .data = (char*)p };
+    dec->pos = (size_t)(p + len - dec->data);
+    return true;
+}
 
-    result->type = BSTRING;
-    result->value.bstring = (BString){ .pre_delim_len = len_buf_size, .post_delim_len = len, .data = str_data };
+static BNode* bencode_decode_string(BDecoder* dec) {
+    BString str;
+    if(!bencode_decode_bstring(dec, &str)) return NULL;
 
-    // return the valid BNode
-    return result;
+    unsigned int flags = BNODE_BORROWED;
+    if(dec->copy_strings) {
+        // only remember where a long payload is, bencode_string_offset finds it again
+        const bool ref = dec->ref_threshold > 0 && str.post_delim_len > dec->ref_threshold;
+        flags = ref ? BNODE_REF : BNODE_INLINE;
+    }
 
-cleanup:
-    if(str_data) free(str_data);
-    if(result) free(result);
-    return NULL;
+    // a copied payload shares the node's allocation instead of getting one of its own
+    BNode* result = bencode_new_node(dec, BSTRING, flags & BNODE_INLINE ? str.post_delim_len : 0);
+    if(!result) return NULL;
+
+    if(flags & BNODE_INLINE) {
+        char* data = (char*)(result + 1);
+        memcpy(data, str.data, str.post_delim_len);
+        str.data = data;
+        BENC_COUNT(dec, string_bytes, str.post_delim_len);
+    } else if(flags & BNODE_REF) {
+        str.data = NULL;
+    }
+
+    result->flags |= flags;
+    result->value.bstring = str;
+
+    return result;
 }
 
-static BNode* bencode_decode_dict(FILE* f) {
-    BNode* result = NULL;
-    BString* keys = NULL;
-    BNode** values = NULL;
-    size_t capacity = 0;
-    size_t len = 0;
+static BNode* bencode_decode_dict(BDecoder* dec) {
+    const size_t nodes_base = dec->nodes_len;
+    const size_t keys_base = dec->keys_len;
 
-    if(!f) goto cleanup;
-    if(fgetc(f) != BENC_DICT_START) goto cleanup;
+    if(dec->data[dec->pos] != BENC_DICT_START) return NULL;
+    dec->pos++;
 
-    // parse all key-value pairs
-    int c;
+    // parse all key-value pairs onto the scratch stacks
     while(1) {
-        c = fgetc(f);
-        if(c == EOF) goto cleanup;
-        if(c == BENC_TERMINATOR) break;
-        ungetc(c, f);
-
-        BNode* key_node = bencode_decode_string(f);
-        if(!key_node) goto cleanup;
-
-        BNode* value_node = bencode_decode_any(f);
-        if(!value_node) {
-            bencode_free_node(key_node);
-            goto cleanup;
+        if(dec->pos >= dec->len) return NULL;
+        if(dec->data[dec->pos] == BENC_TERMINATOR) {
+            dec->pos++;
+            break;
         }
 
-        if(len >= capacity) {
-            size_t new_cap = capacity == 0 ? 8 : capacity * 2;
-            
-            BString* new_keys = realloc(keys, new_cap*sizeof(BString));
-            if(!new_keys) {
-                bencode_free_node(key_node);
-                bencode_free_node(value_node);
-                goto cleanup;
-            }
-            keys = new_keys;
-            
-            BNode** new_values = realloc(values, new_cap*sizeof(BNode*));
-            if(!new_values) {
-                bencode_free_node(key_node);
-                bencode_free_node(value_node);
-                goto cleanup;
-            }
-            values = new_values;
+        BString key;
+        if(!bencode_decode_bstring(dec, &key)) return NULL;
+        if(dec->copy_strings) {
+            // the same few keys repeat in every entry of a list, each is copied once
+            key.data = bencode_intern(&dec->interned, key.data, key.post_delim_len);
+            if(!key.data) return NULL;
+        }
+        if(!bencode_push_key(dec, key)) {
+            if(dec->copy_strings && !dec->arena) bencode_intern_release(key.data);
+            return NULL;
+        }
 
-            capacity = new_cap;
+        BNode* value_node = bencode_decode_any(dec);
+        if(!value_node) return NULL;
+        if(!bencode_push_node(dec, value_node)) {
+            bencode_free_node(value_node);
+            return NULL;
         }
+    }
 
-        keys[len] = key_node->value.bstring;
-        free(key_node);
-        values[len] = value_node;
-        len++;
+    // create BNode with one exactly sized block for the keys followed by the values
+    const size_t len = dec->keys_len - keys_base;
+    BString* keys = NULL;
+    BNode** values = NULL;
+    if(len > 0) {
+        keys = bencode_alloc(dec, len*(sizeof(BString) + sizeof(BNode*)));
+        if(!keys) return NULL;
+        values = (BNode**)(keys + len);
+    }
+    BNode* result = bencode_new_node(dec, BDICT, 0);
+    if(!result) {
+        if(!dec->arena) free(keys);
+        return NULL;
     }
 
-    // create BNode
-    result = malloc(sizeof(*result));
-    if(!result) goto cleanup;
+    if(len > 0) {
+        memcpy(keys, dec->keys + keys_base, len*sizeof(BString));
+        memcpy(values, dec->nodes + nodes_base, len*sizeof(BNode*));
+    }
+    dec->keys_len = keys_base;
+    dec->nodes_len = nodes_base;
 
-    result->type = BDICT;
+    result->flags |= BNODE_PACKED | (dec->copy_strings ? BNODE_INTERNED : BNODE_BORROWED);
     result->value.bdict = (BDict){.len = len, .keys = keys, .values = values};
+    bencode_index_dict(result);
 
     // return valid BNode
     return result;
-cleanup:
-    if(keys) {
-        for(size_t i = 0; i < len; i++) {
-            free(keys[i].data);  // Free each key's string data
-        }
-        free(keys);
-    }
-    if(values) {
-        for(size_t i = 0; i < len; i++) {
-            bencode_free_node(values[i]);  // Free each value node
-        }
-        free(values);
-    }
-    free(result);
-    return NULL;
 }
 
-static BNode* bencode_decode_list(FILE* f) {
-    BNode* result = NULL;
-    BNode** items = NULL;
-    size_t capacity = 0;
-    size_t len = 0;
+static BNode* bencode_decode_list(BDecoder* dec) {
+    const size_t nodes_base = dec->nodes_len;
 
-    if(!f) goto cleanup;
-    if(fgetc(f) != BENC_LIST_START) goto cleanup;
+    if(dec->data[dec->pos] != BENC_LIST_START) return NULL;
+    dec->pos++;
 
-    // parse all list children
-    int c;
+    // parse all list children onto the scratch stack
     while(1) {
-        c = fgetc(f);
-        if(c == EOF) goto cleanup;
-        if(c == BENC_TERMINATOR) break;
-        ungetc(c, f);
-
-        BNode* item = bencode_decode_any(f);
-        if(!item) goto cleanup;
-
-        // grow array if needed
-        if(len >= capacity) {
-            size_t new_cap = capacity == 0 ? 8 : capacity * 2;
-            BNode** new_items = realloc(items, new_cap*sizeof(BNode*));
-            if(!new_items) {
-                bencode_free_node(item);
-                goto cleanup;
-            }
-            items = new_items;
-            capacity = new_cap;
+        if(dec->pos >= dec->len) return NULL;
+        if(dec->data[dec->pos] == BENC_TERMINATOR) {
+            dec->pos++;
+            break;
         }
 
-        items[len++] = item;
+        BNode* item = bencode_decode_any(dec);
+        if(!item) return NULL;
+        if(!bencode_push_node(dec, item)) {
+            bencode_free_node(item);
+            return NULL;
+        }
     }
 
-    // create BNode
-    result = malloc(sizeof(*result));
-    if(!result) goto cleanup;
+    // create BNode with an exactly sized array
+    const size_t len = dec->nodes_len - nodes_base;
+    BNode** items = NULL;
+    if(len > 0) {
+        items = bencode_alloc(dec, len*sizeof(BNode*));
+        if(!items) return NULL;
+    }
+    BNode* result = bencode_new_node(dec, BLIST, 0);
+    if(!result) {
+        if(!dec->arena) free(items);
+        return NULL;
+    }
+
+    if(len > 0) memcpy(items, dec->nodes + nodes_base, len*sizeof(BNode*));
+    dec->nodes_len = nodes_base;
 
-    result->type = BLIST;
     result->value.blist = (BList){.len = len, .items = items};
 
     // return valid BNode
     return result;
+}
 
-cleanup:
-    if(items) {
-        for(size_t i = 0; i < len; i++) {
-            bencode_free_node(items[i]);
-        }
-        free(items);
+static bool bencode_decode_bint(BDecoder* dec, BInt* out) {
+    const char* p = dec->data + dec->pos;
+    const char* end = dec->data + dec->len;
+
+    if(p == end || *p != BENC_INT_START) return false;
+    p++;
+
+    // read in integer digits
+    const char* digits = p;
+    bool negative = false;
+    if(p < end && *p == '-') {
+        negative = true;
+        p++;
     }
-    if(result) free(result);
-    return NULL;
+
+    uint64_t magnitude;
+    const char* first_digit = p;
+    p += bencode_scan_digits(p, (size_t)(end - p), &magnitude);
+    if(magnitude == UINT64_MAX) return false;               // overflow
+    if(p == first_digit) return false;                      // no digits
+    if(p == end || *p != BENC_TERMINATOR) return false;
+    if(*first_digit == '0' && p - first_digit > 1) return false;
+    if(negative && *first_digit == '0') return false;
+    if(magnitude > (unsigned long long)LLONG_MAX + negative) return false;
+
+    out->len = (size_t)(p - digits);
+    out->value = negative ? (long long)(0 - magnitude) : (long long)magnitude;
+    dec->pos = (size_t)(p + 1 - dec->data);
+    return true;
 }
 
-static BNode* bencode_decode_int(FILE* f) {
-    BNode* result = NULL;
-    
-    if(!f) goto cleanup;
-    if(fgetc(f) != BENC_INT_START) goto cleanup;
+static BNode* bencode_decode_int(BDecoder* dec) {
+    BInt integer;
+    if(!bencode_decode_bint(dec, &integer)) return NULL;
 
-    // read in integer string
-    size_t buf_size = 0;
-    bool found_terminator = false;
-    char integer_buf[BENC_MAX_LOOKAHEAD] = {0};
-    for(size_t i = 0; i < BENC_MAX_LOOKAHEAD-1; i++) {
-        int c = fgetc(f);
-        if(c == EOF) goto cleanup;
+    // create BNode
+    BNode* result = bencode_new_node(dec, BINT, 0);
+    if(!result) return NULL;
+
+    result->value.bint = integer;
+
+    // return valid BNode
+    return result;
+}
+
+/*
+ * Check the container at dec->pos and step over it without building nodes: strings are
+ * jumped over by their length prefix, brackets are matched on a stack that also tracks
+ * whether a dict expects a key or a value.
+ */
+static bool bencode_skip_container(BDecoder* dec) {
+    // per open container: 'l', or 'd' while a key is expected and 'v' while its value is
+    char stack[BENC_MAX_DEPTH];
+    size_t level = 0;
+
+    stack[level++] = dec->data[dec->pos++];
+    while(level > 0) {
+        if(dec->pos >= dec->len) return false;
+
+        const char c = dec->data[dec->pos];
+        char* top = &stack[level - 1];
         if(c == BENC_TERMINATOR) {
-            found_terminator = true;
-            break;
+            if(*top == 'v') return false;               // key without a value
+            dec->pos++;
+            level--;
+            continue;
+        }
+        if(*top == BENC_DICT_START) {
+            BString key;
+            if(!bencode_decode_bstring(dec, &key)) return false;
+            *top = 'v';
+            continue;
         }
 
-        integer_buf[i] = c;
-        buf_size++;
-    }
-    if(!found_terminator) goto cleanup;
-    if(integer_buf[0] == '0' && integer_buf[1] != '\0') goto cleanup;
-    if(integer_buf[0] == '-' && integer_buf[1] == '0') goto cleanup;
+        // same limit as bencode_decode_any applies to the value when decoded eagerly
+        if(dec->depth + level - 1 >= BENC_MAX_DEPTH) return false;
+        if(*top == 'v') *top = BENC_DICT_START;
 
-    // convert integer string to long
-    char* end;
-    long value = strtol(integer_buf, &end, 10);
-    if (*end != '\0') goto cleanup;
+        if(c == BENC_DICT_START || c == BENC_LIST_START) {
+            stack[level++] = c;
+            dec->pos++;
+        } else if(c == BENC_INT_START) {
+            BInt integer;
+            if(!bencode_decode_bint(dec, &integer)) return false;
+        } else {
+            BString str;
+            if(!bencode_decode_bstring(dec, &str)) return false;
+        }
+    }
+    return true;
+}
 
-    // create BNode
-    result = malloc(sizeof(*result));
-    if(!result) goto cleanup;
+static BNode* bencode_decode_lazy(BDecoder* dec, BTYPE type) {
+    if(!bencode_skip_container(dec)) return NULL;
 
-    result->type = BINT;
-    result->value.bint = (BInt){.len = buf_size, .value = value};
+    BNode* result = bencode_new_node(dec, type, 0);
+    if(!result) return NULL;
 
-    // return valid BNode
+    result->flags |= BNODE_LAZY | BNODE_BORROWED;
+    result->value.lazy = (BLazy){ .len = 0, .source = dec->lazy };
+    dec->lazy->refs++;
     return result;
-cleanup:
-    if(result) free(result);
-    return NULL;
 }
 
-static BNode* bencode_decode_any(FILE* f) {
-    if(!f) return NULL;
-    
-    int c = fgetc(f);
-    if(c == EOF) return NULL;
-    ungetc(c, f);
+static BNode* bencode_decode_any(BDecoder* dec) {
+    if(dec->pos >= dec->len) return NULL;
+    if(dec->depth >= BENC_MAX_DEPTH) return NULL;
+
+    const size_t start = dec->pos;
 
-    switch (c) {
+    dec->depth++;
+    // in lazy mode only the top-level container is decoded right away
+    const bool lazy = dec->lazy && dec->depth > 1;
+    BNode* result;
+    switch (dec->data[start]) {
         case BENC_DICT_START:
-            return bencode_decode_dict(f);
+            result = lazy ? bencode_decode_lazy(dec, BDICT) : bencode_decode_dict(dec);
+            break;
         
         case BENC_LIST_START:
-            return bencode_decode_list(f);
+            result = lazy ? bencode_decode_lazy(dec, BLIST) : bencode_decode_list(dec);
+            break;
 
         case BENC_INT_START:
-            return bencode_decode_int(f);
+            result = bencode_decode_int(dec);
+            break;
 
         default:
-            return bencode_decode_string(f);
+            result = bencode_decode_string(dec);
+            break;
+    }
+    dec->depth--;
+    if(!result) return NULL;
+
+    // remember where the value came from, so its raw bytes can be reused (e.g. for the infohash)
+    result->start = start;
+    result->end = dec->pos;
+
+    return result;
+}
+
+/* Free what the scratch stacks still own after a failed decode, and the stacks themselves */
+static void bencode_decoder_release(BDecoder* dec) {
+#ifdef CTORRENT_STATS
+    STATS_ADD(STAT_NODE_ALLOCS, dec->node_allocs);
+    STATS_ADD(STAT_NODE_BYTES, dec->node_allocs * sizeof(BNode));
+    STATS_ADD(STAT_STRING_BYTES, dec->string_bytes);
+#endif
+    for(size_t i = 0; i < dec->nodes_len; ++i) {
+        bencode_free_node(dec->nodes[i]);
     }
+    if(dec->copy_strings && !dec->arena) {
+        for(size_t i = 0; i < dec->keys_len; ++i) {
+            bencode_intern_release(dec->keys[i].data);
+        }
+    }
+    // the tree holds its own references to the keys it uses
+    bencode_intern_clear(&dec->interned);
+    free(dec->nodes);
+    free(dec->keys);
+}
+
+bool bencode_expand(const BNode* node) {
+    if(!node || !(node->flags & BNODE_LAZY)) return true;
+
+    // the lazy node is replaced in place, callers hold it through const lookups
+    BNode* lazy = (BNode*)node;
+    BLazySource* source = lazy->value.lazy.source;
+    BDecoder dec = {
+        .data = source->data,
+        .len = source->len,
+        .pos = lazy->start,
+        .depth = 1,             // as if bencode_decode_any had entered the container
+        .arena = source->arena,
+        .max_string_size = source->max_string_size,
+        .lazy = source,
+    };
+    BNode* level = lazy->type == BDICT ? bencode_decode_dict(&dec) : bencode_decode_list(&dec);
+    bencode_decoder_release(&dec);
+    if(!level) return false;
+
+    lazy->flags = level->flags;
+    lazy->value = level->value;
+    if(!(level->flags & BNODE_ARENA)) free(level);
+    bencode_lazy_release(source);
+    return true;
+}
+
+BNode* bencode_decode_buffer_opts(const char* data, size_t len, size_t* consumed, const BDecodeOptions* opts) {
+    if(!data) return NULL;
+
+    const BDecodeOptions defaults = {0};
+    if(!opts) opts = &defaults;
+    // lazy nodes decode straight from the input later on, there is nothing to copy into
+    if(opts->lazy && opts->copy_strings) return NULL;
+
+    STATS_TIMER_START(timer);
+    BDecoder dec = {
+        .data = data,
+        .len = len,
+        .arena = opts->arena,
+        // no string can be longer than the input it is read from
+        .max_string_size = opts->max_string_size ? opts->max_string_size : len,
+        .copy_strings = opts->copy_strings,
+        .ref_threshold = opts->ref_threshold,
+    };
+    bencode_intern_init(&dec.interned, dec.arena);
+    if(opts->lazy) {
+        dec.lazy = bencode_alloc(&dec, sizeof(*dec.lazy));
+        if(!dec.lazy) return NULL;
+        // the decode itself holds one reference until it is done
+        *dec.lazy = (BLazySource){
+            .data = data,
+            .len = len,
+            .arena = dec.arena,
+            .max_string_size = dec.max_string_size,
+            .refs = 1,
+        };
+    }
+    BNode* root = bencode_decode_any(&dec);
+
+    if(root && !consumed && dec.pos != len) {
+        // trailing garbage after the top-level value
+        bencode_free_node(root);
+        root = NULL;
+    }
+    if(root && consumed) *consumed = dec.pos;
+
+    // on failure the scratch stack still owns the children decoded so far
+    bencode_decoder_release(&dec);
+    if(dec.lazy) bencode_lazy_release(dec.lazy);
+
+    STATS_ADD(STAT_PARSE_CALLS, 1);
+    STATS_ADD(STAT_PARSE_BYTES, dec.pos);
+    STATS_TIMER_STOP(timer, STAT_PARSE_NS);
+    return root;
+}
+
+BNode* bencode_decode_buffer_arena(const char* data, size_t len, size_t* consumed, Arena* arena) {
+    const BDecodeOptions opts = { .arena = arena };
+    return bencode_decode_buffer_opts(data, len, consumed, &opts);
+}
+
+BNode* bencode_decode_buffer(const char* data, size_t len, size_t* consumed) {
+    return bencode_decode_buffer_opts(data, len, consumed, NULL);
 }
 
 #pragma endregion Decoding
@@ -301,174 +563,626 @@ void bencode_free_buf(BEncodeBuf* buffer) {
     free(buffer);
 }
 
-static size_t bencode_get_encoded_size(const BNode* node) {
-    if(!node) return 0;
-    
-    size_t result = 0;
+/*
+ * Small pieces of output (delimiters, length prefixes, integers, short strings) are copied
+ * into a staging area; long string payloads are handed to the sink in place. Both end up
+ * as iovecs, flushed to the sink when either runs out.
+ */
+typedef struct BEncoder {
+    const BEncodeSink*  sink;
+    struct iovec        iov[BENC_ENCODE_IOVECS];
+    int                 iovcnt;
+    size_t              staged;
+    bool                failed;
+    char                staging[BENC_ENCODE_STAGING];
+} BEncoder;
+
+static const char BENC_DIGIT_PAIRS[201] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+/* Write value in decimal ending right before end, two digits per step; returns the first digit */
+static char* bencode_format_uint(char* end, unsigned long long value) {
+    char* p = end;
+    while(value >= 100) {
+        const unsigned int pair = (unsigned int)(value % 100) * 2;
+        value /= 100;
+        *--p = BENC_DIGIT_PAIRS[pair + 1];
+        *--p = BENC_DIGIT_PAIRS[pair];
+    }
+    if(value >= 10) {
+        const unsigned int pair = (unsigned int)value * 2;
+        *--p = BENC_DIGIT_PAIRS[pair + 1];
+        *--p = BENC_DIGIT_PAIRS[pair];
+    } else {
+        *--p = (char)('0' + value);
+    }
+    return p;
+}
+
+static void bencode_encoder_flush(BEncoder* enc) {
+    if(enc->iovcnt > 0 && !enc->failed) {
+        if(enc->sink->write(enc->sink->user, enc->iov, enc->iovcnt) != 0) enc->failed = true;
+#ifdef CTORRENT_STATS
+        for(int i = 0; i < enc->iovcnt; ++i) {
+            STATS_ADD(STAT_ENCODE_BYTES, enc->iov[i].iov_len);
+        }
+#endif
+    }
+    enc->iovcnt = 0;
+    enc->staged = 0;
+}
+
+static void bencode_encoder_ref(BEncoder* enc, const char* data, size_t len) {
+    if(enc->iovcnt == BENC_ENCODE_IOVECS) bencode_encoder_flush(enc);
+    enc->iov[enc->iovcnt++] = (struct iovec){ .iov_base = (void*)data, .iov_len = len };
+}
+
+/* Room for len more staged bytes, which the caller fills and commits with bencode_encoder_commit */
+static char* bencode_encoder_reserve(BEncoder* enc, size_t len) {
+    if(enc->staged + len > BENC_ENCODE_STAGING || enc->iovcnt == BENC_ENCODE_IOVECS) bencode_encoder_flush(enc);
+    return enc->staging + enc->staged;
+}
+
+static void bencode_encoder_commit(BEncoder* enc, size_t len) {
+    char* data = enc->staging + enc->staged;
+    struct iovec* last = enc->iovcnt > 0 ? &enc->iov[enc->iovcnt - 1] : NULL;
+
+    // extend the previous iovec when it ends where this staging run starts
+    if(last && (char*)last->iov_base + last->iov_len == data) last->iov_len += len;
+    else enc->iov[enc->iovcnt++] = (struct iovec){ .iov_base = data, .iov_len = len };
+    enc->staged += len;
+}
+
+static void bencode_encoder_byte(BEncoder* enc, char c) {
+    *bencode_encoder_reserve(enc, 1) = c;
+    bencode_encoder_commit(enc, 1);
+}
+
+static void bencode_encode_bstring(BEncoder* enc, const char* data, size_t len) {
+    char digits[24];
+    char* first = bencode_format_uint(digits + sizeof(digits), len);
+    const size_t prefix = (size_t)(digits + sizeof(digits) - first);
+
+    const bool inline_payload = len < BENC_ENCODE_COPY_MAX;
+    char* out = bencode_encoder_reserve(enc, prefix + 1 + (inline_payload ? len : 0));
+    memcpy(out, first, prefix);
+    out[prefix] = BENC_DELIMITER;
+    if(inline_payload) {
+        memcpy(out + prefix + 1, data, len);
+        bencode_encoder_commit(enc, prefix + 1 + len);
+    } else {
+        bencode_encoder_commit(enc, prefix + 1);
+        bencode_encoder_ref(enc, data, len);
+    }
+}
+
+static void bencode_encode_bint(BEncoder* enc, long long value) {
+    char digits[24];
+    digits[sizeof(digits) - 1] = BENC_TERMINATOR;
+
+    const unsigned long long magnitude = value < 0 ? 0ull - (unsigned long long)value : (unsigned long long)value;
+    char* first = bencode_format_uint(digits + sizeof(digits) - 1, magnitude);
+    if(value < 0) *--first = '-';
+    *--first = BENC_INT_START;
+
+    const size_t len = (size_t)(digits + sizeof(digits) - first);
+    memcpy(bencode_encoder_reserve(enc, len), first, len);
+    bencode_encoder_commit(enc, len);
+}
+
+/* Pass through bytes that are already encoded, copying short runs like any other output */
+static void bencode_encode_raw(BEncoder* enc, const char* data, size_t len) {
+    if(len < BENC_ENCODE_COPY_MAX) {
+        memcpy(bencode_encoder_reserve(enc, len), data, len);
+        bencode_encoder_commit(enc, len);
+    } else {
+        bencode_encoder_ref(enc, data, len);
+    }
+}
+
+static void bencode_encode_any(BEncoder* enc, const BNode* node) {
+    if(enc->failed) return;
+
+    // an unexpanded container is still its input bytes, no need to decode it to write it out
+    if(node->flags & BNODE_LAZY) {
+        bencode_encode_raw(enc, node->value.lazy.source->data + node->start, node->end - node->start);
+        return;
+    }
+
     switch (node->type)
     {
         case BDICT:
+            bencode_encoder_byte(enc, BENC_DICT_START);
             for(size_t i = 0; i < node->value.bdict.len; ++i) {
-                const BString key = node->value.bdict.keys[i];
-                result += key.pre_delim_len;                        // chars before ':'
-                result += 1;                                        // ':'
-                result += key.post_delim_len;                       // chars after ':'
-
-                const BNode* value = node->value.bdict.values[i];
-                result += bencode_get_encoded_size(value);
+                const BString* key = &node->value.bdict.keys[i];
+                bencode_encode_bstring(enc, key->data, key->post_delim_len);
+                bencode_encode_any(enc, node->value.bdict.values[i]);
             }
-            result += 2;                                            // 'd' and 'e'
+            bencode_encoder_byte(enc, BENC_TERMINATOR);
             break;
         case BLIST:
+            bencode_encoder_byte(enc, BENC_LIST_START);
             for(size_t i = 0; i < node->value.blist.len; ++i) {
-                const BNode* item = node->value.blist.items[i];
-                result += bencode_get_encoded_size(item);           // encoded size of child
+                bencode_encode_any(enc, node->value.blist.items[i]);
             }
-            result += 2;                                            // 'l' and 'e'
+            bencode_encoder_byte(enc, BENC_TERMINATOR);
             break;
         case BSTRING:
-            result += node->value.bstring.pre_delim_len;            // chars before ':'
-            result += 1;                                            // ':'
-            result += node->value.bstring.post_delim_len;           // chars after ':'
+            if(node->flags & BNODE_REF) {
+                enc->failed = true;
+                return;
+            }
+            bencode_encode_bstring(enc, node->value.bstring.data, node->value.bstring.post_delim_len);
             break;
         case BINT:
-            result += node->value.bint.len;                         // digits of bint + possible '-'
-            result += 2;                                            // 'i' and 'e'
+            bencode_encode_bint(enc, node->value.bint.value);
             break;
     }
-    
-    return result;
 }
 
-static size_t bencode_encode_any_to_buffer(const BNode* node, char* buffer);
-
-static size_t bencode_encode_string_to_buffer(const BString* string, char* buffer) { // (TODO) Error handling
-    if(!buffer) return 0;
+static int bencode_buffer_sink_write(void* user, const struct iovec* iov, int iovcnt) {
+    BEncodeBufferSink* buf = user;
 
-    int written = snprintf(buffer, 32, "%zu:", string->post_delim_len);
-    memcpy(buffer + written, string->data, string->post_delim_len);
-    
-    return written + string->post_delim_len;
-}
+    size_t total = 0;
+    for(int i = 0; i < iovcnt; ++i) total += iov[i].iov_len;
 
-static size_t bencode_encode_int_to_buffer(const BInt* integer, char* buffer) { // (TODO) Error handling
-    if(!buffer) return 0;
+    if(buf->len + total > buf->cap) {
+        size_t new_cap = buf->cap ? buf->cap : BENC_ENCODE_STAGING;
+        while(new_cap < buf->len + total) new_cap *= 2;
+        char* data = realloc(buf->data, new_cap);
+        if(!data) return -1;
+        buf->data = data;
+        buf->cap = new_cap;
+    }
 
-    int written = snprintf(buffer, 32, "i%llde", integer->value);
-    
-    return written;
+    for(int i = 0; i < iovcnt; ++i) {
+        memcpy(buf->data + buf->len, iov[i].iov_base, iov[i].iov_len);
+        buf->len += iov[i].iov_len;
+    }
+    return 0;
 }
 
-static size_t bencode_encode_dict_to_buffer(const BDict* dict, char* buffer) { // (TODO) Error handling
-    if(!buffer) return 0;
+static int bencode_fd_sink_write(void* user, const struct iovec* iov, int iovcnt) {
+    const int fd = (int)(intptr_t)user;
 
-    size_t current_offset = 0;
+    struct iovec pending[BENC_ENCODE_IOVECS];
+    memcpy(pending, iov, (size_t)iovcnt * sizeof(struct iovec));
 
-    *(buffer+current_offset++) = 'd';
-    for(size_t i = 0; i < dict->len; ++i) {
-        current_offset += bencode_encode_string_to_buffer(&dict->keys[i], buffer + current_offset);
-        current_offset += bencode_encode_any_to_buffer(dict->values[i], buffer + current_offset);
-    }
-    *(buffer+current_offset++) = 'e';
+    // writev may stop short, continue from the first iovec it did not finish
+    struct iovec* next = pending;
+    while(iovcnt > 0) {
+        ssize_t written = writev(fd, next, iovcnt);
+        if(written < 0) {
+            if(errno == EINTR) continue;
+            return -1;
+        }
 
-    return current_offset;
+        size_t done = (size_t)written;
+        while(iovcnt > 0 && done >= next->iov_len) {
+            done -= next->iov_len;
+            next++;
+            iovcnt--;
+        }
+        if(iovcnt > 0) {
+            next->iov_base = (char*)next->iov_base + done;
+            next->iov_len -= done;
+        }
+    }
+    return 0;
 }
 
-static size_t bencode_encode_list_to_buffer(const BList* list, char* buffer) { // (TODO) Error handling
-    if(!buffer) return 0;
-
-    size_t current_offset = 0;
-
-    *(buffer+current_offset++) = 'l';
-    for(size_t i = 0; i < list->len; ++i) {
-        current_offset += bencode_encode_any_to_buffer(list->items[i], buffer + current_offset);
+static int bencode_file_sink_write(void* user, const struct iovec* iov, int iovcnt) {
+    FILE* file = user;
+    for(int i = 0; i < iovcnt; ++i) {
+        if(fwrite(iov[i].iov_base, 1, iov[i].iov_len, file) != iov[i].iov_len) return -1;
     }
-    *(buffer+current_offset++) = 'e';
-
-    return current_offset;
+    return 0;
 }
 
-static size_t bencode_encode_any_to_buffer(const BNode* node, char* buffer) { // (TODO) Error handling
-    switch (node->type)
-    {
-        case BDICT:
-            return bencode_encode_dict_to_buffer(&node->value.bdict, buffer);
-        case BLIST:
-            return bencode_encode_list_to_buffer(&node->value.blist, buffer);
-        case BSTRING:
-            return bencode_encode_string_to_buffer(&node->value.bstring, buffer);
-        case BINT:
-            return bencode_encode_int_to_buffer(&node->value.bint, buffer);
+static int bencode_sha1_sink_write(void* user, const struct iovec* iov, int iovcnt) {
+    sha1_ctx* ctx = user;
+    for(int i = 0; i < iovcnt; ++i) {
+        sha1_update(ctx, iov[i].iov_base, iov[i].iov_len);
     }
+    return 0;
 }
 
 #pragma endregion Encoding
 
 #pragma region Traversal
-BNode* bencode_find_node_by_key(const BNode* dict, const char* key) {
-    if(dict->type != BDICT) return NULL;
 
-    for(size_t i = 0; i < dict->value.bdict.len; ++i) {
-        BString dict_key = dict->value.bdict.keys[i];
+/* Bytewise key order as required by the spec: shorter key first on a common prefix */
+static int bencode_compare_key(const char* a, size_t a_len, const char* b, size_t b_len) {
+    int cmp = memcmp(a, b, a_len < b_len ? a_len : b_len);
+    if(cmp != 0) return cmp;
+    return (a_len > b_len) - (a_len < b_len);
+}
+
+void bencode_index_dict(BNode* dict) {
+    if(dict->type != BDICT) return;
+
+    const BDict* d = &dict->value.bdict;
+    dict->flags |= BNODE_SORTED;
+    for(size_t i = 1; i < d->len; ++i) {
+        if(bencode_compare_key(d->keys[i-1].data, d->keys[i-1].post_delim_len,
+                               d->keys[i].data, d->keys[i].post_delim_len) >= 0) {
+            dict->flags &= ~BNODE_SORTED;
+            return;
+        }
+    }
+}
+
+BNode* bencode_find_node_by_key_len(const BNode* dict, const char* key, size_t key_len) {
+    if(!dict || dict->type != BDICT) return NULL;
+    if(!bencode_expand(dict)) return NULL;
+
+    const BDict* d = &dict->value.bdict;
+
+    // well-formed input has sorted keys, which the decoder recorded
+    if(dict->flags & BNODE_SORTED) {
+        size_t lo = 0;
+        size_t hi = d->len;
+        while(lo < hi) {
+            size_t mid = lo + (hi - lo) / 2;
+            const BString* dict_key = &d->keys[mid];
+            // interned keys are shared by the whole tree, one from a sibling dict matches by pointer
+            if(dict_key->data == key && dict_key->post_delim_len == key_len) return d->values[mid];
+
+            int cmp = bencode_compare_key(dict_key->data, dict_key->post_delim_len, key, key_len);
+            if(cmp == 0) return d->values[mid];
+            if(cmp < 0) lo = mid + 1;
+            else hi = mid;
+        }
+        return NULL;
+    }
+
+    for(size_t i = 0; i < d->len; ++i) {
+        const BString* dict_key = &d->keys[i];
         
-        if(strlen(key) != dict_key.post_delim_len) continue;
+        if(key_len != dict_key->post_delim_len) continue;
 
-        if(strncmp(dict_key.data, key, dict_key.post_delim_len) == 0)
-            return dict->value.bdict.values[i];
+        if(dict_key->data == key || memcmp(dict_key->data, key, key_len) == 0)
+            return d->values[i];
     }
 
     return NULL;
 }
+
+BNode* bencode_find_node_by_key(const BNode* dict, const char* key) {
+    return bencode_find_node_by_key_len(dict, key, strlen(key));
+}
+
+bool bencode_iter_begin(BNodeIter* iter, const BNode* node) {
+    *iter = (BNodeIter){ .node = NULL, .index = 0 };
+    if(!node || (node->type != BDICT && node->type != BLIST)) return false;
+    if(!bencode_expand(node)) return false;
+
+    iter->node = node;
+    return true;
+}
+
+bool bencode_iter_next(BNodeIter* iter, const BString** key, BNode** value) {
+    const BNode* node = iter->node;
+    if(!node) return false;
+
+    if(node->type == BDICT) {
+        if(iter->index >= node->value.bdict.len) return false;
+        if(key) *key = &node->value.bdict.keys[iter->index];
+        *value = node->value.bdict.values[iter->index];
+    } else {
+        if(iter->index >= node->value.blist.len) return false;
+        if(key) *key = NULL;
+        *value = node->value.blist.items[iter->index];
+    }
+    iter->index++;
+    return true;
+}
 #pragma endregion Traversal
 
+#pragma region Building
+
+static size_t bencode_decimal_len(unsigned long long value) {
+    size_t len = 1;
+    while(value >= 10) {
+        value /= 10;
+        len++;
+    }
+    return len;
+}
+
+/* Arrays of built containers double in size; len alone tells when the next append needs room */
+static bool bencode_needs_growth(size_t len) {
+    return len == 0 || (len >= 4 && (len & (len - 1)) == 0);
+}
+
+static size_t bencode_grown_cap(size_t len) {
+    return len == 0 ? 4 : len * 2;
+}
+
+/* extra bytes are allocated right behind the node, for a BNODE_INLINE payload */
+static BNode* bencode_new_owned(BTYPE type, size_t extra) {
+    BNode* node = calloc(1, sizeof(*node) + extra);
+    if(!node) return NULL;
+    STATS_ADD(STAT_NODE_ALLOCS, 1);
+    STATS_ADD(STAT_NODE_BYTES, sizeof(*node));
+
+    node->type = type;
+    return node;
+}
+
+BNode* bencode_new_string(const char* data, size_t len) {
+    if(len > UINT32_MAX) return NULL;
+
+    BNode* node = bencode_new_owned(BSTRING, len);
+    if(!node) return NULL;
+
+    STATS_ADD(STAT_STRING_BYTES, len);
+    node->flags = BNODE_INLINE;
+    node->value.bstring.data = (char*)(node + 1);
+    memcpy(node->value.bstring.data, data, len);
+    node->value.bstring.pre_delim_len = (uint32_t)bencode_decimal_len(len);
+    node->value.bstring.post_delim_len = (uint32_t)len;
+    return node;
+}
+
+BNode* bencode_new_int(long long value) {
+    BNode* node = bencode_new_owned(BINT, 0);
+    if(!node) return NULL;
+
+    const unsigned long long magnitude = value < 0 ? 0ull - (unsigned long long)value : (unsigned long long)value;
+    node->value.bint.value = value;
+    node->value.bint.len = bencode_decimal_len(magnitude) + (value < 0);
+    return node;
+}
+
+BNode* bencode_new_list(void) {
+    BNode* node = bencode_new_owned(BLIST, 0);
+    if(node) node->flags = BNODE_BUILT;
+    return node;
+}
+
+BNode* bencode_new_dict(void) {
+    BNode* node = bencode_new_owned(BDICT, 0);
+    if(node) node->flags = BNODE_BUILT | BNODE_SORTED;
+    return node;
+}
+
+bool bencode_list_append(BNode* list, BNode* item) {
+    if(!list || !item || list->type != BLIST || !(list->flags & BNODE_BUILT)) return false;
+
+    BList* l = &list->value.blist;
+    if(bencode_needs_growth(l->len)) {
+        BNode** items = realloc(l->items, bencode_grown_cap(l->len) * sizeof(BNode*));
+        if(!items) return false;
+        l->items = items;
+    }
+    l->items[l->len++] = item;
+    return true;
+}
+
+bool bencode_dict_set(BNode* dict, const char* key, BNode* value) {
+    if(!dict || !value || dict->type != BDICT || !(dict->flags & BNODE_BUILT)) return false;
+
+    BDict* d = &dict->value.bdict;
+    const size_t key_len = strlen(key);
+    if(key_len > UINT32_MAX) return false;
+
+    // keep the keys in encoding order, so the dict stays BNODE_SORTED
+    size_t lo = 0;
+    size_t hi = d->len;
+    while(lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        int cmp = bencode_compare_key(d->keys[mid].data, d->keys[mid].post_delim_len, key, key_len);
+        if(cmp == 0) {
+            bencode_free_node(d->values[mid]);
+            d->values[mid] = value;
+            return true;
+        }
+        if(cmp < 0) lo = mid + 1;
+        else hi = mid;
+    }
+
+    char* key_data = malloc(key_len ? key_len : 1);
+    if(!key_data) return false;
+    STATS_ADD(STAT_STRING_ALLOCS, 1);
+    STATS_ADD(STAT_STRING_BYTES, key_len);
+    memcpy(key_data, key, key_len);
+
+    if(bencode_needs_growth(d->len)) {
+        const size_t cap = bencode_grown_cap(d->len);
+        BString* keys = realloc(d->keys, cap * sizeof(BString));
+        if(keys) d->keys = keys;
+        BNode** values = keys ? realloc(d->values, cap * sizeof(BNode*)) : NULL;
+        if(!values) {
+            free(key_data);
+            return false;
+        }
+        d->values = values;
+    }
+
+    memmove(&d->keys[lo + 1], &d->keys[lo], (d->len - lo) * sizeof(BString));
+    memmove(&d->values[lo + 1], &d->values[lo], (d->len - lo) * sizeof(BNode*));
+    d->keys[lo] = (BString){
+        .pre_delim_len = (uint32_t)bencode_decimal_len(key_len),
+        .post_delim_len = (uint32_t)key_len,
+        .data = key_data,
+    };
+    d->values[lo] = value;
+    d->len++;
+    return true;
+}
+
+#pragma endregion Building
+
 #pragma region Public
 
-BNode* bencode_parse_torrent(const char* fpath) {
-    FILE* f = fopen(fpath, "rb");
-    if(!f) return NULL;
+void bencode_free_document(BDocument* doc) {
+    if(!doc) return;
 
-    BNode* root = bencode_decode_dict(f);
+    bencode_free_node(doc->root);
+    if(doc->heap) free((void*)doc->data);
+    else if(doc->data) munmap((void*)doc->data, doc->len);
+    free(doc);
+}
 
-    fclose(f);
-    return root;
+BDocument* bencode_document_from_buffer(char* data, size_t len, const BDecodeOptions* opts) {
+    if(!data) return NULL;
+
+    BDocument* doc = malloc(sizeof(*doc));
+    if(!doc) return NULL;
+
+    *doc = (BDocument){ .data = data, .len = len, .heap = true };
+    doc->root = bencode_decode_buffer_opts(data, len, NULL, opts);
+    if(!doc->root || doc->root->type != BDICT) {
+        bencode_free_node(doc->root);
+        free(doc);
+        return NULL;
+    }
+    return doc;
 }
 
-BEncodeBuf* bencode_encode_node(const BNode* node) {
-    BEncodeBuf* result = NULL;
-    
-    size_t encoded_size = bencode_get_encoded_size(node);
-    
-    char* encoded_data = malloc(encoded_size);
-    if(!encoded_data) goto cleanup;
-    bencode_encode_any_to_buffer(node, encoded_data);
+BDocument* bencode_parse_torrent_opts(const char* fpath, const BDecodeOptions* opts) {
+    BDocument* doc = NULL;
+    void* data = MAP_FAILED;
+    struct stat st;
 
-    result = malloc(sizeof(*result));
-    if(!result) goto cleanup;
+    int fd = open(fpath, O_RDONLY);
+    if(fd < 0) return NULL;
 
-    result->len = encoded_size;
-    result->data = encoded_data;
+    if(fstat(fd, &st) != 0 || st.st_size <= 0) goto cleanup;
 
-    return result;
+    // map the file read-only, the decoded strings point straight into the mapping
+    data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if(data == MAP_FAILED) goto cleanup;
+    posix_madvise(data, (size_t)st.st_size, POSIX_MADV_SEQUENTIAL);
+
+    doc = malloc(sizeof(*doc));
+    if(!doc) goto cleanup;
+
+    doc->data = data;
+    doc->len = (size_t)st.st_size;
+    doc->heap = false;
+    doc->root = bencode_decode_buffer_opts(doc->data, doc->len, NULL, opts);
+    if(!doc->root || doc->root->type != BDICT) goto cleanup;
+
+    close(fd);
+    return doc;
 
 cleanup:
-    free(encoded_data);
-    free(result);
+    if(doc) bencode_free_node(doc->root);
+    free(doc);
+    if(data != MAP_FAILED) munmap(data, (size_t)st.st_size);
+    close(fd);
     return NULL;
 }
 
+BDocument* bencode_parse_torrent_arena(const char* fpath, Arena* arena) {
+    const BDecodeOptions opts = { .arena = arena };
+    return bencode_parse_torrent_opts(fpath, &opts);
+}
+
+BDocument* bencode_parse_torrent(const char* fpath) {
+    return bencode_parse_torrent_opts(fpath, NULL);
+}
+
+size_t bencode_string_offset(const BNode* node) {
+    return node->end - node->value.bstring.post_delim_len;
+}
+
+const char* bencode_string_data(const BDocument* doc, const BNode* node) {
+    if(!node || node->type != BSTRING) return NULL;
+    if(!(node->flags & BNODE_REF)) return node->value.bstring.data;
+
+    return doc->data + bencode_string_offset(node);
+}
+
+BEncodeSink bencode_buffer_sink(BEncodeBufferSink* buffer) {
+    return (BEncodeSink){ .write = bencode_buffer_sink_write, .user = buffer };
+}
+
+BEncodeSink bencode_fd_sink(int fd) {
+    return (BEncodeSink){ .write = bencode_fd_sink_write, .user = (void*)(intptr_t)fd };
+}
+
+BEncodeSink bencode_file_sink(FILE* file) {
+    return (BEncodeSink){ .write = bencode_file_sink_write, .user = file };
+}
+
+BEncodeSink bencode_sha1_sink(sha1_ctx* ctx) {
+    return (BEncodeSink){ .write = bencode_sha1_sink_write, .user = ctx };
+}
+
+int bencode_encode_to_sink(const BNode* node, const BEncodeSink* sink) {
+    if(!node) return -1;
+
+    STATS_TIMER_START(timer);
+    BEncoder* enc = malloc(sizeof(*enc));
+    if(!enc) return -1;
+    enc->sink = sink;
+    enc->iovcnt = 0;
+    enc->staged = 0;
+    enc->failed = false;
+
+    bencode_encode_any(enc, node);
+    bencode_encoder_flush(enc);
+
+    const int status = enc->failed ? -1 : 0;
+    free(enc);
+    STATS_ADD(STAT_ENCODE_CALLS, 1);
+    STATS_TIMER_STOP(timer, STAT_ENCODE_NS);
+    return status;
+}
+
+BEncodeBuf* bencode_encode_node(const BNode* node) {
+    BEncodeBufferSink buffer = {0};
+    const BEncodeSink sink = bencode_buffer_sink(&buffer);
+    if(bencode_encode_to_sink(node, &sink) != 0) {
+        free(buffer.data);
+        return NULL;
+    }
+
+    BEncodeBuf* result = malloc(sizeof(*result));
+    if(!result) {
+        free(buffer.data);
+        return NULL;
+    }
+    result->len = buffer.len;
+    result->data = buffer.data;
+    return result;
+}
+
+sha1hash bencode_hash_encoded(const BNode* node) {
+    sha1_ctx ctx;
+    sha1_init(&ctx);
+
+    const BEncodeSink sink = bencode_sha1_sink(&ctx);
+    if(bencode_encode_to_sink(node, &sink) != 0) return (sha1hash){.bytes = {0}};
+    return sha1_final(&ctx);
+}
+
+sha1hash bencode_hash_node(const BDocument* doc, const BNode* node) {
+    if(!doc || !node || node->end > doc->len || node->start > node->end)
+        return (sha1hash){.bytes = {0}};
+
+    return sha1((const uint8_t*)doc->data + node->start, node->end - node->start);
+}
+
 void bencode_print_recursive(const BNode* node, size_t indent) {
     if (!node) return;
+    if (!bencode_expand(node)) return;
 
     printf("%*s", (int)indent, "");
 
     switch (node->type) {
     case BSTRING:
-        if(node->value.bstring.post_delim_len >= 100) { //assume binary blob
+        if(node->value.bstring.post_delim_len >= 100 || !node->value.bstring.data) { //assume binary blob
             printf("<blob>...</blob>\n");
         } else {
-            printf("String: %zu, %zu, %.*s\n",
-                node->value.bstring.pre_delim_len,
-                node->value.bstring.post_delim_len,
+            printf("String: %u, %u, %.*s\n",
+                (unsigned)node->value.bstring.pre_delim_len,
+                (unsigned)node->value.bstring.post_delim_len,
                 (int)node->value.bstring.post_delim_len,
                 node->value.bstring.data);
         }
@@ -0,0 +1,99 @@
+#include "bencode_intern.h"
+#include "stats.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BENC_INTERN_MIN_CAP     64
+
+/* A heap key: its count sits right in front of the bytes the dicts point at */
+typedef struct BInternKey {
+    size_t  refs;
+    char    data[];
+} BInternKey;
+
+static BInternKey* bencode_intern_header(char* key) {
+    return (BInternKey*)(key - offsetof(BInternKey, data));
+}
+
+/* FNV-1a, keys are a handful of bytes */
+static uint32_t bencode_intern_hash(const char* key, uint32_t len) {
+    uint32_t hash = 2166136261u;
+    for(uint32_t i = 0; i < len; ++i) {
+        hash = (hash ^ (uint8_t)key[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static bool bencode_intern_grow(BInternTable* table) {
+    const size_t cap = table->cap ? table->cap * 2 : BENC_INTERN_MIN_CAP;
+    BInternSlot* slots = calloc(cap, sizeof(*slots));
+    if(!slots) return false;
+
+    for(size_t i = 0; i < table->cap; ++i) {
+        const BInternSlot* slot = &table->slots[i];
+        if(!slot->key) continue;
+
+        size_t j = slot->hash & (cap - 1);
+        while(slots[j].key) j = (j + 1) & (cap - 1);
+        slots[j] = *slot;
+    }
+    free(table->slots);
+    table->slots = slots;
+    table->cap = cap;
+    return true;
+}
+
+void bencode_intern_init(BInternTable* table, Arena* arena) {
+    *table = (BInternTable){ .arena = arena };
+}
+
+char* bencode_intern(BInternTable* table, const char* key, uint32_t len) {
+    // at most half full, probe runs stay short
+    if(2 * (table->count + 1) > table->cap && !bencode_intern_grow(table)) return NULL;
+
+    const uint32_t hash = bencode_intern_hash(key, len);
+    size_t i = hash & (table->cap - 1);
+    for(; table->slots[i].key; i = (i + 1) & (table->cap - 1)) {
+        const BInternSlot* slot = &table->slots[i];
+        if(slot->hash != hash || slot->len != len || memcmp(slot->key, key, len) != 0) continue;
+
+        if(!table->arena) bencode_intern_header(slot->key)->refs++;
+        return slot->key;
+    }
+
+    char* copy = NULL;
+    if(table->arena) {
+        copy = arena_alloc(table->arena, len ? len : 1);
+    } else {
+        BInternKey* header = malloc(sizeof(*header) + len);
+        if(header) {
+            header->refs = 2;   // the table's and the caller's
+            copy = header->data;
+        }
+    }
+    if(!copy) return NULL;
+    STATS_ADD(STAT_STRING_ALLOCS, 1);
+    STATS_ADD(STAT_STRING_BYTES, len);
+
+    memcpy(copy, key, len);
+    table->slots[i] = (BInternSlot){ .key = copy, .len = len, .hash = hash };
+    table->count++;
+    return copy;
+}
+
+void bencode_intern_release(char* key) {
+    BInternKey* header = bencode_intern_header(key);
+    if(--header->refs == 0) free(header);
+}
+
+void bencode_intern_clear(BInternTable* table) {
+    if(!table->arena) {
+        for(size_t i = 0; i < table->cap; ++i) {
+            if(table->slots[i].key) bencode_intern_release(table->slots[i].key);
+        }
+    }
+    free(table->slots);
+    *table = (BInternTable){ .arena = table->arena };
+}
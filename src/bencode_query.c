@@ -0,0 +1,178 @@
+#include "bencode_query.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#pragma region Compile
+
+static bool bencode_query_parse_key(BQueryStep* step, const char** cursor) {
+    const char* p = *cursor;
+
+    char* key = malloc(strlen(p) + 1);
+    if(!key) return false;
+
+    size_t len = 0;
+    while(*p && *p != '.' && *p != '[') {
+        if(*p == '\\') {
+            p++;
+            if(!*p) {
+                free(key);
+                return false;
+            }
+        }
+        key[len++] = *p++;
+    }
+    key[len] = '\0';
+
+    if(len == 1 && key[0] == '*' && (*cursor)[0] == '*') {
+        free(key);
+        step->type = BQUERY_ALL_VALUES;
+    } else {
+        step->type = BQUERY_KEY;
+        step->key = key;
+        step->key_len = len;
+    }
+
+    *cursor = p;
+    return true;
+}
+
+static bool bencode_query_parse_index(BQueryStep* step, const char** cursor) {
+    const char* p = *cursor + 1;        // skip '['
+
+    if(*p == '*') {
+        step->type = BQUERY_ALL_ITEMS;
+        p++;
+    } else {
+        if(*p < '0' || *p > '9') return false;
+        size_t index = 0;
+        while(*p >= '0' && *p <= '9') {
+            index = index * 10 + (size_t)(*p - '0');
+            p++;
+        }
+        step->type = BQUERY_INDEX;
+        step->index = index;
+    }
+
+    if(*p != ']') return false;
+    *cursor = p + 1;
+    return true;
+}
+
+BQuery* bencode_query_compile(const char* path) {
+    if(!path) return NULL;
+
+    BQuery* query = calloc(1, sizeof(*query));
+    if(!query) return NULL;
+
+    const char* p = path;
+    bool expect_key = *p != '[';
+    while(*p) {
+        if(query->len >= BENC_QUERY_MAX_STEPS) goto fail;
+        BQueryStep* step = &query->steps[query->len];
+
+        if(*p == '[') {
+            if(!bencode_query_parse_index(step, &p)) goto fail;
+        } else {
+            if(!expect_key || *p == '.') goto fail;
+            if(!bencode_query_parse_key(step, &p)) goto fail;
+        }
+        query->len++;
+
+        // a key has to follow a '.', an index may follow anything
+        expect_key = false;
+        if(*p == '.') {
+            p++;
+            if(!*p) goto fail;
+            expect_key = true;
+        }
+    }
+    return query;
+
+fail:
+    bencode_query_free(query);
+    return NULL;
+}
+
+void bencode_query_free(BQuery* query) {
+    if(!query) return;
+
+    for(size_t i = 0; i < BENC_QUERY_MAX_STEPS; ++i) {
+        free(query->steps[i].key);
+    }
+    free(query);
+}
+
+#pragma endregion Compile
+
+#pragma region Iteration
+
+void bencode_query_begin(BQueryIter* iter, const BQuery* query, const BNode* root) {
+    iter->query = query;
+    iter->frames[0] = (BQueryFrame){ .node = root, .cursor = 0 };
+    iter->depth = root ? 1 : 0;
+}
+
+/* Next child of frame selected by step, or NULL when the step has nothing more to offer */
+static const BNode* bencode_query_advance(BQueryFrame* frame, const BQueryStep* step) {
+    const BNode* node = frame->node;
+    const size_t cursor = frame->cursor++;
+    if(!bencode_expand(node)) return NULL;
+
+    switch(step->type) {
+        case BQUERY_KEY:
+            if(cursor > 0) return NULL;
+            return bencode_find_node_by_key_len(node, step->key, step->key_len);
+
+        case BQUERY_INDEX:
+            if(cursor > 0 || node->type != BLIST) return NULL;
+            if(step->index >= node->value.blist.len) return NULL;
+            return node->value.blist.items[step->index];
+
+        case BQUERY_ALL_ITEMS:
+            if(node->type != BLIST || cursor >= node->value.blist.len) return NULL;
+            return node->value.blist.items[cursor];
+
+        case BQUERY_ALL_VALUES:
+            if(node->type != BDICT || cursor >= node->value.bdict.len) return NULL;
+            return node->value.bdict.values[cursor];
+    }
+    return NULL;
+}
+
+const BNode* bencode_query_next(BQueryIter* iter) {
+    const BQuery* query = iter->query;
+
+    while(iter->depth > 0) {
+        BQueryFrame* frame = &iter->frames[iter->depth - 1];
+
+        // every step applied: this frame is a match
+        if(iter->depth - 1 == query->len) {
+            iter->depth--;
+            return frame->node;
+        }
+
+        const BNode* child = bencode_query_advance(frame, &query->steps[iter->depth - 1]);
+        if(!child) {
+            iter->depth--;
+            continue;
+        }
+
+        iter->frames[iter->depth++] = (BQueryFrame){ .node = child, .cursor = 0 };
+    }
+    return NULL;
+}
+
+const BNode* bencode_query(const BNode* root, const char* path) {
+    BQuery* query = bencode_query_compile(path);
+    if(!query) return NULL;
+
+    BQueryIter iter;
+    bencode_query_begin(&iter, query, root);
+    const BNode* result = bencode_query_next(&iter);
+
+    bencode_query_free(query);
+    return result;
+}
+
+#pragma endregion Iteration
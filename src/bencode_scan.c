@@ -0,0 +1,38 @@
+#include "bencode_scan.h"
+
+static const uint64_t BSCAN_POW10_8 = 100000000;
+
+static uint64_t bencode_scan_convert_exact(const char* p, size_t n, size_t avail) {
+    // chunks of 8 need 8 readable bytes at each chunk start
+    if(avail < ((n + 7) & ~(size_t)7)) {
+        uint64_t value = 0;
+        for(size_t i = 0; i < n; ++i) value = value * 10 + (uint64_t)(p[i] - '0');
+        return value;
+    }
+
+    const size_t head = n % 8 ? n % 8 : 8;
+    uint64_t value = bencode_scan_swar8(p, head);
+    for(size_t i = head; i < n; i += 8) {
+        value = value * BSCAN_POW10_8 + bencode_scan_swar8(p + i, 8);
+    }
+    return value;
+}
+
+uint64_t bencode_scan_convert_long(const char* p, size_t n, size_t avail) {
+    // past the 20th digit from the end, only leading zeros still fit
+    size_t skip = 0;
+    while(n - skip > BENC_SCAN_EXACT_DIGITS + 1) {
+        if(p[skip] != '0') return UINT64_MAX;
+        skip++;
+    }
+    p += skip;
+    n -= skip;
+    avail -= skip;
+
+    if(n <= BENC_SCAN_EXACT_DIGITS) return bencode_scan_convert_exact(p, n, avail);
+
+    const uint64_t high = bencode_scan_convert_exact(p, BENC_SCAN_EXACT_DIGITS, avail);
+    const uint64_t last = (uint64_t)(p[BENC_SCAN_EXACT_DIGITS] - '0');
+    if(high > (UINT64_MAX - last) / 10) return UINT64_MAX;
+    return high * 10 + last;
+}
@@ -0,0 +1,450 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "bencode_stream.h"
+#include "bencode_intern.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BSTREAM_FILE_CHUNK  (64 * 1024)
+
+enum {
+    BSTATE_VALUE,       // between tokens
+    BSTATE_STRLEN,      // reading the length prefix of a string
+    BSTATE_STRDATA,     // reading string payload into buf
+    BSTATE_STRSKIP,     // passing over the payload of a string longer than ref_threshold
+    BSTATE_INT,         // reading the digits of an integer
+    BSTATE_FINISHED,
+    BSTATE_FAILED,
+};
+
+enum {
+    BFRAME_LIST,
+    BFRAME_DICT_KEY,    // dict expecting a key or its terminator
+    BFRAME_DICT_VALUE,  // dict expecting the value for the last key
+};
+
+#pragma region Builder
+
+typedef struct BStreamBuilder {
+    BNode*  root;
+    BNode*  stack[BENC_MAX_DEPTH];
+    size_t  caps[BENC_MAX_DEPTH];
+    size_t  depth;
+    BString pending_key;
+    bool    finished;
+    BInternTable interned;      // keys of the message being built
+} BStreamBuilder;
+
+static void bstream_builder_clear(BStreamBuilder* b) {
+    bencode_free_node(b->root);
+    if(b->pending_key.data) bencode_intern_release(b->pending_key.data);
+    bencode_intern_clear(&b->interned);
+    memset(b, 0, sizeof(*b));
+}
+
+static bool bstream_builder_attach(BStreamBuilder* b, BNode* node) {
+    if(b->depth == 0) {
+        b->root = node;
+        return true;
+    }
+
+    BNode* parent = b->stack[b->depth - 1];
+    size_t* cap = &b->caps[b->depth - 1];
+
+    if(parent->type == BLIST) {
+        BList* list = &parent->value.blist;
+        if(list->len >= *cap) {
+            size_t new_cap = *cap == 0 ? 8 : *cap * 2;
+            BNode** new_items = realloc(list->items, new_cap*sizeof(BNode*));
+            if(!new_items) return false;
+            list->items = new_items;
+            *cap = new_cap;
+        }
+        list->items[list->len++] = node;
+        return true;
+    }
+
+    BDict* dict = &parent->value.bdict;
+    if(dict->len >= *cap) {
+        size_t new_cap = *cap == 0 ? 8 : *cap * 2;
+        BString* new_keys = realloc(dict->keys, new_cap*sizeof(BString));
+        if(!new_keys) return false;
+        dict->keys = new_keys;
+        BNode** new_values = realloc(dict->values, new_cap*sizeof(BNode*));
+        if(!new_values) return false;
+        dict->values = new_values;
+        *cap = new_cap;
+    }
+    dict->keys[dict->len] = b->pending_key;
+    dict->values[dict->len] = node;
+    dict->len++;
+    b->pending_key = (BString){0};
+    return true;
+}
+
+/* Give back what the doubling left unused, most dicts of a file list have two keys */
+static void bstream_builder_trim(BNode* node, size_t cap) {
+    if(node->type == BLIST) {
+        BList* list = &node->value.blist;
+        if(list->len == 0 || list->len == cap) return;
+
+        BNode** items = realloc(list->items, list->len * sizeof(BNode*));
+        if(items) list->items = items;
+        return;
+    }
+
+    BDict* dict = &node->value.bdict;
+    if(dict->len == 0 || dict->len == cap) return;
+
+    BString* keys = realloc(dict->keys, dict->len * sizeof(BString));
+    if(keys) dict->keys = keys;
+    BNode** values = realloc(dict->values, dict->len * sizeof(BNode*));
+    if(values) dict->values = values;
+}
+
+static int bstream_builder_handler(void* user, const BStreamToken* token) {
+    BStreamBuilder* b = user;
+
+    if(token->type == BEV_END) {
+        BNode* node = b->stack[--b->depth];
+        node->end = token->end;
+        bstream_builder_trim(node, b->caps[b->depth]);
+        bencode_index_dict(node);
+        if(b->depth == 0) b->finished = true;
+        return 0;
+    }
+
+    if((token->type == BEV_KEY || token->type == BEV_STRING) && token->len > UINT32_MAX) return -1;
+
+    if(token->type == BEV_KEY) {
+        char* data = bencode_intern(&b->interned, token->data, (uint32_t)token->len);
+        if(!data) return -1;
+        b->pending_key = (BString){ .post_delim_len = (uint32_t)token->len, .data = data };
+        for(size_t n = token->len; ; n /= 10) {
+            b->pending_key.pre_delim_len++;
+            if(n < 10) break;
+        }
+        return 0;
+    }
+
+    // a buffered payload is stored right behind its node
+    const size_t extra = token->type == BEV_STRING && token->data ? token->len : 0;
+    BNode* node = calloc(1, sizeof(*node) + extra);
+    if(!node) return -1;
+    node->start = token->start;
+    node->end = token->end;
+
+    switch(token->type) {
+        case BEV_DICT_START:
+            node->type = BDICT;
+            node->flags = BNODE_INTERNED;
+            break;
+        case BEV_LIST_START:
+            node->type = BLIST;
+            break;
+        case BEV_INT:
+            node->type = BINT;
+            node->value.bint = (BInt){ .len = token->end - token->start - 2, .value = token->value };
+            break;
+        default: {
+            char* data = NULL;
+            if(token->data) {
+                data = (char*)(node + 1);
+                memcpy(data, token->data, token->len);
+                node->flags = BNODE_INLINE;
+            } else {
+                node->flags = BNODE_REF;
+            }
+            node->type = BSTRING;
+            node->value.bstring = (BString){
+                .pre_delim_len = (uint32_t)(token->end - token->start - token->len - 1),
+                .post_delim_len = (uint32_t)token->len,
+                .data = data,
+            };
+            break;
+        }
+    }
+
+    // attach right away, so a failed decode can free everything through root
+    if(!bstream_builder_attach(b, node)) {
+        bencode_free_node(node);
+        return -1;
+    }
+
+    if(node->type == BDICT || node->type == BLIST) {
+        b->caps[b->depth] = 0;
+        b->stack[b->depth++] = node;
+    } else if(b->depth == 0) {
+        b->finished = true;
+    }
+    return 0;
+}
+
+#pragma endregion Builder
+
+#pragma region Public
+
+void bstream_init(BStream* stream, BStreamHandler handler, void* user) {
+    memset(stream, 0, sizeof(*stream));
+    stream->handler = handler;
+    stream->user = user;
+    stream->max_string_size = BENC_DEFAULT_MAX_STRSIZE;
+    stream->state = BSTATE_VALUE;
+}
+
+bool bstream_init_tree(BStream* stream) {
+    BStreamBuilder* builder = calloc(1, sizeof(*builder));
+    if(!builder) return false;
+
+    bstream_init(stream, bstream_builder_handler, builder);
+    stream->builder = builder;
+    return true;
+}
+
+BNode* bstream_take_root(BStream* stream) {
+    if(!stream->builder || !stream->builder->finished) return NULL;
+
+    BNode* root = stream->builder->root;
+    stream->builder->root = NULL;
+    // the tree owns its keys from here on, it may be freed on another thread
+    bencode_intern_clear(&stream->builder->interned);
+    return root;
+}
+
+void bstream_reset(BStream* stream) {
+    if(stream->builder) bstream_builder_clear(stream->builder);
+
+    stream->state = BSTATE_VALUE;
+    stream->offset = 0;
+    stream->depth = 0;
+    stream->buf_len = 0;
+}
+
+void bstream_free(BStream* stream) {
+    if(stream->builder) {
+        bstream_builder_clear(stream->builder);
+        free(stream->builder);
+    }
+    free(stream->buf);
+    memset(stream, 0, sizeof(*stream));
+}
+
+static bool bstream_emit(BStream* s, BStreamEvent type, const char* data, size_t len, long long value, size_t end) {
+    BStreamToken token = {
+        .type = type,
+        .data = data,
+        .len = len,
+        .value = value,
+        .start = s->token_start,
+        .end = end,
+    };
+    return s->handler(s->user, &token) == 0;
+}
+
+// a scalar or container just ended, advance the enclosing frame
+static void bstream_value_done(BStream* s) {
+    if(s->depth == 0) {
+        s->state = BSTATE_FINISHED;
+        return;
+    }
+    if(s->frames[s->depth - 1] == BFRAME_DICT_VALUE) s->frames[s->depth - 1] = BFRAME_DICT_KEY;
+    s->state = BSTATE_VALUE;
+}
+
+static bool bstream_string_done(BStream* s, const char* data, size_t end) {
+    const bool is_key = s->depth > 0 && s->frames[s->depth - 1] == BFRAME_DICT_KEY;
+    if(!bstream_emit(s, is_key ? BEV_KEY : BEV_STRING, data, s->str_len, 0, end)) return false;
+
+    if(is_key) {
+        s->frames[s->depth - 1] = BFRAME_DICT_VALUE;
+        s->state = BSTATE_VALUE;
+    } else {
+        bstream_value_done(s);
+    }
+    return true;
+}
+
+BStreamStatus bstream_feed(BStream* s, const char* chunk, size_t len, size_t* consumed) {
+    size_t i = 0;
+
+    while(i < len && s->state != BSTATE_FINISHED && s->state != BSTATE_FAILED) {
+        const char c = chunk[i];
+
+        switch(s->state) {
+            case BSTATE_VALUE: {
+                const int frame = s->depth > 0 ? s->frames[s->depth - 1] : -1;
+                s->token_start = s->offset + i;
+
+                if(c == BENC_TERMINATOR && (frame == BFRAME_LIST || frame == BFRAME_DICT_KEY)) {
+                    s->depth--;
+                    if(!bstream_emit(s, BEV_END, NULL, 0, 0, s->offset + i + 1)) goto fail;
+                    bstream_value_done(s);
+                    i++;
+                    break;
+                }
+                if(c >= '0' && c <= '9') {
+                    s->state = BSTATE_STRLEN;
+                    s->digits = 0;
+                    s->str_len = 0;
+                    break;                  // the digit is consumed by BSTATE_STRLEN
+                }
+                if(frame == BFRAME_DICT_KEY) goto fail;    // keys must be strings
+
+                if(c == BENC_DICT_START || c == BENC_LIST_START) {
+                    if(s->depth >= BENC_MAX_DEPTH) goto fail;
+                    s->frames[s->depth++] = c == BENC_DICT_START ? BFRAME_DICT_KEY : BFRAME_LIST;
+                    if(!bstream_emit(s, c == BENC_DICT_START ? BEV_DICT_START : BEV_LIST_START,
+                                     NULL, 0, 0, s->offset + i + 1)) goto fail;
+                    i++;
+                    break;
+                }
+                if(c == BENC_INT_START) {
+                    s->state = BSTATE_INT;
+                    s->digits = 0;
+                    s->negative = false;
+                    s->magnitude = 0;
+                    i++;
+                    break;
+                }
+                goto fail;
+            }
+
+            case BSTATE_STRLEN: {
+                // consume as many digits as this chunk holds
+                while(i < len && chunk[i] >= '0' && chunk[i] <= '9') {
+                    if(s->digits >= BENC_MAX_LOOKAHEAD-1) goto fail;
+                    s->str_len = s->str_len * 10 + (size_t)(chunk[i] - '0');
+                    s->digits++;
+                    i++;
+                }
+                if(i == len) break;
+                if(chunk[i] != BENC_DELIMITER) goto fail;
+                i++;
+                if(s->str_len > s->max_string_size) goto fail;
+
+                // huge values are only reported by position, their bytes are never held
+                const bool is_key = s->depth > 0 && s->frames[s->depth - 1] == BFRAME_DICT_KEY;
+                if(!is_key && s->ref_threshold > 0 && s->str_len > s->ref_threshold) {
+                    s->buf_len = 0;
+                    s->state = BSTATE_STRSKIP;
+                    break;
+                }
+
+                // whole payload is in this chunk: hand it out without copying
+                if(len - i >= s->str_len) {
+                    if(!bstream_string_done(s, chunk + i, s->offset + i + s->str_len)) goto fail;
+                    i += s->str_len;
+                    break;
+                }
+
+                if(s->buf_cap < s->str_len) {
+                    char* new_buf = realloc(s->buf, s->str_len);
+                    if(!new_buf) goto fail;
+                    s->buf = new_buf;
+                    s->buf_cap = s->str_len;
+                }
+                s->buf_len = 0;
+                s->state = BSTATE_STRDATA;
+                break;
+            }
+
+            case BSTATE_STRDATA: {
+                size_t take = s->str_len - s->buf_len;
+                if(take > len - i) take = len - i;
+                memcpy(s->buf + s->buf_len, chunk + i, take);
+                s->buf_len += take;
+                i += take;
+
+                if(s->buf_len == s->str_len) {
+                    if(!bstream_string_done(s, s->buf, s->offset + i)) goto fail;
+                }
+                break;
+            }
+
+            case BSTATE_STRSKIP: {
+                size_t take = s->str_len - s->buf_len;
+                if(take > len - i) take = len - i;
+                s->buf_len += take;
+                i += take;
+
+                if(s->buf_len == s->str_len) {
+                    if(!bstream_string_done(s, NULL, s->offset + i)) goto fail;
+                }
+                break;
+            }
+
+            case BSTATE_INT: {
+                if(c == '-' && s->digits == 0 && !s->negative) {
+                    s->negative = true;
+                    i++;
+                    break;
+                }
+                if(c >= '0' && c <= '9') {
+                    if(s->digits > 0 && s->magnitude == 0) goto fail;      // leading zero
+                    unsigned long long next = s->magnitude * 10 + (unsigned long long)(c - '0');
+                    if(next / 10 != s->magnitude) goto fail;                // overflow
+                    s->magnitude = next;
+                    s->digits++;
+                    i++;
+                    break;
+                }
+                if(c != BENC_TERMINATOR || s->digits == 0) goto fail;
+                if(s->negative && s->magnitude == 0) goto fail;            // "-0"
+                if(s->magnitude > (unsigned long long)LLONG_MAX + s->negative) goto fail;
+
+                long long value = s->negative ? (long long)(0 - s->magnitude) : (long long)s->magnitude;
+                i++;
+                if(!bstream_emit(s, BEV_INT, NULL, 0, value, s->offset + i)) goto fail;
+                bstream_value_done(s);
+                break;
+            }
+        }
+    }
+
+    s->offset += i;
+    if(consumed) *consumed = i;
+
+    if(s->state == BSTATE_FAILED) return BSTREAM_ERROR;
+    if(s->state == BSTATE_FINISHED) return BSTREAM_DONE;
+    return BSTREAM_NEED_MORE;
+
+fail:
+    s->state = BSTATE_FAILED;
+    s->offset += i;
+    if(consumed) *consumed = i;
+    return BSTREAM_ERROR;
+}
+
+BNode* bstream_parse_file(const char* fpath, size_t ref_threshold) {
+    char chunk[BSTREAM_FILE_CHUNK];
+    BNode* root = NULL;
+    BStream stream;
+
+    int fd = open(fpath, O_RDONLY);
+    if(fd < 0) return NULL;
+
+    if(!bstream_init_tree(&stream)) {
+        close(fd);
+        return NULL;
+    }
+    stream.ref_threshold = ref_threshold;
+
+    BStreamStatus status = BSTREAM_NEED_MORE;
+    while(status == BSTREAM_NEED_MORE) {
+        ssize_t n = read(fd, chunk, sizeof(chunk));
+        if(n <= 0) break;
+        status = bstream_feed(&stream, chunk, (size_t)n, NULL);
+    }
+
+    if(status == BSTREAM_DONE) root = bstream_take_root(&stream);
+
+    bstream_free(&stream);
+    close(fd);
+    return root;
+}
+
+#pragma endregion Public
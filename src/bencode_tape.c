@@ -0,0 +1,356 @@
+#include "bencode_tape.h"
+#include "bencode_scan.h"
+
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct BTapeFrame {
+    size_t  entry;
+    bool    dict;
+    bool    key_next;   // dict: the next child is a key
+} BTapeFrame;
+
+typedef struct BTapeParser {
+    BTape*      tape;
+    const char* data;
+    size_t      len;
+    size_t      pos;
+    BTapeFrame  frames[BENC_MAX_DEPTH];
+    size_t      depth;
+} BTapeParser;
+
+#pragma region Parsing
+
+static BTapeEntry* btape_push(BTape* tape) {
+    if(tape->len >= tape->cap) {
+        // next is 32 bits wide
+        if(tape->len >= UINT32_MAX) return NULL;
+
+        size_t new_cap = tape->cap == 0 ? 256 : tape->cap * 2;
+        BTapeEntry* new_entries = realloc(tape->entries, new_cap * sizeof(BTapeEntry));
+        if(!new_entries) return NULL;
+        tape->entries = new_entries;
+        tape->cap = new_cap;
+    }
+    BTapeEntry* entry = &tape->entries[tape->len++];
+    entry->next = (uint32_t)tape->len;
+    return entry;
+}
+
+static bool btape_parse_string(BTapeParser* p) {
+    const char* s = p->data + p->pos;
+    const char* end = p->data + p->len;
+
+    uint64_t len;
+    const size_t digits = bencode_scan_digits(s, (size_t)(end - s), &len);
+    if(digits == 0 || digits >= BENC_MAX_LOOKAHEAD) return false;
+    s += digits;
+    if(s == end || *s != BENC_DELIMITER) return false;
+    s++;
+    // BString lengths are 32-bit, the same limit as bencode_decode_buffer
+    if(len > UINT32_MAX || len > (uint64_t)(end - s)) return false;
+
+    BTapeEntry* entry = btape_push(p->tape);
+    if(!entry) return false;
+    entry->type = BSTRING;
+    entry->prefix = (uint16_t)digits;
+    entry->start = p->pos;
+    entry->data.len = len;
+
+    p->pos = (size_t)(s + len - p->data);
+    return true;
+}
+
+/* Same rules as bencode_decode_bint: no leading zeros, no "-0", no overflow */
+static bool btape_parse_int(BTapeParser* p) {
+    const char* s = p->data + p->pos + 1;
+    const char* end = p->data + p->len;
+
+    const char* digits = s;
+    bool negative = false;
+    if(s < end && *s == '-') {
+        negative = true;
+        s++;
+    }
+
+    uint64_t magnitude;
+    const char* first_digit = s;
+    s += bencode_scan_digits(s, (size_t)(end - s), &magnitude);
+    if(magnitude == UINT64_MAX) return false;
+    if(s == first_digit) return false;
+    if(s == end || *s != BENC_TERMINATOR) return false;
+    if(*first_digit == '0' && s - first_digit > 1) return false;
+    if(negative && *first_digit == '0') return false;
+    if(magnitude > (unsigned long long)LLONG_MAX + negative) return false;
+
+    BTapeEntry* entry = btape_push(p->tape);
+    if(!entry) return false;
+    entry->type = BINT;
+    entry->prefix = (uint16_t)(s - digits);
+    entry->start = p->pos;
+    entry->data.value = negative ? (int64_t)(0 - magnitude) : (int64_t)magnitude;
+
+    p->pos = (size_t)(s + 1 - p->data);
+    return true;
+}
+
+static bool btape_parse_value(BTapeParser* p) {
+    if(p->pos >= p->len) return false;
+    if(p->depth >= BENC_MAX_DEPTH) return false;
+
+    const char c = p->data[p->pos];
+    if(c == BENC_DICT_START || c == BENC_LIST_START) {
+        BTapeEntry* entry = btape_push(p->tape);
+        if(!entry) return false;
+        entry->type = c == BENC_DICT_START ? BDICT : BLIST;
+        entry->prefix = 0;
+        entry->start = p->pos;
+
+        p->frames[p->depth++] = (BTapeFrame){
+            .entry = p->tape->len - 1,
+            .dict = c == BENC_DICT_START,
+            .key_next = true,
+        };
+        p->pos++;
+        return true;
+    }
+    if(c == BENC_INT_START) return btape_parse_int(p);
+    return btape_parse_string(p);
+}
+
+/* Iterative, so the nesting depth costs no C stack */
+static bool btape_parse_document(BTapeParser* p) {
+    if(!btape_parse_value(p)) return false;
+
+    while(p->depth > 0) {
+        BTapeFrame* frame = &p->frames[p->depth - 1];
+        if(p->pos >= p->len) return false;
+
+        if(p->data[p->pos] == BENC_TERMINATOR) {
+            if(frame->dict && !frame->key_next) return false;  // key without a value
+
+            BTapeEntry* entry = &p->tape->entries[frame->entry];
+            entry->next = (uint32_t)p->tape->len;
+            entry->data.end = ++p->pos;
+            p->depth--;
+            continue;
+        }
+
+        if(frame->dict) {
+            frame->key_next = !frame->key_next;
+            if(!frame->key_next) {
+                if(!btape_parse_string(p)) return false;
+                continue;
+            }
+        }
+        if(!btape_parse_value(p)) return false;
+    }
+    return true;
+}
+
+#pragma endregion Parsing
+
+#pragma region Access
+
+BTYPE btape_type(const BTape* tape, size_t entry) {
+    return (BTYPE)tape->entries[entry].type;
+}
+
+const char* btape_string(const BTape* tape, size_t entry, size_t* len) {
+    const BTapeEntry* e = &tape->entries[entry];
+    if(e->type != BSTRING) return NULL;
+
+    if(len) *len = e->data.len;
+    return tape->data + e->start + e->prefix + 1;
+}
+
+long long btape_int(const BTape* tape, size_t entry) {
+    const BTapeEntry* e = &tape->entries[entry];
+    return e->type == BINT ? e->data.value : 0;
+}
+
+size_t btape_end(const BTape* tape, size_t entry) {
+    const BTapeEntry* e = &tape->entries[entry];
+    switch (e->type)
+    {
+        case BSTRING:
+            return e->start + e->prefix + 1 + e->data.len;
+        case BINT:
+            return e->start + e->prefix + 2;
+        default:
+            return e->data.end;
+    }
+}
+
+size_t btape_count(const BTape* tape, size_t entry) {
+    BTapeIter iter;
+    if(!btape_iter_begin(&iter, tape, entry)) return 0;
+
+    size_t count = 0;
+    size_t key, value;
+    while(btape_iter_next(&iter, &key, &value)) count++;
+    return count;
+}
+
+bool btape_iter_begin(BTapeIter* iter, const BTape* tape, size_t entry) {
+    const BTapeEntry* e = &tape->entries[entry];
+    if(e->type != BDICT && e->type != BLIST) return false;
+
+    *iter = (BTapeIter){ .tape = tape, .pos = entry + 1, .end = e->next, .dict = e->type == BDICT };
+    return true;
+}
+
+bool btape_iter_next(BTapeIter* iter, size_t* key, size_t* value) {
+    if(iter->pos >= iter->end) return false;
+
+    const BTapeEntry* entries = iter->tape->entries;
+    if(iter->dict) {
+        *key = iter->pos;
+        iter->pos = entries[iter->pos].next;
+    } else {
+        *key = BTAPE_NONE;
+    }
+    *value = iter->pos;
+    iter->pos = entries[iter->pos].next;
+    return true;
+}
+
+size_t btape_find_key(const BTape* tape, size_t dict, const char* key, size_t key_len) {
+    if(tape->entries[dict].type != BDICT) return BTAPE_NONE;
+
+    // keys are adjacent to their values, the scan touches consecutive memory
+    const BTapeEntry* entries = tape->entries;
+    const size_t end = entries[dict].next;
+    size_t pos = dict + 1;
+    while(pos < end) {
+        const BTapeEntry* k = &entries[pos];
+        const size_t value = k->next;
+        if(k->data.len == key_len && memcmp(tape->data + k->start + k->prefix + 1, key, key_len) == 0) {
+            return value;
+        }
+        pos = entries[value].next;
+    }
+    return BTAPE_NONE;
+}
+
+size_t btape_list_item(const BTape* tape, size_t list, size_t index) {
+    if(tape->entries[list].type != BLIST) return BTAPE_NONE;
+
+    const size_t end = tape->entries[list].next;
+    size_t pos = list + 1;
+    while(pos < end && index > 0) {
+        pos = tape->entries[pos].next;
+        index--;
+    }
+    return pos < end ? pos : BTAPE_NONE;
+}
+
+sha1hash btape_hash(const BTape* tape, size_t entry) {
+    const size_t start = tape->entries[entry].start;
+    return sha1((const uint8_t*)tape->data + start, btape_end(tape, entry) - start);
+}
+
+static BNode* btape_new_node(const BTape* tape, size_t entry, BTYPE type) {
+    BNode* node = calloc(1, sizeof(*node));
+    if(!node) return NULL;
+
+    node->type = type;
+    node->flags = BNODE_BORROWED;
+    node->start = tape->entries[entry].start;
+    node->end = btape_end(tape, entry);
+    return node;
+}
+
+BNode* btape_to_node(const BTape* tape, size_t entry) {
+    const BTapeEntry* e = &tape->entries[entry];
+    BNode* node = btape_new_node(tape, entry, (BTYPE)e->type);
+    if(!node) return NULL;
+
+    if(e->type == BSTRING) {
+        node->value.bstring = (BString){
+            .pre_delim_len = e->prefix,
+            .post_delim_len = (uint32_t)e->data.len,
+            .data = (char*)btape_string(tape, entry, NULL),
+        };
+        return node;
+    }
+    if(e->type == BINT) {
+        node->value.bint = (BInt){ .len = e->prefix, .value = e->data.value };
+        return node;
+    }
+
+    const size_t count = btape_count(tape, entry);
+    BTapeIter iter;
+    if(!btape_iter_begin(&iter, tape, entry)) goto fail;
+
+    if(e->type == BLIST) {
+        node->value.blist.items = count ? malloc(count * sizeof(BNode*)) : NULL;
+        if(count && !node->value.blist.items) goto fail;
+
+        size_t key, value;
+        while(btape_iter_next(&iter, &key, &value)) {
+            BNode* item = btape_to_node(tape, value);
+            if(!item) goto fail;
+            node->value.blist.items[node->value.blist.len++] = item;
+        }
+        return node;
+    }
+
+    node->value.bdict.keys = count ? malloc(count * sizeof(BString)) : NULL;
+    node->value.bdict.values = count ? malloc(count * sizeof(BNode*)) : NULL;
+    if(count && (!node->value.bdict.keys || !node->value.bdict.values)) goto fail;
+
+    size_t key, value;
+    while(btape_iter_next(&iter, &key, &value)) {
+        BNode* child = btape_to_node(tape, value);
+        if(!child) goto fail;
+
+        const BTapeEntry* k = &tape->entries[key];
+        BDict* dict = &node->value.bdict;
+        dict->keys[dict->len] = (BString){
+            .pre_delim_len = k->prefix,
+            .post_delim_len = (uint32_t)k->data.len,
+            .data = (char*)btape_string(tape, key, NULL),
+        };
+        dict->values[dict->len++] = child;
+    }
+    bencode_index_dict(node);
+    return node;
+
+fail:
+    bencode_free_node(node);
+    return NULL;
+}
+
+#pragma endregion Access
+
+#pragma region Public
+
+int btape_parse(BTape* tape, const char* data, size_t len, size_t* consumed) {
+    if(!tape || !data) return -1;
+
+    tape->len = 0;
+    tape->data = data;
+    tape->data_len = len;
+
+    BTapeParser* p = malloc(sizeof(*p));
+    if(!p) return -1;
+    *p = (BTapeParser){ .tape = tape, .data = data, .len = len };
+
+    bool ok = btape_parse_document(p);
+    if(ok && !consumed && p->pos != len) ok = false;     // trailing garbage
+    if(ok && consumed) *consumed = p->pos;
+    free(p);
+
+    if(!ok) tape->len = 0;
+    return ok ? 0 : -1;
+}
+
+void btape_free(BTape* tape) {
+    if(!tape) return;
+    free(tape->entries);
+    *tape = (BTape){0};
+}
+
+#pragma endregion Public
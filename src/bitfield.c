@@ -0,0 +1,83 @@
+#include "bitfield.h"
+
+#include <string.h>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+/* Up to 8 bytes as a word whose most significant bit is the first bit of the first byte */
+static uint64_t bitfield_load(const uint8_t* p, size_t avail) {
+    uint64_t word = 0;
+    memcpy(&word, p, avail < sizeof(word) ? avail : sizeof(word));
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    word = __builtin_bswap64(word);
+#endif
+    return word;
+}
+
+/* Whether the 32 or 16 bytes at i of a and b share no bit, or false if the build has no vectors */
+static bool bitfield_vector_disjoint(const uint8_t* a, const uint8_t* b, size_t i) {
+#if defined(__AVX2__)
+    return _mm256_testz_si256(_mm256_loadu_si256((const __m256i*)(a + i)), _mm256_loadu_si256((const __m256i*)(b + i)));
+#elif defined(__SSE2__)
+    const __m128i both = _mm_and_si128(_mm_loadu_si128((const __m128i*)(a + i)), _mm_loadu_si128((const __m128i*)(b + i)));
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(both, _mm_setzero_si128())) == 0xFFFF;
+#else
+    (void)a; (void)b; (void)i;
+    return false;
+#endif
+}
+
+#if defined(__AVX2__)
+#define BITFIELD_VECTOR     32
+#elif defined(__SSE2__)
+#define BITFIELD_VECTOR     16
+#else
+#define BITFIELD_VECTOR     SIZE_MAX
+#endif
+
+size_t bitfield_count(const uint8_t* bits, size_t len) {
+    size_t count = 0;
+    size_t i = 0;
+    for(; i + 8 <= len; i += 8) {
+        uint64_t word;
+        memcpy(&word, bits + i, sizeof(word));
+        count += (size_t)__builtin_popcountll(word);
+    }
+    for(; i < len; ++i) {
+        count += (size_t)__builtin_popcount(bits[i]);
+    }
+    return count;
+}
+
+bool bitfield_any_and(const uint8_t* a, const uint8_t* b, size_t len) {
+    size_t i = 0;
+    for(; len >= BITFIELD_VECTOR && i <= len - BITFIELD_VECTOR; i += BITFIELD_VECTOR) {
+        if(!bitfield_vector_disjoint(a, b, i)) return true;
+    }
+    for(; i < len; i += 8) {
+        if(bitfield_load(a + i, len - i) & bitfield_load(b + i, len - i)) return true;
+    }
+    return false;
+}
+
+size_t bitfield_next_and(const uint8_t* a, const uint8_t* b, size_t nbits, size_t from) {
+    if(from >= nbits) return nbits;
+
+    const size_t len = BITFIELD_BYTES(nbits);
+    size_t byte = from / 64 * 8;
+    uint64_t word = bitfield_load(a + byte, len - byte) & bitfield_load(b + byte, len - byte) & (~0ull >> (from % 64));
+    while(word == 0) {
+        byte += 8;
+        // skip stretches with nothing in common a vector at a time
+        while(len >= BITFIELD_VECTOR && byte <= len - BITFIELD_VECTOR && bitfield_vector_disjoint(a, b, byte)) {
+            byte += BITFIELD_VECTOR;
+        }
+        if(byte >= len) return nbits;
+        word = bitfield_load(a + byte, len - byte) & bitfield_load(b + byte, len - byte);
+    }
+
+    const size_t index = byte * 8 + (size_t)__builtin_clzll(word);
+    return index < nbits ? index : nbits;
+}
@@ -0,0 +1,519 @@
+#define _XOPEN_SOURCE 700    // realpath
+
+#include "create.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cryptography.h"
+#include "torrent.h"
+
+// piece buffers in the ring per thread, enough that neither side waits on the other's jitter
+#define CREATE_SLOTS_PER_THREAD     2
+#define CREATE_MAX_RING_BYTES       (256u * 1024 * 1024)
+
+typedef struct CreateFile {
+    char*       disk_path;
+    char*       rel_path;       // path below the shared directory, NULL for a single file
+    uint64_t    length;
+    uint64_t    offset;
+} CreateFile;
+
+typedef struct CreateFileList {
+    CreateFile* files;
+    size_t      len;
+    size_t      cap;
+} CreateFileList;
+
+typedef enum CreateSlotState {
+    CREATE_SLOT_FREE,
+    CREATE_SLOT_FILLING,
+    CREATE_SLOT_FILLED,
+} CreateSlotState;
+
+/**
+ * Piece p always goes through slot p % slot_count, and a slot is handed to the next piece
+ * (p + slot_count) only after p was hashed. Readers and hashers both claim pieces in
+ * ascending order, so the ring never holds more than slot_count pieces and every digest
+ * lands at its own index in pieces.
+ */
+typedef struct CreateJob {
+    const CreateFile*   files;
+    size_t              file_count;
+    uint64_t            total_length;
+    uint64_t            piece_length;
+    size_t              piece_count;
+    uint8_t*            pieces;
+
+    uint8_t*            ring;
+    size_t              slot_count;
+    CreateSlotState*    slot_state;
+    size_t*             slot_piece;     // piece the slot belongs to next
+    pthread_mutex_t     lock;
+    pthread_cond_t      changed;
+
+    atomic_size_t       next_read;
+    atomic_size_t       next_hash;
+    atomic_bool         failed;
+} CreateJob;
+
+#pragma region Files
+
+static void create_files_free(CreateFileList* list) {
+    for(size_t i = 0; i < list->len; ++i) {
+        free(list->files[i].disk_path);
+        free(list->files[i].rel_path);
+    }
+    free(list->files);
+}
+
+static char* create_join(const char* a, const char* b) {
+    size_t len = strlen(a) + strlen(b) + 2;
+    char* joined = malloc(len);
+    if(joined) snprintf(joined, len, "%s/%s", a, b);
+    return joined;
+}
+
+static bool create_add_file(CreateFileList* list, char* disk_path, char* rel_path, uint64_t length) {
+    if(list->len >= list->cap) {
+        size_t new_cap = list->cap == 0 ? 64 : list->cap * 2;
+        CreateFile* new_files = realloc(list->files, new_cap * sizeof(CreateFile));
+        if(!new_files) return false;
+        list->files = new_files;
+        list->cap = new_cap;
+    }
+    list->files[list->len++] = (CreateFile){ .disk_path = disk_path, .rel_path = rel_path, .length = length };
+    return true;
+}
+
+static int create_compare_names(const void* a, const void* b) {
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+/* A directory being walked, and the one it was reached from */
+typedef struct CreateDir {
+    dev_t                   dev;
+    ino_t                   ino;
+    const struct CreateDir* parent;
+} CreateDir;
+
+static bool create_dir_open(const CreateDir* dir, const struct stat* st) {
+    for(; dir; dir = dir->parent) {
+        if(dir->dev == st->st_dev && dir->ino == st->st_ino) return true;
+    }
+    return false;
+}
+
+/*
+ * Collect the regular files below dir in path order, following symlinks.
+ * Entries that cannot be stat'ed (dangling links, link loops) are skipped, and so is a
+ * directory that is already being walked higher up, which a link to a parent would be.
+ */
+static bool create_walk(CreateFileList* list, const char* dir, const char* rel, const CreateDir* self) {
+    DIR* d = opendir(dir);
+    if(!d) return false;
+
+    char** names = NULL;
+    size_t len = 0, cap = 0;
+    bool ok = true;
+
+    struct dirent* entry;
+    while(ok && (entry = readdir(d))) {
+        if(strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+        if(len >= cap) {
+            cap = cap == 0 ? 16 : cap * 2;
+            char** new_names = realloc(names, cap * sizeof(char*));
+            if(!new_names) {
+                ok = false;
+                break;
+            }
+            names = new_names;
+        }
+        names[len] = strdup(entry->d_name);
+        ok = names[len++] != NULL;
+    }
+    closedir(d);
+
+    if(ok) qsort(names, len, sizeof(char*), create_compare_names);
+
+    for(size_t i = 0; ok && i < len; ++i) {
+        char* disk_path = create_join(dir, names[i]);
+        char* rel_path = rel ? create_join(rel, names[i]) : strdup(names[i]);
+        struct stat st;
+        if(!disk_path || !rel_path) {
+            ok = false;
+        } else if(stat(disk_path, &st) != 0) {
+            // nothing to share behind it
+        } else if(S_ISDIR(st.st_mode)) {
+            const CreateDir child = { .dev = st.st_dev, .ino = st.st_ino, .parent = self };
+            if(!create_dir_open(self, &st)) ok = create_walk(list, disk_path, rel_path, &child);
+        } else if(S_ISREG(st.st_mode)) {
+            ok = create_add_file(list, disk_path, rel_path, (uint64_t)st.st_size);
+            if(ok) disk_path = rel_path = NULL;    // owned by the list now
+        }
+        free(disk_path);
+        free(rel_path);
+    }
+
+    for(size_t i = 0; i < len; ++i) free(names[i]);
+    free(names);
+    return ok;
+}
+
+/*
+ * Name of the torrent: the last component of path as given, so a symlink keeps its own
+ * name. Paths like "." or "/" have none, those take the resolved directory's name.
+ */
+static char* create_name(const char* path, const char* resolved) {
+    size_t end = strlen(path);
+    while(end > 0 && path[end - 1] == '/') end--;
+    size_t start = end;
+    while(start > 0 && path[start - 1] != '/') start--;
+
+    const size_t len = end - start;
+    if(len == 0 || (len == 1 && path[start] == '.') || (len == 2 && strncmp(path + start, "..", 2) == 0)) {
+        const char* last = strrchr(resolved, '/') + 1;
+        return *last ? strdup(last) : NULL;
+    }
+    return strndup(path + start, len);
+}
+
+#pragma endregion Files
+
+#pragma region Pipeline
+
+typedef struct CreateReader {
+    size_t  file;   // file of the cached descriptor
+    int     fd;
+} CreateReader;
+
+/* Index of the file holding byte offset of the concatenated data */
+static size_t create_file_at(const CreateJob* job, uint64_t offset) {
+    size_t lo = 0;
+    size_t hi = job->file_count;
+    while(hi - lo > 1) {
+        size_t mid = lo + (hi - lo) / 2;
+        if(job->files[mid].offset <= offset) lo = mid;
+        else hi = mid;
+    }
+    return lo;
+}
+
+static bool create_read_range(const CreateJob* job, CreateReader* reader, uint64_t offset, uint8_t* buffer, uint64_t size) {
+    size_t file = create_file_at(job, offset);
+
+    while(size > 0) {
+        if(file >= job->file_count) return false;
+
+        const CreateFile* f = &job->files[file];
+        uint64_t in_file = offset - f->offset;
+        uint64_t take = f->length - in_file;
+        if(take > size) take = size;
+
+        if(take > 0) {
+            // pieces of one reader mostly stay within a file, keep its descriptor open
+            if(reader->fd < 0 || reader->file != file) {
+                if(reader->fd >= 0) close(reader->fd);
+                reader->fd = open(f->disk_path, O_RDONLY);
+                reader->file = file;
+                if(reader->fd < 0) return false;
+            }
+
+            uint64_t done = 0;
+            while(done < take) {
+                ssize_t n = pread(reader->fd, buffer + done, take - done, (off_t)(in_file + done));
+                if(n <= 0) return false;
+                done += (uint64_t)n;
+            }
+        }
+
+        buffer += take;
+        offset += take;
+        size -= take;
+        file++;
+    }
+    return true;
+}
+
+static uint64_t create_piece_size(const CreateJob* job, size_t piece) {
+    uint64_t start = (uint64_t)piece * job->piece_length;
+    uint64_t left = job->total_length - start;
+    return left < job->piece_length ? left : job->piece_length;
+}
+
+static void create_fail(CreateJob* job) {
+    pthread_mutex_lock(&job->lock);
+    atomic_store(&job->failed, true);
+    pthread_cond_broadcast(&job->changed);
+    pthread_mutex_unlock(&job->lock);
+}
+
+/* Wait until the slot of piece is in state; false if the job failed meanwhile */
+static bool create_wait_slot(CreateJob* job, size_t piece, CreateSlotState state) {
+    const size_t slot = piece % job->slot_count;
+
+    pthread_mutex_lock(&job->lock);
+    while(!atomic_load(&job->failed) && (job->slot_piece[slot] != piece || job->slot_state[slot] != state)) {
+        pthread_cond_wait(&job->changed, &job->lock);
+    }
+    const bool ok = !atomic_load(&job->failed);
+    pthread_mutex_unlock(&job->lock);
+    return ok;
+}
+
+static void create_set_slot(CreateJob* job, size_t slot, CreateSlotState state, size_t piece) {
+    pthread_mutex_lock(&job->lock);
+    job->slot_state[slot] = state;
+    job->slot_piece[slot] = piece;
+    pthread_cond_broadcast(&job->changed);
+    pthread_mutex_unlock(&job->lock);
+}
+
+static void* create_reader(void* arg) {
+    CreateJob* job = arg;
+    CreateReader reader = { .file = 0, .fd = -1 };
+
+    while(!atomic_load(&job->failed)) {
+        size_t piece = atomic_fetch_add(&job->next_read, 1);
+        if(piece >= job->piece_count) break;
+        if(!create_wait_slot(job, piece, CREATE_SLOT_FREE)) break;
+
+        const size_t slot = piece % job->slot_count;
+        uint8_t* buffer = job->ring + slot * job->piece_length;
+        if(!create_read_range(job, &reader, (uint64_t)piece * job->piece_length, buffer, create_piece_size(job, piece))) {
+            create_fail(job);
+            break;
+        }
+        create_set_slot(job, slot, CREATE_SLOT_FILLED, piece);
+    }
+
+    if(reader.fd >= 0) close(reader.fd);
+    return NULL;
+}
+
+static void* create_hasher(void* arg) {
+    CreateJob* job = arg;
+
+    while(!atomic_load(&job->failed)) {
+        size_t piece = atomic_fetch_add(&job->next_hash, 1);
+        if(piece >= job->piece_count) break;
+        if(!create_wait_slot(job, piece, CREATE_SLOT_FILLED)) break;
+
+        const size_t slot = piece % job->slot_count;
+        sha1hash hash = sha1(job->ring + slot * job->piece_length, create_piece_size(job, piece));
+        memcpy(job->pieces + piece * TORRENT_HASH_LEN, hash.bytes, TORRENT_HASH_LEN);
+
+        create_set_slot(job, slot, CREATE_SLOT_FREE, piece + job->slot_count);
+    }
+    return NULL;
+}
+
+static bool create_hash_pieces(CreateJob* job, size_t readers, size_t hashers) {
+    size_t slots = (readers + hashers) * CREATE_SLOTS_PER_THREAD;
+    while(slots > 2 && slots * job->piece_length > CREATE_MAX_RING_BYTES) slots--;
+    if(slots > job->piece_count) slots = job->piece_count;
+
+    job->slot_count = slots;
+    job->ring = malloc(slots * job->piece_length);
+    job->slot_state = calloc(slots, sizeof(CreateSlotState));
+    job->slot_piece = malloc(slots * sizeof(size_t));
+    if(!job->ring || !job->slot_state || !job->slot_piece) return false;
+    for(size_t i = 0; i < slots; ++i) job->slot_piece[i] = i;
+
+    pthread_mutex_init(&job->lock, NULL);
+    pthread_cond_init(&job->changed, NULL);
+    atomic_init(&job->next_read, 0);
+    atomic_init(&job->next_hash, 0);
+    atomic_init(&job->failed, false);
+
+    pthread_t* threads = malloc((readers + hashers) * sizeof(pthread_t));
+    size_t started_readers = 0, started_hashers = 0;
+    if(threads) {
+        for(; started_readers < readers; ++started_readers) {
+            if(pthread_create(&threads[started_readers], NULL, create_reader, job) != 0) break;
+        }
+        for(; started_hashers < hashers; ++started_hashers) {
+            if(pthread_create(&threads[started_readers + started_hashers], NULL, create_hasher, job) != 0) break;
+        }
+    }
+    // the pipeline cannot make progress without both sides
+    if(started_readers == 0 || started_hashers == 0) create_fail(job);
+
+    for(size_t i = 0; i < started_readers + started_hashers; ++i) pthread_join(threads[i], NULL);
+    free(threads);
+
+    pthread_mutex_destroy(&job->lock);
+    pthread_cond_destroy(&job->changed);
+    return !atomic_load(&job->failed);
+}
+
+#pragma endregion Pipeline
+
+#pragma region Metainfo
+
+static bool create_set_string(BNode* dict, const char* key, const char* data, size_t len) {
+    BNode* value = bencode_new_string(data, len);
+    if(value && bencode_dict_set(dict, key, value)) return true;
+    bencode_free_node(value);
+    return false;
+}
+
+static bool create_set_int(BNode* dict, const char* key, long long number) {
+    BNode* value = bencode_new_int(number);
+    if(value && bencode_dict_set(dict, key, value)) return true;
+    bencode_free_node(value);
+    return false;
+}
+
+static BNode* create_file_entry(const CreateFile* file) {
+    BNode* entry = bencode_new_dict();
+    BNode* path = bencode_new_list();
+    if(!entry || !path || !create_set_int(entry, "length", (long long)file->length)) goto fail;
+
+    const char* component = file->rel_path;
+    while(1) {
+        const char* slash = strchr(component, '/');
+        size_t len = slash ? (size_t)(slash - component) : strlen(component);
+
+        BNode* item = bencode_new_string(component, len);
+        if(!bencode_list_append(path, item)) {
+            bencode_free_node(item);
+            goto fail;
+        }
+        if(!slash) break;
+        component = slash + 1;
+    }
+
+    if(!bencode_dict_set(entry, "path", path)) goto fail;
+    return entry;
+
+fail:
+    bencode_free_node(path);
+    bencode_free_node(entry);
+    return NULL;
+}
+
+static BNode* create_info_dict(const CreateJob* job, const char* name, bool multi_file) {
+    BNode* info = bencode_new_dict();
+    if(!info) return NULL;
+
+    bool ok = create_set_string(info, "name", name, strlen(name)) &&
+              create_set_int(info, "piece length", (long long)job->piece_length) &&
+              create_set_string(info, "pieces", (const char*)job->pieces, job->piece_count * TORRENT_HASH_LEN);
+
+    if(ok && multi_file) {
+        BNode* files = bencode_new_list();
+        ok = files && bencode_dict_set(info, "files", files);
+        if(!ok) bencode_free_node(files);
+
+        for(size_t i = 0; ok && i < job->file_count; ++i) {
+            BNode* entry = create_file_entry(&job->files[i]);
+            ok = bencode_list_append(files, entry);
+            if(!ok) bencode_free_node(entry);
+        }
+    } else if(ok) {
+        ok = create_set_int(info, "length", (long long)job->total_length);
+    }
+
+    if(ok) return info;
+    bencode_free_node(info);
+    return NULL;
+}
+
+#pragma endregion Metainfo
+
+#pragma region Public
+
+uint64_t torrent_auto_piece_length(uint64_t total_length) {
+    uint64_t piece_length = CREATE_MIN_PIECE_LENGTH;
+    while(piece_length < CREATE_MAX_PIECE_LENGTH && total_length / piece_length > CREATE_TARGET_PIECES) {
+        piece_length *= 2;
+    }
+    return piece_length;
+}
+
+BNode* torrent_create(const char* path, const CreateOptions* opts) {
+    const CreateOptions defaults = {0};
+    if(!opts) opts = &defaults;
+
+    char* resolved = realpath(path, NULL);
+    if(!resolved) return NULL;
+
+    BNode* root = NULL;
+    CreateFileList list = {0};
+    CreateJob job = {0};
+    struct stat st;
+
+    char* name = create_name(path, resolved);
+    if(!name || stat(resolved, &st) != 0) goto cleanup;
+
+    const bool multi_file = S_ISDIR(st.st_mode);
+    if(multi_file) {
+        const CreateDir top = { .dev = st.st_dev, .ino = st.st_ino };
+        if(!create_walk(&list, resolved, NULL, &top)) goto cleanup;
+    } else if(S_ISREG(st.st_mode)) {
+        char* disk_path = strdup(resolved);
+        if(!disk_path || !create_add_file(&list, disk_path, NULL, (uint64_t)st.st_size)) {
+            free(disk_path);
+            goto cleanup;
+        }
+    } else {
+        goto cleanup;
+    }
+
+    for(size_t i = 0; i < list.len; ++i) {
+        list.files[i].offset = job.total_length;
+        job.total_length += list.files[i].length;
+    }
+    if(job.total_length == 0 || job.total_length > (uint64_t)LLONG_MAX) goto cleanup;
+
+    job.files = list.files;
+    job.file_count = list.len;
+    job.piece_length = opts->piece_length ? opts->piece_length : torrent_auto_piece_length(job.total_length);
+    if((job.piece_length & (job.piece_length - 1)) != 0) goto cleanup;
+    job.piece_count = (size_t)((job.total_length + job.piece_length - 1) / job.piece_length);
+    job.pieces = malloc(job.piece_count * TORRENT_HASH_LEN);
+    if(!job.pieces) goto cleanup;
+
+    size_t readers = opts->readers ? opts->readers : 2;
+    size_t hashers = opts->hashers;
+    if(hashers == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        hashers = cpus > 0 ? (size_t)cpus : 1;
+    }
+    if(!create_hash_pieces(&job, readers, hashers)) goto cleanup;
+
+    root = bencode_new_dict();
+    BNode* info = root ? create_info_dict(&job, name, multi_file) : NULL;
+    if(!info || !bencode_dict_set(root, "info", info)) {
+        bencode_free_node(info);
+        bencode_free_node(root);
+        root = NULL;
+        goto cleanup;
+    }
+    if(opts->announce && !create_set_string(root, "announce", opts->announce, strlen(opts->announce))) {
+        bencode_free_node(root);
+        root = NULL;
+    }
+
+cleanup:
+    free(job.ring);
+    free(job.slot_state);
+    free(job.slot_piece);
+    free(job.pieces);
+    create_files_free(&list);
+    free(name);
+    free(resolved);
+    return root;
+}
+
+#pragma endregion Public
@@ -1,10 +1,13 @@
 #include "cryptography.h"
+#include "sha1_backend.h"
+#include "stats.h"
 
+#include <stdio.h>
 #include <stdint.h>
-#include <assert.h>
 #include <stdlib.h>
 #include <string.h>
 #include <limits.h>
+#include <stdatomic.h>
 
 
 static uint32_t rotl32 (uint32_t value, unsigned int count) {
@@ -13,45 +16,20 @@ static uint32_t rotl32 (uint32_t value, unsigned int count) {
     return (value << count) | (value >> (-count & mask));
 }
 
-sha1hash sha1(const uint8_t* message, size_t message_len) {
-    uint32_t h0 = 0x67452301;
-    uint32_t h1 = 0xEFCDAB89;
-    uint32_t h2 = 0x98BADCFE;
-    uint32_t h3 = 0x10325476;
-    uint32_t h4 = 0xC3D2E1F0;
-    
-    uint64_t bitlen = message_len << 3;
-
-    /* Pre Processing */
-    size_t new_message_len = message_len;
-    
-    new_message_len +=1;                // account for the appended 0x80 byte
-    while(new_message_len % 64 != 56) { // leave room for the 64-bit message len that needs to be appended at the end
-        new_message_len++;
-    }
-    new_message_len += 8;               // account for the added 64-bit message len
-    
-    assert(new_message_len % 64 == 0);
-
-    uint8_t* new_message = calloc(new_message_len, sizeof(uint8_t));
-    if(!new_message) goto fail;
-
-    memcpy(new_message, message, message_len);                                  // copy the old message into the new buffer
-    new_message[message_len] = 0x80;                                            // add the 0x80 byte
-    for (int i = 0; i < 8; i++) {                                               // add the message len in bits to the end of the new buffer
-        new_message[new_message_len - 8 + i] = (bitlen >> (56 - i * 8)) & 0xFF;
-    }
+#pragma region Compression
 
-    /* Process the message in 512-bit chunks */
-    for(size_t i = 0; i < new_message_len; i += 64) {
+/* Reference implementation: process nblocks consecutive 512-bit chunks */
+static void sha1_compress_ref(uint32_t state[5], const uint8_t* blocks, size_t nblocks) {
+    for(size_t i = 0; i < nblocks; ++i) {
+        const uint8_t* block = blocks + i * 64;
         
         /* Break chunk into 16 32-bit big endian words */
         uint32_t words[80] = {0};
         for(size_t j = 0; j < 16; ++j) {
-            words[j] = (new_message[i + j*4 + 0] << 24) |
-                       (new_message[i + j*4 + 1] << 16) |
-                       (new_message[i + j*4 + 2] << 8)  |
-                       (new_message[i + j*4 + 3] << 0);
+            words[j] = ((uint32_t)block[j*4 + 0] << 24) |
+                       ((uint32_t)block[j*4 + 1] << 16) |
+                       ((uint32_t)block[j*4 + 2] << 8)  |
+                       ((uint32_t)block[j*4 + 3] << 0);
         }
 
         /* Extend the sixteen 32-bit words into eighty 32-bit words */
@@ -60,29 +38,29 @@ sha1hash sha1(const uint8_t* message, size_t message_len) {
         }
 
         /* Initialize hash values for this chunk */
-        uint32_t a = h0;
-        uint32_t b = h1;
-        uint32_t c = h2;
-        uint32_t d = h3;
-        uint32_t e = h4;
+        uint32_t a = state[0];
+        uint32_t b = state[1];
+        uint32_t c = state[2];
+        uint32_t d = state[3];
+        uint32_t e = state[4];
 
         /* Main Loop */
         for(size_t j = 0; j < 80; ++j) {
             uint32_t f, k = 0;
             
-            if(j >= 0 && j <= 19) {
+            if(j <= 19) {
                 f = (b & c) | ((~b) & d);
                 k = 0x5A827999;
             } 
-            else if(j >= 20 && j <= 39) {
+            else if(j <= 39) {
                 f = b ^ c ^ d;
                 k = 0x6ED9EBA1;
             }
-            else if(j >= 40 && j <= 59) {
+            else if(j <= 59) {
                 f = (b & c) | (b & d) | (c & d); 
                 k = 0x8F1BBCDC;
             }
-            else if(j >= 60 && j <= 79) {
+            else {
                 f = b ^ c ^ d;
                 k = 0xCA62C1D6;
             }
@@ -95,27 +73,223 @@ sha1hash sha1(const uint8_t* message, size_t message_len) {
             a = temp;
         }
 
-        h0 = h0 + a;
-        h1 = h1 + b; 
-        h2 = h2 + c;
-        h3 = h3 + d;
-        h4 = h4 + e;
+        state[0] += a;
+        state[1] += b; 
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
     }
+}
+
+#define SHA1_F1(b, c, d) ((d) ^ ((b) & ((c) ^ (d))))
+#define SHA1_F2(b, c, d) ((b) ^ (c) ^ (d))
+#define SHA1_F3(b, c, d) (((b) & (c)) | ((d) & ((b) | (c))))
+
+/* Message schedule kept in a 16-word ring: W[t-3], W[t-8], W[t-14], W[t-16] */
+#define SHA1_W(t) (t < 16 ? w[t] : \
+    (w[(t) & 15] = rotl32(w[((t) + 13) & 15] ^ w[((t) + 8) & 15] ^ w[((t) + 2) & 15] ^ w[(t) & 15], 1)))
+
+#define SHA1_ROUND(a, b, c, d, e, F, k, t) \
+    e += rotl32(a, 5) + F(b, c, d) + k + SHA1_W(t); \
+    b = rotl32(b, 30);
+
+/* Five rounds rotate the variables back into place, so no per-round shuffling is needed */
+#define SHA1_ROUND5(F, k, t) \
+    SHA1_ROUND(a, b, c, d, e, F, k, (t) + 0) \
+    SHA1_ROUND(e, a, b, c, d, F, k, (t) + 1) \
+    SHA1_ROUND(d, e, a, b, c, F, k, (t) + 2) \
+    SHA1_ROUND(c, d, e, a, b, F, k, (t) + 3) \
+    SHA1_ROUND(b, c, d, e, a, F, k, (t) + 4)
+
+/* Fully unrolled scalar implementation without per-round branches or an 80-word schedule */
+static void sha1_compress_unrolled(uint32_t state[5], const uint8_t* blocks, size_t nblocks) {
+    for(size_t i = 0; i < nblocks; ++i) {
+        const uint8_t* block = blocks + i * 64;
+
+        uint32_t w[16];
+        for(size_t j = 0; j < 16; ++j) {
+            w[j] = ((uint32_t)block[j*4 + 0] << 24) |
+                   ((uint32_t)block[j*4 + 1] << 16) |
+                   ((uint32_t)block[j*4 + 2] << 8)  |
+                   ((uint32_t)block[j*4 + 3] << 0);
+        }
+
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3], e = state[4];
+
+        SHA1_ROUND5(SHA1_F1, 0x5A827999, 0)  SHA1_ROUND5(SHA1_F1, 0x5A827999, 5)
+        SHA1_ROUND5(SHA1_F1, 0x5A827999, 10) SHA1_ROUND5(SHA1_F1, 0x5A827999, 15)
+        SHA1_ROUND5(SHA1_F2, 0x6ED9EBA1, 20) SHA1_ROUND5(SHA1_F2, 0x6ED9EBA1, 25)
+        SHA1_ROUND5(SHA1_F2, 0x6ED9EBA1, 30) SHA1_ROUND5(SHA1_F2, 0x6ED9EBA1, 35)
+        SHA1_ROUND5(SHA1_F3, 0x8F1BBCDC, 40) SHA1_ROUND5(SHA1_F3, 0x8F1BBCDC, 45)
+        SHA1_ROUND5(SHA1_F3, 0x8F1BBCDC, 50) SHA1_ROUND5(SHA1_F3, 0x8F1BBCDC, 55)
+        SHA1_ROUND5(SHA1_F2, 0xCA62C1D6, 60) SHA1_ROUND5(SHA1_F2, 0xCA62C1D6, 65)
+        SHA1_ROUND5(SHA1_F2, 0xCA62C1D6, 70) SHA1_ROUND5(SHA1_F2, 0xCA62C1D6, 75)
+
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+    }
+}
+
+#pragma endregion Compression
+
+#pragma region Dispatch
+
+static bool sha1_always_supported(void) {
+    return true;
+}
+
+static const sha1_backend SHA1_BACKENDS[] = {
+#if defined(SHA1_HAVE_X86)
+    { "shani",      sha1_compress_shani,        sha1_cpu_has_shani },
+    { "avx2",       sha1_compress_avx2,         sha1_cpu_has_avx2 },
+    { "ssse3",      sha1_compress_ssse3,        sha1_cpu_has_ssse3 },
+#endif
+    { "unrolled",   sha1_compress_unrolled,     sha1_always_supported },
+    { "reference",  sha1_compress_ref,          sha1_always_supported },
+};
+
+#define SHA1_BACKEND_COUNT (sizeof(SHA1_BACKENDS) / sizeof(SHA1_BACKENDS[0]))
+
+static _Atomic(const sha1_backend*) sha1_backend_active = NULL;
+
+const sha1_backend* sha1_backends(size_t* count) {
+    *count = SHA1_BACKEND_COUNT;
+    return SHA1_BACKENDS;
+}
+
+/* Run a backend over a few blocks of patterned data and compare it against the reference */
+static bool sha1_backend_matches_reference(const sha1_backend* backend) {
+    uint8_t blocks[5 * 64];
+    for(size_t i = 0; i < sizeof(blocks); ++i) {
+        blocks[i] = (uint8_t)(i * 131 + (i >> 3));
+    }
+
+    for(size_t nblocks = 1; nblocks <= 5; ++nblocks) {
+        uint32_t expected[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+        uint32_t actual[5];
+        memcpy(actual, expected, sizeof(actual));
+
+        sha1_compress_ref(expected, blocks, nblocks);
+        backend->compress(actual, blocks, nblocks);
+        if(memcmp(expected, actual, sizeof(actual)) != 0) return false;
+    }
+    return true;
+}
+
+static bool sha1_backend_usable(const sha1_backend* backend) {
+    return backend->supported() && sha1_backend_matches_reference(backend);
+}
+
+bool sha1_select_backend(const char* name) {
+    for(size_t i = 0; i < SHA1_BACKEND_COUNT; ++i) {
+        if(strcmp(SHA1_BACKENDS[i].name, name) != 0) continue;
+        if(!sha1_backend_usable(&SHA1_BACKENDS[i])) return false;
+
+        atomic_store(&sha1_backend_active, &SHA1_BACKENDS[i]);
+        return true;
+    }
+    return false;
+}
+
+const sha1_backend* sha1_active_backend(void) {
+    const sha1_backend* backend = atomic_load_explicit(&sha1_backend_active, memory_order_acquire);
+    if(backend) return backend;
+
+    // concurrent first calls may both probe, they agree on the result
+    const char* forced = getenv("CTORRENT_SHA1");
+    if(forced && sha1_select_backend(forced)) return atomic_load(&sha1_backend_active);
+
+    for(size_t i = 0; i < SHA1_BACKEND_COUNT; ++i) {
+        if(!sha1_backend_usable(&SHA1_BACKENDS[i])) continue;
+
+        atomic_store(&sha1_backend_active, &SHA1_BACKENDS[i]);
+        return &SHA1_BACKENDS[i];
+    }
+    return &SHA1_BACKENDS[SHA1_BACKEND_COUNT - 1];
+}
+
+static void sha1_compress(uint32_t state[5], const uint8_t* blocks, size_t nblocks) {
+    sha1_active_backend()->compress(state, blocks, nblocks);
+}
+
+#pragma endregion Dispatch
+
+void sha1_init(sha1_ctx* ctx) {
+    ctx->state[0] = 0x67452301;
+    ctx->state[1] = 0xEFCDAB89;
+    ctx->state[2] = 0x98BADCFE;
+    ctx->state[3] = 0x10325476;
+    ctx->state[4] = 0xC3D2E1F0;
+    ctx->length = 0;
+    ctx->block_len = 0;
+}
+
+void sha1_update(sha1_ctx* ctx, const uint8_t* data, size_t len) {
+    ctx->length += len;
+    STATS_ADD(STAT_SHA1_BYTES, len);
+
+    /* Top up a partially filled block first */
+    if(ctx->block_len > 0) {
+        size_t take = 64 - ctx->block_len;
+        if(take > len) take = len;
+        memcpy(ctx->block + ctx->block_len, data, take);
+        ctx->block_len += take;
+        data += take;
+        len -= take;
+
+        if(ctx->block_len < 64) return;
+        sha1_compress(ctx->state, ctx->block, 1);
+        ctx->block_len = 0;
+    }
+
+    /* Hash whole blocks straight from the caller's buffer */
+    size_t nblocks = len / 64;
+    if(nblocks > 0) {
+        sha1_compress(ctx->state, data, nblocks);
+        data += nblocks * 64;
+        len -= nblocks * 64;
+    }
+
+    memcpy(ctx->block, data, len);
+    ctx->block_len = len;
+}
+
+sha1hash sha1_final(sha1_ctx* ctx) {
+    const uint64_t bitlen = ctx->length << 3;
+
+    /* Pad only the last block: 0x80, zeros, then the 64-bit message length */
+    uint8_t tail[128] = {0};
+    memcpy(tail, ctx->block, ctx->block_len);
+    tail[ctx->block_len] = 0x80;
+
+    size_t tail_len = ctx->block_len + 1 + 8 <= 64 ? 64 : 128;
+    for (int i = 0; i < 8; i++) {
+        tail[tail_len - 8 + i] = (bitlen >> (56 - i * 8)) & 0xFF;
+    }
+    sha1_compress(ctx->state, tail, tail_len / 64);
 
     /* Produce the final hash value */
     sha1hash result;
-    for(int i = 0; i < 4; i++) {
-        result.bytes[0 + i]  = (h0 >> (24 - i * 8)) & 0xFF;
-        result.bytes[4 + i]  = (h1 >> (24 - i * 8)) & 0xFF;
-        result.bytes[8 + i]  = (h2 >> (24 - i * 8)) & 0xFF;
-        result.bytes[12 + i] = (h3 >> (24 - i * 8)) & 0xFF;
-        result.bytes[16 + i] = (h4 >> (24 - i * 8)) & 0xFF;
+    for(int i = 0; i < 5; i++) {
+        for(int j = 0; j < 4; j++) {
+            result.bytes[i*4 + j] = (ctx->state[i] >> (24 - j * 8)) & 0xFF;
+        }
     }
-    free(new_message);
     return result;
-fail:
-    free(new_message);
-    return (sha1hash){.bytes = {0}};
+}
+
+sha1hash sha1(const uint8_t* message, size_t message_len) {
+    STATS_TIMER_START(timer);
+    sha1_ctx ctx;
+    sha1_init(&ctx);
+    sha1_update(&ctx, message, message_len);
+    const sha1hash result = sha1_final(&ctx);
+    STATS_ADD(STAT_SHA1_CALLS, 1);
+    STATS_TIMER_STOP(timer, STAT_SHA1_NS);
+    return result;
 }
 
 void print_sha1(sha1hash hash) {
@@ -123,4 +297,4 @@ void print_sha1(sha1hash hash) {
         printf("%02x", (unsigned int)hash.bytes[i]);
     }
     printf("\n");
-}
\ No newline at end of file
+}
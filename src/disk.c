@@ -0,0 +1,582 @@
+#define _GNU_SOURCE     // preadv, pwritev
+
+#include "disk.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "stats.h"
+
+#define DISK_BATCH_PIECES   1024                    // queued writes one thread takes at once
+#define DISK_BATCH_BYTES    (32u * 1024 * 1024)
+#define DISK_IOV_MAX        256                     // buffers per preadv/pwritev call
+
+typedef enum DiskEntryState {
+    DISK_ENTRY_LOADING,     // being read by an I/O thread
+    DISK_ENTRY_CLEAN,       // matches the disk, on the LRU list
+    DISK_ENTRY_DIRTY,       // queued for writing
+    DISK_ENTRY_WRITING,
+    DISK_ENTRY_FAILED,      // could not be loaded, reported by the next disk_read
+} DiskEntryState;
+
+/* A piece in memory: cached, or on its way to or from the disk */
+typedef struct DiskEntry {
+    size_t              piece;
+    uint64_t            offset;     // in the concatenated torrent data
+    size_t              size;
+    DiskEntryState      state;
+    uint64_t            seq;        // order of disk_write_piece calls
+    uint8_t*            data;
+    struct DiskEntry*   prev;       // on the LRU list while clean, otherwise on the list of its state
+    struct DiskEntry*   next;
+} DiskEntry;
+
+typedef struct DiskList {
+    DiskEntry*  head;
+    DiskEntry*  tail;
+} DiskList;
+
+typedef struct DiskFile {
+    int         fd;
+    size_t      users;          // transfers using fd right now
+    bool        referenced;     // used since the eviction clock last passed
+} DiskFile;
+
+struct Disk {
+    const TorrentInfo*  info;
+    DiskOptions         opts;
+    char*               root;
+    int                 event_fd;
+    pthread_t*          threads;
+    size_t              thread_count;
+
+    pthread_mutex_t     files_lock;
+    DiskFile*           files;
+    size_t*             open;           // indices of the open files
+    size_t              open_count;
+    size_t              clock;
+
+    pthread_mutex_t     lock;           // everything below
+    pthread_cond_t      work;           // queued writes or reads, or stop
+    pthread_cond_t      done;           // an entry finished writing or loading
+    DiskEntry**         entries;        // by piece, NULL if the piece is not in memory
+    DiskList            lru;            // clean entries, most recently used first
+    DiskList            writes;
+    DiskList            writing;        // taken by a thread, in queue order like writes
+    DiskList            reads;
+    uint64_t            submitted;      // writes queued so far
+    uint64_t            cached;         // bytes of clean and loading entries
+    uint64_t            queued;         // bytes of dirty and writing entries
+    bool                failed;         // a write failed since the last flush
+    bool                stop;
+    DiskStats           stats;
+};
+
+#pragma region Entries
+
+static void disk_list_push(DiskList* list, DiskEntry* entry, bool front) {
+    entry->prev = front ? NULL : list->tail;
+    entry->next = front ? list->head : NULL;
+    if(entry->prev) entry->prev->next = entry;
+    else list->head = entry;
+    if(entry->next) entry->next->prev = entry;
+    else list->tail = entry;
+}
+
+static void disk_list_remove(DiskList* list, DiskEntry* entry) {
+    if(entry->prev) entry->prev->next = entry->next;
+    else list->head = entry->next;
+    if(entry->next) entry->next->prev = entry->prev;
+    else list->tail = entry->prev;
+}
+
+static DiskEntry* disk_entry_new(const Disk* disk, size_t piece) {
+    DiskEntry* entry = calloc(1, sizeof(*entry));
+    if(!entry) return NULL;
+
+    entry->piece = piece;
+    entry->offset = (uint64_t)piece * disk->info->piece_length;
+    entry->size = (size_t)torrent_piece_size(disk->info, piece);
+    entry->data = malloc(entry->size);
+    if(!entry->data) {
+        free(entry);
+        return NULL;
+    }
+    return entry;
+}
+
+static void disk_entry_free(DiskEntry* entry) {
+    free(entry->data);
+    free(entry);
+}
+
+/* Drop least recently used pieces beyond the cache size, but never the most recent one */
+static void disk_evict(Disk* disk) {
+    while(disk->cached > disk->opts.cache_size && disk->lru.tail && disk->lru.tail != disk->lru.head) {
+        DiskEntry* entry = disk->lru.tail;
+        disk_list_remove(&disk->lru, entry);
+        disk->entries[entry->piece] = NULL;
+        disk->cached -= entry->size;
+        disk_entry_free(entry);
+    }
+}
+
+static int disk_compare_offset(const void* a, const void* b) {
+    const DiskEntry* x = *(DiskEntry* const*)a;
+    const DiskEntry* y = *(DiskEntry* const*)b;
+    return (x->offset > y->offset) - (x->offset < y->offset);
+}
+
+#pragma endregion Entries
+
+#pragma region Files
+
+static void disk_make_parents(char* path) {
+    for(char* slash = strchr(path + 1, '/'); slash; slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        mkdir(path, 0755);
+        *slash = '/';
+    }
+}
+
+static int disk_open(const Disk* disk, size_t index) {
+    const size_t len = strlen(disk->root) + strlen(disk->info->files[index].path) + 2;
+    char* path = malloc(len);
+    if(!path) return -1;
+    snprintf(path, len, "%s/%s", disk->root, disk->info->files[index].path);
+
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if(fd < 0 && errno == ENOENT) {
+        disk_make_parents(path);
+        fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    }
+    free(path);
+    return fd;
+}
+
+/* Close an idle file; ones used since the clock last passed get a second chance */
+static void disk_close_idle(Disk* disk) {
+    for(size_t step = 0; step < 2 * disk->open_count; ++step) {
+        if(disk->clock >= disk->open_count) disk->clock = 0;
+
+        DiskFile* file = &disk->files[disk->open[disk->clock]];
+        if(file->users == 0 && !file->referenced) {
+            close(file->fd);
+            file->fd = -1;
+            disk->open[disk->clock] = disk->open[--disk->open_count];
+            return;
+        }
+        file->referenced = false;
+        disk->clock++;
+    }
+}
+
+static int disk_file_acquire(Disk* disk, size_t index) {
+    pthread_mutex_lock(&disk->files_lock);
+    DiskFile* file = &disk->files[index];
+    if(file->fd < 0) {
+        if(disk->open_count == disk->opts.max_open_files) disk_close_idle(disk);
+        if(disk->open_count < disk->opts.max_open_files) {
+            file->fd = disk_open(disk, index);
+            if(file->fd >= 0) disk->open[disk->open_count++] = index;
+        }
+    }
+    if(file->fd >= 0) {
+        file->users++;
+        file->referenced = true;
+    }
+    const int fd = file->fd;
+    pthread_mutex_unlock(&disk->files_lock);
+    return fd;
+}
+
+static void disk_file_release(Disk* disk, size_t index) {
+    pthread_mutex_lock(&disk->files_lock);
+    disk->files[index].users--;
+    pthread_mutex_unlock(&disk->files_lock);
+}
+
+/*
+ * Read or write the torrent data from offset on, held by consecutive buffers: one preadv
+ * or pwritev per file the range crosses (more if a file takes over DISK_IOV_MAX buffers
+ * or the kernel transfers less than asked).
+ */
+static bool disk_transfer(Disk* disk, bool writing, uint64_t offset, const struct iovec* bufs, size_t count, size_t* calls) {
+    const TorrentInfo* info = disk->info;
+    size_t buf = 0;
+    size_t pos = 0;     // bytes of bufs[buf] already transferred
+
+    for(size_t file = torrent_file_at(info, offset); buf < count; ++file) {
+        if(file >= info->file_count) return false;
+
+        const TorrentFile* f = &info->files[file];
+        uint64_t in_file = offset - f->offset;
+        uint64_t left = f->length - in_file;
+        if(left == 0) continue;
+
+        const int fd = disk_file_acquire(disk, file);
+        if(fd < 0) return false;
+
+        while(left > 0 && buf < count) {
+            struct iovec iov[DISK_IOV_MAX];
+            int n = 0;
+            uint64_t chunk = 0;
+            for(size_t b = buf, p = pos; n < DISK_IOV_MAX && b < count && chunk < left; ++b, p = 0) {
+                size_t take = bufs[b].iov_len - p;
+                if(take > left - chunk) take = (size_t)(left - chunk);
+                iov[n++] = (struct iovec){ .iov_base = (uint8_t*)bufs[b].iov_base + p, .iov_len = take };
+                chunk += take;
+            }
+
+            STATS_TIMER_START(timer);
+            const ssize_t done = writing ? pwritev(fd, iov, n, (off_t)in_file) : preadv(fd, iov, n, (off_t)in_file);
+            (*calls)++;
+            STATS_TIMER_STOP(timer, writing ? STAT_DISK_WRITE_NS : STAT_DISK_READ_NS);
+            if(done > 0) STATS_ADD(writing ? STAT_DISK_WRITE_BYTES : STAT_DISK_READ_BYTES, done);
+            if(done < 0 && errno == EINTR) continue;
+            if(done <= 0) {
+                disk_file_release(disk, file);
+                return false;
+            }
+
+            // step over what was transferred, which may end inside a buffer
+            for(size_t moved = (size_t)done; moved > 0;) {
+                const size_t take = bufs[buf].iov_len - pos < moved ? bufs[buf].iov_len - pos : moved;
+                pos += take;
+                moved -= take;
+                if(pos == bufs[buf].iov_len) {
+                    buf++;
+                    pos = 0;
+                }
+            }
+            in_file += (uint64_t)done;
+            left -= (uint64_t)done;
+            offset += (uint64_t)done;
+        }
+        disk_file_release(disk, file);
+    }
+    return true;
+}
+
+#pragma endregion Files
+
+#pragma region Workers
+
+/* Write what is queued, neighbours on disk in one go; called and returns with the lock held */
+static void disk_write_batch(Disk* disk, DiskEntry** batch, bool* ok) {
+    size_t count = 0;
+    uint64_t bytes = 0;
+    while(disk->writes.head && count < DISK_BATCH_PIECES && bytes < DISK_BATCH_BYTES) {
+        DiskEntry* entry = disk->writes.head;
+        disk_list_remove(&disk->writes, entry);
+        disk_list_push(&disk->writing, entry, false);
+        entry->state = DISK_ENTRY_WRITING;
+        batch[count++] = entry;
+        bytes += entry->size;
+    }
+    pthread_mutex_unlock(&disk->lock);
+
+    qsort(batch, count, sizeof(*batch), disk_compare_offset);
+    size_t calls = 0;
+    for(size_t first = 0, last; first < count; first = last) {
+        struct iovec bufs[DISK_BATCH_PIECES];
+        bufs[0] = (struct iovec){ .iov_base = batch[first]->data, .iov_len = batch[first]->size };
+        for(last = first + 1; last < count && batch[last - 1]->offset + batch[last - 1]->size == batch[last]->offset; ++last) {
+            bufs[last - first] = (struct iovec){ .iov_base = batch[last]->data, .iov_len = batch[last]->size };
+        }
+
+        const bool written = disk_transfer(disk, true, batch[first]->offset, bufs, last - first, &calls);
+        for(size_t i = first; i < last; ++i) ok[i] = written;
+    }
+
+    pthread_mutex_lock(&disk->lock);
+    disk->stats.write_calls += calls;
+    for(size_t i = 0; i < count; ++i) {
+        DiskEntry* entry = batch[i];
+        disk_list_remove(&disk->writing, entry);
+        disk->queued -= entry->size;
+        if(ok[i]) {
+            disk->stats.pieces_written++;
+            disk->stats.bytes_written += entry->size;
+            entry->state = DISK_ENTRY_CLEAN;
+            disk_list_push(&disk->lru, entry, true);
+            disk->cached += entry->size;
+        } else {
+            disk->stats.write_failures++;
+            disk->failed = true;
+            disk->entries[entry->piece] = NULL;
+            disk_entry_free(entry);
+        }
+    }
+    disk_evict(disk);
+    pthread_cond_broadcast(&disk->done);
+}
+
+/* Load the next requested piece; called and returns with the lock held */
+static void disk_load(Disk* disk) {
+    DiskEntry* entry = disk->reads.head;
+    disk_list_remove(&disk->reads, entry);
+    pthread_mutex_unlock(&disk->lock);
+
+    size_t calls = 0;
+    const struct iovec buf = { .iov_base = entry->data, .iov_len = entry->size };
+    const bool loaded = disk_transfer(disk, false, entry->offset, &buf, 1, &calls);
+
+    pthread_mutex_lock(&disk->lock);
+    disk->stats.read_calls += calls;
+    if(loaded) {
+        disk->stats.bytes_read += entry->size;
+        entry->state = DISK_ENTRY_CLEAN;
+        disk_list_push(&disk->lru, entry, true);
+    } else {
+        // keep the entry so the reader learns about it, without its buffer
+        entry->state = DISK_ENTRY_FAILED;
+        disk->cached -= entry->size;
+        free(entry->data);
+        entry->data = NULL;
+    }
+    disk_evict(disk);
+    pthread_cond_broadcast(&disk->done);
+
+    const uint64_t one = 1;
+    if(write(disk->event_fd, &one, sizeof(one)) < 0) {
+        // the counter is already non-zero, which is all a reader needs
+    }
+}
+
+static void* disk_worker(void* arg) {
+    Disk* disk = arg;
+    DiskEntry** batch = malloc(DISK_BATCH_PIECES * sizeof(DiskEntry*));
+    bool* ok = malloc(DISK_BATCH_PIECES * sizeof(bool));
+
+    pthread_mutex_lock(&disk->lock);
+    while(batch && ok) {
+        while(!disk->stop && !disk->writes.head && !disk->reads.head) pthread_cond_wait(&disk->work, &disk->lock);
+
+        // reads first: a peer waits for them, writes only hold memory
+        if(disk->reads.head) disk_load(disk);
+        else if(disk->writes.head) disk_write_batch(disk, batch, ok);
+        else break;     // stopping and nothing left to do
+    }
+    pthread_mutex_unlock(&disk->lock);
+
+    free(batch);
+    free(ok);
+    return NULL;
+}
+
+#pragma endregion Workers
+
+#pragma region Public
+
+Disk* disk_new(const TorrentInfo* info, const char* data_dir, const DiskOptions* opts) {
+    if(info->file_count == 0) return NULL;
+
+    Disk* disk = calloc(1, sizeof(*disk));
+    if(!disk) return NULL;
+
+    const DiskOptions defaults = {0};
+    disk->info = info;
+    disk->opts = opts ? *opts : defaults;
+    if(disk->opts.threads == 0) disk->opts.threads = DISK_DEFAULT_THREADS;
+    if(disk->opts.cache_size == 0) disk->opts.cache_size = DISK_DEFAULT_CACHE;
+    if(disk->opts.max_queued == 0) disk->opts.max_queued = DISK_DEFAULT_QUEUED;
+    if(disk->opts.max_open_files == 0) disk->opts.max_open_files = DISK_DEFAULT_OPEN_FILES;
+    // every thread holds at most one file at a time
+    if(disk->opts.max_open_files < disk->opts.threads) disk->opts.max_open_files = disk->opts.threads;
+
+    pthread_mutex_init(&disk->files_lock, NULL);
+    pthread_mutex_init(&disk->lock, NULL);
+    pthread_cond_init(&disk->work, NULL);
+    pthread_cond_init(&disk->done, NULL);
+    disk->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    const char* name = info->multi_file ? info->name : NULL;
+    const size_t root_len = strlen(data_dir) + (name ? strlen(name) + 1 : 0) + 1;
+    disk->root = malloc(root_len);
+    if(disk->root) {
+        if(name) snprintf(disk->root, root_len, "%s/%s", data_dir, name);
+        else snprintf(disk->root, root_len, "%s", data_dir);
+    }
+
+    disk->files = malloc(info->file_count * sizeof(DiskFile));
+    disk->open = malloc(disk->opts.max_open_files * sizeof(size_t));
+    disk->entries = calloc(info->piece_count, sizeof(DiskEntry*));
+    disk->threads = malloc(disk->opts.threads * sizeof(pthread_t));
+    if(disk->event_fd < 0 || !disk->root || !disk->files || !disk->open || !disk->entries || !disk->threads) {
+        disk_free(disk);
+        return NULL;
+    }
+    for(size_t i = 0; i < info->file_count; ++i) {
+        disk->files[i] = (DiskFile){ .fd = -1 };
+        // no piece covers an empty file, create it up front
+        if(info->files[i].length == 0) {
+            const int fd = disk_open(disk, i);
+            if(fd >= 0) close(fd);
+        }
+    }
+
+    for(; disk->thread_count < disk->opts.threads; ++disk->thread_count) {
+        if(pthread_create(&disk->threads[disk->thread_count], NULL, disk_worker, disk) != 0) break;
+    }
+    if(disk->thread_count == 0) {
+        disk_free(disk);
+        return NULL;
+    }
+    return disk;
+}
+
+void disk_free(Disk* disk) {
+    if(!disk) return;
+
+    pthread_mutex_lock(&disk->lock);
+    disk->stop = true;
+    pthread_cond_broadcast(&disk->work);
+    pthread_mutex_unlock(&disk->lock);
+    for(size_t i = 0; i < disk->thread_count; ++i) {
+        pthread_join(disk->threads[i], NULL);
+    }
+
+    for(size_t i = 0; disk->entries && i < disk->info->piece_count; ++i) {
+        if(disk->entries[i]) disk_entry_free(disk->entries[i]);
+    }
+    for(size_t i = 0; disk->open && i < disk->open_count; ++i) {
+        close(disk->files[disk->open[i]].fd);
+    }
+    if(disk->event_fd >= 0) close(disk->event_fd);
+
+    pthread_mutex_destroy(&disk->files_lock);
+    pthread_mutex_destroy(&disk->lock);
+    pthread_cond_destroy(&disk->work);
+    pthread_cond_destroy(&disk->done);
+    free(disk->root);
+    free(disk->files);
+    free(disk->open);
+    free(disk->entries);
+    free(disk->threads);
+    free(disk);
+}
+
+bool disk_write_piece(Disk* disk, size_t piece, const uint8_t* data, size_t len) {
+    if(piece >= disk->info->piece_count || len != torrent_piece_size(disk->info, piece)) return false;
+
+    // copied outside the lock, the caller's buffer is free to go once this returns
+    DiskEntry* entry = disk_entry_new(disk, piece);
+    if(!entry) return false;
+    memcpy(entry->data, data, len);
+    entry->state = DISK_ENTRY_DIRTY;
+
+    pthread_mutex_lock(&disk->lock);
+    // wait for room in the queue, and for an earlier copy of the piece on its way to or from the disk
+    DiskEntry* old = disk->entries[piece];
+    while((disk->queued > 0 && disk->queued + len > disk->opts.max_queued) ||
+          (old && old->state != DISK_ENTRY_CLEAN && old->state != DISK_ENTRY_FAILED)) {
+        pthread_cond_wait(&disk->done, &disk->lock);
+        old = disk->entries[piece];
+    }
+    if(old) {
+        if(old->state == DISK_ENTRY_CLEAN) {
+            disk_list_remove(&disk->lru, old);
+            disk->cached -= old->size;
+        }
+        disk_entry_free(old);
+    }
+
+    entry->seq = ++disk->submitted;
+    disk->entries[piece] = entry;
+    disk->queued += len;
+    disk_list_push(&disk->writes, entry, false);
+    pthread_cond_signal(&disk->work);
+    pthread_mutex_unlock(&disk->lock);
+    return true;
+}
+
+/* Sequence number of the oldest write not done yet, UINT64_MAX if there is none */
+static uint64_t disk_oldest_write(const Disk* disk) {
+    uint64_t oldest = UINT64_MAX;
+    if(disk->writing.head) oldest = disk->writing.head->seq;
+    if(disk->writes.head && disk->writes.head->seq < oldest) oldest = disk->writes.head->seq;
+    return oldest;
+}
+
+bool disk_flush(Disk* disk) {
+    pthread_mutex_lock(&disk->lock);
+    // writes queued meanwhile are not waited for, so a busy download cannot hold this up
+    const uint64_t target = disk->submitted;
+    while(disk_oldest_write(disk) <= target) pthread_cond_wait(&disk->done, &disk->lock);
+    const bool ok = !disk->failed;
+    disk->failed = false;
+    pthread_mutex_unlock(&disk->lock);
+    return ok;
+}
+
+int disk_read(Disk* disk, size_t piece, uint64_t begin, size_t len, uint8_t* out) {
+    if(piece >= disk->info->piece_count || begin + len > torrent_piece_size(disk->info, piece)) return -1;
+
+    int status = 0;
+    pthread_mutex_lock(&disk->lock);
+    DiskEntry* entry = disk->entries[piece];
+    if(!entry) {
+        disk->stats.cache_misses++;
+        entry = disk_entry_new(disk, piece);
+        if(entry) {
+            entry->state = DISK_ENTRY_LOADING;
+            disk->entries[piece] = entry;
+            disk->cached += entry->size;
+            disk_list_push(&disk->reads, entry, false);
+            pthread_cond_signal(&disk->work);
+        } else {
+            status = -1;
+        }
+    } else if(entry->state == DISK_ENTRY_FAILED) {
+        disk->entries[piece] = NULL;
+        disk_entry_free(entry);
+        status = -1;
+    } else if(entry->state != DISK_ENTRY_LOADING) {
+        // pieces still queued for writing are served from their buffer too
+        if(entry->state == DISK_ENTRY_CLEAN) {
+            disk_list_remove(&disk->lru, entry);
+            disk_list_push(&disk->lru, entry, true);
+        }
+        memcpy(out, entry->data + begin, len);
+        disk->stats.cache_hits++;
+        status = 1;
+    }
+    pthread_mutex_unlock(&disk->lock);
+    return status;
+}
+
+int disk_event_fd(const Disk* disk) {
+    return disk->event_fd;
+}
+
+void disk_acknowledge(Disk* disk) {
+    uint64_t count;
+    if(read(disk->event_fd, &count, sizeof(count)) < 0) {
+        // nothing was signalled
+    }
+}
+
+void disk_get_stats(Disk* disk, DiskStats* stats) {
+    pthread_mutex_lock(&disk->lock);
+    *stats = disk->stats;
+    pthread_mutex_unlock(&disk->lock);
+}
+
+static bool disk_storage_write(void* user, size_t piece, const uint8_t* data, size_t len) {
+    return disk_write_piece(user, piece, data, len);
+}
+
+DownloadStorage disk_storage(Disk* disk) {
+    return (DownloadStorage){ .user = disk, .write_piece = disk_storage_write };
+}
+
+#pragma endregion Public
@@ -0,0 +1,556 @@
+#include "download.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "bitfield.h"
+#include "cryptography.h"
+#include "picker.h"
+
+#define DOWNLOAD_ENDGAME_BLOCKS     256     // outstanding blocks left when they start to be requested twice
+
+typedef enum DownloadBlockState {
+    DOWNLOAD_BLOCK_MISSING,
+    DOWNLOAD_BLOCK_REQUESTED,
+    DOWNLOAD_BLOCK_DUPLICATE,           // end game: requested from two peers
+    DOWNLOAD_BLOCK_RECEIVED,
+} DownloadBlockState;
+
+/* A piece being downloaded: its blocks are collected in data until all arrived */
+typedef struct DownloadPiece {
+    size_t      index;
+    size_t      size;
+    size_t      block_count;
+    size_t      received;
+    size_t      first_missing;      // no block before it is missing
+    size_t      slot;               // position in Download.active_list
+    uint8_t*    block_state;
+    uint8_t*    data;
+} DownloadPiece;
+
+typedef struct DownloadRequest {
+    uint32_t    piece;
+    uint32_t    block;
+} DownloadRequest;
+
+typedef struct DownloadPeer {
+    PeerConn*               conn;
+    uint8_t*                bitfield;
+    size_t                  have_count;     // bits set in bitfield
+    bool                    seed;           // has every piece, counted by the picker as a seed
+    bool                    choked;         // the peer is choking us
+    bool                    interested;     // we told the peer we are interested
+    DownloadRequest*        requests;       // outstanding, a block is requested from one peer at a time outside the end game
+    size_t                  request_count;
+    size_t                  current;        // piece the peer last got a block of, SIZE_MAX for none
+    struct DownloadPeer*    prev;
+    struct DownloadPeer*    next;
+} DownloadPeer;
+
+struct Download {
+    const TorrentInfo*  info;
+    DownloadOptions     opts;
+    uint8_t*            have;
+    size_t              have_len;
+    Picker*             picker;
+    DownloadPiece**     active;         // by piece index, NULL unless the piece is being downloaded
+    DownloadPiece**     active_list;
+    size_t              active_count;
+    size_t              missing;        // blocks of the active pieces nobody was asked for
+    size_t              requested;      // blocks of the active pieces exactly one peer was asked for
+    uint64_t            buffered;       // bytes of the active pieces
+    bool                starved;        // some peer wanted blocks but got none, see download_wake
+    DownloadPeer*       peers;
+    DownloadStats       stats;
+};
+
+#pragma region Pieces
+
+static size_t download_block_len(const DownloadPiece* piece, size_t block) {
+    const size_t begin = block * PEER_BLOCK_SIZE;
+    return piece->size - begin < PEER_BLOCK_SIZE ? piece->size - begin : PEER_BLOCK_SIZE;
+}
+
+static DownloadPiece* download_start_piece(Download* download, size_t index) {
+    DownloadPiece* piece = calloc(1, sizeof(*piece));
+    if(!piece) return NULL;
+
+    piece->index = index;
+    piece->size = (size_t)torrent_piece_size(download->info, index);
+    piece->block_count = (piece->size + PEER_BLOCK_SIZE - 1) / PEER_BLOCK_SIZE;
+    piece->block_state = calloc(piece->block_count, 1);
+    piece->data = malloc(piece->size);
+    if(!piece->block_state || !piece->data) {
+        free(piece->block_state);
+        free(piece->data);
+        free(piece);
+        return NULL;
+    }
+
+    piece->slot = download->active_count;
+    download->active_list[download->active_count++] = piece;
+    download->active[index] = piece;
+    download->missing += piece->block_count;
+    download->buffered += piece->size;
+    return piece;
+}
+
+static void download_drop_piece(Download* download, DownloadPiece* piece) {
+    DownloadPiece* last = download->active_list[--download->active_count];
+    download->active_list[piece->slot] = last;
+    last->slot = piece->slot;
+    download->active[piece->index] = NULL;
+    download->buffered -= piece->size;
+
+    free(piece->block_state);
+    free(piece->data);
+    free(piece);
+}
+
+/* Claim the first missing block of the piece */
+static bool download_take_block(Download* download, DownloadPiece* piece, size_t* block) {
+    while(piece->first_missing < piece->block_count &&
+          piece->block_state[piece->first_missing] != DOWNLOAD_BLOCK_MISSING) {
+        piece->first_missing++;
+    }
+    if(piece->first_missing == piece->block_count) return false;
+
+    *block = piece->first_missing++;
+    piece->block_state[*block] = DOWNLOAD_BLOCK_REQUESTED;
+    download->missing--;
+    download->requested++;
+    return true;
+}
+
+/* A request for the block was withdrawn, it is missing again unless another peer was asked too */
+static void download_return_block(Download* download, DownloadPiece* piece, size_t block) {
+    switch(piece->block_state[block]) {
+        case DOWNLOAD_BLOCK_REQUESTED:
+            piece->block_state[block] = DOWNLOAD_BLOCK_MISSING;
+            if(block < piece->first_missing) piece->first_missing = block;
+            download->requested--;
+            download->missing++;
+            break;
+        case DOWNLOAD_BLOCK_DUPLICATE:
+            piece->block_state[block] = DOWNLOAD_BLOCK_REQUESTED;
+            download->requested++;
+            break;
+        default:
+            break;
+    }
+}
+
+static size_t download_find_request(const DownloadPeer* peer, size_t piece, size_t begin) {
+    size_t i = 0;
+    while(i < peer->request_count &&
+          (peer->requests[i].piece != piece || peer->requests[i].block * PEER_BLOCK_SIZE != begin)) {
+        ++i;
+    }
+    return i;
+}
+
+/*
+ * Choose the next block to request from peer: more of the piece it is already on, then
+ * any piece in progress it has, then the piece the picker ranks first among those it has
+ * (rarest first), as long as the memory budget allows another piece.
+ */
+static DownloadPiece* download_pick(Download* download, DownloadPeer* peer, size_t* block) {
+    if(peer->current != SIZE_MAX) {
+        DownloadPiece* piece = download->active[peer->current];
+        if(piece && download_take_block(download, piece, block)) return piece;
+    }
+
+    // with many peers most of them ask while every active block is out, skip the scan then
+    for(size_t i = 0; download->missing > 0 && i < download->active_count; ++i) {
+        DownloadPiece* piece = download->active_list[i];
+        if(bitfield_get(peer->bitfield, piece->index) && download_take_block(download, piece, block)) {
+            peer->current = piece->index;
+            return piece;
+        }
+    }
+
+    const TorrentInfo* info = download->info;
+    if(download->active_count > 0 && download->buffered + info->piece_length > download->opts.max_buffered) return NULL;
+
+    const size_t index = picker_pick(download->picker, peer->seed ? NULL : peer->bitfield);
+    if(index == PICKER_NONE) return NULL;
+
+    DownloadPiece* piece = download_start_piece(download, index);
+    if(!piece || !download_take_block(download, piece, block)) return NULL;
+    picker_start(download->picker, index);
+    peer->current = index;
+    return piece;
+}
+
+/*
+ * End game: every wanted piece is active, none of their blocks is missing and only a few
+ * are still outstanding, so ask the peer for a block another peer is on. The first copy
+ * to arrive wins and the other request is cancelled; a block is asked from two peers at most.
+ */
+static DownloadPiece* download_pick_duplicate(Download* download, DownloadPeer* peer, size_t* block) {
+    if(!picker_endgame(download->picker) || download->requested > DOWNLOAD_ENDGAME_BLOCKS) return NULL;
+
+    for(size_t i = 0; download->requested > 0 && i < download->active_count; ++i) {
+        DownloadPiece* piece = download->active_list[i];
+        if(!bitfield_get(peer->bitfield, piece->index)) continue;
+
+        for(size_t j = 0; j < piece->block_count; ++j) {
+            if(piece->block_state[j] != DOWNLOAD_BLOCK_REQUESTED ||
+               download_find_request(peer, piece->index, j * PEER_BLOCK_SIZE) < peer->request_count) {
+                continue;
+            }
+            piece->block_state[j] = DOWNLOAD_BLOCK_DUPLICATE;
+            download->requested--;
+            *block = j;
+            return piece;
+        }
+    }
+    return NULL;
+}
+
+#pragma endregion Pieces
+
+#pragma region Peers
+
+/* Keep the peer's request pipeline full */
+static void download_fill(Download* download, DownloadPeer* peer) {
+    if(peer->choked || !peer->interested) return;
+
+    PeerRing* output = NULL;
+    while(peer->request_count < download->opts.pipeline) {
+        size_t block;
+        DownloadPiece* piece = download_pick(download, peer, &block);
+        if(!piece) piece = download_pick_duplicate(download, peer, &block);
+        if(!piece) {
+            download->starved = true;
+            return;
+        }
+
+        if(!output) output = peer_conn_output(peer->conn);
+        const uint32_t begin = (uint32_t)(block * PEER_BLOCK_SIZE);
+        if(!peer_write_request(output, PEER_MSG_REQUEST, (uint32_t)piece->index, begin, (uint32_t)download_block_len(piece, block))) {
+            download_return_block(download, piece, block);
+            return;
+        }
+        peer->requests[peer->request_count++] = (DownloadRequest){ .piece = (uint32_t)piece->index, .block = (uint32_t)block };
+    }
+}
+
+/* Give peers that ran dry another chance, after blocks or buffer budget were freed */
+static void download_wake(Download* download) {
+    if(!download->starved) return;
+
+    download->starved = false;
+    for(DownloadPeer* peer = download->peers; peer; peer = peer->next) {
+        if(peer->request_count < download->opts.pipeline) download_fill(download, peer);
+    }
+}
+
+/* Forget the peer's outstanding requests, a choke discards them on the peer's side too */
+static void download_release_requests(Download* download, DownloadPeer* peer) {
+    for(size_t i = 0; i < peer->request_count; ++i) {
+        DownloadPiece* piece = download->active[peer->requests[i].piece];
+        if(piece) download_return_block(download, piece, peer->requests[i].block);
+    }
+    peer->request_count = 0;
+}
+
+static void download_update_interest(Download* download, DownloadPeer* peer) {
+    if(peer->interested || !picker_interesting(download->picker, peer->seed ? NULL : peer->bitfield)) return;
+
+    peer_write_simple(peer_conn_output(peer->conn), PEER_MSG_INTERESTED);
+    peer->interested = true;
+}
+
+/* Once nothing wanted is left no peer is interesting */
+static void download_update_complete(Download* download) {
+    if(!download_complete(download)) return;
+
+    for(DownloadPeer* peer = download->peers; peer; peer = peer->next) {
+        if(!peer->interested) continue;
+        peer_write_simple(peer_conn_output(peer->conn), PEER_MSG_NOT_INTERESTED);
+        peer->interested = false;
+    }
+}
+
+/* A peer got one more piece; one that now has them all is counted as a seed instead */
+static void download_peer_have(Download* download, DownloadPeer* peer, size_t index) {
+    bitfield_set(peer->bitfield, index);
+    picker_add_have(download->picker, index);
+    if(++peer->have_count < download->info->piece_count) return;
+
+    picker_remove_bitfield(download->picker, peer->bitfield);
+    picker_add_seed(download->picker);
+    peer->seed = true;
+}
+
+/* The peer's bitfield message; only valid before anything else told us what it has */
+static bool download_peer_bitfield(Download* download, DownloadPeer* peer, const PeerMessage* msg) {
+    const size_t piece_count = download->info->piece_count;
+    if(msg->payload_len != download->have_len || peer->have_count > 0) return false;
+
+    uint8_t* dst = peer->bitfield;
+    for(int i = 0; i < msg->payload_count; ++i) {
+        memcpy(dst, msg->payload[i].iov_base, msg->payload[i].iov_len);
+        dst += msg->payload[i].iov_len;
+    }
+    // spare bits past the last piece have to be clear, ignore them if they are not
+    if(piece_count % 8) peer->bitfield[download->have_len - 1] &= (uint8_t)(0xFF00 >> (piece_count % 8));
+
+    peer->have_count = bitfield_count(peer->bitfield, download->have_len);
+    if(peer->have_count == piece_count) {
+        picker_add_seed(download->picker);
+        peer->seed = true;
+    } else {
+        picker_add_bitfield(download->picker, peer->bitfield);
+    }
+    return true;
+}
+
+static void download_finish_piece(Download* download, DownloadPiece* piece) {
+    const TorrentInfo* info = download->info;
+    const size_t index = piece->index;
+
+    const sha1hash hash = sha1(piece->data, piece->size);
+    bool good = memcmp(hash.bytes, info->pieces + index * TORRENT_HASH_LEN, TORRENT_HASH_LEN) == 0;
+    if(good && download->opts.storage.write_piece) {
+        good = download->opts.storage.write_piece(download->opts.storage.user, index, piece->data, piece->size);
+    }
+    if(!good) {
+        download->stats.hash_failures++;
+        memset(piece->block_state, DOWNLOAD_BLOCK_MISSING, piece->block_count);
+        download->missing += piece->block_count;
+        piece->received = 0;
+        piece->first_missing = 0;
+        download_wake(download);
+        return;
+    }
+
+    bitfield_set(download->have, index);
+    picker_done(download->picker, index);
+    download->stats.pieces_done++;
+    download_drop_piece(download, piece);
+
+    for(DownloadPeer* peer = download->peers; peer; peer = peer->next) {
+        if(!bitfield_get(peer->bitfield, index)) peer_write_have(peer_conn_output(peer->conn), (uint32_t)index);
+    }
+    download_update_complete(download);
+    download_wake(download);
+}
+
+/* The block came in from one of the two peers it was asked from, withdraw the other request */
+static void download_cancel_duplicate(Download* download, const DownloadPeer* except, const DownloadPiece* piece, size_t block) {
+    const size_t begin = block * PEER_BLOCK_SIZE;
+    for(DownloadPeer* peer = download->peers; peer; peer = peer->next) {
+        if(peer == except) continue;
+
+        const size_t i = download_find_request(peer, piece->index, begin);
+        if(i == peer->request_count) continue;
+
+        peer->requests[i] = peer->requests[--peer->request_count];
+        peer_write_request(peer_conn_output(peer->conn), PEER_MSG_CANCEL, (uint32_t)piece->index, (uint32_t)begin,
+                           (uint32_t)download_block_len(piece, block));
+        download_fill(download, peer);
+        return;
+    }
+}
+
+static PeerAction download_on_piece(Download* download, DownloadPeer* peer, const PeerMessage* msg) {
+    download->stats.bytes_received += msg->payload_len;
+
+    // blocks nobody asked this peer for (or that a choke or cancel withdrew) are dropped
+    const size_t i = download_find_request(peer, msg->index, msg->begin);
+    if(i == peer->request_count) return PEER_CONTINUE;
+
+    DownloadPiece* piece = download->active[msg->index];
+    const size_t block = peer->requests[i].block;
+    if(msg->payload_len != download_block_len(piece, block)) return PEER_DISCONNECT;
+    peer->requests[i] = peer->requests[--peer->request_count];
+
+    switch(piece->block_state[block]) {
+        case DOWNLOAD_BLOCK_REQUESTED:
+            download->requested--;
+            break;
+        case DOWNLOAD_BLOCK_DUPLICATE:
+            download_cancel_duplicate(download, peer, piece, block);
+            break;
+        default:
+            break;
+    }
+
+    // the one copy a block takes: from the input ring into its piece
+    uint8_t* dst = piece->data + msg->begin;
+    for(int j = 0; j < msg->payload_count; ++j) {
+        memcpy(dst, msg->payload[j].iov_base, msg->payload[j].iov_len);
+        dst += msg->payload[j].iov_len;
+    }
+    piece->block_state[block] = DOWNLOAD_BLOCK_RECEIVED;
+    if(++piece->received == piece->block_count) download_finish_piece(download, piece);
+
+    download_fill(download, peer);
+    return PEER_CONTINUE;
+}
+
+static bool download_on_connect(void* user, PeerConn* conn, const PeerHandshake* remote) {
+    (void)remote;
+    Download* download = user;
+    if(download_complete(download)) return false;
+
+    DownloadPeer* peer = calloc(1, sizeof(*peer));
+    if(!peer) return false;
+    peer->bitfield = calloc(download->have_len, 1);
+    peer->requests = malloc(download->opts.pipeline * sizeof(DownloadRequest));
+    if(!peer->bitfield || !peer->requests) {
+        free(peer->bitfield);
+        free(peer->requests);
+        free(peer);
+        return false;
+    }
+
+    peer->conn = conn;
+    peer->choked = true;
+    peer->current = SIZE_MAX;
+    peer->next = download->peers;
+    if(download->peers) download->peers->prev = peer;
+    download->peers = peer;
+    download->stats.peers++;
+    peer_conn_set_user(conn, peer);
+
+    if(download->stats.pieces_done > 0) peer_write_bitfield(peer_conn_output(conn), download->have, download->have_len);
+    return true;
+}
+
+static PeerAction download_on_message(void* user, PeerConn* conn, const PeerMessage* msg) {
+    Download* download = user;
+    DownloadPeer* peer = peer_conn_user(conn);
+    const size_t piece_count = download->info->piece_count;
+
+    switch(msg->type) {
+        case PEER_MSG_CHOKE:
+            peer->choked = true;
+            download_release_requests(download, peer);
+            download_wake(download);
+            break;
+        case PEER_MSG_UNCHOKE:
+            peer->choked = false;
+            download_fill(download, peer);
+            break;
+        case PEER_MSG_HAVE:
+            if(msg->index >= piece_count) return PEER_DISCONNECT;
+            if(bitfield_get(peer->bitfield, msg->index)) break;
+            download_peer_have(download, peer, msg->index);
+            if(picker_wanted(download->picker, msg->index)) download_update_interest(download, peer);
+            download_fill(download, peer);
+            break;
+        case PEER_MSG_BITFIELD:
+            if(!download_peer_bitfield(download, peer, msg)) return PEER_DISCONNECT;
+            download_update_interest(download, peer);
+            download_fill(download, peer);
+            break;
+        case PEER_MSG_PIECE:
+            if(msg->index >= piece_count) return PEER_DISCONNECT;
+            return download_on_piece(download, peer, msg);
+        default:
+            // requests are not served: this side only downloads
+            break;
+    }
+    return PEER_CONTINUE;
+}
+
+static void download_on_close(void* user, PeerConn* conn) {
+    Download* download = user;
+    DownloadPeer* peer = peer_conn_user(conn);
+
+    download_release_requests(download, peer);
+    if(peer->seed) picker_remove_seed(download->picker);
+    else picker_remove_bitfield(download->picker, peer->bitfield);
+    if(peer->prev) peer->prev->next = peer->next;
+    else download->peers = peer->next;
+    if(peer->next) peer->next->prev = peer->prev;
+    download->stats.peers--;
+
+    free(peer->bitfield);
+    free(peer->requests);
+    free(peer);
+    download_wake(download);
+}
+
+#pragma endregion Peers
+
+#pragma region Public
+
+Download* download_new(const TorrentInfo* info, const DownloadOptions* opts) {
+    if(info->piece_count == 0 || info->piece_length > UINT32_MAX) return NULL;
+
+    Download* download = calloc(1, sizeof(*download));
+    if(!download) return NULL;
+
+    const DownloadOptions defaults = {0};
+    download->info = info;
+    download->opts = opts ? *opts : defaults;
+    if(download->opts.pipeline == 0) download->opts.pipeline = DOWNLOAD_DEFAULT_PIPELINE;
+    if(download->opts.max_buffered == 0) download->opts.max_buffered = DOWNLOAD_DEFAULT_BUFFERED;
+
+    download->have_len = (info->piece_count + 7) / 8;
+    download->have = calloc(download->have_len, 1);
+    download->active = calloc(info->piece_count, sizeof(DownloadPiece*));
+    download->active_list = malloc(info->piece_count * sizeof(DownloadPiece*));
+    download->picker = picker_new(info->piece_count);
+    if(!download->have || !download->active || !download->active_list || !download->picker) {
+        download_free(download);
+        return NULL;
+    }
+    return download;
+}
+
+void download_free(Download* download) {
+    if(!download) return;
+
+    while(download->active_count > 0) {
+        download_drop_piece(download, download->active_list[download->active_count - 1]);
+    }
+    free(download->have);
+    free(download->active);
+    free(download->active_list);
+    picker_free(download->picker);
+    free(download);
+}
+
+PeerHandler download_peer_handler(Download* download) {
+    return (PeerHandler){
+        .user = download,
+        .on_connect = download_on_connect,
+        .on_message = download_on_message,
+        .on_close = download_on_close,
+    };
+}
+
+bool download_complete(const Download* download) {
+    return picker_remaining(download->picker) == 0;
+}
+
+void download_set_priority(Download* download, size_t piece, int priority) {
+    if(piece >= download->info->piece_count || bitfield_get(download->have, piece)) return;
+
+    picker_set_priority(download->picker, piece, priority);
+    if(!picker_wanted(download->picker, piece)) {
+        download_update_complete(download);
+        return;
+    }
+    for(DownloadPeer* peer = download->peers; peer; peer = peer->next) {
+        if(!bitfield_get(peer->bitfield, piece)) continue;
+        download_update_interest(download, peer);
+        download_fill(download, peer);
+    }
+}
+
+void download_get_stats(const Download* download, DownloadStats* stats) {
+    *stats = download->stats;
+}
+
+const uint8_t* download_bitfield(const Download* download, size_t* len) {
+    *len = download->have_len;
+    return download->have;
+}
+
+#pragma endregion Public
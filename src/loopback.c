@@ -0,0 +1,480 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "loopback.h"
+
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+
+#include "bencode.h"
+#include "bitfield.h"
+#include "create.h"
+#include "cryptography.h"
+#include "disk.h"
+#include "download.h"
+#include "metadata.h"
+#include "peer_engine.h"
+#include "resume.h"
+#include "torrent.h"
+#include "verify.h"
+
+#define LOOPBACK_POLL_MS            50
+#define LOOPBACK_STALL_SECONDS      30.0    // give up when no piece completed for this long
+#define LOOPBACK_RESUME_INTERVAL    1.0     // seconds between writes of data_dir/leech.resume
+#define LOOPBACK_SPARE_FDS          (64 + DISK_DEFAULT_OPEN_FILES)
+#define LOOPBACK_METADATA_PEERS     8       // connections fetching the info dict of a magnet start
+
+typedef struct LoopbackSeed {
+    PeerEngine*         engine;
+    const TorrentInfo*  info;
+    MetadataSource      metadata;       // the encoded info dict, for ut_metadata
+    const uint8_t*      data;
+    const uint8_t*      bitfield;
+    size_t              bitfield_len;
+    Disk*               disk;           // NULL to serve data from memory
+    uint8_t*            block;          // a block read from disk
+    atomic_bool*        stop;
+    pthread_t           thread;
+    bool                started;
+} LoopbackSeed;
+
+typedef struct LoopbackCheck {
+    const uint8_t*      data;
+    uint64_t            piece_length;
+    size_t              good_pieces;
+} LoopbackCheck;
+
+static double loopback_clock(clockid_t clock) {
+    struct timespec now;
+    clock_gettime(clock, &now);
+    return (double)now.tv_sec + (double)now.tv_nsec / 1e9;
+}
+
+#pragma region Torrent
+
+static uint8_t* loopback_generate(uint64_t size) {
+    uint8_t* data = malloc(size);
+    if(!data) return NULL;
+
+    // xorshift64: cheap to produce and nothing a compressing transport could shortcut
+    uint64_t state = 0x9E3779B97F4A7C15ull;
+    for(uint64_t i = 0; i < size; i += sizeof(state)) {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        memcpy(data + i, &state, size - i < sizeof(state) ? size - i : sizeof(state));
+    }
+    return data;
+}
+
+static bool loopback_set(BNode* dict, const char* key, BNode* value) {
+    if(value && bencode_dict_set(dict, key, value)) return true;
+    bencode_free_node(value);
+    return false;
+}
+
+static bool loopback_append(BNode* list, BNode* item) {
+    if(item && bencode_list_append(list, item)) return true;
+    bencode_free_node(item);
+    return false;
+}
+
+/* size / count bytes per file, the last one takes the rest */
+static BNode* loopback_files(uint64_t size, size_t count) {
+    BNode* files = bencode_new_list();
+    for(size_t i = 0; files && i < count; ++i) {
+        char name[32];
+        snprintf(name, sizeof(name), "part%04zu.bin", i);
+        const uint64_t length = i + 1 < count ? size / count : size - (count - 1) * (size / count);
+
+        BNode* path = bencode_new_list();
+        BNode* file = bencode_new_dict();
+        if(!path || !file || !loopback_append(path, bencode_new_string(name, strlen(name)))) {
+            bencode_free_node(path);
+            path = NULL;
+        }
+        if(!file || !loopback_set(file, "path", path) || !loopback_set(file, "length", bencode_new_int((long long)length))) {
+            bencode_free_node(file);
+            bencode_free_node(files);
+            return NULL;
+        }
+        if(!loopback_append(files, file)) {
+            bencode_free_node(files);
+            return NULL;
+        }
+    }
+    return files;
+}
+
+static BNode* loopback_metainfo(const uint8_t* data, uint64_t size, uint64_t piece_length, size_t file_count) {
+    const size_t piece_count = (size_t)((size + piece_length - 1) / piece_length);
+    const size_t full_pieces = (size_t)(size / piece_length);
+
+    uint8_t* pieces = malloc(piece_count * TORRENT_HASH_LEN);
+    const uint8_t** msgs = malloc((full_pieces ? full_pieces : 1) * sizeof(*msgs));
+    BNode* root = NULL;
+    if(!pieces || !msgs) goto cleanup;
+
+    for(size_t i = 0; i < full_pieces; ++i) {
+        msgs[i] = data + i * piece_length;
+    }
+    sha1_many(msgs, (size_t)piece_length, full_pieces, (sha1hash*)pieces);
+    if(full_pieces < piece_count) {
+        const sha1hash last = sha1(data + full_pieces * piece_length, (size_t)(size - full_pieces * piece_length));
+        memcpy(pieces + full_pieces * TORRENT_HASH_LEN, last.bytes, TORRENT_HASH_LEN);
+    }
+
+    root = bencode_new_dict();
+    BNode* info = bencode_new_dict();
+    const char* name = file_count > 1 ? "loopback" : "loopback.bin";
+    if(!root || !loopback_set(root, "info", info) ||
+       !(file_count > 1 ? loopback_set(info, "files", loopback_files(size, file_count))
+                        : loopback_set(info, "length", bencode_new_int((long long)size))) ||
+       !loopback_set(info, "name", bencode_new_string(name, strlen(name))) ||
+       !loopback_set(info, "piece length", bencode_new_int((long long)piece_length)) ||
+       !loopback_set(info, "pieces", bencode_new_string((const char*)pieces, piece_count * TORRENT_HASH_LEN))) {
+        bencode_free_node(root);
+        root = NULL;
+    }
+
+cleanup:
+    free(msgs);
+    free(pieces);
+    return root;
+}
+
+#pragma endregion Torrent
+
+#pragma region Seeds
+
+static bool loopback_seed_connect(void* user, PeerConn* conn, const PeerHandshake* remote) {
+    const LoopbackSeed* seed = user;
+
+    // a seed has everything and serves anyone right away
+    PeerRing* output = peer_conn_output(conn);
+    return metadata_source_connect(&seed->metadata, conn, remote) &&
+           peer_write_bitfield(output, seed->bitfield, seed->bitfield_len) &&
+           peer_write_simple(output, PEER_MSG_UNCHOKE);
+}
+
+static PeerAction loopback_seed_message(void* user, PeerConn* conn, const PeerMessage* msg) {
+    const LoopbackSeed* seed = user;
+    if(msg->type == PEER_MSG_EXTENDED) return metadata_source_message(&seed->metadata, conn, msg);
+    if(msg->type != PEER_MSG_REQUEST) return PEER_CONTINUE;
+
+    const TorrentInfo* info = seed->info;
+    if(msg->index >= info->piece_count || msg->length == 0 || msg->length > PEER_MAX_BLOCK_SIZE ||
+       (uint64_t)msg->begin + msg->length > torrent_piece_size(info, msg->index)) {
+        return PEER_DISCONNECT;
+    }
+
+    const uint8_t* block = seed->data + msg->index * info->piece_length + msg->begin;
+    if(seed->disk) {
+        // a piece that is not cached yet is loaded meanwhile, loopback_seed_ready retries
+        const int status = disk_read(seed->disk, msg->index, msg->begin, msg->length, seed->block);
+        if(status == 0) return PEER_BLOCKED;
+        if(status < 0) return PEER_DISCONNECT;
+        block = seed->block;
+    }
+    if(!peer_write_piece(peer_conn_output(conn), msg->index, msg->begin, block, msg->length)) return PEER_BLOCKED;
+    return PEER_CONTINUE;
+}
+
+static void loopback_seed_ready(void* user) {
+    LoopbackSeed* seed = user;
+    disk_acknowledge(seed->disk);
+    peer_engine_resume(seed->engine);
+}
+
+static void* loopback_seed_thread(void* arg) {
+    LoopbackSeed* seed = arg;
+    while(!atomic_load_explicit(seed->stop, memory_order_relaxed)) {
+        if(peer_engine_poll(seed->engine, LOOPBACK_POLL_MS) < 0) break;
+    }
+    return NULL;
+}
+
+static void loopback_peer_id(uint8_t peer_id[PEER_ID_LEN], const char* role, size_t index) {
+    char text[PEER_ID_LEN + 1];
+    snprintf(text, sizeof(text), "-CT0001-%s%06zu", role, index % 1000000);
+    memcpy(peer_id, text, PEER_ID_LEN);
+}
+
+/* Put the generated data where the seeds read it from */
+static bool loopback_store_seed_data(const TorrentInfo* info, const uint8_t* data, const char* dir) {
+    Disk* disk = disk_new(info, dir, NULL);
+    if(!disk) return false;
+
+    bool ok = true;
+    for(size_t i = 0; ok && i < info->piece_count; ++i) {
+        ok = disk_write_piece(disk, i, data + i * info->piece_length, (size_t)torrent_piece_size(info, i));
+    }
+    ok = disk_flush(disk) && ok;
+    disk_free(disk);
+    return ok;
+}
+
+static char* loopback_path(const char* dir, const char* name) {
+    const size_t len = strlen(dir) + strlen(name) + 2;
+    char* path = malloc(len);
+    if(path) snprintf(path, len, "%s/%s", dir, name);
+    return path;
+}
+
+#pragma endregion Seeds
+
+#pragma region Magnet
+
+/* Fetch the info dict from the seeds the way a magnet link starts, on connections of its own */
+static BDocument* loopback_fetch_metadata(const struct sockaddr_in* addr, const sha1hash* info_hash, size_t peers) {
+    MetadataFetch* fetch = metadata_fetch_new(info_hash);
+    if(!fetch) return NULL;
+
+    PeerEngineOptions opts = { .info_hash = *info_hash, .max_peers = peers, .handler = metadata_fetch_handler(fetch) };
+    opts.reserved[PEER_EXTENSION_BYTE] = PEER_EXTENSION_BIT;
+    loopback_peer_id(opts.peer_id, "magnet", 0);
+    PeerEngine* engine = peer_engine_new(&opts);
+
+    bool connected = engine != NULL;
+    for(size_t i = 0; connected && i < peers; ++i) {
+        connected = peer_engine_connect(engine, addr) != NULL;
+    }
+
+    const double start = loopback_clock(CLOCK_MONOTONIC);
+    while(connected && !metadata_fetch_complete(fetch)) {
+        if(peer_engine_poll(engine, LOOPBACK_POLL_MS) < 0 || peer_engine_peers(engine) == 0) break;
+        if(loopback_clock(CLOCK_MONOTONIC) - start > LOOPBACK_STALL_SECONDS) break;
+    }
+
+    // the connections are closed before the document is handed out, the fetch outlives them
+    peer_engine_free(engine);
+    BDocument* doc = metadata_fetch_complete(fetch) ? metadata_fetch_take_document(fetch) : NULL;
+    metadata_fetch_free(fetch);
+    return doc;
+}
+
+#pragma endregion Magnet
+
+#pragma region Public
+
+static bool loopback_store(void* user, size_t piece, const uint8_t* data, size_t len) {
+    LoopbackCheck* check = user;
+    if(memcmp(check->data + piece * check->piece_length, data, len) == 0) check->good_pieces++;
+    return true;
+}
+
+/* Two descriptors per connection, one on each end */
+static bool loopback_raise_fd_limit(size_t peers) {
+    const rlim_t needed = (rlim_t)(2 * peers + LOOPBACK_SPARE_FDS);
+    struct rlimit limit;
+    if(getrlimit(RLIMIT_NOFILE, &limit) != 0) return false;
+    if(limit.rlim_cur >= needed) return true;
+    if(limit.rlim_max != RLIM_INFINITY && limit.rlim_max < needed) return false;
+
+    limit.rlim_cur = needed;
+    return setrlimit(RLIMIT_NOFILE, &limit) == 0;
+}
+
+int loopback_run(const LoopbackOptions* opts, LoopbackResult* result) {
+    const LoopbackOptions defaults = {0};
+    if(!opts) opts = &defaults;
+    *result = (LoopbackResult){0};
+
+    const size_t peers = opts->peers ? opts->peers : LOOPBACK_DEFAULT_PEERS;
+    const uint64_t size = opts->size ? opts->size : LOOPBACK_DEFAULT_SIZE;
+    const uint64_t piece_length = opts->piece_length ? opts->piece_length : torrent_auto_piece_length(size);
+    const size_t threads = opts->threads ? opts->threads : 1;
+    if((piece_length & (piece_length - 1)) != 0 || !loopback_raise_fd_limit(peers + LOOPBACK_METADATA_PEERS)) return -1;
+
+    int status = -1;
+    atomic_bool stop = false;
+    uint8_t* data = loopback_generate(size);
+    BNode* root = data ? loopback_metainfo(data, size, piece_length, opts->files) : NULL;
+    BEncodeBuf* encoded = root ? bencode_encode_node(root) : NULL;
+    BDocument doc = { .root = NULL };
+    TorrentInfo* info = NULL;
+    BDocument* fetched = NULL;
+    TorrentInfo* fetched_info = NULL;
+    const TorrentInfo* leech_info = NULL;
+    uint8_t* bitfield = NULL;
+    LoopbackSeed* seeds = calloc(threads, sizeof(*seeds));
+    Download* download = NULL;
+    PeerEngine* engine = NULL;
+    char* seed_dir = NULL;
+    char* leech_dir = NULL;
+    Disk* leech_disk = NULL;
+    ResumeWriter* resume = NULL;
+    if(!encoded || !seeds) goto cleanup;
+
+    // the downloader gets the torrent the way a client would: parsed from its encoding
+    doc = (BDocument){ .root = bencode_decode_buffer(encoded->data, encoded->len, NULL), .data = encoded->data, .len = encoded->len };
+    info = doc.root ? torrent_info_from_document(&doc) : NULL;
+    if(!info) goto cleanup;
+    const BNode* info_node = bencode_find_node_by_key(doc.root, "info");
+
+    const size_t bitfield_len = BITFIELD_BYTES(info->piece_count);
+    bitfield = calloc(bitfield_len, 1);
+    if(!bitfield) goto cleanup;
+    for(size_t i = 0; i < info->piece_count; ++i) {
+        bitfield_set(bitfield, i);
+    }
+
+    if(opts->data_dir) {
+        seed_dir = loopback_path(opts->data_dir, "seed");
+        leech_dir = loopback_path(opts->data_dir, "leech");
+        if(!seed_dir || !leech_dir || !loopback_store_seed_data(info, data, seed_dir)) goto cleanup;
+    }
+
+    // every seed engine listens on the same port, the kernel spreads the connections
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    for(size_t i = 0; i < threads; ++i) {
+        LoopbackSeed* seed = &seeds[i];
+        *seed = (LoopbackSeed){ .info = info, .data = data, .bitfield = bitfield, .bitfield_len = bitfield_len, .stop = &stop };
+        seed->metadata = (MetadataSource){ .data = (const uint8_t*)doc.data + info_node->start, .len = info_node->end - info_node->start };
+
+        PeerEngineOptions seed_opts = {
+            .info_hash = info->info_hash,
+            .max_peers = peers + LOOPBACK_METADATA_PEERS,
+            .handler = { .user = seed, .on_connect = loopback_seed_connect, .on_message = loopback_seed_message },
+        };
+        seed_opts.reserved[PEER_EXTENSION_BYTE] = PEER_EXTENSION_BIT;
+        loopback_peer_id(seed_opts.peer_id, "seed", i);
+        seed->engine = peer_engine_new(&seed_opts);
+        const int port = seed->engine ? peer_engine_listen(seed->engine, &addr) : -1;
+        if(port < 0) goto cleanup;
+        addr.sin_port = htons((uint16_t)port);
+
+        // each seed has a disk of its own, whose loaded pieces wake its engine
+        if(seed_dir) {
+            seed->disk = disk_new(info, seed_dir, NULL);
+            seed->block = malloc(PEER_MAX_BLOCK_SIZE);
+            if(!seed->disk || !seed->block ||
+               !peer_engine_watch(seed->engine, disk_event_fd(seed->disk), loopback_seed_ready, seed)) {
+                goto cleanup;
+            }
+        }
+    }
+
+    for(size_t i = 0; i < threads; ++i) {
+        if(pthread_create(&seeds[i].thread, NULL, loopback_seed_thread, &seeds[i]) != 0) goto cleanup;
+        seeds[i].started = true;
+    }
+
+    const double start = loopback_clock(CLOCK_MONOTONIC);
+    const double cpu_start = loopback_clock(CLOCK_PROCESS_CPUTIME_ID);
+
+    // a magnet start has nothing but the infohash, the torrent comes from the seeds
+    leech_info = info;
+    if(opts->magnet) {
+        const size_t metadata_peers = peers < LOOPBACK_METADATA_PEERS ? peers : LOOPBACK_METADATA_PEERS;
+        fetched = loopback_fetch_metadata(&addr, &info->info_hash, metadata_peers);
+        fetched_info = fetched ? torrent_info_from_dict(fetched, fetched->root) : NULL;
+        if(!fetched_info) goto cleanup;
+
+        leech_info = fetched_info;
+        result->metadata_seconds = loopback_clock(CLOCK_MONOTONIC) - start;
+    }
+
+    LoopbackCheck check = { .data = data, .piece_length = piece_length };
+    DownloadOptions download_opts = { .storage = { .user = &check, .write_piece = loopback_store } };
+    if(leech_dir) {
+        leech_disk = disk_new(leech_info, leech_dir, NULL);
+        if(!leech_disk) goto cleanup;
+        download_opts.storage = disk_storage(leech_disk);
+
+        char* resume_path = loopback_path(opts->data_dir, "leech.resume");
+        const ResumeOptions resume_opts = { .interval = LOOPBACK_RESUME_INTERVAL, .disk = leech_disk };
+        resume = resume_path ? resume_writer_new(leech_info, resume_path, leech_dir, &resume_opts) : NULL;
+        free(resume_path);
+        if(!resume) goto cleanup;
+    }
+    download = download_new(leech_info, &download_opts);
+    if(!download) goto cleanup;
+
+    PeerEngineOptions engine_opts = { .info_hash = leech_info->info_hash, .max_peers = peers, .handler = download_peer_handler(download) };
+    loopback_peer_id(engine_opts.peer_id, "leech", 0);
+    engine = peer_engine_new(&engine_opts);
+    if(!engine) goto cleanup;
+
+    for(size_t i = 0; i < peers; ++i) {
+        if(!peer_engine_connect(engine, &addr)) goto cleanup;
+    }
+
+    DownloadStats stats = {0};
+    size_t have_len;
+    double last_progress = start;
+    while(!download_complete(download)) {
+        if(peer_engine_poll(engine, LOOPBACK_POLL_MS) < 0) break;
+
+        const size_t pieces_done = stats.pieces_done;
+        download_get_stats(download, &stats);
+        if(stats.peers > result->peers) result->peers = stats.peers;
+
+        const double now = loopback_clock(CLOCK_MONOTONIC);
+        if(stats.pieces_done != pieces_done) {
+            if(pieces_done == 0) result->first_piece_seconds = now - start;
+            last_progress = now;
+            if(resume) resume_writer_update(resume, download_bitfield(download, &have_len));
+        } else if(now - last_progress > LOOPBACK_STALL_SECONDS) break;
+    }
+    download_get_stats(download, &stats);
+    const bool stored = !leech_disk || disk_flush(leech_disk);
+    if(resume) resume_writer_update(resume, download_bitfield(download, &have_len));
+    resume_writer_free(resume);
+    resume = NULL;
+
+    result->seconds = loopback_clock(CLOCK_MONOTONIC) - start;
+    result->cpu_seconds = loopback_clock(CLOCK_PROCESS_CPUTIME_ID) - cpu_start;
+    result->pieces = leech_info->piece_count;
+    result->good_pieces = check.good_pieces;
+    result->hash_failures = stats.hash_failures;
+    result->bytes = stats.bytes_received;
+    status = download_complete(download) && stored ? 0 : -1;
+
+    // what landed on disk is checked the way a client would on startup
+    if(leech_disk) {
+        DiskStats disk_stats;
+        disk_get_stats(leech_disk, &disk_stats);
+        result->write_calls = disk_stats.write_calls;
+
+        VerifyResult verified;
+        if(verify_torrent(leech_info, leech_dir, 0, &verified) != 0) status = -1;
+        result->good_pieces = verified.good_pieces;
+        verify_result_free(&verified);
+    }
+
+cleanup:
+    atomic_store(&stop, true);
+    for(size_t i = 0; seeds && i < threads; ++i) {
+        if(seeds[i].started) pthread_join(seeds[i].thread, NULL);
+    }
+    peer_engine_free(engine);
+    resume_writer_free(resume);
+    download_free(download);
+    disk_free(leech_disk);
+    for(size_t i = 0; seeds && i < threads; ++i) {
+        peer_engine_free(seeds[i].engine);
+        disk_free(seeds[i].disk);
+        free(seeds[i].block);
+    }
+    free(seeds);
+    free(seed_dir);
+    free(leech_dir);
+    free(bitfield);
+    torrent_info_free(fetched_info);
+    bencode_free_document(fetched);
+    torrent_info_free(info);
+    bencode_free_node(doc.root);
+    if(encoded) bencode_free_buf(encoded);
+    bencode_free_node(root);
+    free(data);
+    return status;
+}
+
+#pragma endregion Public
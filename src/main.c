@@ -1,26 +1,361 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
+#include "batch.h"
 #include "bencode.h"
+#include "create.h"
 #include "cryptography.h"
+#include "loopback.h"
+#include "resume.h"
+#include "stats.h"
+#include "torrent.h"
+#include "verify.h"
 
-int main(int argc, char** argv) {
-    if(argc != 2) {
-        printf("Invalid number of arguments!");
+static void print_usage(void) {
+    printf("Usage:\n");
+    printf("  ctorrent <torrent>                              print the infohash\n");
+    printf("  ctorrent verify <torrent> <data-dir> [-j N] [-r resume-file] [-2]\n");
+    printf("                                                  check the data against the piece hashes,\n");
+    printf("                                                  -2 against the v2 merkle trees of a hybrid torrent\n");
+    printf("  ctorrent batch <dir|list|-> [-j N] [--json]     print the infohash of many torrents\n");
+    printf("  ctorrent create <path> -o <torrent> [-a URL] [-l piece-length] [-j N]\n");
+    printf("                                                  create a torrent for a file or directory\n");
+    printf("  ctorrent loopback [-p peers] [-s MiB] [-l piece-length] [-j N] [-f files] [-d dir] [-m]\n");
+    printf("                                                  download a generated torrent from local seeds,\n");
+    printf("                                                  -m starting from its infohash like a magnet link\n");
+    printf("Any command also takes:\n");
+    printf("  --stats[=json|prometheus] [--stats-interval S]  write hot path counters to stderr at exit, and every S seconds\n");
+}
+
+static int cmd_infohash(const char* fpath) {
+    // only the raw bytes of the info dict are needed, its contents are checked but not decoded
+    const BDecodeOptions opts = { .lazy = true };
+    BDocument* doc = bencode_parse_torrent_opts(fpath, &opts);
+    if(!doc) {
+        printf("Failed to parse torrent!");
         return 1;
     }
 
-    BNode* root = bencode_parse_torrent(argv[1]);
-    BEncodeBuf* info_buf = bencode_encode_node(
-        bencode_find_node_by_key(root, "info")
-    );
-    sha1hash info_hash = sha1(
-        (const uint8_t*)info_buf->data,
-        info_buf->len
-    );
-    bencode_free_node(root);
-    bencode_free_buf(info_buf);
+    const BNode* info = bencode_find_node_by_key(doc->root, "info");
+    if(!info) {
+        printf("Torrent has no info dict!");
+        bencode_free_document(doc);
+        return 1;
+    }
+
+    sha1hash info_hash = bencode_hash_node(doc, info);
+    bencode_free_document(doc);
     
     print_sha1(info_hash);
 
     return 0;
-}
\ No newline at end of file
+}
+
+/* Check with a resume file and write it back with the result */
+static int cmd_verify_resume(const TorrentInfo* info, const char* data_dir, const char* resume_path, size_t threads) {
+    ResumeResult result;
+    if(resume_check(info, resume_path, data_dir, threads, &result) != 0) {
+        printf("Failed to verify torrent!\n");
+        return 1;
+    }
+
+    printf("bitfield: ");
+    for(size_t i = 0; i < result.bitfield_len; ++i) {
+        printf("%02x", (unsigned int)result.bitfield[i]);
+    }
+    printf("\n");
+
+    printf("pieces: %zu/%zu good, %zu trusted from %s, %zu hashed in %.3f s\n",
+        result.good_pieces, info->piece_count, result.trusted_pieces,
+        result.loaded ? "the resume file" : "nothing", result.checked_pieces, result.seconds);
+
+    if(!resume_save(info, resume_path, data_dir, result.bitfield)) {
+        printf("Failed to write resume file!\n");
+    }
+
+    const int status = result.good_pieces == info->piece_count ? 0 : 2;
+    resume_result_free(&result);
+    return status;
+}
+
+/* Check against the v2 merkle trees, for v2-only torrents or with -2 */
+static int cmd_verify_v2(const BDocument* doc, const char* data_dir, size_t threads) {
+    TorrentInfoV2* info = torrent_info_v2_from_document(doc);
+    if(!info) {
+        printf("Torrent has no valid info dict!\n");
+        return 1;
+    }
+
+    size_t piece_count = 0;
+    for(size_t i = 0; i < info->file_count; ++i) {
+        piece_count += verify_v2_piece_count(info, i);
+    }
+
+    VerifyResult result;
+    if(verify_torrent_v2(info, data_dir, threads, &result) != 0) {
+        printf("Failed to verify torrent!\n");
+        torrent_info_v2_free(info);
+        return 1;
+    }
+
+    printf("bitfield: ");
+    for(size_t i = 0; i < result.bitfield_len; ++i) {
+        printf("%02x", (unsigned int)result.bitfield[i]);
+    }
+    printf("\n");
+
+    const double mb = (double)result.bytes_hashed / (1024.0 * 1024.0);
+    printf("v2 pieces: %zu/%zu good, %.1f MB in %.3f s (%.1f MB/s)\n",
+        result.good_pieces, piece_count, mb, result.seconds,
+        result.seconds > 0 ? mb / result.seconds : 0.0);
+
+    const int status = result.good_pieces == piece_count ? 0 : 2;
+    verify_result_free(&result);
+    torrent_info_v2_free(info);
+    return status;
+}
+
+static int cmd_verify(int argc, char** argv) {
+    if(argc < 2) {
+        print_usage();
+        return 1;
+    }
+
+    size_t threads = 0;
+    const char* resume_path = NULL;
+    bool v2 = false;
+    for(int i = 2; i < argc; ++i) {
+        if(strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            threads = strtoul(argv[++i], NULL, 10);
+        } else if(strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+            resume_path = argv[++i];
+        } else if(strcmp(argv[i], "-2") == 0) {
+            v2 = true;
+        } else {
+            print_usage();
+            return 1;
+        }
+    }
+
+    BDocument* doc = bencode_parse_torrent(argv[0]);
+    if(!doc) {
+        printf("Failed to parse torrent!\n");
+        return 1;
+    }
+
+    // a v2-only torrent has no v1 piece hashes
+    TorrentInfo* info = v2 ? NULL : torrent_info_from_document(doc);
+    if(!info && !resume_path) {
+        const int status = cmd_verify_v2(doc, argv[1], threads);
+        bencode_free_document(doc);
+        return status;
+    }
+    if(!info) {
+        printf("Torrent has no valid info dict!\n");
+        bencode_free_document(doc);
+        return 1;
+    }
+
+    if(resume_path) {
+        const int status = cmd_verify_resume(info, argv[1], resume_path, threads);
+        torrent_info_free(info);
+        bencode_free_document(doc);
+        return status;
+    }
+
+    VerifyResult result;
+    if(verify_torrent(info, argv[1], threads, &result) != 0) {
+        printf("Failed to verify torrent!\n");
+        torrent_info_free(info);
+        bencode_free_document(doc);
+        return 1;
+    }
+
+    printf("bitfield: ");
+    for(size_t i = 0; i < result.bitfield_len; ++i) {
+        printf("%02x", (unsigned int)result.bitfield[i]);
+    }
+    printf("\n");
+
+    const double mb = (double)result.bytes_hashed / (1024.0 * 1024.0);
+    printf("pieces: %zu/%zu good, %.1f MB in %.3f s (%.1f MB/s)\n",
+        result.good_pieces, info->piece_count, mb, result.seconds,
+        result.seconds > 0 ? mb / result.seconds : 0.0);
+
+    const int status = result.good_pieces == info->piece_count ? 0 : 2;
+    verify_result_free(&result);
+    torrent_info_free(info);
+    bencode_free_document(doc);
+    return status;
+}
+
+static int cmd_batch(int argc, char** argv) {
+    if(argc < 1) {
+        print_usage();
+        return 1;
+    }
+
+    BatchOptions opts = { .threads = 0, .format = BATCH_FORMAT_TSV };
+    for(int i = 1; i < argc; ++i) {
+        if(strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            opts.threads = strtoul(argv[++i], NULL, 10);
+        } else if(strcmp(argv[i], "--json") == 0) {
+            opts.format = BATCH_FORMAT_JSON;
+        } else {
+            print_usage();
+            return 1;
+        }
+    }
+
+    BatchResult result;
+    if(batch_infohash(argv[0], &opts, stdout, &result) != 0) {
+        fprintf(stderr, "Failed to read %s!\n", argv[0]);
+        return 1;
+    }
+
+    fprintf(stderr, "%zu hashed, %zu failed in %.3f s\n", result.hashed, result.failed, result.seconds);
+    return result.failed ? 2 : 0;
+}
+
+static int cmd_create(int argc, char** argv) {
+    if(argc < 1) {
+        print_usage();
+        return 1;
+    }
+
+    const char* output = NULL;
+    CreateOptions opts = {0};
+    for(int i = 1; i < argc; ++i) {
+        if(strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            output = argv[++i];
+        } else if(strcmp(argv[i], "-a") == 0 && i + 1 < argc) {
+            opts.announce = argv[++i];
+        } else if(strcmp(argv[i], "-l") == 0 && i + 1 < argc) {
+            opts.piece_length = strtoull(argv[++i], NULL, 10);
+        } else if(strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            opts.hashers = strtoul(argv[++i], NULL, 10);
+        } else {
+            print_usage();
+            return 1;
+        }
+    }
+    if(!output) {
+        print_usage();
+        return 1;
+    }
+    if((opts.piece_length & (opts.piece_length - 1)) != 0) {
+        printf("Piece length %llu is not a power of two!\n", (unsigned long long)opts.piece_length);
+        return 1;
+    }
+
+    BNode* root = torrent_create(argv[0], &opts);
+    if(!root) {
+        printf("Failed to create torrent!\n");
+        return 1;
+    }
+
+    // stream the torrent straight to the file, the pieces string is never copied
+    FILE* out = fopen(output, "wb");
+    const BEncodeSink sink = bencode_file_sink(out);
+    bool written = out && bencode_encode_to_sink(root, &sink) == 0;
+    if(out && fclose(out) != 0) written = false;
+
+    if(written) print_sha1(bencode_hash_encoded(bencode_find_node_by_key(root, "info")));
+    else printf("Failed to write %s!\n", output);
+
+    bencode_free_node(root);
+    return written ? 0 : 1;
+}
+
+static int cmd_loopback(int argc, char** argv) {
+    LoopbackOptions opts = {0};
+    for(int i = 0; i < argc; ++i) {
+        if(strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
+            opts.peers = strtoul(argv[++i], NULL, 10);
+        } else if(strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+            opts.size = strtoull(argv[++i], NULL, 10) * 1024 * 1024;
+        } else if(strcmp(argv[i], "-l") == 0 && i + 1 < argc) {
+            opts.piece_length = strtoull(argv[++i], NULL, 10);
+        } else if(strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            opts.threads = strtoul(argv[++i], NULL, 10);
+        } else if(strcmp(argv[i], "-f") == 0 && i + 1 < argc) {
+            opts.files = strtoul(argv[++i], NULL, 10);
+        } else if(strcmp(argv[i], "-d") == 0 && i + 1 < argc) {
+            opts.data_dir = argv[++i];
+        } else if(strcmp(argv[i], "-m") == 0) {
+            opts.magnet = true;
+        } else {
+            print_usage();
+            return 1;
+        }
+    }
+
+    LoopbackResult result;
+    const int status = loopback_run(&opts, &result);
+    if(status != 0 && result.pieces == 0) {
+        printf("Failed to set up the loopback download!\n");
+        return 1;
+    }
+
+    const double mb = (double)result.bytes / (1024.0 * 1024.0);
+    printf("peers: %zu connected\n", result.peers);
+    printf("pieces: %zu/%zu good, %zu hash failures, %.1f MB in %.3f s (%.1f MB/s), cpu %.3f s\n",
+        result.good_pieces, result.pieces, result.hash_failures, mb, result.seconds,
+        result.seconds > 0 ? mb / result.seconds : 0.0, result.cpu_seconds);
+    if(opts.data_dir) printf("disk: %zu pieces stored in %zu writes\n", result.pieces, result.write_calls);
+    if(opts.magnet) printf("magnet: info dict after %.3f s, ", result.metadata_seconds);
+    printf("first piece after %.3f s\n", result.first_piece_seconds);
+
+    if(status != 0) return 1;
+    return result.good_pieces == result.pieces ? 0 : 2;
+}
+
+static int run_command(int argc, char** argv) {
+    if(argc < 2) {
+        printf("Invalid number of arguments!");
+        return 1;
+    }
+
+    if(strcmp(argv[1], "verify") == 0) return cmd_verify(argc - 2, argv + 2);
+    if(strcmp(argv[1], "batch") == 0) return cmd_batch(argc - 2, argv + 2);
+    if(strcmp(argv[1], "create") == 0) return cmd_create(argc - 2, argv + 2);
+    if(strcmp(argv[1], "loopback") == 0) return cmd_loopback(argc - 2, argv + 2);
+
+    if(argc != 2) {
+        printf("Invalid number of arguments!");
+        return 1;
+    }
+    return cmd_infohash(argv[1]);
+}
+
+int main(int argc, char** argv) {
+    // the stats options work with every command, so they are taken out before dispatching
+    bool stats = false;
+    StatsFormat format = STATS_FORMAT_JSON;
+    double interval = 0;
+    int kept = 1;
+    for(int i = 1; i < argc; ++i) {
+        if(strcmp(argv[i], "--stats") == 0 || strcmp(argv[i], "--stats=json") == 0) {
+            stats = true;
+        } else if(strcmp(argv[i], "--stats=prometheus") == 0) {
+            stats = true;
+            format = STATS_FORMAT_PROMETHEUS;
+        } else if(strcmp(argv[i], "--stats-interval") == 0 && i + 1 < argc) {
+            stats = true;
+            interval = strtod(argv[++i], NULL);
+        } else {
+            argv[kept++] = argv[i];
+        }
+    }
+    argv[kept] = NULL;
+
+    if(stats && !stats_enabled()) fprintf(stderr, "ctorrent was built without CTORRENT_STATS, every counter is 0\n");
+    StatsReporter* reporter = stats && interval > 0 ? stats_reporter_start(stderr, format, interval) : NULL;
+
+    const int status = run_command(kept, argv);
+
+    stats_reporter_stop(reporter);
+    if(stats) stats_write(stderr, format);
+    return status;
+}
@@ -0,0 +1,320 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "merkle.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// blocks handed to a leaf worker at once, 4 MiB of data
+#define MERKLE_BATCH_BLOCKS     256
+
+typedef struct MerkleJob {
+    const uint8_t*  data;
+    size_t          full_blocks;
+    sha256hash*     leaves;
+    atomic_size_t   next_batch;
+} MerkleJob;
+
+#pragma region Helpers
+
+static size_t merkle_next_pow2(size_t n) {
+    size_t result = 1;
+    while(result < n) result <<= 1;
+    return result;
+}
+
+/* log2 of value if it is a power of two */
+static bool merkle_exact_log2(uint64_t value, size_t* out) {
+    if(value == 0 || (value & (value - 1)) != 0) return false;
+
+    size_t log = 0;
+    while(value > 1) {
+        value >>= 1;
+        log++;
+    }
+    *out = log;
+    return true;
+}
+
+/* Levels between a piece's leaves and its node in the tree */
+static bool merkle_piece_level(uint64_t piece_length, size_t* level) {
+    if(piece_length < MERKLE_BLOCK_SIZE || piece_length % MERKLE_BLOCK_SIZE != 0) return false;
+    return merkle_exact_log2(piece_length / MERKLE_BLOCK_SIZE, level);
+}
+
+size_t merkle_block_count(uint64_t file_length) {
+    return (size_t)((file_length + MERKLE_BLOCK_SIZE - 1) / MERKLE_BLOCK_SIZE);
+}
+
+size_t merkle_piece_count(uint64_t file_length, uint64_t piece_length) {
+    if(piece_length == 0 || file_length <= piece_length) return 0;
+    return (size_t)((file_length + piece_length - 1) / piece_length);
+}
+
+sha256hash merkle_pad_hash(size_t level) {
+    sha256hash hash = {{0}};
+    for(size_t i = 0; i < level; ++i) {
+        hash = sha256_pair(&hash, &hash);
+    }
+    return hash;
+}
+
+#pragma endregion Helpers
+
+#pragma region Leaves
+
+static void* merkle_leaf_worker(void* arg) {
+    MerkleJob* job = arg;
+    const uint8_t* msgs[MERKLE_BATCH_BLOCKS];
+
+    for(;;) {
+        const size_t first = atomic_fetch_add(&job->next_batch, 1) * MERKLE_BATCH_BLOCKS;
+        if(first >= job->full_blocks) break;
+
+        size_t count = job->full_blocks - first;
+        if(count > MERKLE_BATCH_BLOCKS) count = MERKLE_BATCH_BLOCKS;
+        for(size_t i = 0; i < count; ++i) {
+            msgs[i] = job->data + (first + i) * MERKLE_BLOCK_SIZE;
+        }
+        sha256_many(msgs, MERKLE_BLOCK_SIZE, count, job->leaves + first);
+    }
+    return NULL;
+}
+
+void merkle_hash_blocks(const uint8_t* data, uint64_t len, size_t threads, sha256hash* leaves) {
+    MerkleJob job = {
+        .data = data,
+        .full_blocks = (size_t)(len / MERKLE_BLOCK_SIZE),
+        .leaves = leaves,
+    };
+    atomic_init(&job.next_batch, 0);
+
+    if(threads == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cpus > 0 ? (size_t)cpus : 1;
+    }
+    const size_t batches = (job.full_blocks + MERKLE_BATCH_BLOCKS - 1) / MERKLE_BATCH_BLOCKS;
+    if(threads > batches) threads = batches;
+
+    // the caller works as well, so one thread less to start
+    pthread_t* workers = threads > 1 ? malloc((threads - 1) * sizeof(pthread_t)) : NULL;
+    size_t started = 0;
+    if(workers) {
+        for(; started < threads - 1; ++started) {
+            if(pthread_create(&workers[started], NULL, merkle_leaf_worker, &job) != 0) break;
+        }
+    }
+    merkle_leaf_worker(&job);
+    for(size_t i = 0; i < started; ++i) {
+        pthread_join(workers[i], NULL);
+    }
+    free(workers);
+
+    const size_t tail = (size_t)(len % MERKLE_BLOCK_SIZE);
+    if(tail > 0) {
+        leaves[job.full_blocks] = sha256(data + job.full_blocks * MERKLE_BLOCK_SIZE, tail);
+    }
+}
+
+#pragma endregion Leaves
+
+#pragma region Tree
+
+bool merkle_root(const sha256hash* hashes, size_t count, size_t width, size_t level, sha256hash* root) {
+    if(width == 0 || (width & (width - 1)) != 0 || count > width) return false;
+    if(width == 1 && count == 1) {
+        *root = hashes[0];
+        return true;
+    }
+
+    sha256hash* scratch = malloc(((count + 1) / 2 ? (count + 1) / 2 : 1) * sizeof(sha256hash));
+    if(!scratch) return false;
+
+    // each pass halves the layer in place; node i only reads 2i and 2i + 1, never an earlier result
+    const sha256hash* layer = hashes;
+    sha256hash pad = merkle_pad_hash(level);
+    for(; width > 1; width /= 2) {
+        const size_t parents = (count + 1) / 2;
+        for(size_t i = 0; i < parents; ++i) {
+            const sha256hash* right = 2 * i + 1 < count ? &layer[2 * i + 1] : &pad;
+            scratch[i] = sha256_pair(&layer[2 * i], right);
+        }
+        pad = sha256_pair(&pad, &pad);
+        count = parents;
+        layer = scratch;
+    }
+
+    *root = count ? layer[0] : pad;
+    free(scratch);
+    return true;
+}
+
+MerkleTree* merkle_tree_from_leaves(const sha256hash* leaves, size_t count) {
+    if(count == 0) return NULL;
+
+    MerkleTree* tree = calloc(1, sizeof(*tree));
+    if(!tree) return NULL;
+    tree->block_count = count;
+    while(((size_t)1 << tree->depth) < count) tree->depth++;
+    tree->leaf_count = (size_t)1 << tree->depth;
+
+    tree->nodes = malloc((2 * tree->leaf_count - 1) * sizeof(sha256hash));
+    const uint8_t** msgs = malloc((tree->leaf_count / 2 ? tree->leaf_count / 2 : 1) * sizeof(uint8_t*));
+    if(!tree->nodes || !msgs) {
+        free(msgs);
+        merkle_tree_free(tree);
+        return NULL;
+    }
+
+    memcpy(tree->nodes, leaves, count * sizeof(sha256hash));
+    memset(tree->nodes + count, 0, (tree->leaf_count - count) * sizeof(sha256hash));
+
+    // the children of a parent are adjacent, so each of them is one 64-byte message and a
+    // whole layer goes through the multi-buffer hasher at once
+    sha256hash* layer = tree->nodes;
+    for(size_t width = tree->leaf_count; width > 1; width /= 2) {
+        sha256hash* parents = layer + width;
+        for(size_t i = 0; i < width / 2; ++i) {
+            msgs[i] = layer[2 * i].bytes;
+        }
+        sha256_many(msgs, 2 * sizeof(sha256hash), width / 2, parents);
+        layer = parents;
+    }
+
+    free(msgs);
+    return tree;
+}
+
+MerkleTree* merkle_tree_build(const uint8_t* data, uint64_t len, size_t threads) {
+    const size_t count = merkle_block_count(len);
+    if(count == 0) return NULL;
+
+    sha256hash* leaves = malloc(count * sizeof(sha256hash));
+    if(!leaves) return NULL;
+
+    merkle_hash_blocks(data, len, threads, leaves);
+    MerkleTree* tree = merkle_tree_from_leaves(leaves, count);
+    free(leaves);
+    return tree;
+}
+
+void merkle_tree_free(MerkleTree* tree) {
+    if(!tree) return;
+
+    free(tree->nodes);
+    free(tree);
+}
+
+sha256hash merkle_tree_root(const MerkleTree* tree) {
+    return tree->nodes[2 * tree->leaf_count - 2];
+}
+
+const sha256hash* merkle_tree_layer(const MerkleTree* tree, size_t level, size_t* count) {
+    if(level > tree->depth) return NULL;
+
+    const sha256hash* layer = tree->nodes;
+    size_t width = tree->leaf_count;
+    for(size_t i = 0; i < level; ++i) {
+        layer += width;
+        width /= 2;
+    }
+    *count = width;
+    return layer;
+}
+
+bool merkle_tree_piece_layer(const MerkleTree* tree, uint64_t piece_length, sha256hash* layer) {
+    size_t level;
+    if(!merkle_piece_level(piece_length, &level)) return false;
+
+    const size_t blocks_per_piece = (size_t)1 << level;
+    if(tree->block_count <= blocks_per_piece) return true;
+
+    size_t width;
+    const sha256hash* nodes = merkle_tree_layer(tree, level, &width);
+    memcpy(layer, nodes, (tree->block_count + blocks_per_piece - 1) / blocks_per_piece * sizeof(sha256hash));
+    return true;
+}
+
+size_t merkle_tree_proof(const MerkleTree* tree, size_t block, sha256hash* proof) {
+    if(block >= tree->block_count) return 0;
+
+    const sha256hash* layer = tree->nodes;
+    size_t width = tree->leaf_count;
+    for(size_t level = 0; level < tree->depth; ++level) {
+        proof[level] = layer[block ^ 1];
+        layer += width;
+        width /= 2;
+        block /= 2;
+    }
+    return tree->depth;
+}
+
+#pragma endregion Tree
+
+#pragma region Verification
+
+bool merkle_verify_proof(const sha256hash* root, const sha256hash* hash, size_t index,
+                         const sha256hash* proof, size_t depth) {
+    if(depth < sizeof(size_t) * 8 && (index >> depth) != 0) return false;
+
+    sha256hash node = *hash;
+    for(size_t i = 0; i < depth; ++i) {
+        node = index & 1 ? sha256_pair(&proof[i], &node) : sha256_pair(&node, &proof[i]);
+        index >>= 1;
+    }
+    return memcmp(node.bytes, root->bytes, sizeof(node.bytes)) == 0;
+}
+
+bool merkle_verify_block(const sha256hash* root, uint64_t file_length, size_t block,
+                         const uint8_t* data, size_t len, const sha256hash* proof) {
+    const size_t blocks = merkle_block_count(file_length);
+    if(block >= blocks) return false;
+
+    const uint64_t start = (uint64_t)block * MERKLE_BLOCK_SIZE;
+    const uint64_t expected = file_length - start < MERKLE_BLOCK_SIZE ? file_length - start : MERKLE_BLOCK_SIZE;
+    if(len != expected) return false;
+
+    size_t depth = 0;
+    while(((size_t)1 << depth) < blocks) depth++;
+
+    const sha256hash leaf = sha256(data, len);
+    return merkle_verify_proof(root, &leaf, block, proof, depth);
+}
+
+bool merkle_verify_piece_layer(const sha256hash* root, uint64_t file_length, uint64_t piece_length,
+                               const sha256hash* layer) {
+    size_t level;
+    if(!merkle_piece_level(piece_length, &level)) return false;
+
+    const size_t count = merkle_piece_count(file_length, piece_length);
+    if(count == 0) return false;
+
+    // the piece layer of the padded tree, the pieces past the file's end hash padding only
+    const size_t width = merkle_next_pow2(merkle_block_count(file_length)) >> level;
+    sha256hash computed;
+    if(!merkle_root(layer, count, width, level, &computed)) return false;
+    return memcmp(computed.bytes, root->bytes, sizeof(computed.bytes)) == 0;
+}
+
+bool merkle_verify_piece(const sha256hash* piece_hash, uint64_t piece_length,
+                         const uint8_t* data, size_t len) {
+    size_t level;
+    if(!merkle_piece_level(piece_length, &level)) return false;
+    if(len == 0 || len > piece_length) return false;
+
+    const size_t count = merkle_block_count(len);
+    sha256hash* leaves = malloc(count * sizeof(sha256hash));
+    if(!leaves) return false;
+
+    merkle_hash_blocks(data, len, 1, leaves);
+    sha256hash computed;
+    const bool ok = merkle_root(leaves, count, (size_t)1 << level, 0, &computed) &&
+                    memcmp(computed.bytes, piece_hash->bytes, sizeof(computed.bytes)) == 0;
+    free(leaves);
+    return ok;
+}
+
+#pragma endregion Verification
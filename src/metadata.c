@@ -0,0 +1,544 @@
+#include "metadata.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bitfield.h"
+
+// ut_metadata msg_type values
+#define METADATA_MSG_REQUEST    0
+#define METADATA_MSG_DATA       1
+#define METADATA_MSG_REJECT     2
+
+// peers asked for the same piece at most, once every missing piece was asked for somewhere
+#define METADATA_MAX_ASKED      2
+
+struct MetadataAssembler {
+    sha1hash    info_hash;
+    uint8_t*    data;
+    size_t      size;
+    size_t      piece_count;
+    uint8_t*    have;
+    size_t      missing;
+    size_t      hashed;         // pieces fed to hash, a prefix of the ones we have
+    sha1_ctx    hash;
+    bool        complete;
+};
+
+typedef struct MetadataPeer {
+    PeerConn*               conn;
+    uint8_t                 remote_id;      // the peer's ut_metadata id, 0 until its extension handshake
+    size_t                  size;           // the metadata_size it announced, 0 until then
+    size_t                  requests[METADATA_PIPELINE];
+    size_t                  request_count;
+    struct MetadataPeer*    prev;
+    struct MetadataPeer*    next;
+} MetadataPeer;
+
+/* A metadata_size some peer announced that failed the infohash check */
+typedef struct MetadataFailure {
+    size_t  size;
+    size_t  count;
+} MetadataFailure;
+
+struct MetadataFetch {
+    sha1hash            info_hash;
+    MetadataAssembler*  assembler;      // for one of the announced sizes, only its peers are asked
+    uint8_t*            requested;      // peers asked for each piece, at most METADATA_MAX_ASKED
+    MetadataPeer*       peers;
+    MetadataFailure*    failures;
+    size_t              failure_count;
+    MetadataFetchStats  stats;
+};
+
+#pragma region Assembler
+
+static size_t metadata_piece_len(const MetadataAssembler* assembler, size_t piece) {
+    const size_t begin = piece * METADATA_PIECE_SIZE;
+    return assembler->size - begin < METADATA_PIECE_SIZE ? assembler->size - begin : METADATA_PIECE_SIZE;
+}
+
+static void metadata_reset(MetadataAssembler* assembler) {
+    memset(assembler->have, 0, BITFIELD_BYTES(assembler->piece_count));
+    assembler->missing = assembler->piece_count;
+    assembler->hashed = 0;
+    sha1_init(&assembler->hash);
+}
+
+MetadataAssembler* metadata_assembler_new(const sha1hash* info_hash, size_t size) {
+    if(size == 0 || size > METADATA_MAX_SIZE) return NULL;
+
+    MetadataAssembler* assembler = calloc(1, sizeof(*assembler));
+    if(!assembler) return NULL;
+
+    assembler->info_hash = *info_hash;
+    assembler->size = size;
+    assembler->piece_count = (size + METADATA_PIECE_SIZE - 1) / METADATA_PIECE_SIZE;
+    assembler->data = malloc(size);
+    assembler->have = malloc(BITFIELD_BYTES(assembler->piece_count));
+    if(!assembler->data || !assembler->have) {
+        metadata_assembler_free(assembler);
+        return NULL;
+    }
+    metadata_reset(assembler);
+    return assembler;
+}
+
+void metadata_assembler_free(MetadataAssembler* assembler) {
+    if(!assembler) return;
+
+    free(assembler->data);
+    free(assembler->have);
+    free(assembler);
+}
+
+size_t metadata_size(const MetadataAssembler* assembler) {
+    return assembler->size;
+}
+
+size_t metadata_piece_count(const MetadataAssembler* assembler) {
+    return assembler->piece_count;
+}
+
+bool metadata_have_piece(const MetadataAssembler* assembler, size_t piece) {
+    return piece < assembler->piece_count && bitfield_get(assembler->have, piece);
+}
+
+size_t metadata_missing(const MetadataAssembler* assembler) {
+    return assembler->missing;
+}
+
+MetadataResult metadata_add_piece(MetadataAssembler* assembler, size_t piece, const uint8_t* data, size_t len) {
+    if(!assembler->data || piece >= assembler->piece_count || len != metadata_piece_len(assembler, piece)) {
+        return METADATA_INVALID;
+    }
+    if(assembler->complete) return METADATA_COMPLETE;
+    if(bitfield_get(assembler->have, piece)) return METADATA_STORED;
+
+    memcpy(assembler->data + piece * METADATA_PIECE_SIZE, data, len);
+    bitfield_set(assembler->have, piece);
+    assembler->missing--;
+
+    // hash whatever became contiguous, so only the tail is left once the last piece is in
+    while(assembler->hashed < assembler->piece_count && bitfield_get(assembler->have, assembler->hashed)) {
+        sha1_update(&assembler->hash, assembler->data + assembler->hashed * METADATA_PIECE_SIZE,
+                    metadata_piece_len(assembler, assembler->hashed));
+        assembler->hashed++;
+    }
+    if(assembler->missing > 0) return METADATA_STORED;
+
+    const sha1hash hash = sha1_final(&assembler->hash);
+    if(memcmp(hash.bytes, assembler->info_hash.bytes, sizeof(hash.bytes)) != 0) {
+        // nothing tells which piece was bad, so all of them are fetched again
+        metadata_reset(assembler);
+        return METADATA_HASH_FAILED;
+    }
+    assembler->complete = true;
+    return METADATA_COMPLETE;
+}
+
+BDocument* metadata_take_document(MetadataAssembler* assembler, const BDecodeOptions* opts) {
+    if(!assembler->complete || !assembler->data) return NULL;
+
+    BDocument* doc = bencode_document_from_buffer((char*)assembler->data, assembler->size, opts);
+    if(doc) assembler->data = NULL;
+    return doc;
+}
+
+#pragma endregion Assembler
+
+#pragma region Messages
+
+/* The payload of msg in one piece: in place unless it wraps around the ring, else copied to *copy */
+static const uint8_t* metadata_payload(const PeerMessage* msg, uint8_t** copy) {
+    *copy = NULL;
+    if(msg->payload_count <= 1) return msg->payload_len ? msg->payload[0].iov_base : (const uint8_t*)"";
+
+    *copy = malloc(msg->payload_len);
+    if(!*copy) return NULL;
+    memcpy(*copy, msg->payload[0].iov_base, msg->payload[0].iov_len);
+    memcpy(*copy + msg->payload[0].iov_len, msg->payload[1].iov_base, msg->payload[1].iov_len);
+    return *copy;
+}
+
+static bool metadata_get_int(const BNode* dict, const char* key, long long* out) {
+    const BNode* node = bencode_find_node_by_key(dict, key);
+    if(!node || node->type != BINT) return false;
+
+    *out = node->value.bint.value;
+    return true;
+}
+
+/* Our extension handshake; size 0 leaves metadata_size out */
+static bool metadata_write_handshake(PeerRing* output, size_t size) {
+    char dict[96];
+    int len = size ? snprintf(dict, sizeof(dict), "d1:md11:ut_metadatai%dee13:metadata_sizei%zuee", METADATA_LOCAL_ID, size)
+                   : snprintf(dict, sizeof(dict), "d1:md11:ut_metadatai%deee", METADATA_LOCAL_ID);
+    return peer_write_extended(output, PEER_EXTENDED_HANDSHAKE, dict, (size_t)len, NULL, 0);
+}
+
+/* A ut_metadata message without data (request or reject), sent with the peer's id */
+static bool metadata_write_message(PeerRing* output, uint8_t remote_id, int type, size_t piece) {
+    char dict[64];
+    int len = snprintf(dict, sizeof(dict), "d8:msg_typei%de5:piecei%zuee", type, piece);
+    return peer_write_extended(output, remote_id, dict, (size_t)len, NULL, 0);
+}
+
+/* The peer's ut_metadata id from its extension handshake, 0 if it has none */
+static uint8_t metadata_remote_id(const BNode* handshake) {
+    long long id;
+    if(!metadata_get_int(bencode_find_node_by_key(handshake, "m"), "ut_metadata", &id)) return 0;
+    return id > 0 && id <= UINT8_MAX ? (uint8_t)id : 0;
+}
+
+#pragma endregion Messages
+
+#pragma region Fetching
+
+static bool metadata_peer_requested(const MetadataPeer* peer, size_t piece) {
+    for(size_t i = 0; i < peer->request_count; ++i) {
+        if(peer->requests[i] == piece) return true;
+    }
+    return false;
+}
+
+/* Forget the peer's request for piece, if it had one */
+static void metadata_peer_forget(MetadataFetch* fetch, MetadataPeer* peer, size_t piece) {
+    for(size_t i = 0; i < peer->request_count; ++i) {
+        if(peer->requests[i] != piece) continue;
+
+        peer->requests[i] = peer->requests[--peer->request_count];
+        fetch->requested[piece]--;
+        return;
+    }
+}
+
+/* Next piece to ask the peer for: a missing one nobody was asked for, else one somebody else was */
+static bool metadata_pick(const MetadataFetch* fetch, const MetadataPeer* peer, size_t* piece) {
+    const MetadataAssembler* assembler = fetch->assembler;
+    size_t shared = SIZE_MAX;
+    for(size_t i = 0; i < assembler->piece_count; ++i) {
+        if(bitfield_get(assembler->have, i) || metadata_peer_requested(peer, i)) continue;
+        if(fetch->requested[i] == 0) {
+            *piece = i;
+            return true;
+        }
+        if(shared == SIZE_MAX && fetch->requested[i] < METADATA_MAX_ASKED) shared = i;
+    }
+    *piece = shared;
+    return shared != SIZE_MAX;
+}
+
+static void metadata_fill(MetadataFetch* fetch, MetadataPeer* peer) {
+    if(!fetch->assembler || fetch->assembler->complete || peer->remote_id == 0) return;
+    if(peer->size != fetch->assembler->size) return;
+
+    size_t piece;
+    while(peer->request_count < METADATA_PIPELINE && metadata_pick(fetch, peer, &piece)) {
+        if(!metadata_write_message(peer_conn_output(peer->conn), peer->remote_id, METADATA_MSG_REQUEST, piece)) break;
+
+        peer->requests[peer->request_count++] = piece;
+        fetch->requested[piece]++;
+    }
+}
+
+static void metadata_fill_all(MetadataFetch* fetch) {
+    for(MetadataPeer* peer = fetch->peers; peer; peer = peer->next) {
+        metadata_fill(fetch, peer);
+    }
+}
+
+static size_t metadata_failures(const MetadataFetch* fetch, size_t size) {
+    for(size_t i = 0; i < fetch->failure_count; ++i) {
+        if(fetch->failures[i].size == size) return fetch->failures[i].count;
+    }
+    return 0;
+}
+
+static bool metadata_record_failure(MetadataFetch* fetch, size_t size) {
+    for(size_t i = 0; i < fetch->failure_count; ++i) {
+        if(fetch->failures[i].size != size) continue;
+        fetch->failures[i].count++;
+        return true;
+    }
+
+    MetadataFailure* failures = realloc(fetch->failures, (fetch->failure_count + 1) * sizeof(*failures));
+    if(!failures) return false;
+    failures[fetch->failure_count++] = (MetadataFailure){ .size = size, .count = 1 };
+    fetch->failures = failures;
+    return true;
+}
+
+static size_t metadata_announced(const MetadataFetch* fetch, size_t size) {
+    size_t count = 0;
+    for(const MetadataPeer* peer = fetch->peers; peer; peer = peer->next) {
+        count += peer->remote_id != 0 && peer->size == size;
+    }
+    return count;
+}
+
+/* Drop the assembler and every outstanding request, late answers are ignored by their total_size */
+static void metadata_drop_assembler(MetadataFetch* fetch) {
+    metadata_assembler_free(fetch->assembler);
+    fetch->assembler = NULL;
+    free(fetch->requested);
+    fetch->requested = NULL;
+    for(MetadataPeer* peer = fetch->peers; peer; peer = peer->next) {
+        peer->request_count = 0;
+    }
+}
+
+/*
+ * Fetch the size that failed the infohash check least often, the one most peers announced
+ * on a tie. Which peer connected first does not matter, the infohash tells the right size.
+ */
+static void metadata_choose_size(MetadataFetch* fetch) {
+    if(fetch->assembler) return;
+
+    size_t best = 0;
+    size_t best_failures = 0;
+    size_t best_peers = 0;
+    for(const MetadataPeer* peer = fetch->peers; peer; peer = peer->next) {
+        if(peer->remote_id == 0 || peer->size == 0 || peer->size == best) continue;
+
+        const size_t failures = metadata_failures(fetch, peer->size);
+        const size_t peers = metadata_announced(fetch, peer->size);
+        if(best == 0 || failures < best_failures || (failures == best_failures && peers > best_peers)) {
+            best = peer->size;
+            best_failures = failures;
+            best_peers = peers;
+        }
+    }
+    if(best == 0) return;
+
+    fetch->assembler = metadata_assembler_new(&fetch->info_hash, best);
+    fetch->requested = fetch->assembler ? calloc(fetch->assembler->piece_count, 1) : NULL;
+    if(!fetch->requested) {
+        metadata_drop_assembler(fetch);
+        return;
+    }
+    metadata_fill_all(fetch);
+}
+
+static PeerAction metadata_on_handshake(MetadataFetch* fetch, MetadataPeer* peer, const BNode* dict) {
+    peer->remote_id = metadata_remote_id(dict);
+    if(peer->remote_id == 0) return PEER_DISCONNECT;
+
+    long long size;
+    if(!metadata_get_int(dict, "metadata_size", &size) || size <= 0 || size > METADATA_MAX_SIZE) return PEER_DISCONNECT;
+
+    // peers that disagree are kept, the one that is fetched is decided by metadata_choose_size
+    peer->size = (size_t)size;
+    if(fetch->assembler) metadata_fill(fetch, peer);
+    else metadata_choose_size(fetch);
+    return PEER_CONTINUE;
+}
+
+static PeerAction metadata_on_data(MetadataFetch* fetch, MetadataPeer* peer, size_t piece,
+                                   const uint8_t* data, size_t len) {
+    metadata_peer_forget(fetch, peer, piece);
+    fetch->stats.pieces_received++;
+
+    switch(metadata_add_piece(fetch->assembler, piece, data, len)) {
+        case METADATA_INVALID:
+            return PEER_DISCONNECT;
+        case METADATA_HASH_FAILED:
+            // a bad piece or the wrong size: start over with the size that failed least
+            fetch->stats.hash_failures++;
+            if(!metadata_record_failure(fetch, fetch->assembler->size)) return PEER_DISCONNECT;
+            metadata_drop_assembler(fetch);
+            metadata_choose_size(fetch);
+            break;
+        case METADATA_STORED:
+            metadata_fill(fetch, peer);
+            break;
+        case METADATA_COMPLETE:
+            break;
+    }
+    return PEER_CONTINUE;
+}
+
+static bool metadata_on_connect(void* user, PeerConn* conn, const PeerHandshake* remote) {
+    MetadataFetch* fetch = user;
+    if(!(remote->reserved[PEER_EXTENSION_BYTE] & PEER_EXTENSION_BIT)) return false;
+
+    MetadataPeer* peer = calloc(1, sizeof(*peer));
+    if(!peer) return false;
+    if(!metadata_write_handshake(peer_conn_output(conn), 0)) {
+        free(peer);
+        return false;
+    }
+
+    peer->conn = conn;
+    peer->next = fetch->peers;
+    if(fetch->peers) fetch->peers->prev = peer;
+    fetch->peers = peer;
+    fetch->stats.peers++;
+    peer_conn_set_user(conn, peer);
+    return true;
+}
+
+static PeerAction metadata_on_message(void* user, PeerConn* conn, const PeerMessage* msg) {
+    MetadataFetch* fetch = user;
+    MetadataPeer* peer = peer_conn_user(conn);
+    if(msg->type != PEER_MSG_EXTENDED) return PEER_CONTINUE;
+    if(msg->index != PEER_EXTENDED_HANDSHAKE && msg->index != METADATA_LOCAL_ID) return PEER_CONTINUE;
+
+    uint8_t* copy;
+    const uint8_t* payload = metadata_payload(msg, &copy);
+    if(!payload) return PEER_DISCONNECT;
+
+    // a data message is the dict followed by the piece, which is not part of the bencoding
+    size_t consumed = 0;
+    BNode* dict = bencode_decode_buffer((const char*)payload, msg->payload_len, &consumed);
+    PeerAction action = PEER_CONTINUE;
+    long long type, piece, total;
+    if(!dict || dict->type != BDICT) {
+        action = PEER_DISCONNECT;
+    } else if(msg->index == PEER_EXTENDED_HANDSHAKE) {
+        action = metadata_on_handshake(fetch, peer, dict);
+    } else if(peer->remote_id == 0 || !metadata_get_int(dict, "msg_type", &type)) {
+        action = PEER_DISCONNECT;
+    } else if(type != METADATA_MSG_REQUEST && type != METADATA_MSG_DATA && type != METADATA_MSG_REJECT) {
+        // BEP 9: unknown message types are ignored
+        action = PEER_CONTINUE;
+    } else if(!metadata_get_int(dict, "piece", &piece) || piece < 0) {
+        action = PEER_DISCONNECT;
+    } else if(type == METADATA_MSG_REQUEST) {
+        // nothing to serve yet
+        action = metadata_write_message(peer_conn_output(conn), peer->remote_id, METADATA_MSG_REJECT, (size_t)piece)
+                     ? PEER_CONTINUE : PEER_BLOCKED;
+    } else if(type == METADATA_MSG_DATA) {
+        // an answer for a size no longer fetched (or never asked for) is dropped, not held against the peer
+        if(!metadata_get_int(dict, "total_size", &total)) total = (long long)peer->size;
+        if(fetch->assembler && total > 0 && (size_t)total == fetch->assembler->size) {
+            action = metadata_on_data(fetch, peer, (size_t)piece, payload + consumed, msg->payload_len - consumed);
+        } else {
+            metadata_peer_forget(fetch, peer, (size_t)piece);
+        }
+    } else {
+        // a reject: it cannot or will not serve the metadata, which is all this connection is for
+        action = PEER_DISCONNECT;
+    }
+
+    bencode_free_node(dict);
+    free(copy);
+    return action;
+}
+
+static void metadata_on_close(void* user, PeerConn* conn) {
+    MetadataFetch* fetch = user;
+    MetadataPeer* peer = peer_conn_user(conn);
+
+    while(peer->request_count > 0) {
+        metadata_peer_forget(fetch, peer, peer->requests[0]);
+    }
+    if(peer->prev) peer->prev->next = peer->next;
+    else fetch->peers = peer->next;
+    if(peer->next) peer->next->prev = peer->prev;
+    fetch->stats.peers--;
+    free(peer);
+
+    // its pieces go to the others; if it was the last one with this size, another size gets a turn
+    if(fetch->assembler && !fetch->assembler->complete && metadata_announced(fetch, fetch->assembler->size) == 0) {
+        metadata_drop_assembler(fetch);
+        metadata_choose_size(fetch);
+    }
+    metadata_fill_all(fetch);
+}
+
+MetadataFetch* metadata_fetch_new(const sha1hash* info_hash) {
+    MetadataFetch* fetch = calloc(1, sizeof(*fetch));
+    if(!fetch) return NULL;
+
+    fetch->info_hash = *info_hash;
+    return fetch;
+}
+
+void metadata_fetch_free(MetadataFetch* fetch) {
+    if(!fetch) return;
+
+    while(fetch->peers) {
+        MetadataPeer* next = fetch->peers->next;
+        free(fetch->peers);
+        fetch->peers = next;
+    }
+    metadata_assembler_free(fetch->assembler);
+    free(fetch->requested);
+    free(fetch->failures);
+    free(fetch);
+}
+
+PeerHandler metadata_fetch_handler(MetadataFetch* fetch) {
+    return (PeerHandler){
+        .user = fetch,
+        .on_connect = metadata_on_connect,
+        .on_message = metadata_on_message,
+        .on_close = metadata_on_close,
+    };
+}
+
+bool metadata_fetch_complete(const MetadataFetch* fetch) {
+    return fetch->assembler && fetch->assembler->complete;
+}
+
+void metadata_fetch_get_stats(const MetadataFetch* fetch, MetadataFetchStats* stats) {
+    *stats = fetch->stats;
+}
+
+BDocument* metadata_fetch_take_document(MetadataFetch* fetch) {
+    return fetch->assembler ? metadata_take_document(fetch->assembler, NULL) : NULL;
+}
+
+#pragma endregion Fetching
+
+#pragma region Serving
+
+bool metadata_source_connect(const MetadataSource* source, PeerConn* conn, const PeerHandshake* remote) {
+    if(!(remote->reserved[PEER_EXTENSION_BYTE] & PEER_EXTENSION_BIT)) return true;
+    return metadata_write_handshake(peer_conn_output(conn), source->len);
+}
+
+PeerAction metadata_source_message(const MetadataSource* source, PeerConn* conn, const PeerMessage* msg) {
+    if(msg->type != PEER_MSG_EXTENDED) return PEER_CONTINUE;
+    if(msg->index != PEER_EXTENDED_HANDSHAKE && msg->index != METADATA_LOCAL_ID) return PEER_CONTINUE;
+
+    uint8_t* copy;
+    const uint8_t* payload = metadata_payload(msg, &copy);
+    if(!payload) return PEER_DISCONNECT;
+
+    BNode* dict = bencode_decode_buffer((const char*)payload, msg->payload_len, NULL);
+    const uint8_t remote_id = (uint8_t)(uintptr_t)peer_conn_user(conn);
+    PeerAction action = PEER_DISCONNECT;
+    long long type, piece;
+    if(!dict || dict->type != BDICT) {
+        action = PEER_DISCONNECT;
+    } else if(msg->index == PEER_EXTENDED_HANDSHAKE) {
+        peer_conn_set_user(conn, (void*)(uintptr_t)metadata_remote_id(dict));
+        action = PEER_CONTINUE;
+    } else if(remote_id == 0 || !metadata_get_int(dict, "msg_type", &type) || !metadata_get_int(dict, "piece", &piece)) {
+        action = PEER_DISCONNECT;
+    } else if(type != METADATA_MSG_REQUEST) {
+        action = PEER_CONTINUE;
+    } else if(piece < 0 || (size_t)piece >= (source->len + METADATA_PIECE_SIZE - 1) / METADATA_PIECE_SIZE) {
+        action = metadata_write_message(peer_conn_output(conn), remote_id, METADATA_MSG_REJECT, (size_t)(piece < 0 ? 0 : piece))
+                     ? PEER_CONTINUE : PEER_BLOCKED;
+    } else {
+        const size_t begin = (size_t)piece * METADATA_PIECE_SIZE;
+        const size_t len = source->len - begin < METADATA_PIECE_SIZE ? source->len - begin : METADATA_PIECE_SIZE;
+
+        char header[96];
+        const int header_len = snprintf(header, sizeof(header), "d8:msg_typei%de5:piecei%llde10:total_sizei%zuee",
+                                        METADATA_MSG_DATA, piece, source->len);
+        action = peer_write_extended(peer_conn_output(conn), remote_id, header, (size_t)header_len, source->data + begin, len)
+                     ? PEER_CONTINUE : PEER_BLOCKED;
+    }
+
+    bencode_free_node(dict);
+    free(copy);
+    return action;
+}
+
+#pragma endregion Serving
@@ -0,0 +1,473 @@
+#define _GNU_SOURCE     // accept4
+
+#include "peer_engine.h"
+
+#include <errno.h>
+#include <netinet/tcp.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "stats.h"
+
+#define PEER_EPOLL_EVENTS       256
+#define PEER_ACCEPT_BATCH       64      // connections accepted per listen event, the rest wait for the next round
+
+typedef enum PeerConnState {
+    PEER_CONN_FREE,
+    PEER_CONN_CONNECTING,   // outgoing, waiting for connect to finish
+    PEER_CONN_HANDSHAKE,    // waiting for the remote handshake
+    PEER_CONN_ACTIVE,
+    PEER_CONN_CLOSING,      // socket closed, released at the end of the poll round
+} PeerConnState;
+
+struct PeerConn {
+    PeerEngine*     engine;
+    int             fd;
+    PeerConnState   state;
+    bool            outgoing;
+    bool            readable;       // the socket may have input: an edge was seen and no EAGAIN since
+    bool            writable;       // likewise for output
+    bool            blocked;        // the handler returned PEER_BLOCKED for the message at the head of input
+    bool            scheduled;      // on the engine's service list
+    bool            connected;      // on_connect accepted the peer, on_close is owed
+    bool            listed_blocked; // on the engine's blocked list, possibly since before it was reused
+    PeerRing        input;
+    PeerRing        output;
+    void*           user;
+    PeerConn*       next;           // free list or close list
+    PeerConn*       next_scheduled;
+    PeerConn*       next_blocked;
+};
+
+typedef struct PeerWatch {
+    int         fd;
+    void        (*on_ready)(void* user);
+    void*       user;
+} PeerWatch;
+
+struct PeerEngine {
+    int                 epoll_fd;
+    int                 listen_fd;
+    PeerEngineOptions   opts;
+    PeerConn*           conns;
+    PeerConn*           free_list;
+    PeerConn*           close_list;
+    PeerConn*           scheduled;      // connections with output queued outside of their own service
+    PeerConn*           servicing;
+    PeerConn*           blocked;        // connections whose handler returned PEER_BLOCKED, see peer_engine_resume
+    PeerWatch           watch;
+    size_t              peers;
+    struct epoll_event  events[PEER_EPOLL_EVENTS];
+};
+
+#pragma region Connections
+
+static void peer_conn_schedule(PeerConn* conn) {
+    PeerEngine* engine = conn->engine;
+    if(conn->scheduled || conn == engine->servicing) return;
+
+    conn->scheduled = true;
+    conn->next_scheduled = engine->scheduled;
+    engine->scheduled = conn;
+}
+
+static PeerConn* peer_conn_open(PeerEngine* engine, int fd, bool outgoing) {
+    PeerConn* conn = engine->free_list;
+    if(!conn) return NULL;
+
+    if(!peer_ring_init(&conn->input, engine->opts.ring_size) ||
+       !peer_ring_init(&conn->output, engine->opts.ring_size)) {
+        peer_ring_free(&conn->input);
+        return NULL;
+    }
+
+    // registered once for both directions, edges are tracked in readable/writable
+    struct epoll_event event = { .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, .data.ptr = conn };
+    if(epoll_ctl(engine->epoll_fd, EPOLL_CTL_ADD, fd, &event) != 0) {
+        peer_ring_free(&conn->input);
+        peer_ring_free(&conn->output);
+        return NULL;
+    }
+
+    const int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    engine->free_list = conn->next;
+    conn->fd = fd;
+    conn->state = outgoing ? PEER_CONN_CONNECTING : PEER_CONN_HANDSHAKE;
+    conn->outgoing = outgoing;
+    conn->readable = false;
+    conn->writable = false;
+    conn->blocked = false;
+    conn->scheduled = false;
+    conn->connected = false;
+    conn->user = NULL;
+    conn->next = NULL;
+    engine->peers++;
+    return conn;
+}
+
+void peer_conn_close(PeerConn* conn) {
+    if(conn->state == PEER_CONN_FREE || conn->state == PEER_CONN_CLOSING) return;
+
+    PeerEngine* engine = conn->engine;
+    close(conn->fd);
+    conn->fd = -1;
+    conn->state = PEER_CONN_CLOSING;
+    conn->next = engine->close_list;
+    engine->close_list = conn;
+    engine->peers--;
+}
+
+/* Hand closed connections back to the free list, once no event of this round can refer to them */
+static void peer_engine_release(PeerEngine* engine) {
+    while(engine->close_list) {
+        PeerConn* conn = engine->close_list;
+        engine->close_list = conn->next;
+
+        if(conn->connected && engine->opts.handler.on_close) {
+            engine->opts.handler.on_close(engine->opts.handler.user, conn);
+        }
+        peer_ring_free(&conn->input);
+        peer_ring_free(&conn->output);
+        conn->state = PEER_CONN_FREE;
+        conn->next = engine->free_list;
+        engine->free_list = conn;
+    }
+}
+
+PeerRing* peer_conn_output(PeerConn* conn) {
+    peer_conn_schedule(conn);
+    return &conn->output;
+}
+
+void peer_conn_set_user(PeerConn* conn, void* user) {
+    conn->user = user;
+}
+
+void* peer_conn_user(const PeerConn* conn) {
+    return conn->user;
+}
+
+#pragma endregion Connections
+
+#pragma region Service
+
+static bool peer_conn_handshake(PeerConn* conn) {
+    PeerEngine* engine = conn->engine;
+
+    PeerHandshake remote;
+    const int status = peer_parse_handshake(&conn->input, &remote);
+    if(status == 0) return false;
+    if(status < 0 || memcmp(&remote.info_hash, &engine->opts.info_hash, sizeof(remote.info_hash)) != 0) {
+        peer_conn_close(conn);
+        return false;
+    }
+    peer_ring_consume(&conn->input, PEER_HANDSHAKE_LEN);
+
+    // an incoming peer learns who we are only once it named a torrent we serve
+    if(!conn->outgoing) {
+        PeerHandshake local = { .info_hash = engine->opts.info_hash };
+        memcpy(local.reserved, engine->opts.reserved, sizeof(local.reserved));
+        memcpy(local.peer_id, engine->opts.peer_id, PEER_ID_LEN);
+        peer_write_handshake(&conn->output, &local);
+    }
+
+    conn->state = PEER_CONN_ACTIVE;
+    const PeerHandler* handler = &engine->opts.handler;
+    if(handler->on_connect && !handler->on_connect(handler->user, conn, &remote)) {
+        peer_conn_close(conn);
+        return false;
+    }
+    conn->connected = true;
+    return true;
+}
+
+/* Hand complete messages at the head of input to the handler; returns whether any was consumed */
+static bool peer_conn_dispatch(PeerConn* conn) {
+    const PeerHandler* handler = &conn->engine->opts.handler;
+    bool progress = false;
+
+    if(conn->state == PEER_CONN_HANDSHAKE) progress = peer_conn_handshake(conn);
+
+    while(conn->state == PEER_CONN_ACTIVE && !conn->blocked) {
+        PeerMessage msg;
+        const int status = peer_parse_message(&conn->input, conn->input.cap - 4, &msg);
+        if(status == 0) break;
+        if(status < 0) {
+            peer_conn_close(conn);
+            break;
+        }
+
+        STATS_ADD(STAT_NET_MESSAGES_IN, 1);
+        const PeerAction action = handler->on_message ? handler->on_message(handler->user, conn, &msg) : PEER_CONTINUE;
+        if(action == PEER_BLOCKED) {
+            conn->blocked = true;
+            if(!conn->listed_blocked) {
+                conn->listed_blocked = true;
+                conn->next_blocked = conn->engine->blocked;
+                conn->engine->blocked = conn;
+            }
+            break;
+        }
+        if(action == PEER_DISCONNECT) {
+            peer_conn_close(conn);
+            break;
+        }
+        peer_ring_consume(&conn->input, msg.size);
+        progress = true;
+    }
+    return progress;
+}
+
+static bool peer_conn_receive(PeerConn* conn) {
+    struct iovec iov[2];
+    struct msghdr msg = { .msg_iov = iov, .msg_iovlen = (size_t)peer_ring_reserve(&conn->input, iov) };
+
+    const ssize_t n = recvmsg(conn->fd, &msg, 0);
+    if(n > 0) {
+        peer_ring_commit(&conn->input, (size_t)n);
+        STATS_ADD(STAT_NET_BYTES_IN, n);
+        return true;
+    }
+    if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) conn->readable = false;
+    else if(!(n < 0 && errno == EINTR)) peer_conn_close(conn);     // orderly shutdown or a socket error
+    return false;
+}
+
+static bool peer_conn_send(PeerConn* conn) {
+    struct iovec iov[2];
+    struct msghdr msg = { .msg_iov = iov };
+    msg.msg_iovlen = (size_t)peer_ring_peek(&conn->output, 0, peer_ring_used(&conn->output), iov);
+
+    const ssize_t n = sendmsg(conn->fd, &msg, MSG_NOSIGNAL);
+    if(n > 0) {
+        peer_ring_consume(&conn->output, (size_t)n);
+        STATS_ADD(STAT_NET_BYTES_OUT, n);
+        conn->blocked = false;      // there is room for whatever the handler could not answer
+        return true;
+    }
+    if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) conn->writable = false;
+    else if(!(n < 0 && errno == EINTR)) peer_conn_close(conn);
+    return false;
+}
+
+/*
+ * Move data until the connection stalls: read while the socket has input and the ring
+ * has room, dispatch complete messages, write while there is output and the socket takes
+ * it. Edge-triggered events only say something changed, so each direction is driven
+ * until EAGAIN.
+ */
+static void peer_conn_service(PeerConn* conn) {
+    PeerEngine* engine = conn->engine;
+    engine->servicing = conn;
+
+    bool progress = true;
+    while(progress && conn->state != PEER_CONN_CLOSING) {
+        progress = false;
+        if(conn->readable && peer_ring_space(&conn->input) > 0) progress |= peer_conn_receive(conn);
+        if(conn->state == PEER_CONN_CLOSING) break;
+        progress |= peer_conn_dispatch(conn);
+        if(conn->state == PEER_CONN_CLOSING) break;
+        if(conn->writable && peer_ring_used(&conn->output) > 0) progress |= peer_conn_send(conn);
+    }
+
+    engine->servicing = NULL;
+}
+
+static void peer_conn_connected(PeerConn* conn) {
+    int error = 0;
+    socklen_t len = sizeof(error);
+    if(getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &error, &len) != 0 || error != 0) {
+        peer_conn_close(conn);
+        return;
+    }
+
+    PeerEngine* engine = conn->engine;
+    PeerHandshake local = { .info_hash = engine->opts.info_hash };
+    memcpy(local.reserved, engine->opts.reserved, sizeof(local.reserved));
+    memcpy(local.peer_id, engine->opts.peer_id, PEER_ID_LEN);
+    peer_write_handshake(&conn->output, &local);
+    conn->state = PEER_CONN_HANDSHAKE;
+}
+
+static void peer_engine_accept(PeerEngine* engine) {
+    for(size_t i = 0; i < PEER_ACCEPT_BATCH; ++i) {
+        const int fd = accept4(engine->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if(fd < 0) {
+            if(errno == EINTR || errno == ECONNABORTED) continue;
+            return;
+        }
+        if(!peer_conn_open(engine, fd, false)) close(fd);
+    }
+}
+
+/* Service connections that got output from elsewhere, then release the closed ones */
+static void peer_engine_settle(PeerEngine* engine) {
+    while(engine->scheduled || engine->close_list) {
+        while(engine->scheduled) {
+            PeerConn* conn = engine->scheduled;
+            engine->scheduled = conn->next_scheduled;
+            conn->scheduled = false;
+            if(conn->state == PEER_CONN_HANDSHAKE || conn->state == PEER_CONN_ACTIVE) peer_conn_service(conn);
+        }
+        // on_close may queue output on other connections, hence the outer loop
+        peer_engine_release(engine);
+    }
+}
+
+#pragma endregion Service
+
+#pragma region Public
+
+PeerEngine* peer_engine_new(const PeerEngineOptions* opts) {
+    PeerEngine* engine = calloc(1, sizeof(*engine));
+    if(!engine) return NULL;
+
+    engine->opts = *opts;
+    if(engine->opts.max_peers == 0) engine->opts.max_peers = PEER_DEFAULT_MAX_PEERS;
+    if(engine->opts.ring_size == 0) engine->opts.ring_size = PEER_DEFAULT_RING_SIZE;
+    engine->listen_fd = -1;
+    engine->watch.fd = -1;
+    engine->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    engine->conns = calloc(engine->opts.max_peers, sizeof(PeerConn));
+    const size_t ring_size = engine->opts.ring_size;
+    if(engine->epoll_fd < 0 || !engine->conns || ring_size < 2 * PEER_HANDSHAKE_LEN || (ring_size & (ring_size - 1)) != 0) {
+        if(engine->epoll_fd >= 0) close(engine->epoll_fd);
+        free(engine->conns);
+        free(engine);
+        return NULL;
+    }
+
+    for(size_t i = engine->opts.max_peers; i-- > 0;) {
+        PeerConn* conn = &engine->conns[i];
+        conn->engine = engine;
+        conn->fd = -1;
+        conn->next = engine->free_list;
+        engine->free_list = conn;
+    }
+    return engine;
+}
+
+void peer_engine_free(PeerEngine* engine) {
+    if(!engine) return;
+
+    for(size_t i = 0; i < engine->opts.max_peers; ++i) {
+        peer_conn_close(&engine->conns[i]);
+    }
+    engine->scheduled = NULL;
+    peer_engine_release(engine);
+
+    if(engine->listen_fd >= 0) close(engine->listen_fd);
+    close(engine->epoll_fd);
+    free(engine->conns);
+    free(engine);
+}
+
+int peer_engine_listen(PeerEngine* engine, const struct sockaddr_in* addr) {
+    if(engine->listen_fd >= 0) return -1;
+
+    const int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(fd < 0) return -1;
+
+    const int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+
+    struct sockaddr_in bound;
+    socklen_t bound_len = sizeof(bound);
+    // level-triggered: connections left over from a full batch are picked up next round
+    struct epoll_event event = { .events = EPOLLIN, .data.ptr = NULL };
+    if(bind(fd, (const struct sockaddr*)addr, sizeof(*addr)) != 0 ||
+       listen(fd, SOMAXCONN) != 0 ||
+       getsockname(fd, (struct sockaddr*)&bound, &bound_len) != 0 ||
+       epoll_ctl(engine->epoll_fd, EPOLL_CTL_ADD, fd, &event) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    engine->listen_fd = fd;
+    return ntohs(bound.sin_port);
+}
+
+PeerConn* peer_engine_connect(PeerEngine* engine, const struct sockaddr_in* addr) {
+    if(!engine->free_list) return NULL;
+
+    const int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(fd < 0) return NULL;
+
+    // completion (or failure) shows up as the socket becoming writable
+    if(connect(fd, (const struct sockaddr*)addr, sizeof(*addr)) != 0 && errno != EINPROGRESS) {
+        close(fd);
+        return NULL;
+    }
+
+    PeerConn* conn = peer_conn_open(engine, fd, true);
+    if(!conn) close(fd);
+    return conn;
+}
+
+int peer_engine_poll(PeerEngine* engine, int timeout_ms) {
+    const int count = epoll_wait(engine->epoll_fd, engine->events, PEER_EPOLL_EVENTS, timeout_ms);
+    if(count < 0) return errno == EINTR ? 0 : -1;
+
+    for(int i = 0; i < count; ++i) {
+        PeerConn* conn = engine->events[i].data.ptr;
+        const uint32_t events = engine->events[i].events;
+        if(!conn) {
+            peer_engine_accept(engine);
+            continue;
+        }
+        if(conn == (PeerConn*)&engine->watch) {
+            engine->watch.on_ready(engine->watch.user);
+            continue;
+        }
+
+        if(conn->state == PEER_CONN_CONNECTING) {
+            if(!(events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) continue;
+            peer_conn_connected(conn);
+        }
+        if(conn->state == PEER_CONN_FREE || conn->state == PEER_CONN_CLOSING) continue;
+
+        // errors and hangups surface as a failing or empty read
+        if(events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) conn->readable = true;
+        if(events & EPOLLOUT) conn->writable = true;
+        peer_conn_service(conn);
+    }
+
+    peer_engine_settle(engine);
+    return count;
+}
+
+bool peer_engine_watch(PeerEngine* engine, int fd, void (*on_ready)(void* user), void* user) {
+    if(engine->watch.fd >= 0) return false;
+
+    // the pointer to the watch tells its events apart from those of connections
+    struct epoll_event event = { .events = EPOLLIN, .data.ptr = &engine->watch };
+    if(epoll_ctl(engine->epoll_fd, EPOLL_CTL_ADD, fd, &event) != 0) return false;
+
+    engine->watch = (PeerWatch){ .fd = fd, .on_ready = on_ready, .user = user };
+    return true;
+}
+
+void peer_engine_resume(PeerEngine* engine) {
+    while(engine->blocked) {
+        PeerConn* conn = engine->blocked;
+        engine->blocked = conn->next_blocked;
+        conn->listed_blocked = false;
+
+        // entries can be stale: unblocked by output draining, or closed and reused since
+        if(conn->state != PEER_CONN_ACTIVE || !conn->blocked) continue;
+        conn->blocked = false;
+        peer_conn_schedule(conn);
+    }
+}
+
+size_t peer_engine_peers(const PeerEngine* engine) {
+    return engine->peers;
+}
+
+#pragma endregion Public
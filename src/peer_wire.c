@@ -0,0 +1,245 @@
+#include "peer_wire.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#pragma region Ring
+
+bool peer_ring_init(PeerRing* ring, size_t cap) {
+    *ring = (PeerRing){0};
+    if(cap == 0 || (cap & (cap - 1)) != 0) return false;
+
+    ring->data = malloc(cap);
+    if(!ring->data) return false;
+    ring->cap = cap;
+    return true;
+}
+
+void peer_ring_free(PeerRing* ring) {
+    free(ring->data);
+    *ring = (PeerRing){0};
+}
+
+/* Split [pos, pos + len) of the free-running positions into at most two segments of data */
+static int peer_ring_span(const PeerRing* ring, size_t pos, size_t len, struct iovec iov[2]) {
+    if(len == 0) return 0;
+
+    const size_t start = pos & (ring->cap - 1);
+    const size_t first = ring->cap - start < len ? ring->cap - start : len;
+    iov[0] = (struct iovec){ .iov_base = ring->data + start, .iov_len = first };
+    if(first == len) return 1;
+
+    iov[1] = (struct iovec){ .iov_base = ring->data, .iov_len = len - first };
+    return 2;
+}
+
+int peer_ring_peek(const PeerRing* ring, size_t offset, size_t len, struct iovec iov[2]) {
+    return peer_ring_span(ring, ring->head + offset, len, iov);
+}
+
+int peer_ring_reserve(const PeerRing* ring, struct iovec iov[2]) {
+    return peer_ring_span(ring, ring->tail, peer_ring_space(ring), iov);
+}
+
+void peer_ring_copy_out(const PeerRing* ring, size_t offset, void* out, size_t len) {
+    struct iovec iov[2];
+    const int count = peer_ring_peek(ring, offset, len, iov);
+    uint8_t* dst = out;
+    for(int i = 0; i < count; ++i) {
+        memcpy(dst, iov[i].iov_base, iov[i].iov_len);
+        dst += iov[i].iov_len;
+    }
+}
+
+bool peer_ring_write(PeerRing* ring, const void* data, size_t len) {
+    if(len > peer_ring_space(ring)) return false;
+
+    struct iovec iov[2];
+    const int count = peer_ring_span(ring, ring->tail, len, iov);
+    const uint8_t* src = data;
+    for(int i = 0; i < count; ++i) {
+        memcpy(iov[i].iov_base, src, iov[i].iov_len);
+        src += iov[i].iov_len;
+    }
+    ring->tail += len;
+    return true;
+}
+
+#pragma endregion Ring
+
+#pragma region Parsing
+
+static uint32_t peer_load_u32(const uint8_t* p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | (uint32_t)p[3];
+}
+
+static void peer_store_u32(uint8_t* p, uint32_t value) {
+    p[0] = (uint8_t)(value >> 24);
+    p[1] = (uint8_t)(value >> 16);
+    p[2] = (uint8_t)(value >> 8);
+    p[3] = (uint8_t)value;
+}
+
+int peer_parse_handshake(const PeerRing* ring, PeerHandshake* handshake) {
+    const size_t used = peer_ring_used(ring);
+
+    // reject a wrong protocol string as soon as its bytes are in
+    uint8_t raw[PEER_HANDSHAKE_LEN];
+    const size_t have = used < PEER_HANDSHAKE_LEN ? used : PEER_HANDSHAKE_LEN;
+    peer_ring_copy_out(ring, 0, raw, have);
+    if(have == 0) return 0;
+    if(raw[0] != PEER_PROTOCOL_LEN) return -1;
+    const size_t protocol_bytes = have - 1 < PEER_PROTOCOL_LEN ? have - 1 : PEER_PROTOCOL_LEN;
+    if(memcmp(raw + 1, PEER_PROTOCOL, protocol_bytes) != 0) return -1;
+    if(have < PEER_HANDSHAKE_LEN) return 0;
+
+    const uint8_t* p = raw + 1 + PEER_PROTOCOL_LEN;
+    memcpy(handshake->reserved, p, sizeof(handshake->reserved));
+    memcpy(handshake->info_hash.bytes, p + 8, sizeof(handshake->info_hash.bytes));
+    memcpy(handshake->peer_id, p + 28, PEER_ID_LEN);
+    return 1;
+}
+
+int peer_parse_message(const PeerRing* ring, size_t max_len, PeerMessage* msg) {
+    const size_t used = peer_ring_used(ring);
+    if(used < 4) return 0;
+
+    // the fixed part of every known message fits in 4 + 1 + 12 bytes
+    uint8_t header[17];
+    const size_t header_len = used < sizeof(header) ? used : sizeof(header);
+    peer_ring_copy_out(ring, 0, header, header_len);
+
+    const uint32_t len = peer_load_u32(header);
+    if(len > max_len) return -1;
+    if(used - 4 < len) return 0;
+
+    *msg = (PeerMessage){ .size = 4 + (size_t)len };
+    if(len == 0) {
+        msg->type = PEER_MSG_KEEPALIVE;
+        return 1;
+    }
+
+    msg->type = header[4];
+    const uint8_t* body = header + 5;
+    size_t fixed = 0;
+    switch(msg->type) {
+        case PEER_MSG_CHOKE:
+        case PEER_MSG_UNCHOKE:
+        case PEER_MSG_INTERESTED:
+        case PEER_MSG_NOT_INTERESTED:
+            if(len != 1) return -1;
+            return 1;
+        case PEER_MSG_HAVE:
+            if(len != 5) return -1;
+            msg->index = peer_load_u32(body);
+            return 1;
+        case PEER_MSG_REQUEST:
+        case PEER_MSG_CANCEL:
+            if(len != 13) return -1;
+            msg->index = peer_load_u32(body);
+            msg->begin = peer_load_u32(body + 4);
+            msg->length = peer_load_u32(body + 8);
+            return 1;
+        case PEER_MSG_PIECE:
+            if(len < 9) return -1;
+            msg->index = peer_load_u32(body);
+            msg->begin = peer_load_u32(body + 4);
+            fixed = 8;
+            break;
+        case PEER_MSG_EXTENDED:
+            if(len < 2) return -1;
+            msg->index = body[0];
+            fixed = 1;
+            break;
+        default:
+            // bitfield and messages this codec does not know: the whole body is payload
+            break;
+    }
+
+    msg->payload_len = len - 1 - fixed;
+    msg->payload_count = peer_ring_peek(ring, 5 + fixed, msg->payload_len, msg->payload);
+    return 1;
+}
+
+#pragma endregion Parsing
+
+#pragma region Writing
+
+bool peer_write_handshake(PeerRing* ring, const PeerHandshake* handshake) {
+    uint8_t raw[PEER_HANDSHAKE_LEN];
+    raw[0] = PEER_PROTOCOL_LEN;
+    memcpy(raw + 1, PEER_PROTOCOL, PEER_PROTOCOL_LEN);
+    memcpy(raw + 1 + PEER_PROTOCOL_LEN, handshake->reserved, 8);
+    memcpy(raw + 1 + PEER_PROTOCOL_LEN + 8, handshake->info_hash.bytes, 20);
+    memcpy(raw + 1 + PEER_PROTOCOL_LEN + 28, handshake->peer_id, PEER_ID_LEN);
+    return peer_ring_write(ring, raw, sizeof(raw));
+}
+
+bool peer_write_simple(PeerRing* ring, PeerMessageType type) {
+    uint8_t raw[5];
+    if(type == PEER_MSG_KEEPALIVE) {
+        peer_store_u32(raw, 0);
+        return peer_ring_write(ring, raw, 4);
+    }
+    peer_store_u32(raw, 1);
+    raw[4] = (uint8_t)type;
+    return peer_ring_write(ring, raw, sizeof(raw));
+}
+
+bool peer_write_have(PeerRing* ring, uint32_t index) {
+    uint8_t raw[9];
+    peer_store_u32(raw, 5);
+    raw[4] = PEER_MSG_HAVE;
+    peer_store_u32(raw + 5, index);
+    return peer_ring_write(ring, raw, sizeof(raw));
+}
+
+bool peer_write_bitfield(PeerRing* ring, const uint8_t* bitfield, size_t len) {
+    if(5 + len > peer_ring_space(ring) || len >= UINT32_MAX) return false;
+
+    uint8_t raw[5];
+    peer_store_u32(raw, (uint32_t)(1 + len));
+    raw[4] = PEER_MSG_BITFIELD;
+    peer_ring_write(ring, raw, sizeof(raw));
+    peer_ring_write(ring, bitfield, len);
+    return true;
+}
+
+bool peer_write_request(PeerRing* ring, PeerMessageType type, uint32_t index, uint32_t begin, uint32_t length) {
+    uint8_t raw[17];
+    peer_store_u32(raw, 13);
+    raw[4] = (uint8_t)type;
+    peer_store_u32(raw + 5, index);
+    peer_store_u32(raw + 9, begin);
+    peer_store_u32(raw + 13, length);
+    return peer_ring_write(ring, raw, sizeof(raw));
+}
+
+bool peer_write_piece(PeerRing* ring, uint32_t index, uint32_t begin, const void* block, size_t len) {
+    if(13 + len > peer_ring_space(ring) || len > PEER_MAX_BLOCK_SIZE) return false;
+
+    uint8_t raw[13];
+    peer_store_u32(raw, (uint32_t)(9 + len));
+    raw[4] = PEER_MSG_PIECE;
+    peer_store_u32(raw + 5, index);
+    peer_store_u32(raw + 9, begin);
+    peer_ring_write(ring, raw, sizeof(raw));
+    peer_ring_write(ring, block, len);
+    return true;
+}
+
+bool peer_write_extended(PeerRing* ring, uint8_t id, const void* dict, size_t dict_len, const void* data, size_t data_len) {
+    const size_t len = 2 + dict_len + data_len;
+    if(4 + len > peer_ring_space(ring) || len > UINT32_MAX) return false;
+
+    uint8_t raw[6];
+    peer_store_u32(raw, (uint32_t)len);
+    raw[4] = PEER_MSG_EXTENDED;
+    raw[5] = id;
+    peer_ring_write(ring, raw, sizeof(raw));
+    peer_ring_write(ring, dict, dict_len);
+    peer_ring_write(ring, data, data_len);
+    return true;
+}
+
+#pragma endregion Writing
@@ -0,0 +1,275 @@
+#include "picker.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "bitfield.h"
+
+#define PICKER_BUCKETS      (PICKER_PRIORITY_MAX * PICKER_AVAILABILITY_LEVELS)
+#define PICKER_LINK_NONE    UINT32_MAX
+#define PICKER_SCAN_LIMIT   64      // pieces looked at in bucket order before intersecting bitfields instead
+
+typedef enum PickerState {
+    PICKER_STATE_WANTED,
+    PICKER_STATE_ACTIVE,
+    PICKER_STATE_DONE,
+} PickerState;
+
+struct Picker {
+    size_t      piece_count;
+    uint32_t*   availability;   // peers with the piece, seeds not included
+    uint8_t*    priority;
+    uint8_t*    state;
+    uint32_t*   next;           // bucket list links of the pickable pieces
+    uint32_t*   prev;
+    uint32_t    heads[PICKER_BUCKETS];
+    uint64_t    nonempty[(PICKER_BUCKETS + 63) / 64];
+    uint8_t*    pickable;       // bitfield: in a bucket (wanted, not started, priority above skip)
+    uint8_t*    wanted;         // bitfield: priority above skip and not done, started or not
+    size_t      pickable_count;
+    size_t      wanted_count;
+    size_t      active_count;
+    size_t      seeds;
+};
+
+#pragma region Buckets
+
+/* Higher priorities come first, rarer pieces first within a priority */
+static size_t picker_bucket(const Picker* picker, size_t piece) {
+    const size_t availability = picker->availability[piece];
+    const size_t level = availability < PICKER_AVAILABILITY_LEVELS ? availability : PICKER_AVAILABILITY_LEVELS - 1;
+    return (size_t)(PICKER_PRIORITY_MAX - picker->priority[piece]) * PICKER_AVAILABILITY_LEVELS + level;
+}
+
+static void picker_link(Picker* picker, size_t piece) {
+    const size_t bucket = picker_bucket(picker, piece);
+    const uint32_t head = picker->heads[bucket];
+
+    picker->next[piece] = head;
+    picker->prev[piece] = PICKER_LINK_NONE;
+    if(head != PICKER_LINK_NONE) picker->prev[head] = (uint32_t)piece;
+    picker->heads[bucket] = (uint32_t)piece;
+    picker->nonempty[bucket / 64] |= 1ull << (bucket % 64);
+
+    bitfield_set(picker->pickable, piece);
+    picker->pickable_count++;
+}
+
+/* Must run before anything picker_bucket depends on changes */
+static void picker_unlink(Picker* picker, size_t piece) {
+    const size_t bucket = picker_bucket(picker, piece);
+    const uint32_t next = picker->next[piece];
+    const uint32_t prev = picker->prev[piece];
+
+    if(prev != PICKER_LINK_NONE) picker->next[prev] = next;
+    else picker->heads[bucket] = next;
+    if(next != PICKER_LINK_NONE) picker->prev[next] = prev;
+    if(picker->heads[bucket] == PICKER_LINK_NONE) picker->nonempty[bucket / 64] &= ~(1ull << (bucket % 64));
+
+    bitfield_clear(picker->pickable, piece);
+    picker->pickable_count--;
+}
+
+/* First non-empty bucket at or after bucket, PICKER_BUCKETS if there is none */
+static size_t picker_next_bucket(const Picker* picker, size_t bucket) {
+    size_t word = bucket / 64;
+    if(word >= sizeof(picker->nonempty) / sizeof(picker->nonempty[0])) return PICKER_BUCKETS;
+
+    uint64_t bits = picker->nonempty[word] & (~0ull << (bucket % 64));
+    while(bits == 0) {
+        if(++word == sizeof(picker->nonempty) / sizeof(picker->nonempty[0])) return PICKER_BUCKETS;
+        bits = picker->nonempty[word];
+    }
+    return word * 64 + (size_t)__builtin_ctzll(bits);
+}
+
+static void picker_change_availability(Picker* picker, size_t piece, int delta) {
+    const bool linked = bitfield_get(picker->pickable, piece);
+    if(linked) picker_unlink(picker, piece);
+    picker->availability[piece] += (uint32_t)delta;
+    if(linked) picker_link(picker, piece);
+}
+
+/* Change the availability of every piece set in bitfield, found a word at a time */
+static void picker_for_each(Picker* picker, const uint8_t* bitfield, int delta) {
+    for(size_t piece = bitfield_next_and(bitfield, bitfield, picker->piece_count, 0);
+        piece < picker->piece_count;
+        piece = bitfield_next_and(bitfield, bitfield, picker->piece_count, piece + 1)) {
+        picker_change_availability(picker, piece, delta);
+    }
+}
+
+#pragma endregion Buckets
+
+#pragma region Public
+
+Picker* picker_new(size_t piece_count) {
+    if(piece_count == 0 || piece_count >= PICKER_LINK_NONE) return NULL;
+
+    Picker* picker = calloc(1, sizeof(*picker));
+    if(!picker) return NULL;
+
+    const size_t bytes = BITFIELD_BYTES(piece_count);
+    picker->piece_count = piece_count;
+    picker->availability = calloc(piece_count, sizeof(uint32_t));
+    picker->priority = malloc(piece_count);
+    picker->state = calloc(piece_count, 1);
+    picker->next = malloc(piece_count * sizeof(uint32_t));
+    picker->prev = malloc(piece_count * sizeof(uint32_t));
+    picker->pickable = calloc(bytes, 1);
+    picker->wanted = calloc(bytes, 1);
+    if(!picker->availability || !picker->priority || !picker->state || !picker->next ||
+       !picker->prev || !picker->pickable || !picker->wanted) {
+        picker_free(picker);
+        return NULL;
+    }
+
+    memset(picker->heads, 0xFF, sizeof(picker->heads));
+    memset(picker->priority, PICKER_PRIORITY_DEFAULT, piece_count);
+    for(size_t piece = piece_count; piece-- > 0;) {
+        picker_link(picker, piece);
+        bitfield_set(picker->wanted, piece);
+    }
+    picker->wanted_count = piece_count;
+    return picker;
+}
+
+void picker_free(Picker* picker) {
+    if(!picker) return;
+
+    free(picker->availability);
+    free(picker->priority);
+    free(picker->state);
+    free(picker->next);
+    free(picker->prev);
+    free(picker->pickable);
+    free(picker->wanted);
+    free(picker);
+}
+
+void picker_add_have(Picker* picker, size_t piece) {
+    picker_change_availability(picker, piece, 1);
+}
+
+void picker_add_bitfield(Picker* picker, const uint8_t* bitfield) {
+    picker_for_each(picker, bitfield, 1);
+}
+
+void picker_remove_bitfield(Picker* picker, const uint8_t* bitfield) {
+    picker_for_each(picker, bitfield, -1);
+}
+
+void picker_add_seed(Picker* picker) {
+    picker->seeds++;
+}
+
+void picker_remove_seed(Picker* picker) {
+    picker->seeds--;
+}
+
+size_t picker_availability(const Picker* picker, size_t piece) {
+    return picker->availability[piece] + picker->seeds;
+}
+
+void picker_set_priority(Picker* picker, size_t piece, int priority) {
+    if(priority < PICKER_PRIORITY_SKIP) priority = PICKER_PRIORITY_SKIP;
+    if(priority > PICKER_PRIORITY_MAX) priority = PICKER_PRIORITY_MAX;
+
+    if(bitfield_get(picker->pickable, piece)) picker_unlink(picker, piece);
+    picker->priority[piece] = (uint8_t)priority;
+
+    if(picker->state[piece] == PICKER_STATE_DONE) return;
+    const bool was_wanted = bitfield_get(picker->wanted, piece);
+    if(priority == PICKER_PRIORITY_SKIP && was_wanted) {
+        bitfield_clear(picker->wanted, piece);
+        picker->wanted_count--;
+    } else if(priority != PICKER_PRIORITY_SKIP && !was_wanted) {
+        bitfield_set(picker->wanted, piece);
+        picker->wanted_count++;
+    }
+    if(priority != PICKER_PRIORITY_SKIP && picker->state[piece] == PICKER_STATE_WANTED) picker_link(picker, piece);
+}
+
+/*
+ * Fallback for peers that have few of the pickable pieces: go through the pieces both
+ * have a word at a time and keep the one in the lowest bucket. Nothing below floor can
+ * match, so a piece in floor ends the search.
+ */
+static size_t picker_pick_sparse(const Picker* picker, const uint8_t* bitfield, size_t floor) {
+    size_t best = PICKER_NONE;
+    size_t best_bucket = PICKER_BUCKETS;
+    for(size_t piece = bitfield_next_and(bitfield, picker->pickable, picker->piece_count, 0);
+        piece < picker->piece_count;
+        piece = bitfield_next_and(bitfield, picker->pickable, picker->piece_count, piece + 1)) {
+        const size_t bucket = picker_bucket(picker, piece);
+        if(bucket < best_bucket) {
+            best = piece;
+            best_bucket = bucket;
+            if(bucket <= floor) break;
+        }
+    }
+    return best;
+}
+
+size_t picker_pick(const Picker* picker, const uint8_t* bitfield) {
+    if(picker->pickable_count == 0) return PICKER_NONE;
+
+    size_t examined = 0;
+    for(size_t bucket = picker_next_bucket(picker, 0); bucket < PICKER_BUCKETS; bucket = picker_next_bucket(picker, bucket + 1)) {
+        // a piece no counted peer has can only come from a seed
+        if(bitfield && bucket % PICKER_AVAILABILITY_LEVELS == 0) continue;
+
+        for(uint32_t piece = picker->heads[bucket]; piece != PICKER_LINK_NONE; piece = picker->next[piece]) {
+            if(!bitfield || bitfield_get(bitfield, piece)) return piece;
+            if(++examined == PICKER_SCAN_LIMIT) return picker_pick_sparse(picker, bitfield, bucket);
+        }
+    }
+    return PICKER_NONE;
+}
+
+void picker_start(Picker* picker, size_t piece) {
+    if(picker->state[piece] != PICKER_STATE_WANTED) return;
+
+    if(bitfield_get(picker->pickable, piece)) picker_unlink(picker, piece);
+    picker->state[piece] = PICKER_STATE_ACTIVE;
+    picker->active_count++;
+}
+
+void picker_abort(Picker* picker, size_t piece) {
+    if(picker->state[piece] != PICKER_STATE_ACTIVE) return;
+
+    picker->state[piece] = PICKER_STATE_WANTED;
+    picker->active_count--;
+    if(picker->priority[piece] != PICKER_PRIORITY_SKIP) picker_link(picker, piece);
+}
+
+void picker_done(Picker* picker, size_t piece) {
+    if(picker->state[piece] == PICKER_STATE_DONE) return;
+
+    if(bitfield_get(picker->pickable, piece)) picker_unlink(picker, piece);
+    if(picker->state[piece] == PICKER_STATE_ACTIVE) picker->active_count--;
+    if(bitfield_get(picker->wanted, piece)) {
+        bitfield_clear(picker->wanted, piece);
+        picker->wanted_count--;
+    }
+    picker->state[piece] = PICKER_STATE_DONE;
+}
+
+bool picker_wanted(const Picker* picker, size_t piece) {
+    return bitfield_get(picker->wanted, piece);
+}
+
+bool picker_interesting(const Picker* picker, const uint8_t* bitfield) {
+    if(!bitfield) return picker->wanted_count > 0;
+    return bitfield_any_and(bitfield, picker->wanted, BITFIELD_BYTES(picker->piece_count));
+}
+
+size_t picker_remaining(const Picker* picker) {
+    return picker->wanted_count;
+}
+
+bool picker_endgame(const Picker* picker) {
+    return picker->pickable_count == 0 && picker->active_count > 0;
+}
+
+#pragma endregion Public
@@ -0,0 +1,336 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "resume.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bencode.h"
+#include "bitfield.h"
+#include "verify.h"
+
+#define RESUME_VERSION      1
+
+struct ResumeWriter {
+    const TorrentInfo*  info;
+    char*               path;
+    char*               data_dir;
+    ResumeOptions       opts;
+    uint8_t*            pending;        // last update
+    uint8_t*            snapshot;       // what the thread writes, outside the lock
+    size_t              bitfield_len;
+    bool                dirty;          // pending was not written yet
+    bool                stop;
+    pthread_mutex_t     lock;
+    pthread_cond_t      wake;
+    pthread_t           thread;
+    bool                started;
+};
+
+static double resume_clock(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)now.tv_sec + (double)now.tv_nsec / 1e9;
+}
+
+/* Size and mtime of a file of the torrent, mtime -1 if it does not exist */
+static void resume_stat(const TorrentInfo* info, const char* data_dir, size_t file,
+                        long long* length, long long* mtime, long long* mtime_ns) {
+    *length = 0;
+    *mtime = -1;
+    *mtime_ns = 0;
+
+    char* path = verify_file_path(info, data_dir, file);
+    struct stat st;
+    if(path && stat(path, &st) == 0) {
+        *length = (long long)st.st_size;
+        *mtime = (long long)st.st_mtim.tv_sec;
+        *mtime_ns = (long long)st.st_mtim.tv_nsec;
+    }
+    free(path);
+}
+
+#pragma region Saving
+
+static bool resume_set(BNode* dict, const char* key, BNode* value) {
+    if(value && bencode_dict_set(dict, key, value)) return true;
+    bencode_free_node(value);
+    return false;
+}
+
+static BNode* resume_file_entry(const TorrentInfo* info, const char* data_dir, size_t file) {
+    long long length, mtime, mtime_ns;
+    resume_stat(info, data_dir, file, &length, &mtime, &mtime_ns);
+
+    BNode* entry = bencode_new_dict();
+    if(!entry || !resume_set(entry, "length", bencode_new_int(length)) ||
+       !resume_set(entry, "mtime", bencode_new_int(mtime)) ||
+       !resume_set(entry, "mtime-ns", bencode_new_int(mtime_ns))) {
+        bencode_free_node(entry);
+        return NULL;
+    }
+    return entry;
+}
+
+static BNode* resume_build(const TorrentInfo* info, const char* data_dir, const uint8_t* bitfield) {
+    BNode* root = bencode_new_dict();
+    BNode* files = bencode_new_list();
+    for(size_t i = 0; files && i < info->file_count; ++i) {
+        BNode* entry = resume_file_entry(info, data_dir, i);
+        if(!entry || !bencode_list_append(files, entry)) {
+            bencode_free_node(entry);
+            bencode_free_node(files);
+            files = NULL;
+        }
+    }
+
+    if(!root || !resume_set(root, "files", files) ||
+       !resume_set(root, "info-hash", bencode_new_string((const char*)info->info_hash.bytes, sizeof(info->info_hash.bytes))) ||
+       !resume_set(root, "pieces", bencode_new_string((const char*)bitfield, BITFIELD_BYTES(info->piece_count))) ||
+       !resume_set(root, "version", bencode_new_int(RESUME_VERSION))) {
+        if(!root) bencode_free_node(files);
+        bencode_free_node(root);
+        return NULL;
+    }
+    return root;
+}
+
+bool resume_save(const TorrentInfo* info, const char* path, const char* data_dir, const uint8_t* bitfield) {
+    BNode* root = resume_build(info, data_dir, bitfield);
+    const size_t tmp_len = strlen(path) + sizeof(".tmp");
+    char* tmp = malloc(tmp_len);
+    bool ok = root && tmp;
+    if(ok) {
+        snprintf(tmp, tmp_len, "%s.tmp", path);
+
+        // the new contents have to be on disk before the rename makes them the resume file
+        const int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        const BEncodeSink sink = bencode_fd_sink(fd);
+        ok = fd >= 0 && bencode_encode_to_sink(root, &sink) == 0 && fsync(fd) == 0;
+        if(fd >= 0 && close(fd) != 0) ok = false;
+        ok = ok && rename(tmp, path) == 0;
+        if(!ok) unlink(tmp);
+    }
+
+    free(tmp);
+    bencode_free_node(root);
+    return ok;
+}
+
+#pragma endregion Saving
+
+#pragma region Checking
+
+static bool resume_get_int(const BNode* dict, const char* key, long long* out) {
+    const BNode* node = bencode_find_node_by_key(dict, key);
+    if(!node || node->type != BINT) return false;
+    *out = node->value.bint.value;
+    return true;
+}
+
+static const char* resume_get_string(const BDocument* doc, const BNode* dict, const char* key, size_t len) {
+    const BNode* node = bencode_find_node_by_key(dict, key);
+    if(!node || node->type != BSTRING || node->value.bstring.post_delim_len != len) return NULL;
+    return bencode_string_data(doc, node);
+}
+
+/*
+ * Take the good pieces from the resume file into trusted and mark the pieces of files
+ * that changed since in check (clearing their trust)
+ */
+static bool resume_read(const TorrentInfo* info, const BDocument* doc, const char* data_dir, uint8_t* trusted, uint8_t* check) {
+    const size_t len = BITFIELD_BYTES(info->piece_count);
+    const BNode* root = doc->root;
+    long long version;
+    if(!root || root->type != BDICT || !resume_get_int(root, "version", &version) || version != RESUME_VERSION) return false;
+
+    const char* info_hash = resume_get_string(doc, root, "info-hash", sizeof(info->info_hash.bytes));
+    const char* pieces = resume_get_string(doc, root, "pieces", len);
+    const BNode* files = bencode_find_node_by_key(root, "files");
+    if(!info_hash || memcmp(info_hash, info->info_hash.bytes, sizeof(info->info_hash.bytes)) != 0 ||
+       !pieces || !files || files->type != BLIST || files->value.blist.len != info->file_count) {
+        return false;
+    }
+
+    memcpy(trusted, pieces, len);
+    if(info->piece_count % 8) trusted[len - 1] &= (uint8_t)(0xFF00 >> (info->piece_count % 8));
+    memset(check, 0, len);
+
+    for(size_t i = 0; i < info->file_count; ++i) {
+        const TorrentFile* file = &info->files[i];
+        if(file->length == 0) continue;
+
+        long long length, mtime, mtime_ns;
+        long long recorded_length, recorded_mtime, recorded_mtime_ns;
+        resume_stat(info, data_dir, i, &length, &mtime, &mtime_ns);
+        const BNode* entry = files->value.blist.items[i];
+        if(entry->type == BDICT && resume_get_int(entry, "length", &recorded_length) &&
+           resume_get_int(entry, "mtime", &recorded_mtime) && resume_get_int(entry, "mtime-ns", &recorded_mtime_ns) &&
+           mtime >= 0 && length == recorded_length && mtime == recorded_mtime && mtime_ns == recorded_mtime_ns) {
+            continue;
+        }
+
+        const size_t first = (size_t)(file->offset / info->piece_length);
+        const size_t last = (size_t)((file->offset + file->length - 1) / info->piece_length);
+        for(size_t piece = first; piece <= last; ++piece) {
+            bitfield_clear(trusted, piece);
+            bitfield_set(check, piece);
+        }
+    }
+    return true;
+}
+
+int resume_check(const TorrentInfo* info, const char* path, const char* data_dir, size_t threads, ResumeResult* result) {
+    memset(result, 0, sizeof(*result));
+    const double start = resume_clock();
+
+    const size_t len = BITFIELD_BYTES(info->piece_count);
+    uint8_t* trusted = calloc(len ? len : 1, 1);
+    uint8_t* check = malloc(len ? len : 1);
+    if(!trusted || !check) {
+        free(trusted);
+        free(check);
+        return -1;
+    }
+
+    BDocument* doc = bencode_parse_torrent(path);
+    result->loaded = doc && resume_read(info, doc, data_dir, trusted, check);
+    bencode_free_document(doc);
+    if(!result->loaded) {
+        memset(trusted, 0, len);
+        memset(check, 0xFF, len);
+    }
+
+    VerifyResult verified;
+    const int status = verify_pieces(info, data_dir, check, threads, &verified);
+    if(status == 0) {
+        for(size_t i = 0; i < len; ++i) verified.bitfield[i] |= trusted[i];
+        result->trusted_pieces = bitfield_count(trusted, len);
+        result->checked_pieces = bitfield_count(check, len);
+        if(info->piece_count % 8 && !result->loaded) result->checked_pieces -= 8 - info->piece_count % 8;
+        result->good_pieces = verified.good_pieces + result->trusted_pieces;
+        result->bitfield = verified.bitfield;
+        result->bitfield_len = verified.bitfield_len;
+        result->seconds = resume_clock() - start;
+    }
+
+    free(trusted);
+    free(check);
+    return status;
+}
+
+void resume_result_free(ResumeResult* result) {
+    free(result->bitfield);
+    result->bitfield = NULL;
+    result->bitfield_len = 0;
+}
+
+#pragma endregion Checking
+
+#pragma region Writer
+
+static void* resume_writer_thread(void* arg) {
+    ResumeWriter* writer = arg;
+    double last_write = resume_clock();
+
+    pthread_mutex_lock(&writer->lock);
+    while(1) {
+        while(!writer->dirty && !writer->stop) pthread_cond_wait(&writer->wake, &writer->lock);
+        if(!writer->dirty) break;
+
+        // updates within the interval are folded into one write, unless stopping
+        const double deadline = last_write + writer->opts.interval;
+        while(!writer->stop && resume_clock() < deadline) {
+            struct timespec until;
+            clock_gettime(CLOCK_MONOTONIC, &until);
+            const double wait = deadline - resume_clock();
+            until.tv_sec += (time_t)wait;
+            until.tv_nsec += (long)((wait - (double)(time_t)wait) * 1e9);
+            if(until.tv_nsec >= 1000000000L) {
+                until.tv_sec++;
+                until.tv_nsec -= 1000000000L;
+            }
+            pthread_cond_timedwait(&writer->wake, &writer->lock, &until);
+        }
+
+        memcpy(writer->snapshot, writer->pending, writer->bitfield_len);
+        writer->dirty = false;
+        pthread_mutex_unlock(&writer->lock);
+
+        // the pieces have to be written before their files are looked at; keep the old file if one failed
+        if(!writer->opts.disk || disk_flush(writer->opts.disk)) {
+            resume_save(writer->info, writer->path, writer->data_dir, writer->snapshot);
+        }
+        last_write = resume_clock();
+
+        pthread_mutex_lock(&writer->lock);
+    }
+    pthread_mutex_unlock(&writer->lock);
+    return NULL;
+}
+
+ResumeWriter* resume_writer_new(const TorrentInfo* info, const char* path, const char* data_dir, const ResumeOptions* opts) {
+    ResumeWriter* writer = calloc(1, sizeof(*writer));
+    if(!writer) return NULL;
+
+    const ResumeOptions defaults = {0};
+    writer->info = info;
+    writer->opts = opts ? *opts : defaults;
+    if(writer->opts.interval <= 0) writer->opts.interval = RESUME_DEFAULT_INTERVAL;
+    writer->bitfield_len = BITFIELD_BYTES(info->piece_count);
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&writer->wake, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_mutex_init(&writer->lock, NULL);
+
+    writer->path = strdup(path);
+    writer->data_dir = strdup(data_dir);
+    writer->pending = calloc(writer->bitfield_len ? writer->bitfield_len : 1, 1);
+    writer->snapshot = malloc(writer->bitfield_len ? writer->bitfield_len : 1);
+    if(!writer->path || !writer->data_dir || !writer->pending || !writer->snapshot ||
+       pthread_create(&writer->thread, NULL, resume_writer_thread, writer) != 0) {
+        resume_writer_free(writer);
+        return NULL;
+    }
+    writer->started = true;
+    return writer;
+}
+
+void resume_writer_update(ResumeWriter* writer, const uint8_t* bitfield) {
+    pthread_mutex_lock(&writer->lock);
+    memcpy(writer->pending, bitfield, writer->bitfield_len);
+    writer->dirty = true;
+    pthread_cond_signal(&writer->wake);
+    pthread_mutex_unlock(&writer->lock);
+}
+
+void resume_writer_free(ResumeWriter* writer) {
+    if(!writer) return;
+
+    if(writer->started) {
+        pthread_mutex_lock(&writer->lock);
+        writer->stop = true;
+        pthread_cond_signal(&writer->wake);
+        pthread_mutex_unlock(&writer->lock);
+        pthread_join(writer->thread, NULL);
+    }
+
+    pthread_mutex_destroy(&writer->lock);
+    pthread_cond_destroy(&writer->wake);
+    free(writer->path);
+    free(writer->data_dir);
+    free(writer->pending);
+    free(writer->snapshot);
+    free(writer);
+}
+
+#pragma endregion Writer
@@ -0,0 +1,243 @@
+#include "cryptography.h"
+#include "sha1_backend.h"
+#include "stats.h"
+
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+static inline uint32_t sha1_mb_load_be32(const uint8_t* p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+/* Build the padded final block(s) of every lane, returns how many blocks each tail has */
+static size_t sha1_mb_build_tails(const uint8_t* const* msgs, size_t len, size_t lanes,
+                                  uint8_t (*tails)[128], const uint8_t** tail_ptrs) {
+    const size_t rem = len % 64;
+    const size_t tail_len = rem + 1 + 8 <= 64 ? 64 : 128;
+    const uint64_t bitlen = (uint64_t)len << 3;
+
+    for(size_t l = 0; l < lanes; ++l) {
+        memset(tails[l], 0, tail_len);
+        memcpy(tails[l], msgs[l] + len - rem, rem);
+        tails[l][rem] = 0x80;
+        for(int i = 0; i < 8; i++) {
+            tails[l][tail_len - 8 + i] = (bitlen >> (56 - i * 8)) & 0xFF;
+        }
+        tail_ptrs[l] = tails[l];
+    }
+    return tail_len / 64;
+}
+
+#if defined(SHA1_HAVE_X86)
+
+#include <immintrin.h>
+
+#pragma region SSE2
+
+#define MB_NAME         sse2
+#define MB_TARGET       "sse2"
+#define MB_LANES        4
+#define MB_V            __m128i
+#define MB_LOAD(p)      _mm_load_si128((const __m128i*)(p))
+#define MB_STORE(p, v)  _mm_store_si128((__m128i*)(p), v)
+#define MB_SET1(x)      _mm_set1_epi32((int)(x))
+#define MB_ADD(x, y)    _mm_add_epi32(x, y)
+#define MB_XOR(x, y)    _mm_xor_si128(x, y)
+#define MB_ROL(v, n)    _mm_or_si128(_mm_slli_epi32(v, n), _mm_srli_epi32(v, 32 - (n)))
+#define MB_F1(b, c, d)  _mm_xor_si128(d, _mm_and_si128(b, _mm_xor_si128(c, d)))
+#define MB_F2(b, c, d)  _mm_xor_si128(_mm_xor_si128(b, c), d)
+#define MB_F3(b, c, d)  _mm_or_si128(_mm_and_si128(b, c), _mm_and_si128(d, _mm_or_si128(b, c)))
+#include "sha1_mb_lanes.inc"
+#undef MB_NAME
+#undef MB_TARGET
+#undef MB_LANES
+#undef MB_V
+#undef MB_LOAD
+#undef MB_STORE
+#undef MB_SET1
+#undef MB_ADD
+#undef MB_XOR
+#undef MB_ROL
+#undef MB_F1
+#undef MB_F2
+#undef MB_F3
+
+#pragma endregion SSE2
+
+#pragma region AVX2
+
+#define MB_NAME         avx2
+#define MB_TARGET       "avx2"
+#define MB_LANES        8
+#define MB_V            __m256i
+#define MB_LOAD(p)      _mm256_load_si256((const __m256i*)(p))
+#define MB_STORE(p, v)  _mm256_store_si256((__m256i*)(p), v)
+#define MB_SET1(x)      _mm256_set1_epi32((int)(x))
+#define MB_ADD(x, y)    _mm256_add_epi32(x, y)
+#define MB_XOR(x, y)    _mm256_xor_si256(x, y)
+#define MB_ROL(v, n)    _mm256_or_si256(_mm256_slli_epi32(v, n), _mm256_srli_epi32(v, 32 - (n)))
+#define MB_F1(b, c, d)  _mm256_xor_si256(d, _mm256_and_si256(b, _mm256_xor_si256(c, d)))
+#define MB_F2(b, c, d)  _mm256_xor_si256(_mm256_xor_si256(b, c), d)
+#define MB_F3(b, c, d)  _mm256_or_si256(_mm256_and_si256(b, c), _mm256_and_si256(d, _mm256_or_si256(b, c)))
+#include "sha1_mb_lanes.inc"
+#undef MB_NAME
+#undef MB_TARGET
+#undef MB_LANES
+#undef MB_V
+#undef MB_LOAD
+#undef MB_STORE
+#undef MB_SET1
+#undef MB_ADD
+#undef MB_XOR
+#undef MB_ROL
+#undef MB_F1
+#undef MB_F2
+#undef MB_F3
+
+#pragma endregion AVX2
+
+#pragma region AVX-512
+
+/* ternary logic immediates: F1 = choose, F2 = parity, F3 = majority */
+#define MB_NAME         avx512
+#define MB_TARGET       "avx512f"
+#define MB_LANES        16
+#define MB_V            __m512i
+#define MB_LOAD(p)      _mm512_load_si512((const void*)(p))
+#define MB_STORE(p, v)  _mm512_store_si512((void*)(p), v)
+#define MB_SET1(x)      _mm512_set1_epi32((int)(x))
+#define MB_ADD(x, y)    _mm512_add_epi32(x, y)
+#define MB_XOR(x, y)    _mm512_xor_si512(x, y)
+#define MB_ROL(v, n)    _mm512_rol_epi32(v, n)
+#define MB_F1(b, c, d)  _mm512_ternarylogic_epi32(b, c, d, 0xCA)
+#define MB_F2(b, c, d)  _mm512_ternarylogic_epi32(b, c, d, 0x96)
+#define MB_F3(b, c, d)  _mm512_ternarylogic_epi32(b, c, d, 0xE8)
+#include "sha1_mb_lanes.inc"
+#undef MB_NAME
+#undef MB_TARGET
+#undef MB_LANES
+#undef MB_V
+#undef MB_LOAD
+#undef MB_STORE
+#undef MB_SET1
+#undef MB_ADD
+#undef MB_XOR
+#undef MB_ROL
+#undef MB_F1
+#undef MB_F2
+#undef MB_F3
+
+#pragma endregion AVX-512
+
+static bool sha1_mb_has_sse2(void) {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse2");
+}
+
+static bool sha1_mb_has_avx512(void) {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx512f");
+}
+
+#endif
+
+#pragma region Dispatch
+
+typedef struct sha1_mb_backend {
+    const char* name;
+    size_t      lanes;
+    void        (*hash)(const uint8_t* const* msgs, size_t len, sha1hash* out);
+    bool        (*supported)(void);
+} sha1_mb_backend;
+
+static const sha1_mb_backend SHA1_MB_BACKENDS[] = {
+#if defined(SHA1_HAVE_X86)
+    { "avx512",     16,     sha1_mb_hash_avx512,    sha1_mb_has_avx512 },
+    { "avx2",       8,      sha1_mb_hash_avx2,      sha1_cpu_has_avx2 },
+    { "sse2",       4,      sha1_mb_hash_sse2,      sha1_mb_has_sse2 },
+#endif
+};
+
+#define SHA1_MB_BACKEND_COUNT (sizeof(SHA1_MB_BACKENDS) / sizeof(SHA1_MB_BACKENDS[0]))
+
+#define SHA1_MB_MIN_LANES_WITH_SHANI 8
+
+/* sentinel for "scalar only", distinct from "not probed yet" */
+static const sha1_mb_backend SHA1_MB_SCALAR = { "scalar", 1, NULL, NULL };
+
+static _Atomic(const sha1_mb_backend*) sha1_mb_active = NULL;
+
+/* Compare a backend against sha1() for a few lengths around the padding boundaries */
+static bool sha1_mb_matches_reference(const sha1_mb_backend* backend) {
+    static const size_t lengths[] = { 0, 3, 55, 56, 64, 119, 200 };
+    uint8_t data[16][200];
+    const uint8_t* msgs[16];
+    sha1hash out[16];
+
+    for(size_t l = 0; l < backend->lanes; ++l) {
+        for(size_t i = 0; i < sizeof(data[l]); ++i) {
+            data[l][i] = (uint8_t)(i * 31 + l * 7 + 1);
+        }
+        msgs[l] = data[l];
+    }
+
+    for(size_t n = 0; n < sizeof(lengths) / sizeof(lengths[0]); ++n) {
+        backend->hash(msgs, lengths[n], out);
+        for(size_t l = 0; l < backend->lanes; ++l) {
+            sha1hash expected = sha1(msgs[l], lengths[n]);
+            if(memcmp(expected.bytes, out[l].bytes, sizeof(expected.bytes)) != 0) return false;
+        }
+    }
+    return true;
+}
+
+static const sha1_mb_backend* sha1_mb_backend_active(void) {
+    const sha1_mb_backend* backend = atomic_load_explicit(&sha1_mb_active, memory_order_acquire);
+    if(backend) return backend;
+
+    // SHA-NI hashes one message faster than four SSE2 lanes do, so with it only
+    // the wide backends are worth the transposition overhead
+    const bool have_shani = strcmp(sha1_active_backend()->name, "shani") == 0;
+
+    backend = &SHA1_MB_SCALAR;
+    const char* forced = getenv("CTORRENT_SHA1_MB");
+    for(size_t i = 0; i < SHA1_MB_BACKEND_COUNT; ++i) {
+        const sha1_mb_backend* candidate = &SHA1_MB_BACKENDS[i];
+        if(forced && strcmp(forced, candidate->name) != 0) continue;
+        if(!forced && have_shani && candidate->lanes < SHA1_MB_MIN_LANES_WITH_SHANI) continue;
+        if(!candidate->supported() || !sha1_mb_matches_reference(candidate)) continue;
+
+        backend = candidate;
+        break;
+    }
+
+    atomic_store(&sha1_mb_active, backend);
+    return backend;
+}
+
+const char* sha1_many_backend(void) {
+    return sha1_mb_backend_active()->name;
+}
+
+void sha1_many(const uint8_t** msgs, size_t len, size_t count, sha1hash* out) {
+    const sha1_mb_backend* backend = sha1_mb_backend_active();
+
+    size_t i = 0;
+    if(backend->hash) {
+        STATS_TIMER_START(timer);
+        for(; i + backend->lanes <= count; i += backend->lanes) {
+            backend->hash(msgs + i, len, out + i);
+        }
+        STATS_ADD(STAT_SHA1_CALLS, i);
+        STATS_ADD(STAT_SHA1_BYTES, (uint64_t)i * len);
+        STATS_TIMER_STOP(timer, STAT_SHA1_NS);
+    }
+
+    // leftovers that do not fill every lane go through the single-buffer path
+    for(; i < count; ++i) {
+        out[i] = sha1(msgs[i], len);
+    }
+}
+
+#pragma endregion Dispatch
@@ -0,0 +1,317 @@
+#include "sha1_backend.h"
+
+#if defined(SHA1_HAVE_X86)
+
+#include <cpuid.h>
+#include <immintrin.h>
+#include <string.h>
+
+#pragma region CPU Features
+
+bool sha1_cpu_has_ssse3(void) {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("ssse3");
+}
+
+bool sha1_cpu_has_avx2(void) {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");     // also checks that the OS saves ymm state
+}
+
+bool sha1_cpu_has_shani(void) {
+    unsigned int eax, ebx, ecx, edx;
+    if(!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) return false;
+    if(!(ebx & (1u << 29))) return false;                  // SHA extensions
+
+    if(!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) return false;
+    return (ecx & (1u << 9)) && (ecx & (1u << 19));        // SSSE3 and SSE4.1
+}
+
+#pragma endregion CPU Features
+
+#pragma region Message Schedule
+
+static const uint32_t SHA1_K[4] = { 0x5A827999, 0x6ED9EBA1, 0x8F1BBCDC, 0xCA62C1D6 };
+
+#define ROTL32(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+
+#define F1(b, c, d) ((d) ^ ((b) & ((c) ^ (d))))
+#define F2(b, c, d) ((b) ^ (c) ^ (d))
+#define F3(b, c, d) (((b) & (c)) | ((d) & ((b) | (c))))
+
+#define ROUND(a, b, c, d, e, F, t) \
+    e += ROTL32(a, 5) + F(b, c, d) + wk[(t) & WK_MASK]; \
+    b = ROTL32(b, 30);
+
+#define ROUND5(F, t) \
+    ROUND(a, b, c, d, e, F, (t) + 0) \
+    ROUND(e, a, b, c, d, F, (t) + 1) \
+    ROUND(d, e, a, b, c, F, (t) + 2) \
+    ROUND(c, d, e, a, b, F, (t) + 3) \
+    ROUND(b, c, d, e, a, F, (t) + 4)
+
+/* 80 rounds over a precomputed schedule that already has the round constants added */
+static inline void sha1_rounds_wk(uint32_t state[5], const uint32_t wk[80]) {
+#define WK_MASK 127
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3], e = state[4];
+
+    ROUND5(F1, 0)  ROUND5(F1, 5)  ROUND5(F1, 10) ROUND5(F1, 15)
+    ROUND5(F2, 20) ROUND5(F2, 25) ROUND5(F2, 30) ROUND5(F2, 35)
+    ROUND5(F3, 40) ROUND5(F3, 45) ROUND5(F3, 50) ROUND5(F3, 55)
+    ROUND5(F2, 60) ROUND5(F2, 65) ROUND5(F2, 70) ROUND5(F2, 75)
+#undef WK_MASK
+
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+}
+
+/*
+ * W[t..t+3] = rotl1(W[t-3] ^ W[t-8] ^ W[t-14] ^ W[t-16]), four words at a time.
+ * W[t+3] depends on W[t], so it is computed with W[t] = 0 first and fixed up afterwards:
+ * rotl1(W[t] ^ x) = rotl2(tmp[0]) ^ rotl1(x).
+ */
+__attribute__((target("ssse3")))
+static inline __m128i sha1_ssse3_next(__m128i w16, __m128i w12, __m128i w8, __m128i w4) {
+    __m128i tmp = _mm_xor_si128(_mm_srli_si128(w4, 4), w8);
+    tmp = _mm_xor_si128(tmp, _mm_alignr_epi8(w12, w16, 8));
+    tmp = _mm_xor_si128(tmp, w16);
+
+    __m128i r = _mm_or_si128(_mm_slli_epi32(tmp, 1), _mm_srli_epi32(tmp, 31));
+    __m128i fix = _mm_slli_si128(tmp, 12);
+    fix = _mm_or_si128(_mm_slli_epi32(fix, 2), _mm_srli_epi32(fix, 30));
+    return _mm_xor_si128(r, fix);
+}
+
+/*
+ * Twenty rounds with the schedule for group (t / 4) + 4 computed four rounds ahead of use,
+ * so the vector unit works on the schedule while the scalar rounds run.
+ */
+#define ROUNDS20(F, t, SCHED) \
+    SCHED((t) / 4 + 4) \
+    ROUND(a, b, c, d, e, F, (t) + 0)  ROUND(e, a, b, c, d, F, (t) + 1) \
+    ROUND(d, e, a, b, c, F, (t) + 2)  ROUND(c, d, e, a, b, F, (t) + 3) \
+    SCHED((t) / 4 + 5) \
+    ROUND(b, c, d, e, a, F, (t) + 4)  ROUND(a, b, c, d, e, F, (t) + 5) \
+    ROUND(e, a, b, c, d, F, (t) + 6)  ROUND(d, e, a, b, c, F, (t) + 7) \
+    SCHED((t) / 4 + 6) \
+    ROUND(c, d, e, a, b, F, (t) + 8)  ROUND(b, c, d, e, a, F, (t) + 9) \
+    ROUND(a, b, c, d, e, F, (t) + 10) ROUND(e, a, b, c, d, F, (t) + 11) \
+    SCHED((t) / 4 + 7) \
+    ROUND(d, e, a, b, c, F, (t) + 12) ROUND(c, d, e, a, b, F, (t) + 13) \
+    ROUND(b, c, d, e, a, F, (t) + 14) ROUND(a, b, c, d, e, F, (t) + 15) \
+    SCHED((t) / 4 + 8) \
+    ROUND(e, a, b, c, d, F, (t) + 16) ROUND(d, e, a, b, c, F, (t) + 17) \
+    ROUND(c, d, e, a, b, F, (t) + 18) ROUND(b, c, d, e, a, F, (t) + 19)
+
+#define ROUNDS80(SCHED) \
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3], e = state[4]; \
+    ROUNDS20(F1, 0, SCHED) ROUNDS20(F2, 20, SCHED) ROUNDS20(F3, 40, SCHED) ROUNDS20(F2, 60, SCHED) \
+    state[0] += a; \
+    state[1] += b; \
+    state[2] += c; \
+    state[3] += d; \
+    state[4] += e;
+
+#define WK_MASK 31
+
+#define SSSE3_SCHED(j) \
+    if((j) < 20) { \
+        w[(j) & 3] = sha1_ssse3_next(w[(j) & 3], w[((j) + 1) & 3], w[((j) + 2) & 3], w[((j) + 3) & 3]); \
+        _mm_store_si128((__m128i*)(wk + ((j) & 7) * 4), \
+                        _mm_add_epi32(w[(j) & 3], _mm_set1_epi32((int)SHA1_K[(j) / 5]))); \
+    }
+
+__attribute__((target("ssse3")))
+void sha1_compress_ssse3(uint32_t state[5], const uint8_t* blocks, size_t nblocks) {
+    const __m128i bswap = _mm_set_epi8(12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+
+    // wk is a ring of the last eight schedule groups, (t & 31) indexes it
+    uint32_t ring[32] __attribute__((aligned(16)));
+    uint32_t* const wk = ring;
+
+    for(size_t i = 0; i < nblocks; ++i) {
+        const uint8_t* block = blocks + i * 64;
+
+        __m128i w[4];
+        for(int j = 0; j < 4; ++j) {
+            w[j] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(block + j * 16)), bswap);
+            _mm_store_si128((__m128i*)(wk + j * 4), _mm_add_epi32(w[j], _mm_set1_epi32((int)SHA1_K[0])));
+        }
+
+        ROUNDS80(SSSE3_SCHED)
+    }
+}
+
+__attribute__((target("avx2")))
+static inline __m256i sha1_avx2_next(__m256i w16, __m256i w12, __m256i w8, __m256i w4) {
+    // same as sha1_ssse3_next, every 128-bit lane holds the schedule of a different block
+    __m256i tmp = _mm256_xor_si256(_mm256_srli_si256(w4, 4), w8);
+    tmp = _mm256_xor_si256(tmp, _mm256_alignr_epi8(w12, w16, 8));
+    tmp = _mm256_xor_si256(tmp, w16);
+
+    __m256i r = _mm256_or_si256(_mm256_slli_epi32(tmp, 1), _mm256_srli_epi32(tmp, 31));
+    __m256i fix = _mm256_slli_si256(tmp, 12);
+    fix = _mm256_or_si256(_mm256_slli_epi32(fix, 2), _mm256_srli_epi32(fix, 30));
+    return _mm256_xor_si256(r, fix);
+}
+
+#define AVX2_SCHED(j) \
+    if((j) < 20) { \
+        w[(j) & 3] = sha1_avx2_next(w[(j) & 3], w[((j) + 1) & 3], w[((j) + 2) & 3], w[((j) + 3) & 3]); \
+        const __m256i wk_pair = _mm256_add_epi32(w[(j) & 3], _mm256_set1_epi32((int)SHA1_K[(j) / 5])); \
+        _mm_store_si128((__m128i*)(wk + ((j) & 7) * 4), _mm256_castsi256_si128(wk_pair)); \
+        _mm_store_si128((__m128i*)(wk_second + (j) * 4), _mm256_extracti128_si256(wk_pair, 1)); \
+    }
+
+__attribute__((target("avx2")))
+void sha1_compress_avx2(uint32_t state[5], const uint8_t* blocks, size_t nblocks) {
+    const __m256i bswap = _mm256_set_epi8(
+        12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3,
+        12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+    uint32_t ring[32] __attribute__((aligned(32)));
+    uint32_t wk_second[80] __attribute__((aligned(32)));
+    uint32_t* const wk = ring;
+
+    // the schedules of two consecutive blocks are expanded together while the first
+    // block's rounds run, the second block then only has to run its rounds
+    size_t i = 0;
+    for(; i + 2 <= nblocks; i += 2) {
+        const uint8_t* first = blocks + i * 64;
+        const uint8_t* second = first + 64;
+
+        __m256i w[4];
+        for(int j = 0; j < 4; ++j) {
+            __m256i pair = _mm256_inserti128_si256(
+                _mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)(first + j * 16))),
+                _mm_loadu_si128((const __m128i*)(second + j * 16)), 1);
+            w[j] = _mm256_shuffle_epi8(pair, bswap);
+
+            const __m256i wk_pair = _mm256_add_epi32(w[j], _mm256_set1_epi32((int)SHA1_K[0]));
+            _mm_store_si128((__m128i*)(wk + j * 4), _mm256_castsi256_si128(wk_pair));
+            _mm_store_si128((__m128i*)(wk_second + j * 4), _mm256_extracti128_si256(wk_pair, 1));
+        }
+
+        {
+            ROUNDS80(AVX2_SCHED)
+        }
+        sha1_rounds_wk(state, wk_second);
+    }
+
+    if(i < nblocks) sha1_compress_ssse3(state, blocks + i * 64, nblocks - i);
+}
+
+#pragma endregion Message Schedule
+
+#pragma region SHA-NI
+
+__attribute__((target("sha,sse4.1")))
+void sha1_compress_shani(uint32_t state[5], const uint8_t* blocks, size_t nblocks) {
+    const __m128i mask = _mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+
+    __m128i abcd = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)state), 0x1B);
+    __m128i e0 = _mm_set_epi32((int)state[4], 0, 0, 0);
+    __m128i e1, msg0, msg1, msg2, msg3;
+
+    for(size_t i = 0; i < nblocks; ++i) {
+        const uint8_t* block = blocks + i * 64;
+        const __m128i abcd_save = abcd;
+        const __m128i e0_save = e0;
+
+        /* Rounds 0-3 */
+        msg0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(block + 0)), mask);
+        e0 = _mm_add_epi32(e0, msg0);
+        e1 = abcd;
+        abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+
+        /* Rounds 4-7 */
+        msg1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(block + 16)), mask);
+        e1 = _mm_sha1nexte_epu32(e1, msg1);
+        e0 = abcd;
+        abcd = _mm_sha1rnds4_epu32(abcd, e1, 0);
+        msg0 = _mm_sha1msg1_epu32(msg0, msg1);
+
+        /* Rounds 8-11 */
+        msg2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(block + 32)), mask);
+        e0 = _mm_sha1nexte_epu32(e0, msg2);
+        e1 = abcd;
+        abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+        msg1 = _mm_sha1msg1_epu32(msg1, msg2);
+        msg0 = _mm_xor_si128(msg0, msg2);
+
+        /* Rounds 12-15 */
+        msg3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(block + 48)), mask);
+        e1 = _mm_sha1nexte_epu32(e1, msg3);
+        e0 = abcd;
+        msg0 = _mm_sha1msg2_epu32(msg0, msg3);
+        abcd = _mm_sha1rnds4_epu32(abcd, e1, 0);
+        msg2 = _mm_sha1msg1_epu32(msg2, msg3);
+        msg1 = _mm_xor_si128(msg1, msg3);
+
+/*
+ * Rounds 16-63 follow one pattern: m is the freshest message vector, next/prev
+ * rotate through the four msg registers, func selects the round function.
+ */
+#define SHANI_ROUNDS(e_cur, e_other, m, m_next, m_xor, m_prev, func) \
+        e_cur = _mm_sha1nexte_epu32(e_cur, m); \
+        e_other = abcd; \
+        m_next = _mm_sha1msg2_epu32(m_next, m); \
+        abcd = _mm_sha1rnds4_epu32(abcd, e_cur, func); \
+        m_prev = _mm_sha1msg1_epu32(m_prev, m); \
+        m_xor = _mm_xor_si128(m_xor, m);
+
+        SHANI_ROUNDS(e0, e1, msg0, msg1, msg2, msg3, 0)    /* Rounds 16-19 */
+        SHANI_ROUNDS(e1, e0, msg1, msg2, msg3, msg0, 1)    /* Rounds 20-23 */
+        SHANI_ROUNDS(e0, e1, msg2, msg3, msg0, msg1, 1)    /* Rounds 24-27 */
+        SHANI_ROUNDS(e1, e0, msg3, msg0, msg1, msg2, 1)    /* Rounds 28-31 */
+        SHANI_ROUNDS(e0, e1, msg0, msg1, msg2, msg3, 1)    /* Rounds 32-35 */
+        SHANI_ROUNDS(e1, e0, msg1, msg2, msg3, msg0, 1)    /* Rounds 36-39 */
+        SHANI_ROUNDS(e0, e1, msg2, msg3, msg0, msg1, 2)    /* Rounds 40-43 */
+        SHANI_ROUNDS(e1, e0, msg3, msg0, msg1, msg2, 2)    /* Rounds 44-47 */
+        SHANI_ROUNDS(e0, e1, msg0, msg1, msg2, msg3, 2)    /* Rounds 48-51 */
+        SHANI_ROUNDS(e1, e0, msg1, msg2, msg3, msg0, 2)    /* Rounds 52-55 */
+        SHANI_ROUNDS(e0, e1, msg2, msg3, msg0, msg1, 2)    /* Rounds 56-59 */
+        SHANI_ROUNDS(e1, e0, msg3, msg0, msg1, msg2, 3)    /* Rounds 60-63 */
+#undef SHANI_ROUNDS
+
+        /* Rounds 64-67 */
+        e0 = _mm_sha1nexte_epu32(e0, msg0);
+        e1 = abcd;
+        msg1 = _mm_sha1msg2_epu32(msg1, msg0);
+        abcd = _mm_sha1rnds4_epu32(abcd, e0, 3);
+        msg3 = _mm_sha1msg1_epu32(msg3, msg0);
+        msg2 = _mm_xor_si128(msg2, msg0);
+
+        /* Rounds 68-71 */
+        e1 = _mm_sha1nexte_epu32(e1, msg1);
+        e0 = abcd;
+        msg2 = _mm_sha1msg2_epu32(msg2, msg1);
+        abcd = _mm_sha1rnds4_epu32(abcd, e1, 3);
+        msg3 = _mm_xor_si128(msg3, msg1);
+
+        /* Rounds 72-75 */
+        e0 = _mm_sha1nexte_epu32(e0, msg2);
+        e1 = abcd;
+        msg3 = _mm_sha1msg2_epu32(msg3, msg2);
+        abcd = _mm_sha1rnds4_epu32(abcd, e0, 3);
+
+        /* Rounds 76-79 */
+        e1 = _mm_sha1nexte_epu32(e1, msg3);
+        e0 = abcd;
+        abcd = _mm_sha1rnds4_epu32(abcd, e1, 3);
+
+        /* Add this chunk's hash to the result */
+        e0 = _mm_sha1nexte_epu32(e0, e0_save);
+        abcd = _mm_add_epi32(abcd, abcd_save);
+    }
+
+    abcd = _mm_shuffle_epi32(abcd, 0x1B);
+    _mm_storeu_si128((__m128i*)state, abcd);
+    state[4] = (uint32_t)_mm_extract_epi32(e0, 3);
+}
+
+#pragma endregion SHA-NI
+
+#endif
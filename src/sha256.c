@@ -0,0 +1,247 @@
+#include "cryptography.h"
+#include "sha256_backend.h"
+#include "stats.h"
+
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const uint32_t SHA256_INIT[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+};
+
+static const uint32_t SHA256_K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#pragma region Compression
+
+static inline uint32_t rotr32(uint32_t value, unsigned int count) {
+    return (value >> count) | (value << (32 - count));
+}
+
+/* Reference implementation: process nblocks consecutive 512-bit chunks */
+static void sha256_compress_ref(uint32_t state[8], const uint8_t* blocks, size_t nblocks) {
+    for(size_t i = 0; i < nblocks; ++i) {
+        const uint8_t* block = blocks + i * 64;
+
+        uint32_t w[64];
+        for(size_t j = 0; j < 16; ++j) {
+            w[j] = ((uint32_t)block[j*4 + 0] << 24) |
+                   ((uint32_t)block[j*4 + 1] << 16) |
+                   ((uint32_t)block[j*4 + 2] << 8)  |
+                   ((uint32_t)block[j*4 + 3] << 0);
+        }
+        for(size_t j = 16; j < 64; ++j) {
+            const uint32_t s0 = rotr32(w[j-15], 7) ^ rotr32(w[j-15], 18) ^ (w[j-15] >> 3);
+            const uint32_t s1 = rotr32(w[j-2], 17) ^ rotr32(w[j-2], 19) ^ (w[j-2] >> 10);
+            w[j] = w[j-16] + s0 + w[j-7] + s1;
+        }
+
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+        uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+        for(size_t j = 0; j < 64; ++j) {
+            const uint32_t s1 = rotr32(e, 6) ^ rotr32(e, 11) ^ rotr32(e, 25);
+            const uint32_t ch = (e & f) ^ (~e & g);
+            const uint32_t temp1 = h + s1 + ch + SHA256_K[j] + w[j];
+            const uint32_t s0 = rotr32(a, 2) ^ rotr32(a, 13) ^ rotr32(a, 22);
+            const uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+            const uint32_t temp2 = s0 + maj;
+
+            h = g;
+            g = f;
+            f = e;
+            e = d + temp1;
+            d = c;
+            c = b;
+            b = a;
+            a = temp1 + temp2;
+        }
+
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+        state[5] += f;
+        state[6] += g;
+        state[7] += h;
+    }
+}
+
+#pragma endregion Compression
+
+#pragma region Dispatch
+
+static bool sha256_always_supported(void) {
+    return true;
+}
+
+static const sha256_backend SHA256_BACKENDS[] = {
+#if defined(SHA1_HAVE_X86)
+    { "shani",      sha256_compress_shani,      sha1_cpu_has_shani },
+#endif
+    { "reference",  sha256_compress_ref,        sha256_always_supported },
+};
+
+#define SHA256_BACKEND_COUNT (sizeof(SHA256_BACKENDS) / sizeof(SHA256_BACKENDS[0]))
+
+static _Atomic(const sha256_backend*) sha256_backend_active = NULL;
+
+const sha256_backend* sha256_backends(size_t* count) {
+    *count = SHA256_BACKEND_COUNT;
+    return SHA256_BACKENDS;
+}
+
+/* Run a backend over a few blocks of patterned data and compare it against the reference */
+static bool sha256_backend_matches_reference(const sha256_backend* backend) {
+    uint8_t blocks[5 * 64];
+    for(size_t i = 0; i < sizeof(blocks); ++i) {
+        blocks[i] = (uint8_t)(i * 131 + (i >> 3));
+    }
+
+    for(size_t nblocks = 1; nblocks <= 5; ++nblocks) {
+        uint32_t expected[8];
+        uint32_t actual[8];
+        memcpy(expected, SHA256_INIT, sizeof(expected));
+        memcpy(actual, SHA256_INIT, sizeof(actual));
+
+        sha256_compress_ref(expected, blocks, nblocks);
+        backend->compress(actual, blocks, nblocks);
+        if(memcmp(expected, actual, sizeof(actual)) != 0) return false;
+    }
+    return true;
+}
+
+static bool sha256_backend_usable(const sha256_backend* backend) {
+    return backend->supported() && sha256_backend_matches_reference(backend);
+}
+
+bool sha256_select_backend(const char* name) {
+    for(size_t i = 0; i < SHA256_BACKEND_COUNT; ++i) {
+        if(strcmp(SHA256_BACKENDS[i].name, name) != 0) continue;
+        if(!sha256_backend_usable(&SHA256_BACKENDS[i])) return false;
+
+        atomic_store(&sha256_backend_active, &SHA256_BACKENDS[i]);
+        return true;
+    }
+    return false;
+}
+
+const sha256_backend* sha256_active_backend(void) {
+    const sha256_backend* backend = atomic_load_explicit(&sha256_backend_active, memory_order_acquire);
+    if(backend) return backend;
+
+    // concurrent first calls may both probe, they agree on the result
+    const char* forced = getenv("CTORRENT_SHA256");
+    if(forced && sha256_select_backend(forced)) return atomic_load(&sha256_backend_active);
+
+    for(size_t i = 0; i < SHA256_BACKEND_COUNT; ++i) {
+        if(!sha256_backend_usable(&SHA256_BACKENDS[i])) continue;
+
+        atomic_store(&sha256_backend_active, &SHA256_BACKENDS[i]);
+        return &SHA256_BACKENDS[i];
+    }
+    return &SHA256_BACKENDS[SHA256_BACKEND_COUNT - 1];
+}
+
+static void sha256_compress(uint32_t state[8], const uint8_t* blocks, size_t nblocks) {
+    sha256_active_backend()->compress(state, blocks, nblocks);
+}
+
+#pragma endregion Dispatch
+
+static sha256hash sha256_digest(const uint32_t state[8]) {
+    sha256hash result;
+    for(int i = 0; i < 8; i++) {
+        for(int j = 0; j < 4; j++) {
+            result.bytes[i*4 + j] = (state[i] >> (24 - j * 8)) & 0xFF;
+        }
+    }
+    return result;
+}
+
+void sha256_init(sha256_ctx* ctx) {
+    memcpy(ctx->state, SHA256_INIT, sizeof(ctx->state));
+    ctx->length = 0;
+    ctx->block_len = 0;
+}
+
+void sha256_update(sha256_ctx* ctx, const uint8_t* data, size_t len) {
+    ctx->length += len;
+    STATS_ADD(STAT_SHA256_BYTES, len);
+
+    /* Top up a partially filled block first */
+    if(ctx->block_len > 0) {
+        size_t take = 64 - ctx->block_len;
+        if(take > len) take = len;
+        memcpy(ctx->block + ctx->block_len, data, take);
+        ctx->block_len += take;
+        data += take;
+        len -= take;
+
+        if(ctx->block_len < 64) return;
+        sha256_compress(ctx->state, ctx->block, 1);
+        ctx->block_len = 0;
+    }
+
+    /* Hash whole blocks straight from the caller's buffer */
+    size_t nblocks = len / 64;
+    if(nblocks > 0) {
+        sha256_compress(ctx->state, data, nblocks);
+        data += nblocks * 64;
+        len -= nblocks * 64;
+    }
+
+    memcpy(ctx->block, data, len);
+    ctx->block_len = len;
+}
+
+sha256hash sha256_final(sha256_ctx* ctx) {
+    const uint64_t bitlen = ctx->length << 3;
+
+    /* Pad only the last block: 0x80, zeros, then the 64-bit message length */
+    uint8_t tail[128] = {0};
+    memcpy(tail, ctx->block, ctx->block_len);
+    tail[ctx->block_len] = 0x80;
+
+    size_t tail_len = ctx->block_len + 1 + 8 <= 64 ? 64 : 128;
+    for (int i = 0; i < 8; i++) {
+        tail[tail_len - 8 + i] = (bitlen >> (56 - i * 8)) & 0xFF;
+    }
+    sha256_compress(ctx->state, tail, tail_len / 64);
+
+    return sha256_digest(ctx->state);
+}
+
+sha256hash sha256(const uint8_t* message, size_t message_len) {
+    STATS_TIMER_START(timer);
+    sha256_ctx ctx;
+    sha256_init(&ctx);
+    sha256_update(&ctx, message, message_len);
+    const sha256hash result = sha256_final(&ctx);
+    STATS_ADD(STAT_SHA256_CALLS, 1);
+    STATS_TIMER_STOP(timer, STAT_SHA256_NS);
+    return result;
+}
+
+sha256hash sha256_pair(const sha256hash* left, const sha256hash* right) {
+    // exactly one block of input, so the padding block never changes
+    static const uint8_t padding[64] = { [0] = 0x80, [62] = 0x02 };
+    uint8_t blocks[128];
+    memcpy(blocks, left->bytes, 32);
+    memcpy(blocks + 32, right->bytes, 32);
+    memcpy(blocks + 64, padding, sizeof(padding));
+
+    uint32_t state[8];
+    memcpy(state, SHA256_INIT, sizeof(state));
+    sha256_compress(state, blocks, 2);
+    return sha256_digest(state);
+}
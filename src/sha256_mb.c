@@ -0,0 +1,225 @@
+#include "cryptography.h"
+#include "sha256_backend.h"
+#include "stats.h"
+
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const uint32_t SHA256_MB_INIT[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+};
+
+static const uint32_t SHA256_MB_K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static inline uint32_t sha256_mb_load_be32(const uint8_t* p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+/* Build the padded final block(s) of every lane, returns how many blocks each tail has */
+static size_t sha256_mb_build_tails(const uint8_t* const* msgs, size_t len, size_t lanes,
+                                    uint8_t (*tails)[128], const uint8_t** tail_ptrs) {
+    const size_t rem = len % 64;
+    const size_t tail_len = rem + 1 + 8 <= 64 ? 64 : 128;
+    const uint64_t bitlen = (uint64_t)len << 3;
+
+    for(size_t l = 0; l < lanes; ++l) {
+        memset(tails[l], 0, tail_len);
+        memcpy(tails[l], msgs[l] + len - rem, rem);
+        tails[l][rem] = 0x80;
+        for(int i = 0; i < 8; i++) {
+            tails[l][tail_len - 8 + i] = (bitlen >> (56 - i * 8)) & 0xFF;
+        }
+        tail_ptrs[l] = tails[l];
+    }
+    return tail_len / 64;
+}
+
+#if defined(SHA1_HAVE_X86)
+
+#include <immintrin.h>
+
+#pragma region AVX2
+
+#define MB_NAME         avx2
+#define MB_TARGET       "avx2"
+#define MB_LANES        8
+#define MB_V            __m256i
+#define MB_LOAD(p)      _mm256_load_si256((const __m256i*)(p))
+#define MB_STORE(p, v)  _mm256_store_si256((__m256i*)(p), v)
+#define MB_SET1(x)      _mm256_set1_epi32((int)(x))
+#define MB_ADD(x, y)    _mm256_add_epi32(x, y)
+#define MB_XOR(x, y)    _mm256_xor_si256(x, y)
+#define MB_SHR(v, n)    _mm256_srli_epi32(v, n)
+#define MB_ROR(v, n)    _mm256_or_si256(_mm256_srli_epi32(v, n), _mm256_slli_epi32(v, 32 - (n)))
+#define MB_CH(e, f, g)  _mm256_xor_si256(g, _mm256_and_si256(e, _mm256_xor_si256(f, g)))
+#define MB_MAJ(a, b, c) _mm256_or_si256(_mm256_and_si256(a, b), _mm256_and_si256(c, _mm256_or_si256(a, b)))
+#include "sha256_mb_lanes.inc"
+#undef MB_NAME
+#undef MB_TARGET
+#undef MB_LANES
+#undef MB_V
+#undef MB_LOAD
+#undef MB_STORE
+#undef MB_SET1
+#undef MB_ADD
+#undef MB_XOR
+#undef MB_SHR
+#undef MB_ROR
+#undef MB_CH
+#undef MB_MAJ
+
+#pragma endregion AVX2
+
+#pragma region AVX-512
+
+/* ternary logic immediates: CH = choose, MAJ = majority */
+#define MB_NAME         avx512
+#define MB_TARGET       "avx512f"
+#define MB_LANES        16
+#define MB_V            __m512i
+#define MB_LOAD(p)      _mm512_load_si512((const void*)(p))
+#define MB_STORE(p, v)  _mm512_store_si512((void*)(p), v)
+#define MB_SET1(x)      _mm512_set1_epi32((int)(x))
+#define MB_ADD(x, y)    _mm512_add_epi32(x, y)
+#define MB_XOR(x, y)    _mm512_xor_si512(x, y)
+#define MB_SHR(v, n)    _mm512_srli_epi32(v, n)
+#define MB_ROR(v, n)    _mm512_ror_epi32(v, n)
+#define MB_CH(e, f, g)  _mm512_ternarylogic_epi32(e, f, g, 0xCA)
+#define MB_MAJ(a, b, c) _mm512_ternarylogic_epi32(a, b, c, 0xE8)
+#include "sha256_mb_lanes.inc"
+#undef MB_NAME
+#undef MB_TARGET
+#undef MB_LANES
+#undef MB_V
+#undef MB_LOAD
+#undef MB_STORE
+#undef MB_SET1
+#undef MB_ADD
+#undef MB_XOR
+#undef MB_SHR
+#undef MB_ROR
+#undef MB_CH
+#undef MB_MAJ
+
+#pragma endregion AVX-512
+
+static bool sha256_mb_has_avx2(void) {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+}
+
+static bool sha256_mb_has_avx512(void) {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx512f");
+}
+
+#endif
+
+#pragma region Dispatch
+
+typedef struct sha256_mb_backend {
+    const char* name;
+    size_t      lanes;
+    void        (*hash)(const uint8_t* const* msgs, size_t len, sha256hash* out);
+    bool        (*supported)(void);
+} sha256_mb_backend;
+
+static const sha256_mb_backend SHA256_MB_BACKENDS[] = {
+#if defined(SHA1_HAVE_X86)
+    { "avx512",     16,     sha256_mb_hash_avx512,  sha256_mb_has_avx512 },
+    { "avx2",       8,      sha256_mb_hash_avx2,    sha256_mb_has_avx2 },
+#endif
+};
+
+#define SHA256_MB_BACKEND_COUNT (sizeof(SHA256_MB_BACKENDS) / sizeof(SHA256_MB_BACKENDS[0]))
+
+#define SHA256_MB_MIN_LANES_WITH_SHANI 16
+
+/* sentinel for "scalar only", distinct from "not probed yet" */
+static const sha256_mb_backend SHA256_MB_SCALAR = { "scalar", 1, NULL, NULL };
+
+static _Atomic(const sha256_mb_backend*) sha256_mb_active = NULL;
+
+/* Compare a backend against sha256() for a few lengths around the padding boundaries */
+static bool sha256_mb_matches_reference(const sha256_mb_backend* backend) {
+    static const size_t lengths[] = { 0, 3, 55, 56, 64, 119, 200 };
+    uint8_t data[16][200];
+    const uint8_t* msgs[16];
+    sha256hash out[16];
+
+    for(size_t l = 0; l < backend->lanes; ++l) {
+        for(size_t i = 0; i < sizeof(data[l]); ++i) {
+            data[l][i] = (uint8_t)(i * 31 + l * 7 + 1);
+        }
+        msgs[l] = data[l];
+    }
+
+    for(size_t n = 0; n < sizeof(lengths) / sizeof(lengths[0]); ++n) {
+        backend->hash(msgs, lengths[n], out);
+        for(size_t l = 0; l < backend->lanes; ++l) {
+            sha256hash expected = sha256(msgs[l], lengths[n]);
+            if(memcmp(expected.bytes, out[l].bytes, sizeof(expected.bytes)) != 0) return false;
+        }
+    }
+    return true;
+}
+
+static const sha256_mb_backend* sha256_mb_backend_active(void) {
+    const sha256_mb_backend* backend = atomic_load_explicit(&sha256_mb_active, memory_order_acquire);
+    if(backend) return backend;
+
+    // SHA-NI hashes one message about as fast as eight AVX2 lanes do, so with it only
+    // the widest backend is worth the transposition overhead
+    const bool have_shani = strcmp(sha256_active_backend()->name, "shani") == 0;
+
+    backend = &SHA256_MB_SCALAR;
+    const char* forced = getenv("CTORRENT_SHA256_MB");
+    for(size_t i = 0; i < SHA256_MB_BACKEND_COUNT; ++i) {
+        const sha256_mb_backend* candidate = &SHA256_MB_BACKENDS[i];
+        if(forced && strcmp(forced, candidate->name) != 0) continue;
+        if(!forced && have_shani && candidate->lanes < SHA256_MB_MIN_LANES_WITH_SHANI) continue;
+        if(!candidate->supported() || !sha256_mb_matches_reference(candidate)) continue;
+
+        backend = candidate;
+        break;
+    }
+
+    atomic_store(&sha256_mb_active, backend);
+    return backend;
+}
+
+const char* sha256_many_backend(void) {
+    return sha256_mb_backend_active()->name;
+}
+
+void sha256_many(const uint8_t** msgs, size_t len, size_t count, sha256hash* out) {
+    const sha256_mb_backend* backend = sha256_mb_backend_active();
+
+    size_t i = 0;
+    if(backend->hash) {
+        STATS_TIMER_START(timer);
+        for(; i + backend->lanes <= count; i += backend->lanes) {
+            backend->hash(msgs + i, len, out + i);
+        }
+        STATS_ADD(STAT_SHA256_CALLS, i);
+        STATS_ADD(STAT_SHA256_BYTES, (uint64_t)i * len);
+        STATS_TIMER_STOP(timer, STAT_SHA256_NS);
+    }
+
+    // leftovers that do not fill every lane go through the single-buffer path
+    for(; i < count; ++i) {
+        out[i] = sha256(msgs[i], len);
+    }
+}
+
+#pragma endregion Dispatch
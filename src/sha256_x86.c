@@ -0,0 +1,106 @@
+#include "sha256_backend.h"
+
+#if defined(SHA1_HAVE_X86)
+
+#include <immintrin.h>
+
+#pragma region SHA-NI
+
+/*
+ * Four rounds per step: the message words of the step plus their round constants go
+ * through two sha256rnds2, which keep the state as ABEF and CDGH halves.
+ */
+#define SHANI_ROUNDS(m, k_hi, k_lo) \
+        msg = _mm_add_epi32(m, _mm_set_epi64x((long long)(k_hi), (long long)(k_lo))); \
+        cdgh = _mm_sha256rnds2_epu32(cdgh, abef, msg); \
+        abef = _mm_sha256rnds2_epu32(abef, cdgh, _mm_shuffle_epi32(msg, 0x0E));
+
+/*
+ * Next four schedule words into m_new, which holds the msg1 part of the words 16 back:
+ * W[t..t+3] = msg2(msg1(W[t-16..], W[t-12..]) + W[t-7..t-4], W[t-4..t-1]). Has to run
+ * before m_prev2 gets its own msg1 part added.
+ */
+#define SHANI_SCHEDULE(m_new, m_prev, m_prev2) \
+        m_new = _mm_sha256msg2_epu32(_mm_add_epi32(m_new, _mm_alignr_epi8(m_prev, m_prev2, 4)), m_prev);
+
+__attribute__((target("sha,sse4.1")))
+void sha256_compress_shani(uint32_t state[8], const uint8_t* blocks, size_t nblocks) {
+    const __m128i mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+
+    // DCBA and HGFE as loaded, rearranged into the halves the round instruction wants
+    __m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)&state[0]), 0xB1);
+    __m128i cdgh = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)&state[4]), 0x1B);
+    __m128i abef = _mm_alignr_epi8(tmp, cdgh, 8);
+    cdgh = _mm_blend_epi16(cdgh, tmp, 0xF0);
+
+    __m128i msg, msg0, msg1, msg2, msg3;
+    for(size_t i = 0; i < nblocks; ++i) {
+        const uint8_t* block = blocks + i * 64;
+        const __m128i abef_save = abef;
+        const __m128i cdgh_save = cdgh;
+
+        msg0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(block + 0)), mask);
+        SHANI_ROUNDS(msg0, 0xE9B5DBA5B5C0FBCFULL, 0x71374491428A2F98ULL)
+        msg1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(block + 16)), mask);
+        SHANI_ROUNDS(msg1, 0xAB1C5ED5923F82A4ULL, 0x59F111F13956C25BULL)
+        msg0 = _mm_sha256msg1_epu32(msg0, msg1);
+        msg2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(block + 32)), mask);
+        SHANI_ROUNDS(msg2, 0x550C7DC3243185BEULL, 0x12835B01D807AA98ULL)
+        msg1 = _mm_sha256msg1_epu32(msg1, msg2);
+        msg3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(block + 48)), mask);
+        SHANI_ROUNDS(msg3, 0xC19BF1749BDC06A7ULL, 0x80DEB1FE72BE5D74ULL)
+        SHANI_SCHEDULE(msg0, msg3, msg2)
+        msg2 = _mm_sha256msg1_epu32(msg2, msg3);
+
+        SHANI_ROUNDS(msg0, 0x240CA1CC0FC19DC6ULL, 0xEFBE4786E49B69C1ULL)
+        SHANI_SCHEDULE(msg1, msg0, msg3)
+        msg3 = _mm_sha256msg1_epu32(msg3, msg0);
+        SHANI_ROUNDS(msg1, 0x76F988DA5CB0A9DCULL, 0x4A7484AA2DE92C6FULL)
+        SHANI_SCHEDULE(msg2, msg1, msg0)
+        msg0 = _mm_sha256msg1_epu32(msg0, msg1);
+        SHANI_ROUNDS(msg2, 0xBF597FC7B00327C8ULL, 0xA831C66D983E5152ULL)
+        SHANI_SCHEDULE(msg3, msg2, msg1)
+        msg1 = _mm_sha256msg1_epu32(msg1, msg2);
+        SHANI_ROUNDS(msg3, 0x1429296706CA6351ULL, 0xD5A79147C6E00BF3ULL)
+        SHANI_SCHEDULE(msg0, msg3, msg2)
+        msg2 = _mm_sha256msg1_epu32(msg2, msg3);
+
+        SHANI_ROUNDS(msg0, 0x53380D134D2C6DFCULL, 0x2E1B213827B70A85ULL)
+        SHANI_SCHEDULE(msg1, msg0, msg3)
+        msg3 = _mm_sha256msg1_epu32(msg3, msg0);
+        SHANI_ROUNDS(msg1, 0x92722C8581C2C92EULL, 0x766A0ABB650A7354ULL)
+        SHANI_SCHEDULE(msg2, msg1, msg0)
+        msg0 = _mm_sha256msg1_epu32(msg0, msg1);
+        SHANI_ROUNDS(msg2, 0xC76C51A3C24B8B70ULL, 0xA81A664BA2BFE8A1ULL)
+        SHANI_SCHEDULE(msg3, msg2, msg1)
+        msg1 = _mm_sha256msg1_epu32(msg1, msg2);
+        SHANI_ROUNDS(msg3, 0x106AA070F40E3585ULL, 0xD6990624D192E819ULL)
+        SHANI_SCHEDULE(msg0, msg3, msg2)
+        msg2 = _mm_sha256msg1_epu32(msg2, msg3);
+
+        SHANI_ROUNDS(msg0, 0x34B0BCB52748774CULL, 0x1E376C0819A4C116ULL)
+        SHANI_SCHEDULE(msg1, msg0, msg3)
+        msg3 = _mm_sha256msg1_epu32(msg3, msg0);
+        SHANI_ROUNDS(msg1, 0x682E6FF35B9CCA4FULL, 0x4ED8AA4A391C0CB3ULL)
+        SHANI_SCHEDULE(msg2, msg1, msg0)
+        SHANI_ROUNDS(msg2, 0x8CC7020884C87814ULL, 0x78A5636F748F82EEULL)
+        SHANI_SCHEDULE(msg3, msg2, msg1)
+        SHANI_ROUNDS(msg3, 0xC67178F2BEF9A3F7ULL, 0xA4506CEB90BEFFFAULL)
+
+        abef = _mm_add_epi32(abef, abef_save);
+        cdgh = _mm_add_epi32(cdgh, cdgh_save);
+    }
+
+    // back from ABEF/CDGH to DCBA and HGFE
+    tmp = _mm_shuffle_epi32(abef, 0x1B);
+    cdgh = _mm_shuffle_epi32(cdgh, 0xB1);
+    _mm_storeu_si128((__m128i*)&state[0], _mm_blend_epi16(tmp, cdgh, 0xF0));
+    _mm_storeu_si128((__m128i*)&state[4], _mm_alignr_epi8(cdgh, tmp, 8));
+}
+
+#undef SHANI_SCHEDULE
+#undef SHANI_ROUNDS
+
+#pragma endregion SHA-NI
+
+#endif
@@ -0,0 +1,240 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "stats.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static const char* const STATS_NAMES[STAT_COUNT] = {
+    [STAT_PARSE_CALLS]      = "parse_calls",
+    [STAT_PARSE_BYTES]      = "parse_bytes",
+    [STAT_PARSE_NS]         = "parse_ns",
+    [STAT_ENCODE_CALLS]     = "encode_calls",
+    [STAT_ENCODE_BYTES]     = "encode_bytes",
+    [STAT_ENCODE_NS]        = "encode_ns",
+    [STAT_SHA1_CALLS]       = "sha1_calls",
+    [STAT_SHA1_BYTES]       = "sha1_bytes",
+    [STAT_SHA1_NS]          = "sha1_ns",
+    [STAT_SHA256_CALLS]     = "sha256_calls",
+    [STAT_SHA256_BYTES]     = "sha256_bytes",
+    [STAT_SHA256_NS]        = "sha256_ns",
+    [STAT_NODE_ALLOCS]      = "node_allocs",
+    [STAT_NODE_BYTES]       = "node_bytes",
+    [STAT_STRING_ALLOCS]    = "string_allocs",
+    [STAT_STRING_BYTES]     = "string_bytes",
+    [STAT_NET_BYTES_IN]     = "net_bytes_in",
+    [STAT_NET_BYTES_OUT]    = "net_bytes_out",
+    [STAT_NET_MESSAGES_IN]  = "net_messages_in",
+    [STAT_DISK_READ_BYTES]  = "disk_read_bytes",
+    [STAT_DISK_READ_NS]     = "disk_read_ns",
+    [STAT_DISK_WRITE_BYTES] = "disk_write_bytes",
+    [STAT_DISK_WRITE_NS]    = "disk_write_ns",
+};
+
+#pragma region Counting
+
+#ifdef CTORRENT_STATS
+
+_Thread_local StatsBlock* stats_local = NULL;
+
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t stats_once = PTHREAD_ONCE_INIT;
+static pthread_key_t stats_key;
+static StatsBlock* stats_blocks = NULL;         // blocks of the live threads
+static uint64_t stats_retired[STAT_COUNT];      // what exited threads counted
+
+/* Thread exit: keep what the block counted and drop it from the list */
+static void stats_retire(void* arg) {
+    StatsBlock* block = arg;
+
+    pthread_mutex_lock(&stats_lock);
+    for(size_t i = 0; i < STAT_COUNT; ++i) {
+        stats_retired[i] += atomic_load_explicit(&block->values[i], memory_order_relaxed);
+    }
+    for(StatsBlock** link = &stats_blocks; *link; link = &(*link)->next) {
+        if(*link == block) {
+            *link = block->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&stats_lock);
+    free(block);
+}
+
+static void stats_init(void) {
+    pthread_key_create(&stats_key, stats_retire);
+}
+
+StatsBlock* stats_register(void) {
+    pthread_once(&stats_once, stats_init);
+
+    StatsBlock* block = calloc(1, sizeof(*block));
+    if(!block) return NULL;
+    pthread_setspecific(stats_key, block);
+
+    pthread_mutex_lock(&stats_lock);
+    block->next = stats_blocks;
+    stats_blocks = block;
+    pthread_mutex_unlock(&stats_lock);
+
+    stats_local = block;
+    return block;
+}
+
+uint64_t stats_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+
+bool stats_enabled(void) {
+    return true;
+}
+
+void stats_snapshot(uint64_t values[STAT_COUNT]) {
+    pthread_mutex_lock(&stats_lock);
+    for(size_t i = 0; i < STAT_COUNT; ++i) {
+        values[i] = stats_retired[i];
+    }
+    for(const StatsBlock* block = stats_blocks; block; block = block->next) {
+        for(size_t i = 0; i < STAT_COUNT; ++i) {
+            values[i] += atomic_load_explicit(&block->values[i], memory_order_relaxed);
+        }
+    }
+    pthread_mutex_unlock(&stats_lock);
+}
+
+#else
+
+bool stats_enabled(void) {
+    return false;
+}
+
+void stats_snapshot(uint64_t values[STAT_COUNT]) {
+    for(size_t i = 0; i < STAT_COUNT; ++i) {
+        values[i] = 0;
+    }
+}
+
+#endif
+
+#pragma endregion Counting
+
+#pragma region Output
+
+const char* stats_name(StatCounter counter) {
+    return counter < STAT_COUNT ? STATS_NAMES[counter] : NULL;
+}
+
+/* Length of name without a "_ns" suffix, 0 if it is not a timer */
+static size_t stats_timer_prefix(const char* name) {
+    const size_t len = strlen(name);
+    return len > 3 && strcmp(name + len - 3, "_ns") == 0 ? len - 3 : 0;
+}
+
+bool stats_write(FILE* out, StatsFormat format) {
+    uint64_t values[STAT_COUNT];
+    stats_snapshot(values);
+
+    if(format == STATS_FORMAT_JSON) {
+        fputc('{', out);
+        for(size_t i = 0; i < STAT_COUNT; ++i) {
+            fprintf(out, "%s\"%s\":%llu", i ? "," : "", STATS_NAMES[i], (unsigned long long)values[i]);
+        }
+        fputs("}\n", out);
+    } else {
+        for(size_t i = 0; i < STAT_COUNT; ++i) {
+            const size_t prefix = stats_timer_prefix(STATS_NAMES[i]);
+            if(prefix) {
+                fprintf(out, "# TYPE ctorrent_%.*s_seconds_total counter\n", (int)prefix, STATS_NAMES[i]);
+                fprintf(out, "ctorrent_%.*s_seconds_total %.9f\n", (int)prefix, STATS_NAMES[i], (double)values[i] / 1e9);
+            } else {
+                fprintf(out, "# TYPE ctorrent_%s_total counter\n", STATS_NAMES[i]);
+                fprintf(out, "ctorrent_%s_total %llu\n", STATS_NAMES[i], (unsigned long long)values[i]);
+            }
+        }
+    }
+    return fflush(out) == 0 && !ferror(out);
+}
+
+#pragma endregion Output
+
+#pragma region Reporter
+
+struct StatsReporter {
+    FILE*           out;
+    StatsFormat     format;
+    double          interval;
+    bool            stop;
+    pthread_mutex_t lock;
+    pthread_cond_t  wake;
+    pthread_t       thread;
+};
+
+static void* stats_reporter_thread(void* arg) {
+    StatsReporter* reporter = arg;
+
+    pthread_mutex_lock(&reporter->lock);
+    struct timespec until;
+    clock_gettime(CLOCK_MONOTONIC, &until);
+    while(!reporter->stop) {
+        const long long ns = (long long)(reporter->interval * 1e9);
+        until.tv_sec += (time_t)(ns / 1000000000);
+        until.tv_nsec += (long)(ns % 1000000000);
+        if(until.tv_nsec >= 1000000000L) {
+            until.tv_sec++;
+            until.tv_nsec -= 1000000000L;
+        }
+
+        // a deadline that keeps its phase, the output lines up with the interval
+        while(!reporter->stop && pthread_cond_timedwait(&reporter->wake, &reporter->lock, &until) == 0) {}
+        if(reporter->stop) break;
+
+        pthread_mutex_unlock(&reporter->lock);
+        stats_write(reporter->out, reporter->format);
+        pthread_mutex_lock(&reporter->lock);
+    }
+    pthread_mutex_unlock(&reporter->lock);
+    return NULL;
+}
+
+StatsReporter* stats_reporter_start(FILE* out, StatsFormat format, double interval) {
+    if(!out || !(interval > 0)) return NULL;
+
+    StatsReporter* reporter = calloc(1, sizeof(*reporter));
+    if(!reporter) return NULL;
+    *reporter = (StatsReporter){ .out = out, .format = format, .interval = interval };
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&reporter->wake, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_mutex_init(&reporter->lock, NULL);
+
+    if(pthread_create(&reporter->thread, NULL, stats_reporter_thread, reporter) != 0) {
+        pthread_cond_destroy(&reporter->wake);
+        pthread_mutex_destroy(&reporter->lock);
+        free(reporter);
+        return NULL;
+    }
+    return reporter;
+}
+
+void stats_reporter_stop(StatsReporter* reporter) {
+    if(!reporter) return;
+
+    pthread_mutex_lock(&reporter->lock);
+    reporter->stop = true;
+    pthread_cond_signal(&reporter->wake);
+    pthread_mutex_unlock(&reporter->lock);
+    pthread_join(reporter->thread, NULL);
+
+    pthread_cond_destroy(&reporter->wake);
+    pthread_mutex_destroy(&reporter->lock);
+    free(reporter);
+}
+
+#pragma endregion Reporter
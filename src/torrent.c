@@ -0,0 +1,348 @@
+#include "torrent.h"
+
+#include "merkle.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static bool torrent_get_int(const BNode* dict, const char* key, long long* out) {
+    const BNode* node = bencode_find_node_by_key(dict, key);
+    if(!node || node->type != BINT) return false;
+
+    *out = node->value.bint.value;
+    return true;
+}
+
+static char* torrent_dup_string(const BString* str) {
+    char* result = malloc((size_t)str->post_delim_len + 1);
+    if(!result) return NULL;
+
+    memcpy(result, str->data, str->post_delim_len);
+    result[str->post_delim_len] = '\0';
+    return result;
+}
+
+/* Path components must not escape the torrent root or smuggle separators */
+static bool torrent_valid_component(const BString* str) {
+    if(str->post_delim_len == 0) return false;
+    if(memchr(str->data, '/', str->post_delim_len)) return false;
+    if(memchr(str->data, '\0', str->post_delim_len)) return false;
+    if(str->post_delim_len == 1 && str->data[0] == '.') return false;
+    if(str->post_delim_len == 2 && str->data[0] == '.' && str->data[1] == '.') return false;
+    return true;
+}
+
+/* Join the components of a path list with '/' */
+static char* torrent_join_path(const BNode* path) {
+    if(!path || path->type != BLIST || !bencode_expand(path) || path->value.blist.len == 0) return NULL;
+
+    size_t len = 0;
+    for(size_t i = 0; i < path->value.blist.len; ++i) {
+        const BNode* component = path->value.blist.items[i];
+        if(component->type != BSTRING) return NULL;
+        if(!torrent_valid_component(&component->value.bstring)) return NULL;
+        len += (size_t)component->value.bstring.post_delim_len + 1;
+    }
+
+    char* result = malloc(len);
+    if(!result) return NULL;
+
+    size_t offset = 0;
+    for(size_t i = 0; i < path->value.blist.len; ++i) {
+        const BString* component = &path->value.blist.items[i]->value.bstring;
+        memcpy(result + offset, component->data, component->post_delim_len);
+        offset += component->post_delim_len;
+        result[offset++] = '/';
+    }
+    result[len - 1] = '\0';
+    return result;
+}
+
+static bool torrent_read_files(TorrentInfo* info, const BNode* files) {
+    if(files->type != BLIST || !bencode_expand(files) || files->value.blist.len == 0) return false;
+
+    info->files = calloc(files->value.blist.len, sizeof(TorrentFile));
+    if(!info->files) return false;
+
+    uint64_t offset = 0;
+    for(size_t i = 0; i < files->value.blist.len; ++i) {
+        const BNode* entry = files->value.blist.items[i];
+        if(entry->type != BDICT) return false;
+
+        long long length;
+        if(!torrent_get_int(entry, "length", &length) || length < 0) return false;
+        if((uint64_t)length > UINT64_MAX - offset) return false;     // offsets have to keep growing
+
+        char* path = torrent_join_path(bencode_find_node_by_key(entry, "path"));
+        if(!path) return false;
+
+        info->files[i] = (TorrentFile){ .path = path, .length = (uint64_t)length, .offset = offset };
+        info->file_count++;
+        offset += (uint64_t)length;
+    }
+
+    info->total_length = offset;
+    info->multi_file = true;
+    return true;
+}
+
+TorrentInfo* torrent_info_from_document(const BDocument* doc) {
+    if(!doc || !doc->root) return NULL;
+    return torrent_info_from_dict(doc, bencode_find_node_by_key(doc->root, "info"));
+}
+
+TorrentInfo* torrent_info_from_dict(const BDocument* doc, const BNode* info_node) {
+    if(!info_node || info_node->type != BDICT) return NULL;
+
+    TorrentInfo* info = calloc(1, sizeof(*info));
+    if(!info) return NULL;
+
+    info->info_hash = bencode_hash_node(doc, info_node);
+
+    const BNode* name = bencode_find_node_by_key(info_node, "name");
+    if(!name || name->type != BSTRING || !torrent_valid_component(&name->value.bstring)) goto cleanup;
+    info->name = torrent_dup_string(&name->value.bstring);
+    if(!info->name) goto cleanup;
+
+    long long piece_length;
+    if(!torrent_get_int(info_node, "piece length", &piece_length) || piece_length <= 0) goto cleanup;
+    info->piece_length = (uint64_t)piece_length;
+
+    const BNode* pieces = bencode_find_node_by_key(info_node, "pieces");
+    if(!pieces || pieces->type != BSTRING) goto cleanup;
+    if(pieces->value.bstring.post_delim_len % TORRENT_HASH_LEN != 0) goto cleanup;
+    info->pieces = (const uint8_t*)bencode_string_data(doc, pieces);
+    info->piece_count = pieces->value.bstring.post_delim_len / TORRENT_HASH_LEN;
+
+    const BNode* files = bencode_find_node_by_key(info_node, "files");
+    if(files) {
+        if(!torrent_read_files(info, files)) goto cleanup;
+    } else {
+        long long length;
+        if(!torrent_get_int(info_node, "length", &length) || length < 0) goto cleanup;
+
+        info->files = calloc(1, sizeof(TorrentFile));
+        if(!info->files) goto cleanup;
+        info->files[0].path = torrent_dup_string(&name->value.bstring);
+        if(!info->files[0].path) goto cleanup;
+        info->files[0].length = (uint64_t)length;
+        info->file_count = 1;
+        info->total_length = (uint64_t)length;
+    }
+
+    // the piece hashes have to cover the data exactly
+    if(info->total_length > UINT64_MAX - info->piece_length) goto cleanup;
+    uint64_t expected_pieces = (info->total_length + info->piece_length - 1) / info->piece_length;
+    if(expected_pieces != info->piece_count) goto cleanup;
+
+    return info;
+
+cleanup:
+    torrent_info_free(info);
+    return NULL;
+}
+
+void torrent_info_free(TorrentInfo* info) {
+    if(!info) return;
+
+    for(size_t i = 0; i < info->file_count; ++i) {
+        free(info->files[i].path);
+    }
+    free(info->files);
+    free(info->name);
+    free(info);
+}
+
+uint64_t torrent_piece_size(const TorrentInfo* info, size_t piece) {
+    uint64_t start = (uint64_t)piece * info->piece_length;
+    if(start >= info->total_length) return 0;
+
+    uint64_t remaining = info->total_length - start;
+    return remaining < info->piece_length ? remaining : info->piece_length;
+}
+
+size_t torrent_file_at(const TorrentInfo* info, uint64_t offset) {
+    // last file whose offset is <= the requested one, skipping empty files
+    size_t lo = 0;
+    size_t hi = info->file_count;
+    while(hi - lo > 1) {
+        size_t mid = lo + (hi - lo) / 2;
+        if(info->files[mid].offset <= offset) lo = mid;
+        else hi = mid;
+    }
+    while(lo + 1 < info->file_count && info->files[lo].length == 0) lo++;
+    return lo;
+}
+
+#pragma region v2
+
+// deepest directory nesting accepted in a file tree
+#define TORRENT_V2_MAX_DEPTH    64
+
+/* prefix + '/' + component, or just the component at the root */
+static char* torrent_v2_child_path(const char* prefix, const BString* component) {
+    const size_t prefix_len = prefix ? strlen(prefix) + 1 : 0;
+    char* result = malloc(prefix_len + component->post_delim_len + 1);
+    if(!result) return NULL;
+
+    if(prefix) {
+        memcpy(result, prefix, prefix_len - 1);
+        result[prefix_len - 1] = '/';
+    }
+    memcpy(result + prefix_len, component->data, component->post_delim_len);
+    result[prefix_len + component->post_delim_len] = '\0';
+    return result;
+}
+
+/* Append the file described by entry, the dict under a "" key; takes ownership of path */
+static bool torrent_v2_add_file(TorrentInfoV2* info, size_t* capacity, const BDocument* doc,
+                                const BNode* entry, char* path) {
+    long long length;
+    if(entry->type != BDICT || !torrent_get_int(entry, "length", &length) || length < 0 ||
+       (uint64_t)length > UINT64_MAX - info->total_length) {
+        free(path);
+        return false;
+    }
+
+    const uint8_t* pieces_root = NULL;
+    if(length > 0) {
+        const BNode* root = bencode_find_node_by_key(entry, "pieces root");
+        if(!root || root->type != BSTRING || root->value.bstring.post_delim_len != TORRENT_V2_HASH_LEN) {
+            free(path);
+            return false;
+        }
+        pieces_root = (const uint8_t*)bencode_string_data(doc, root);
+    }
+
+    if(info->file_count == *capacity) {
+        const size_t grown = *capacity ? *capacity * 2 : 8;
+        TorrentFileV2* files = realloc(info->files, grown * sizeof(TorrentFileV2));
+        if(!files) {
+            free(path);
+            return false;
+        }
+        info->files = files;
+        *capacity = grown;
+    }
+
+    info->files[info->file_count++] = (TorrentFileV2){
+        .path = path,
+        .length = (uint64_t)length,
+        .pieces_root = pieces_root,
+    };
+    info->total_length += (uint64_t)length;
+    return true;
+}
+
+/* Collect the files below a directory of the file tree in key order */
+static bool torrent_v2_walk(TorrentInfoV2* info, size_t* capacity, const BDocument* doc,
+                            const BNode* dir, const char* prefix, size_t depth) {
+    if(depth > TORRENT_V2_MAX_DEPTH) return false;
+
+    BNodeIter iter;
+    if(dir->type != BDICT || !bencode_iter_begin(&iter, dir)) return false;
+
+    const BString* key;
+    BNode* value;
+    bool any = false;
+    while(bencode_iter_next(&iter, &key, &value)) {
+        // the "" key only appears alone, below a file's name
+        if(!torrent_valid_component(key) || value->type != BDICT) return false;
+
+        char* path = torrent_v2_child_path(prefix, key);
+        if(!path) return false;
+
+        bool ok;
+        const BNode* file = bencode_find_node_by_key_len(value, "", 0);
+        if(file) {
+            ok = value->value.bdict.len == 1 && torrent_v2_add_file(info, capacity, doc, file, path);
+        } else {
+            ok = torrent_v2_walk(info, capacity, doc, value, path, depth + 1);
+            free(path);
+        }
+        if(!ok) return false;
+        any = true;
+    }
+    return any;
+}
+
+/* Attach each file's entry of "piece layers" and check it against the pieces root */
+static bool torrent_v2_read_layers(TorrentInfoV2* info, const BDocument* doc, const BNode* layers) {
+    if(layers && layers->type != BDICT) return false;
+
+    for(size_t i = 0; i < info->file_count; ++i) {
+        TorrentFileV2* file = &info->files[i];
+        const size_t count = merkle_piece_count(file->length, info->piece_length);
+        if(count == 0 || !layers) continue;
+
+        const BNode* layer = bencode_find_node_by_key_len(layers, (const char*)file->pieces_root, TORRENT_V2_HASH_LEN);
+        if(!layer) continue;
+        if(layer->type != BSTRING || layer->value.bstring.post_delim_len != count * TORRENT_V2_HASH_LEN) return false;
+
+        // sha256hash is plain bytes, so the layer can be read in place
+        const uint8_t* hashes = (const uint8_t*)bencode_string_data(doc, layer);
+        if(!merkle_verify_piece_layer((const sha256hash*)file->pieces_root, file->length, info->piece_length,
+                                      (const sha256hash*)hashes)) {
+            return false;
+        }
+
+        file->piece_layer = hashes;
+        file->piece_count = count;
+    }
+    return true;
+}
+
+TorrentInfoV2* torrent_info_v2_from_document(const BDocument* doc) {
+    if(!doc || !doc->root) return NULL;
+
+    const BNode* info_node = bencode_find_node_by_key(doc->root, "info");
+    if(!info_node || info_node->type != BDICT) return NULL;
+    if(info_node->end > doc->len || info_node->start > info_node->end) return NULL;
+
+    long long version;
+    if(!torrent_get_int(info_node, "meta version", &version) || version != 2) return NULL;
+
+    TorrentInfoV2* info = calloc(1, sizeof(*info));
+    if(!info) return NULL;
+
+    info->info_hash = sha256((const uint8_t*)doc->data + info_node->start, info_node->end - info_node->start);
+
+    const BNode* name = bencode_find_node_by_key(info_node, "name");
+    if(!name || name->type != BSTRING || !torrent_valid_component(&name->value.bstring)) goto cleanup;
+    info->name = torrent_dup_string(&name->value.bstring);
+    if(!info->name) goto cleanup;
+
+    // v2 pieces are subtrees of the merkle trees, so their size is a power of two
+    long long piece_length;
+    if(!torrent_get_int(info_node, "piece length", &piece_length) || piece_length < MERKLE_BLOCK_SIZE) goto cleanup;
+    if((piece_length & (piece_length - 1)) != 0) goto cleanup;
+    info->piece_length = (uint64_t)piece_length;
+
+    const BNode* tree = bencode_find_node_by_key(info_node, "file tree");
+    size_t capacity = 0;
+    if(!tree || !torrent_v2_walk(info, &capacity, doc, tree, NULL, 0)) goto cleanup;
+    if(info->total_length > UINT64_MAX - info->piece_length) goto cleanup;
+
+    // a lone file at the root of the tree is a single-file torrent
+    info->multi_file = info->file_count > 1 || strchr(info->files[0].path, '/');
+
+    if(!torrent_v2_read_layers(info, doc, bencode_find_node_by_key(doc->root, "piece layers"))) goto cleanup;
+    return info;
+
+cleanup:
+    torrent_info_v2_free(info);
+    return NULL;
+}
+
+void torrent_info_v2_free(TorrentInfoV2* info) {
+    if(!info) return;
+
+    for(size_t i = 0; i < info->file_count; ++i) {
+        free(info->files[i].path);
+    }
+    free(info->files);
+    free(info->name);
+    free(info);
+}
+
+#pragma endregion v2
@@ -0,0 +1,384 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "verify.h"
+
+#include "bitfield.h"
+#include "merkle.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// pieces handed to a worker at once; a multiple of 8 so no two workers share a bitfield byte,
+// fewer (down to 1) when the pieces are too large for VERIFY_MAX_BATCH_BYTES
+#define VERIFY_BATCH_PIECES     16
+#define VERIFY_MAX_BATCH_BYTES  (64u * 1024 * 1024)
+// data of one v2 file read and leaf-hashed at once, at least a piece
+#define VERIFY_V2_CHUNK_BYTES   (16u * 1024 * 1024)
+
+typedef struct VerifyJob {
+    const TorrentInfo*  info;
+    const int*          fds;
+    const uint8_t*      pieces;         // the pieces to check, NULL for all
+    uint8_t*            bitfield;
+    pthread_mutex_t     bitfield_lock;  // taken only when batches split bitfield bytes
+    uint64_t            piece_bytes;    // buffer room per piece, less than a piece for a tiny torrent
+    size_t              batch_pieces;
+    size_t              batch_count;
+    atomic_size_t       next_batch;
+    atomic_size_t       done_batches;
+    atomic_size_t       good_pieces;
+    atomic_uint_fast64_t bytes_hashed;
+} VerifyJob;
+
+#pragma region Files
+
+/* data_dir/root/file, or data_dir/file without a root */
+static char* verify_join_path(const char* data_dir, const char* root, const char* file) {
+    size_t len = strlen(data_dir) + (root ? strlen(root) + 1 : 0) + strlen(file) + 2;
+
+    char* path = malloc(len);
+    if(!path) return NULL;
+    if(root) snprintf(path, len, "%s/%s/%s", data_dir, root, file);
+    else snprintf(path, len, "%s/%s", data_dir, file);
+    return path;
+}
+
+char* verify_file_path(const TorrentInfo* info, const char* data_dir, size_t file) {
+    return verify_join_path(data_dir, info->multi_file ? info->name : NULL, info->files[file].path);
+}
+
+int* verify_open_files(const TorrentInfo* info, const char* data_dir) {
+    int* fds = malloc(info->file_count * sizeof(int));
+    if(!fds) return NULL;
+    for(size_t i = 0; i < info->file_count; ++i) fds[i] = -1;
+
+    for(size_t i = 0; i < info->file_count; ++i) {
+        char* path = verify_file_path(info, data_dir, i);
+        if(!path) {
+            verify_close_files(info, fds);
+            return NULL;
+        }
+
+        fds[i] = open(path, O_RDONLY);
+        if(fds[i] >= 0) posix_fadvise(fds[i], 0, 0, POSIX_FADV_SEQUENTIAL);
+        free(path);
+    }
+    return fds;
+}
+
+void verify_close_files(const TorrentInfo* info, int* fds) {
+    if(!fds) return;
+
+    for(size_t i = 0; i < info->file_count; ++i) {
+        if(fds[i] >= 0) close(fds[i]);
+    }
+    free(fds);
+}
+
+bool verify_read_range(const TorrentInfo* info, const int* fds, uint64_t offset, uint8_t* buffer, uint64_t size) {
+    size_t file = torrent_file_at(info, offset);
+
+    while(size > 0) {
+        if(file >= info->file_count) return false;
+
+        const TorrentFile* f = &info->files[file];
+        uint64_t in_file = offset - f->offset;
+        uint64_t take = f->length - in_file;
+        if(take > size) take = size;
+
+        if(take > 0) {
+            if(fds[file] < 0) return false;
+
+            uint64_t done = 0;
+            while(done < take) {
+                ssize_t n = pread(fds[file], buffer + done, take - done, (off_t)(in_file + done));
+                if(n <= 0) return false;
+                done += (uint64_t)n;
+            }
+        }
+
+        buffer += take;
+        offset += take;
+        size -= take;
+        file++;
+    }
+    return true;
+}
+
+#pragma endregion Files
+
+#pragma region Workers
+
+static void* verify_worker(void* arg) {
+    VerifyJob* job = arg;
+    const TorrentInfo* info = job->info;
+
+    uint8_t* buffer = malloc(job->batch_pieces * job->piece_bytes);
+    const uint8_t** msgs = malloc(job->batch_pieces * sizeof(uint8_t*));
+    sha1hash* hashes = malloc(job->batch_pieces * sizeof(sha1hash));
+    size_t* chosen = malloc(job->batch_pieces * sizeof(size_t));
+    if(!buffer || !msgs || !hashes || !chosen) goto cleanup;
+    const bool shared_bytes = job->batch_pieces % 8 != 0;
+
+    while(1) {
+        size_t batch = atomic_fetch_add(&job->next_batch, 1);
+        if(batch >= job->batch_count) break;
+
+        size_t first = batch * job->batch_pieces;
+        size_t count = info->piece_count - first;
+        if(count > job->batch_pieces) count = job->batch_pieces;
+
+        // the batch is contiguous on disk, read the pieces to check in order; unreadable ones are bad and not hashed
+        size_t selected = 0;
+        size_t full = 0;
+        for(size_t i = 0; i < count; ++i) {
+            const size_t piece = first + i;
+            if(job->pieces && !bitfield_get(job->pieces, piece)) continue;
+
+            uint64_t size = torrent_piece_size(info, piece);
+            uint8_t* data = buffer + selected * job->piece_bytes;
+            if(!verify_read_range(info, job->fds, (uint64_t)piece * info->piece_length, data, size)) continue;
+            msgs[selected] = data;
+            chosen[selected++] = piece;
+            if(size == info->piece_length) full = selected;
+        }
+
+        // every piece but the last has the same size, so the batch goes through the SIMD lanes
+        sha1_many(msgs, info->piece_length, full, hashes);
+        for(size_t i = full; i < selected; ++i) {
+            hashes[i] = sha1(msgs[i], torrent_piece_size(info, chosen[i]));
+        }
+
+        size_t good = 0;
+        uint64_t bytes = 0;
+        if(shared_bytes) pthread_mutex_lock(&job->bitfield_lock);
+        for(size_t i = 0; i < selected; ++i) {
+            const size_t piece = chosen[i];
+            bytes += torrent_piece_size(info, piece);
+            if(memcmp(hashes[i].bytes, info->pieces + piece * TORRENT_HASH_LEN, TORRENT_HASH_LEN) != 0) continue;
+
+            bitfield_set(job->bitfield, piece);
+            good++;
+        }
+        if(shared_bytes) pthread_mutex_unlock(&job->bitfield_lock);
+        atomic_fetch_add(&job->good_pieces, good);
+        atomic_fetch_add(&job->bytes_hashed, bytes);
+        atomic_fetch_add(&job->done_batches, 1);
+    }
+
+cleanup:
+    free(buffer);
+    free(msgs);
+    free(hashes);
+    free(chosen);
+    return NULL;
+}
+
+#pragma endregion Workers
+
+#pragma region Public
+
+int verify_torrent(const TorrentInfo* info, const char* data_dir, size_t threads, VerifyResult* result) {
+    return verify_pieces(info, data_dir, NULL, threads, result);
+}
+
+int verify_pieces(const TorrentInfo* info, const char* data_dir, const uint8_t* pieces, size_t threads, VerifyResult* result) {
+    memset(result, 0, sizeof(*result));
+
+    if(threads == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cpus > 0 ? (size_t)cpus : 1;
+    }
+
+    // no piece is longer than the torrent, whatever the piece length says
+    const uint64_t piece_bytes = info->piece_length < info->total_length ? info->piece_length : info->total_length;
+    size_t batch_pieces = VERIFY_BATCH_PIECES;
+    while(batch_pieces > 1 && batch_pieces * piece_bytes > VERIFY_MAX_BATCH_BYTES) {
+        batch_pieces /= 2;
+    }
+
+    result->bitfield_len = (info->piece_count + 7) / 8;
+    result->bitfield = calloc(result->bitfield_len ? result->bitfield_len : 1, 1);
+    if(!result->bitfield) return -1;
+
+    int* fds = verify_open_files(info, data_dir);
+    if(!fds) {
+        verify_result_free(result);
+        return -1;
+    }
+
+    VerifyJob job = {
+        .info = info,
+        .fds = fds,
+        .pieces = pieces,
+        .bitfield = result->bitfield,
+        .piece_bytes = piece_bytes,
+        .batch_pieces = batch_pieces,
+        .batch_count = (info->piece_count + batch_pieces - 1) / batch_pieces,
+    };
+    pthread_mutex_init(&job.bitfield_lock, NULL);
+    atomic_init(&job.next_batch, 0);
+    atomic_init(&job.done_batches, 0);
+    atomic_init(&job.good_pieces, 0);
+    atomic_init(&job.bytes_hashed, 0);
+
+    if(threads > job.batch_count) threads = job.batch_count ? job.batch_count : 1;
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    pthread_t* workers = malloc(threads * sizeof(pthread_t));
+    size_t started = 0;
+    if(workers) {
+        for(; started < threads; ++started) {
+            if(pthread_create(&workers[started], NULL, verify_worker, &job) != 0) break;
+        }
+    }
+    if(started == 0) verify_worker(&job);      // no threads available, check on the caller's thread
+    for(size_t i = 0; i < started; ++i) {
+        pthread_join(workers[i], NULL);
+    }
+    free(workers);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    pthread_mutex_destroy(&job.bitfield_lock);
+    verify_close_files(info, fds);
+
+    // workers that could not get their buffers checked nothing, a partial bitfield is no result
+    if(atomic_load(&job.done_batches) < job.batch_count) {
+        verify_result_free(result);
+        return -1;
+    }
+
+    result->good_pieces = atomic_load(&job.good_pieces);
+    result->bytes_hashed = atomic_load(&job.bytes_hashed);
+    result->seconds = (double)(end.tv_sec - start.tv_sec) + (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+    return 0;
+}
+
+void verify_result_free(VerifyResult* result) {
+    free(result->bitfield);
+    result->bitfield = NULL;
+    result->bitfield_len = 0;
+}
+
+#pragma endregion Public
+
+#pragma region v2
+
+size_t verify_v2_piece_count(const TorrentInfoV2* info, size_t file) {
+    const TorrentFileV2* f = &info->files[file];
+    if(f->length == 0) return 0;
+
+    const size_t count = merkle_piece_count(f->length, info->piece_length);
+    return count ? count : 1;
+}
+
+/* Whether the leaves of one piece hash to what the torrent says; a file that fits into one piece is checked against its root */
+static bool verify_v2_piece_good(const TorrentInfoV2* info, const TorrentFileV2* file, size_t piece,
+                                 const sha256hash* leaves, size_t count) {
+    const size_t blocks_per_piece = (size_t)(info->piece_length / MERKLE_BLOCK_SIZE);
+
+    const uint8_t* expected;
+    size_t width = 1;
+    if(file->piece_layer) {
+        expected = file->piece_layer + piece * TORRENT_V2_HASH_LEN;
+        width = blocks_per_piece;
+    } else if(file->length <= info->piece_length) {
+        expected = file->pieces_root;
+        while(width < count) width <<= 1;
+    } else {
+        return false;
+    }
+
+    sha256hash computed;
+    if(!merkle_root(leaves, count, width, 0, &computed)) return false;
+    return memcmp(computed.bytes, expected, TORRENT_V2_HASH_LEN) == 0;
+}
+
+/* Read exactly size bytes at offset */
+static bool verify_pread_full(int fd, uint8_t* buffer, uint64_t size, uint64_t offset) {
+    uint64_t done = 0;
+    while(done < size) {
+        ssize_t n = pread(fd, buffer + done, size - done, (off_t)(offset + done));
+        if(n <= 0) return false;
+        done += (uint64_t)n;
+    }
+    return true;
+}
+
+int verify_torrent_v2(const TorrentInfoV2* info, const char* data_dir, size_t threads, VerifyResult* result) {
+    memset(result, 0, sizeof(*result));
+
+    size_t total_pieces = 0;
+    for(size_t i = 0; i < info->file_count; ++i) {
+        total_pieces += verify_v2_piece_count(info, i);
+    }
+
+    uint64_t chunk = VERIFY_V2_CHUNK_BYTES - VERIFY_V2_CHUNK_BYTES % info->piece_length;
+    if(chunk == 0) chunk = info->piece_length;
+
+    result->bitfield_len = (total_pieces + 7) / 8;
+    result->bitfield = calloc(result->bitfield_len ? result->bitfield_len : 1, 1);
+    uint8_t* buffer = malloc(chunk);
+    sha256hash* leaves = malloc(chunk / MERKLE_BLOCK_SIZE * sizeof(sha256hash));
+    if(!result->bitfield || !buffer || !leaves) {
+        free(buffer);
+        free(leaves);
+        verify_result_free(result);
+        return -1;
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    size_t first_piece = 0;
+    for(size_t i = 0; i < info->file_count; ++i) {
+        const TorrentFileV2* file = &info->files[i];
+        const size_t pieces = verify_v2_piece_count(info, i);
+        if(pieces == 0) continue;
+
+        // without its piece layer a large file has nothing to be checked against
+        const bool checkable = file->piece_layer || file->length <= info->piece_length;
+        char* path = checkable ? verify_join_path(data_dir, info->multi_file ? info->name : NULL, file->path) : NULL;
+        const int fd = path ? open(path, O_RDONLY) : -1;
+        free(path);
+        if(fd >= 0) posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+        // pieces never span files, so a chunk of whole pieces is hashed in one go
+        for(uint64_t offset = 0; fd >= 0 && offset < file->length; offset += chunk) {
+            const uint64_t size = file->length - offset < chunk ? file->length - offset : chunk;
+            if(!verify_pread_full(fd, buffer, size, offset)) break;
+
+            merkle_hash_blocks(buffer, size, threads, leaves);
+            result->bytes_hashed += size;
+
+            const size_t blocks = merkle_block_count(size);
+            const size_t blocks_per_piece = (size_t)(info->piece_length / MERKLE_BLOCK_SIZE);
+            for(size_t block = 0; block < blocks; block += blocks_per_piece) {
+                const size_t piece = (size_t)(offset / info->piece_length) + block / blocks_per_piece;
+                const size_t count = blocks - block < blocks_per_piece ? blocks - block : blocks_per_piece;
+                if(!verify_v2_piece_good(info, file, piece, leaves + block, count)) continue;
+
+                bitfield_set(result->bitfield, first_piece + piece);
+                result->good_pieces++;
+            }
+        }
+        if(fd >= 0) close(fd);
+        first_piece += pieces;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    free(buffer);
+    free(leaves);
+    result->seconds = (double)(end.tv_sec - start.tv_sec) + (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+    return 0;
+}
+
+#pragma endregion v2